@@ -0,0 +1,96 @@
+// Octave shapes of the terrain recipes, see src/fbm.h. Include after noise.glsl.
+//
+// The application prepends the specialisation (noise::shaderDefines()):
+//   FBM_OCTAVES  number of octaves, 0..10
+//   FBM_BASE     OCTAVE_* type of the first octave
+//   FBM_DETAIL   OCTAVE_* type of the other octaves
+//   FBM_WARP     1 to warp the domain before the first octave
+
+#define OCTAVE_VORONOI 0
+#define OCTAVE_SIMPLEX 1
+#define OCTAVE_RIDGED 2
+#define OCTAVE_BILLOW 3
+
+#ifndef FBM_OCTAVES
+#  define FBM_OCTAVES 7
+#  define FBM_BASE OCTAVE_VORONOI
+#  define FBM_DETAIL OCTAVE_SIMPLEX
+#  define FBM_WARP 0
+#endif
+
+float octave_voronoi(vec2 p) {
+  float v = voronoi2d(p);
+  return v * v;
+}
+
+float octave_simplex(vec2 p) { return snoise(p); }
+
+float octave_ridged(vec2 p) {
+  float r = 1.0 - abs(snoise(p));
+  return r * r;
+}
+
+float octave_billow(vec2 p) { return 2.0 * abs(snoise(p)) - 1.0; }
+
+// vec3(value, d/dx, d/dy)
+vec3 octave_voronoi_grad(vec2 p) {
+  vec3 v = voronoi2d_grad(p);
+  return vec3(v.x * v.x, 2.0 * v.x * v.yz);
+}
+
+vec3 octave_simplex_grad(vec2 p) { return snoise_grad(p); }
+
+vec3 octave_ridged_grad(vec2 p) {
+  vec3 s = snoise_grad(p);
+  float r = 1.0 - abs(s.x);
+  return vec3(r * r, -2.0 * r * (s.x > 0.0 ? 1.0 : -1.0) * s.yz);
+}
+
+vec3 octave_billow_grad(vec2 p) {
+  vec3 s = snoise_grad(p);
+  return vec3(2.0 * abs(s.x) - 1.0, (s.x > 0.0 ? 2.0 : -2.0) * s.yz);
+}
+
+#if FBM_BASE == OCTAVE_VORONOI
+#  define fbm_base octave_voronoi
+#  define fbm_base_grad octave_voronoi_grad
+#elif FBM_BASE == OCTAVE_SIMPLEX
+#  define fbm_base octave_simplex
+#  define fbm_base_grad octave_simplex_grad
+#elif FBM_BASE == OCTAVE_RIDGED
+#  define fbm_base octave_ridged
+#  define fbm_base_grad octave_ridged_grad
+#else
+#  define fbm_base octave_billow
+#  define fbm_base_grad octave_billow_grad
+#endif
+
+#if FBM_DETAIL == OCTAVE_VORONOI
+#  define fbm_detail octave_voronoi
+#  define fbm_detail_grad octave_voronoi_grad
+#elif FBM_DETAIL == OCTAVE_SIMPLEX
+#  define fbm_detail octave_simplex
+#  define fbm_detail_grad octave_simplex_grad
+#elif FBM_DETAIL == OCTAVE_RIDGED
+#  define fbm_detail octave_ridged
+#  define fbm_detail_grad octave_ridged_grad
+#else
+#  define fbm_detail octave_billow
+#  define fbm_detail_grad octave_billow_grad
+#endif
+
+// Offsets the domain by up to `strength` meters, from simplex noise at an eighth of the
+// frequency of the first octave. The rows of `jacobian` are the derivatives of the warped x and z.
+vec2 fbm_warp(vec2 pos, float frequency, float strength, out mat2 jacobian) {
+  float k = frequency / 1600.0;
+  vec3 a = snoise_grad(pos * k + vec2(17, 43));
+  vec3 b = snoise_grad(pos * k + vec2(-31, 7));
+  jacobian = mat2(1.0 + strength * k * a.y, strength * k * b.y,
+                  strength * k * a.z, 1.0 + strength * k * b.z);
+  return pos + strength * vec2(a.x, b.x);
+}
+
+vec2 fbm_warp(vec2 pos, float frequency, float strength) {
+  float k = frequency / 1600.0;
+  return pos + strength * vec2(snoise(pos * k + vec2(17, 43)), snoise(pos * k + vec2(-31, 7)));
+}
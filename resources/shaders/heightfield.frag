@@ -6,6 +6,8 @@ precision highp float;
 uniform vec3 material_color;
 
 in vec2 texCoord;
+in vec3 viewSpacePosition;
+in vec3 viewSpaceNormal;
 layout(location = 0) out vec4 fragmentColor;
 
 // This simple fragment shader is meant to be used for debug purposes
@@ -14,5 +16,8 @@ layout(location = 0) out vec4 fragmentColor;
 void main() {
   // fragmentColor = vec4(texCoord.x, texCoord.y, 0.0, 1.0);
   // fragmentColor = vec4(1, 1, 1, 1);
-  fragmentColor = vec4(material_color, 1.0);
+
+  // Lit from the camera, enough to make out the relief
+  float n_dot_v = max(dot(normalize(viewSpaceNormal), normalize(-viewSpacePosition)), 0.0);
+  fragmentColor = vec4(material_color * (0.2 + 0.8 * n_dot_v), 1.0);
 }
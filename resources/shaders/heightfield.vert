@@ -13,6 +13,11 @@ uniform mat4 normalMatrix;
 uniform mat4 modelViewMatrix;
 uniform mat4 modelViewProjectionMatrix;
 
+// Heights in [0, 1] or meters, scaled to model space y by heightScale. The grid spans [-1, 1] in
+// x and z.
+layout(binding = 0) uniform sampler2D heightField;
+uniform float heightScale;
+
 ///////////////////////////////////////////////////////////////////////////////
 // Output to fragment shader
 ///////////////////////////////////////////////////////////////////////////////
@@ -21,6 +26,21 @@ out vec3 viewSpacePosition;
 out vec3 viewSpaceNormal;
 
 void main() {
-  gl_Position = modelViewProjectionMatrix * vec4(position, 1.0);
+  float height = texture(heightField, texCoordIn).r * heightScale;
+  vec4 displaced = vec4(position.x, height, position.z, 1.0);
+
+  // Central differences, one texel apart. x = 2u - 1, so d/dx is half of d/du
+  vec2 texel = 1.0 / vec2(textureSize(heightField, 0));
+  float dx = (texture(heightField, texCoordIn + vec2(texel.x, 0.0)).r
+              - texture(heightField, texCoordIn - vec2(texel.x, 0.0)).r)
+             / (2.0 * texel.x) * 0.5 * heightScale;
+  float dz = (texture(heightField, texCoordIn + vec2(0.0, texel.y)).r
+              - texture(heightField, texCoordIn - vec2(0.0, texel.y)).r)
+             / (2.0 * texel.y) * 0.5 * heightScale;
+  vec3 normal = normalize(vec3(-dx, 1.0, -dz));
+
+  gl_Position = modelViewProjectionMatrix * displaced;
+  viewSpacePosition = (modelViewMatrix * displaced).xyz;
+  viewSpaceNormal = normalize((normalMatrix * vec4(normal, 0.0)).xyz);
   texCoord = texCoordIn;
 }
@@ -51,6 +51,45 @@ float snoise(vec2 v) {
   return 130.0 * dot(m, g);
 }
 
+// snoise() and its analytic derivatives as vec3(value, d/dx, d/dy)
+vec3 snoise_grad(vec2 v) {
+  vec4 C = vec4(0.211324865405187,   // (3.0-sqrt(3.0))/6.0
+                0.366025403784439,   // 0.5*(sqrt(3.0)-1.0)
+                -0.577350269189626,  // -1.0 + 2.0 * C.x
+                0.024390243902439);  // 1.0 / 41.0
+  vec2 i = floor(v + dot(v, C.yy));
+  vec2 x0 = v - i + dot(i, C.xx);
+
+  vec2 i1 = (x0.x > x0.y) ? vec2(1.0, 0.0) : vec2(0.0, 1.0);
+  vec4 x12 = x0.xyxy + C.xxzz;
+  x12.xy -= i1;
+
+  i = mod289(i);
+  vec3 p = permute(permute(i.y + vec3(0.0, i1.y, 1.0)) + i.x + vec3(0.0, i1.x, 1.0));
+
+  vec3 t = max(0.5 - vec3(dot(x0, x0), dot(x12.xy, x12.xy), dot(x12.zw, x12.zw)), 0.0);
+  vec3 t2 = t * t;
+  vec3 m = t2 * t2;
+
+  vec3 x = 2.0 * fract(p * C.www) - 1.0;
+  vec3 h = abs(x) - 0.5;
+  vec3 ox = floor(x + 0.5);
+  vec3 a0 = x - ox;
+
+  vec3 norm = 1.79284291400159 - 0.85373472095314 * (a0 * a0 + h * h);
+  m *= norm;
+
+  vec3 g;
+  g.x = a0.x * x0.x + h.x * x0.y;
+  g.yz = a0.yz * x12.xz + h.yz * x12.yw;
+
+  // d(t^4)/dP = -8 t^3 x and dg/dP = (a0, h)
+  vec3 w = -8.0 * t2 * t * g * norm;
+  vec2 grad = w.x * x0 + w.y * x12.xy + w.z * x12.zw + m.x * vec2(a0.x, h.x)
+              + m.y * vec2(a0.y, h.y) + m.z * vec2(a0.z, h.z);
+  return 130.0 * vec3(dot(m, g), grad);
+}
+
 const mat2 myt = mat2(.12121212, .13131313, -.13131313, .12121212);
 const vec2 mys = vec2(1e4, 1e6);
 
@@ -79,3 +118,35 @@ float voronoi2d(const in vec2 point) {
   }
   return pow(1. / res, 0.0625);
 }
+
+// voronoi2d() and its analytic derivatives as vec3(value, d/dx, d/dy)
+vec3 voronoi2d_grad(const in vec2 point) {
+  vec2 p = floor(point);
+  vec2 f = fract(point);
+  float res = 0.0;
+  float w[9];
+  float dist[9];
+  vec2 r[9];
+  for (int j = -1; j <= 1; j++) {
+    for (int i = -1; i <= 1; i++) {
+      int k = (j + 1) * 3 + (i + 1);
+      vec2 b = vec2(i, j);
+      r[k] = vec2(b) - f + rhash(p + b);
+      dist[k] = dot(r[k], r[k]);
+      w[k] = 1. / pow(dist[k], 8.);
+      res += w[k];
+    }
+  }
+  float value = pow(1. / res, 0.0625);
+  // res overflows within a few meters of a feature point, where the value is a flat 0
+  if (value <= 0.0) {
+    return vec3(0.0);
+  }
+
+  // d(value)/dP = -value / res * sum w / dist * r, divide by res first to stay in range
+  vec2 grad = vec2(0.0);
+  for (int k = 0; k < 9; k++) {
+    grad += w[k] / res / dist[k] * r[k];
+  }
+  return vec3(value, -value * grad);
+}
@@ -5,6 +5,7 @@ precision highp float;
 
 #include "pbr.glsl"
 #include "sun.glsl"
+#include "terrain_blending.glsl"
 #include "utils.glsl"
 
 in DATA {
@@ -17,6 +18,7 @@ in DATA {
   vec3 tangent;
   vec3 bitangent;
   mat3 tangent_matrix;
+  flat vec4 atlas_page;
 }
 In;
 
@@ -26,6 +28,44 @@ layout(binding = 2) uniform sampler2DArray displacement;
 layout(binding = 3) uniform sampler2DArray roughness;
 layout(binding = 4) uniform sampler2DArray ambient_occlusion;
 
+// Normal + macro roughness and splat weights baked per CDLOD chunk by height_atlas_surface.comp
+layout(binding = 14) uniform sampler2DArray atlasNormals;
+layout(binding = 15) uniform sampler2DArray atlasSplats;
+// Macro albedo + AO, with the roughness replaces the detail layers beyond macroDistance
+layout(binding = 16) uniform sampler2DArray atlasMacro;
+uniform int atlasPageResolution;
+uniform bool macroEnabled;
+uniform float macroDistance;
+uniform float macroFadeBand;
+
+/**
+ * Flow accumulation, log2 of the upstream cells, see hydrology.h
+ */
+struct FlowMap {
+  bool enabled;
+  vec2 origin;
+  float size;
+  float wet_threshold;
+  float river_threshold;
+};
+uniform FlowMap flowMap;
+layout(binding = 17) uniform sampler2D flowAccumulation;
+
+/**
+ * Horizon angles in 8 azimuths from +x towards +z, layer 0 holds the first 4, and the sky
+ * visible over them, see horizon.h
+ */
+struct HorizonMap {
+  bool enabled;
+  vec2 origin;
+  float size;
+  float softness;
+  float occlusion_strength;
+};
+uniform HorizonMap horizonMap;
+layout(binding = 18) uniform sampler2DArray horizonAngles;
+layout(binding = 19) uniform sampler2D horizonOcclusion;
+
 layout(binding = 7) uniform sampler2D irradiance_map;
 layout(binding = 8) uniform sampler2D reflection_map;
 layout(binding = 9) uniform sampler2D brdf_lut;
@@ -44,11 +84,10 @@ struct Noise {
   float frequency;
   float persistence;
   float lacunarity;
+  float warp_strength;
 };
 uniform Noise noise;
 
-uniform float texture_start_heights[4];
-uniform float texture_blends[4];
 uniform float texture_sizes[4];
 uniform float texture_displacement_weights[4];
 
@@ -61,6 +100,7 @@ struct ShadowMap {
   float cascade_clip_splits[NUM_CASCADES];
   mat4 light_wvp_matrix[NUM_CASCADES];
   float blend_distance;
+  int rendered_cascades;
   bool debug_show_splits;
   bool debug_show_blend;
 };
@@ -136,59 +176,6 @@ float[4] getTextureWeightsByDisplacement(vec3[4] t, float[4] a) {
   return w;
 }
 
-float[4] terrainBlending(vec3 world_pos, vec3 normal) {
-  float height = world_pos.y;
-
-  // A completely flat terrain has slope=0
-  float slope = max(1 - dot(normal, vec3(0, 1, 0)), 0.0);
-
-  // For each fragment we compute how much each texture contributes depending on height and slope
-  float draw_strengths[4];
-
-  float sand_grass_height = texture_start_heights[0];
-  float grass_rock_height = texture_start_heights[1];
-  float rock_snow_height = texture_start_heights[2];
-
-  float grass_falloff = texture_blends[1];
-  float rock_falloff = texture_blends[2];
-  float snow_falloff = texture_blends[3];
-
-  float a, b, c, d;
-  {
-    b = inverseLerpClamped(sand_grass_height - grass_falloff / 2,
-                           sand_grass_height + grass_falloff / 2, height);
-  }
-  {
-    c = inverseLerpClamped(grass_rock_height - rock_falloff / 2,
-                           grass_rock_height + rock_falloff / 2, height);
-  }
-
-  float b_in, c_in, d_in;
-  b_in = inverseLerpClamped(sand_grass_height - grass_falloff / 2,
-                            sand_grass_height + grass_falloff / 2, height);
-  c_in = inverseLerpClamped(grass_rock_height - rock_falloff / 2,
-                            grass_rock_height + rock_falloff / 2, height);
-  d_in = inverseLerpClamped(rock_snow_height - snow_falloff / 2,
-                            rock_snow_height + snow_falloff / 2, height);
-
-  a = 1 - b_in;
-  b *= 1 - c_in;
-  c *= 1 - d_in;
-  d = d_in;
-
-  // a *= 1 - inverseLerpClamped(0.1, 1, slope);
-  b *= 1 - inverseLerpClamped(0.1, 1.0, slope);
-  d *= 1 - inverseLerpClamped(0.1, 1, slope);
-
-  float tot = a + b + c + d;
-  draw_strengths[0] = max(a / tot, 0);
-  draw_strengths[1] = max(b / tot, 0);
-  draw_strengths[2] = max(c / tot, 0);
-  draw_strengths[3] = max(d / tot, 0);
-
-  return draw_strengths;
-}
-
 vec3 getTextureCoordinate(vec3 world_pos, int texture_index) {
   return vec3(In.tex_coord * texture_sizes[texture_index], texture_index);
 }
@@ -255,9 +242,51 @@ float calcShadowFactor(int index, vec4 shadow_light_pos, vec3 normal) {
   return mix(0.5, 1.0, percentLit / (size * size) * l);
 }
 
+/**
+ * 1 where the sun is above the baked horizon, 0 where the terrain hides it
+ */
+float horizonVisibility(vec3 world_pos) {
+  vec2 uv = (world_pos.xz - horizonMap.origin) / horizonMap.size;
+  if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0)))) {
+    return 1.0;
+  }
+
+  vec3 to_sun = -sun.direction;
+  float azimuth = mod(atan(to_sun.z, to_sun.x) / (2.0 * PI) * 8.0, 8.0);
+  int d0 = int(azimuth) % 8;
+  int d1 = (d0 + 1) % 8;
+
+  vec4 first = texture(horizonAngles, vec3(uv, 0));
+  vec4 second = texture(horizonAngles, vec3(uv, 1));
+  float angles[8] = float[8](first.x, first.y, first.z, first.w, second.x, second.y, second.z,
+                             second.w);
+  float horizon = mix(angles[d0], angles[d1], fract(azimuth)) * PI * 0.5;
+  float elevation = asin(clamp(to_sun.y, -1.0, 1.0));
+  return smoothstep(-horizonMap.softness, horizonMap.softness, elevation - horizon);
+}
+
 void main() {
   vec3 out_color = vec3(0);
 
+  // The baked attributes of the chunk when it has an atlas page, same texels as terrain.tes
+  bool has_page = In.atlas_page.w >= 0.0;
+  vec3 surface_normal = In.normal;
+  float macro_roughness = 0.0;
+  vec3 atlas_uv = vec3(0.0);
+  if (has_page) {
+    vec2 texel = (In.world_pos.xz - In.atlas_page.xy) / In.atlas_page.z * atlasPageResolution + 0.5;
+    atlas_uv = vec3(texel / (atlasPageResolution + 1), In.atlas_page.w);
+    vec4 atlas_normal = texture(atlasNormals, atlas_uv);
+    surface_normal = normalize(atlas_normal.xyz);
+    macro_roughness = atlas_normal.a;
+  }
+
+  // 0 uses the detail layers only, 1 the macro texture only
+  float macro_fade = 0.0;
+  if (has_page && macroEnabled) {
+    macro_fade = clamp((length(In.view_space_pos) - macroDistance) / macroFadeBand + 0.5, 0.0, 1.0);
+  }
+
   float shadow_factor = 0.0;
   vec3 cascade_indicator = vec3(0.0, 0.0, 0);
 
@@ -265,7 +294,7 @@ void main() {
     float prev_shadow_factor = 0;
     vec3 prev_cascade_color = cascade_indicator;
 
-    for (int i = 0; i < NUM_CASCADES; i++) {
+    for (int i = 0; i < shadow_map.rendered_cascades; i++) {
       float end = shadow_map.cascade_clip_splits[i];
       float prev_end = i == 0 ? 0 : shadow_map.cascade_clip_splits[i - 1];
 
@@ -277,7 +306,7 @@ void main() {
 
       if (i > 0 && shadow_clip_depth > prev_end
           && shadow_clip_depth < prev_end + shadow_map.blend_distance) {
-        prev_shadow_factor = calcShadowFactor(i - 1, shadow_light_pos[i - 1], In.normal);
+        prev_shadow_factor = calcShadowFactor(i - 1, shadow_light_pos[i - 1], surface_normal);
 
         prev_cascade_color = vec3(0, 0, 0);
         if (i == 1)
@@ -287,7 +316,7 @@ void main() {
       }
 
       if (shadow_clip_depth <= end) {
-        float sf = calcShadowFactor(i, shadow_light_pos[i], In.normal);
+        float sf = calcShadowFactor(i, shadow_light_pos[i], surface_normal);
 
         float f = i == 0 ? 0
                          : 1
@@ -308,38 +337,91 @@ void main() {
     }
   }
 
+  // Past the rendered cascades only the horizon map shadows, faded in over the last blend distance
+  {
+    float end = shadow_map.cascade_clip_splits[max(shadow_map.rendered_cascades, 1) - 1];
+    float f = clamp(inverseLerp(end - shadow_map.blend_distance, end, shadow_clip_depth), 0, 1);
+    if (horizonMap.enabled && f > 0.0) {
+      float ndotl = dot(surface_normal, -sun.direction);
+      float lit = horizonVisibility(In.world_pos) * smoothstep(0.0, 0.2, ndotl);
+      shadow_factor = mix(shadow_factor, mix(0.5, 1.0, lit), f);
+    } else if (shadow_clip_depth > end && shadow_map.rendered_cascades < NUM_CASCADES) {
+      shadow_factor = 1.0;
+    }
+  }
+
   if (shadow_map.debug_show_splits) {
     fragmentColor = vec4(cascade_indicator, 1.0);
     return;
   }
 
-  float[4] draw_strengths = terrainBlending(In.world_pos, In.normal);
-
-  vec3[4] tex_coords;
-  tex_coords[0] = getTextureCoordinate(In.world_pos, 0);
-  tex_coords[1] = getTextureCoordinate(In.world_pos, 1);
-  tex_coords[2] = getTextureCoordinate(In.world_pos, 2);
-  tex_coords[3] = getTextureCoordinate(In.world_pos, 3);
-
   vec3 terrain_color = vec3(0);
   vec3 terrain_normal = vec3(0);
   float terrain_roughness = 0;
   float ao = 0;
 
+  float[4] draw_strengths;
+  if (macro_fade < 1.0) {
+    if (has_page) {
+      vec4 splat = texture(atlasSplats, atlas_uv);
+      draw_strengths = float[4](splat.x, splat.y, splat.z, splat.w);
+    } else {
+      draw_strengths = terrainBlending(In.world_pos, In.normal);
+    }
+
+    vec3[4] tex_coords;
+    tex_coords[0] = getTextureCoordinate(In.world_pos, 0);
+    tex_coords[1] = getTextureCoordinate(In.world_pos, 1);
+    tex_coords[2] = getTextureCoordinate(In.world_pos, 2);
+    tex_coords[3] = getTextureCoordinate(In.world_pos, 3);
+
 #if 1
-  float w[4] = getTextureWeightsByDisplacement(tex_coords, draw_strengths);
+    float w[4] = getTextureWeightsByDisplacement(tex_coords, draw_strengths);
 #else
-  float w[4] = draw_strengths;
+    float w[4] = draw_strengths;
 #endif
 
-  for (int i = 0; i < w.length; i++) {
-    terrain_color += texture(albedos, tex_coords[i]).rgb * w[i];
-    terrain_normal += getWorldNormal(tex_coords[i]) * w[i];
-    terrain_roughness += texture(roughness, tex_coords[i]).r * w[i];
-    ao += texture(ambient_occlusion, tex_coords[i]).r * w[i];
+    for (int i = 0; i < w.length; i++) {
+      terrain_color += texture(albedos, tex_coords[i]).rgb * w[i];
+      terrain_normal += getWorldNormal(tex_coords[i]) * w[i];
+      terrain_roughness += texture(roughness, tex_coords[i]).r * w[i];
+      ao += texture(ambient_occlusion, tex_coords[i]).r * w[i];
+    }
+  }
+
+  // Far away the detail is sub-pixel, the macro material averages the layers over the texel
+  if (macro_fade > 0.0) {
+    vec4 macro = texture(atlasMacro, atlas_uv);
+    terrain_color = mix(terrain_color, macro.rgb, macro_fade);
+    terrain_normal = mix(terrain_normal, surface_normal, macro_fade);
+    terrain_roughness = mix(terrain_roughness, macro_roughness, macro_fade);
+    ao = mix(ao, macro.a, macro_fade);
   }
   terrain_normal = normalize(terrain_normal);
 
+  // Soil gets darker and smoother where much water passes, rivers where even more does
+  if (flowMap.enabled) {
+    vec2 flow_uv = (In.world_pos.xz - flowMap.origin) / flowMap.size;
+    if (all(greaterThanEqual(flow_uv, vec2(0.0))) && all(lessThanEqual(flow_uv, vec2(1.0)))) {
+      float flow = texture(flowAccumulation, flow_uv).r;
+      float wet = smoothstep(flowMap.wet_threshold, flowMap.river_threshold, flow);
+      float river = smoothstep(flowMap.river_threshold, flowMap.river_threshold + 2.0, flow);
+      terrain_color *= mix(1.0, 0.6, wet);
+      terrain_roughness = mix(terrain_roughness, terrain_roughness * 0.5, wet);
+      terrain_color = mix(terrain_color, vec3(0.05, 0.12, 0.15), river);
+      terrain_roughness = mix(terrain_roughness, 0.05, river);
+    }
+  }
+
+  // Large scale occlusion of valleys and gorges on top of the texture AO, only dims the ambient
+  if (horizonMap.occlusion_strength > 0.0) {
+    vec2 horizon_uv = (In.world_pos.xz - horizonMap.origin) / horizonMap.size;
+    if (all(greaterThanEqual(horizon_uv, vec2(0.0))) && all(lessThanEqual(horizon_uv, vec2(1.0)))) {
+      float sky = texture(horizonOcclusion, horizon_uv).r;
+      ao *= mix(1.0, sky, horizonMap.occlusion_strength);
+    }
+  }
+
   Material m;
   m.albedo = terrain_color;
   m.metallic = 0.2;
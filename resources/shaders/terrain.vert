@@ -1,20 +1,135 @@
 #version 420
 
 layout(location = 0) in vec3 pos_in;
+// CDLOD chunk: minimum corner (x, z), size and LOD
+layout(location = 1) in vec4 chunk_in;
+// Layer of the chunk in the height atlas, -1 while it has none
+layout(location = 2) in float atlas_layer_in;
+// Quadrant of the chunk drawn by this instance, -1 for the whole chunk
+layout(location = 3) in float quadrant_in;
 
 uniform mat4 modelMatrix;
+uniform vec3 eyeWorldPos;
+
+// Chunked terrain, see cdlod.h
+const int CDLOD_MAX_LODS = 16;
+const float CDLOD_MORPH_START = 0.7;
+
+struct Cdlod {
+  float lod_ranges[CDLOD_MAX_LODS];
+  vec2 height_bounds;
+  float grid_resolution;
+};
+uniform Cdlod cdlod;
+
+// Geometry clipmap, see clipmap.h
+const int CLIPMAP_TEXTURE_SIZE = 256;
+const int CLIPMAP_GRID_SIZE = CLIPMAP_TEXTURE_SIZE - 8;
+const int CLIPMAP_TRANSITION_WIDTH = CLIPMAP_GRID_SIZE / 10;
+
+layout(binding = 11) uniform sampler2DArray clipmapHeights;
+uniform int clipmapLevelCount;
+
+// TerrainMode
+const int TERRAIN_PLANE = 0;
+const int TERRAIN_CHUNKED = 1;
+const int TERRAIN_CLIPMAP = 2;
+uniform int terrainMode;
 
 // Out data
 out DATA {
   vec3 world_pos;
   vec2 tex_coord;
   vec3 normal;
+  // (origin x, origin z, size, layer) of the atlas page, see heightatlas.h
+  vec4 atlas_page;
+  // (origin x, origin z, size) of the drawn part of the chunk
+  vec3 chunk_rect;
 }
 Out;
 
+// Distance to the slab between the height bounds, matches Cdlod::distanceTo()
+float lodDistance(vec2 pos) {
+  float dy = max(max(eyeWorldPos.y - cdlod.height_bounds.y, cdlod.height_bounds.x - eyeWorldPos.y),
+                 0.0);
+  return length(vec3(pos - eyeWorldPos.xz, dy));
+}
+
+vec3 chunkPosition() {
+  vec2 pos = chunk_in.xy + pos_in.xz * chunk_in.z;
+
+  // Move the odd grid vertices onto their even neighbours towards the end of the LOD range
+  float range = cdlod.lod_ranges[int(chunk_in.w)];
+  float morph = clamp((lodDistance(pos) - CDLOD_MORPH_START * range)
+                          / ((1.0 - CDLOD_MORPH_START) * range),
+                      0.0, 1.0);
+  vec2 odd = fract(pos_in.xz * cdlod.grid_resolution * 0.5) * 2.0 / cdlod.grid_resolution;
+  pos -= odd * chunk_in.z * morph;
+
+  return vec3(pos.x, 0.0, pos.y);
+}
+
+float clipmapHeight(ivec2 p, int level) {
+  return texelFetch(clipmapHeights, ivec3(p & (CLIPMAP_TEXTURE_SIZE - 1), level), 0).r;
+}
+
+// vec3(height, d/dx, d/dz) at lattice point p of a level
+vec3 clipmapSample(ivec2 p, int level, float spacing) {
+  float dx = clipmapHeight(p + ivec2(1, 0), level) - clipmapHeight(p - ivec2(1, 0), level);
+  float dz = clipmapHeight(p + ivec2(0, 1), level) - clipmapHeight(p - ivec2(0, 1), level);
+  return vec3(clipmapHeight(p, level), vec2(dx, dz) / (2.0 * spacing));
+}
+
+// The next coarser level at lattice point p of a level, interpolated between its lattice points
+vec3 clipmapSampleCoarser(ivec2 p, int level, float spacing) {
+  ivec2 p0 = p >> 1;
+  ivec2 p1 = p0 + (p & 1);
+  return (clipmapSample(p0, level + 1, 2.0 * spacing)
+          + clipmapSample(ivec2(p1.x, p0.y), level + 1, 2.0 * spacing)
+          + clipmapSample(ivec2(p0.x, p1.y), level + 1, 2.0 * spacing)
+          + clipmapSample(p1, level + 1, 2.0 * spacing))
+         / 4.0;
+}
+
+vec3 clipmapPosition(out vec3 normal) {
+  int level = int(chunk_in.w);
+  float spacing = chunk_in.z / CLIPMAP_GRID_SIZE;
+  ivec2 p = ivec2(round(chunk_in.xy / spacing)) + ivec2(round(pos_in.xz * CLIPMAP_GRID_SIZE));
+  vec2 pos = vec2(p) * spacing;
+
+  vec3 height = clipmapSample(p, level, spacing);
+  if (level + 1 < clipmapLevelCount) {
+    // The camera is at most one texel from the middle, so the border of the ring is fully blended
+    vec2 d = abs(pos - eyeWorldPos.xz) / spacing;
+    float start = CLIPMAP_GRID_SIZE / 2 - 1 - CLIPMAP_TRANSITION_WIDTH;
+    float alpha = clamp((max(d.x, d.y) - start) / CLIPMAP_TRANSITION_WIDTH, 0.0, 1.0);
+    height = mix(height, clipmapSampleCoarser(p, level, spacing), alpha);
+  }
+
+  normal = normalize(vec3(-height.y, 1.0, -height.z));
+  return vec3(pos.x, height.x, pos.y);
+}
+
 void main() {
   // NOTE: We transform the point into world space and _not_ clip space
   // for the Tesselation Control Shader
-  Out.world_pos = (modelMatrix * vec4(pos_in, 1.0)).xyz;
+  Out.normal = vec3(0.0, 1.0, 0.0);
+  Out.atlas_page = vec4(0.0, 0.0, 0.0, -1.0);
+  Out.chunk_rect = vec3(0.0);
+  if (terrainMode == TERRAIN_CLIPMAP) {
+    Out.world_pos = clipmapPosition(Out.normal);
+  } else if (terrainMode == TERRAIN_CHUNKED) {
+    Out.world_pos = chunkPosition();
+    Out.atlas_page = vec4(chunk_in.xyz, atlas_layer_in);
+    if (quadrant_in >= 0.0) {
+      float half_size = chunk_in.z / 2.0;
+      vec2 quadrant = vec2(mod(quadrant_in, 2.0), floor(quadrant_in / 2.0));
+      Out.chunk_rect = vec3(chunk_in.xy + quadrant * half_size, half_size);
+    } else {
+      Out.chunk_rect = chunk_in.xyz;
+    }
+  } else {
+    Out.world_pos = (modelMatrix * vec4(pos_in, 1.0)).xyz;
+  }
   Out.tex_coord = Out.world_pos.xz / (2048.0);
 }
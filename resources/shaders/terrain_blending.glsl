@@ -0,0 +1,65 @@
+#ifndef _TERRAIN_BLENDING_H_
+#define _TERRAIN_BLENDING_H_
+
+// Splat weights of the 4 terrain textures from height and slope, shared by terrain.frag and the
+// bake in height_atlas_surface.comp
+
+#include "utils.glsl"
+
+uniform float texture_start_heights[4];
+uniform float texture_blends[4];
+
+float[4] terrainBlending(vec3 world_pos, vec3 normal) {
+  float height = world_pos.y;
+
+  // A completely flat terrain has slope=0
+  float slope = max(1 - dot(normal, vec3(0, 1, 0)), 0.0);
+
+  // For each fragment we compute how much each texture contributes depending on height and slope
+  float draw_strengths[4];
+
+  float sand_grass_height = texture_start_heights[0];
+  float grass_rock_height = texture_start_heights[1];
+  float rock_snow_height = texture_start_heights[2];
+
+  float grass_falloff = texture_blends[1];
+  float rock_falloff = texture_blends[2];
+  float snow_falloff = texture_blends[3];
+
+  float a, b, c, d;
+  {
+    b = inverseLerpClamped(sand_grass_height - grass_falloff / 2,
+                           sand_grass_height + grass_falloff / 2, height);
+  }
+  {
+    c = inverseLerpClamped(grass_rock_height - rock_falloff / 2,
+                           grass_rock_height + rock_falloff / 2, height);
+  }
+
+  float b_in, c_in, d_in;
+  b_in = inverseLerpClamped(sand_grass_height - grass_falloff / 2,
+                            sand_grass_height + grass_falloff / 2, height);
+  c_in = inverseLerpClamped(grass_rock_height - rock_falloff / 2,
+                            grass_rock_height + rock_falloff / 2, height);
+  d_in = inverseLerpClamped(rock_snow_height - snow_falloff / 2,
+                            rock_snow_height + snow_falloff / 2, height);
+
+  a = 1 - b_in;
+  b *= 1 - c_in;
+  c *= 1 - d_in;
+  d = d_in;
+
+  // a *= 1 - inverseLerpClamped(0.1, 1, slope);
+  b *= 1 - inverseLerpClamped(0.1, 1.0, slope);
+  d *= 1 - inverseLerpClamped(0.1, 1, slope);
+
+  float tot = a + b + c + d;
+  draw_strengths[0] = max(a / tot, 0);
+  draw_strengths[1] = max(b / tot, 0);
+  draw_strengths[2] = max(c / tot, 0);
+  draw_strengths[3] = max(d / tot, 0);
+
+  return draw_strengths;
+}
+
+#endif  // _TERRAIN_BLENDING_H_
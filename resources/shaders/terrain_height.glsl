@@ -0,0 +1,86 @@
+// terrain_height() and terrain_height_grad(), shared by terrain.tes and the atlas bake in
+// height_atlas.comp. src/fbm.h is the CPU port.
+
+#include "noise.glsl"
+#include "fbm.glsl"
+
+// Noise
+struct Noise {
+  int num_octaves;
+  float amplitude;
+  float frequency;
+  float persistence;
+  float lacunarity;
+  float warp_strength;
+};
+uniform Noise noise;
+
+// Specialised for the recipe in the FBM_* defines (fbm.glsl): the octave count is a compile time
+// constant, so the loop over the high octaves is unrolled by the driver. Octave i is sampled at
+// pos * frequency / 200, / 400 and / 800 + (1231, 721) for i = 0, 1, >= 2
+#define FBM_NEXT_OCTAVE amplitude *= noise.persistence, frequency *= noise.lacunarity
+
+float fbm_high_octave(vec2 pos, float frequency) {
+  return fbm_detail(pos * frequency / 800.0 + vec2(1231, 721)) / 2;
+}
+
+vec3 fbm_high_octave_grad(vec2 pos, float frequency) {
+  return fbm_detail_grad(pos * frequency / 800.0 + vec2(1231, 721))
+         * vec3(1.0, vec2(frequency / 800.0)) / 2;
+}
+
+float terrain_height(vec2 pos) {
+  float noise_value = 0;
+  float frequency = noise.frequency;
+  float amplitude = noise.amplitude;
+
+#if FBM_WARP
+  pos = fbm_warp(pos, noise.frequency, noise.warp_strength);
+#endif
+
+#if FBM_OCTAVES > 0
+  noise_value += fbm_base(pos * frequency / 200.0) * amplitude;
+#endif
+#if FBM_OCTAVES > 1
+  FBM_NEXT_OCTAVE;
+  noise_value += fbm_detail(pos * frequency / 400.0) / 1.5 * amplitude;
+#endif
+  for (int i = 2; i < FBM_OCTAVES; i++) {
+    FBM_NEXT_OCTAVE;
+    noise_value += fbm_high_octave(pos, frequency) * amplitude;
+  }
+
+  return noise_value;
+}
+
+// terrain_height() and its analytic derivatives as vec3(height, d/dx, d/dz)
+vec3 terrain_height_grad(vec2 pos) {
+  vec3 noise_value = vec3(0);
+  float frequency = noise.frequency;
+  float amplitude = noise.amplitude;
+
+#if FBM_WARP
+  mat2 jacobian;
+  pos = fbm_warp(pos, noise.frequency, noise.warp_strength, jacobian);
+#endif
+
+#if FBM_OCTAVES > 0
+  noise_value += fbm_base_grad(pos * frequency / 200.0) * vec3(1.0, vec2(frequency / 200.0))
+                 * amplitude;
+#endif
+#if FBM_OCTAVES > 1
+  FBM_NEXT_OCTAVE;
+  noise_value += fbm_detail_grad(pos * frequency / 400.0) * vec3(1.0, vec2(frequency / 400.0))
+                 / 1.5 * amplitude;
+#endif
+  for (int i = 2; i < FBM_OCTAVES; i++) {
+    FBM_NEXT_OCTAVE;
+    noise_value += fbm_high_octave_grad(pos, frequency) * amplitude;
+  }
+
+#if FBM_WARP
+  // Chain rule through the warp, the transposed Jacobian times the gradient
+  noise_value.yz = noise_value.yz * jacobian;
+#endif
+  return noise_value;
+}
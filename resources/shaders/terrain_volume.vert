@@ -0,0 +1,68 @@
+#version 420
+
+// Meshes of the density field terrain, see volume.h. Same outputs as terrain.tes, so the chunks
+// are shaded by terrain.frag
+layout(location = 0) in vec3 position_in;
+layout(location = 1) in vec3 normal_in;
+
+uniform mat4 viewProjectionMatrix;
+uniform mat4 lightMatrix;
+uniform mat4 viewMatrix;
+
+// Cascading shadow maps
+const int NUM_CASCADES = 3;
+
+struct ShadowMap {
+  float cascade_clip_splits[NUM_CASCADES];
+  mat4 light_wvp_matrix[NUM_CASCADES];
+  float blend_distance;
+  int rendered_cascades;
+  bool debug_show_splits;
+  bool debug_show_blend;
+};
+uniform ShadowMap shadow_map;
+
+out vec4 shadow_light_pos[NUM_CASCADES];
+out float shadow_clip_depth;
+
+// Out data
+out DATA {
+  vec3 world_pos;
+  vec3 view_space_pos;
+  vec3 view_space_normal;
+  vec4 shadow_coord;
+  vec2 tex_coord;
+  vec3 normal;
+  vec3 tangent;
+  vec3 bitangent;
+  mat3 tangent_matrix;
+  flat vec4 atlas_page;
+}
+Out;
+
+void main() {
+  Out.world_pos = position_in;
+  Out.tex_coord = Out.world_pos.xz / (2048.0);
+  Out.normal = normalize(normal_in);
+  Out.atlas_page = vec4(0.0, 0.0, 0.0, -1.0);
+
+  Out.view_space_pos = (viewMatrix * vec4(Out.world_pos, 1.0)).xyz;
+  Out.view_space_normal = (viewMatrix * vec4(Out.normal, 0.0)).xyz;
+  // Overhangs and cave ceilings face straight down, where the y axis gives no tangent
+  vec3 up = abs(Out.normal.y) < 0.999 ? vec3(0, 1, 0) : vec3(1, 0, 0);
+  Out.tangent = normalize(cross(Out.normal, up));
+  Out.bitangent = normalize(cross(Out.tangent, Out.normal));
+
+  Out.tangent_matrix = mat3(Out.tangent, Out.bitangent, Out.normal);
+
+  Out.shadow_coord = lightMatrix * vec4(Out.view_space_pos, 1.f);
+
+  gl_Position = viewProjectionMatrix * vec4(Out.world_pos, 1.0);
+
+  // Cascading shadow map
+  for (int i = 0; i < NUM_CASCADES; i++) {
+    shadow_light_pos[i] = shadow_map.light_wvp_matrix[i] * vec4(Out.world_pos, 1.0);
+  }
+
+  shadow_clip_depth = gl_Position.z;
+}
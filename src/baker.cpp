@@ -0,0 +1,113 @@
+#include "baker.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+
+#include "jobs.h"
+#include "tilecache.h"
+
+TileKey TileBaker::tileAt(u64 noise_hash, int lod, glm::vec2 position) const {
+  glm::vec2 tile = glm::floor(position / this->tileWorldSize(lod));
+  return TileKey{noise_hash, lod, int(tile.x), int(tile.y)};
+}
+
+std::vector<TileKey> TileBaker::tilesAround(u64 noise_hash, glm::vec2 center, int lod_count,
+                                            int radius) const {
+  std::vector<TileKey> keys;
+  keys.reserve(lod_count * (2 * radius + 1) * (2 * radius + 1));
+
+  for (int lod = 0; lod < lod_count; lod++) {
+    TileKey middle = this->tileAt(noise_hash, lod, center);
+    for (int z = -radius; z <= radius; z++) {
+      for (int x = -radius; x <= radius; x++) {
+        keys.push_back(TileKey{noise_hash, lod, middle.x + x, middle.z + z});
+      }
+    }
+  }
+
+  return keys;
+}
+
+void TileBaker::bakeTile(const TerrainNoise& noise, HeightTile& tile) const {
+  assert(tile.key.noise_hash == noise::hash(noise));
+
+  float texel_size = this->texelSize(tile.key.lod);
+  glm::vec2 origin = this->tileOrigin(tile.key) - glm::vec2(TILE_APRON * texel_size);
+
+  tile.heights.resize(TILE_STRIDE * TILE_STRIDE);
+
+  // One row at a time keeps the positions in L1
+  glm::vec2 positions[TILE_STRIDE];
+  for (int x = 0; x < TILE_STRIDE; x++) {
+    positions[x].x = origin.x + x * texel_size;
+  }
+
+  for (int z = 0; z < TILE_STRIDE; z++) {
+    for (int x = 0; x < TILE_STRIDE; x++) {
+      positions[x].y = origin.y + z * texel_size;
+    }
+    noise::terrainHeights(noise, positions, &tile.heights[z * TILE_STRIDE], TILE_STRIDE);
+  }
+
+  auto bounds = std::minmax_element(tile.heights.begin(), tile.heights.end());
+  tile.min_height = *bounds.first;
+  tile.max_height = *bounds.second;
+}
+
+std::vector<HeightTile> TileBaker::bakeTiles(const TerrainNoise& noise,
+                                             Span<const TileKey> keys) {
+  std::vector<HeightTile> tiles(keys.size());
+  for (usize i = 0; i < keys.size(); i++) {
+    tiles[i].key = keys[i];
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  JobSystem::instance()->parallelFor(tiles.size(), 1, [&](usize begin, usize end) {
+    for (usize i = begin; i < end; i++) {
+      this->bakeTile(noise, tiles[i]);
+    }
+  });
+  auto end = std::chrono::steady_clock::now();
+
+  this->last_stats.tiles = tiles.size();
+  this->last_stats.samples = tiles.size() * TILE_STRIDE * TILE_STRIDE;
+  this->last_stats.threads = JobSystem::instance()->threadCount() + 1;
+  this->last_stats.seconds = std::chrono::duration<double>(end - start).count();
+
+  return tiles;
+}
+
+void TileBaker::gui(const TerrainNoise& noise, glm::vec3 camera_position, TileCache* cache) {
+  // The texel size is not part of the tile keys
+  if (ImGui::DragFloat("Base texel size", &this->base_texel_size, 0.1f, 0.25f, 64.0f)) {
+    cache->clear();
+  }
+  ImGui::SliderInt("Benchmark LODs", &this->bench_lods, 1, 8);
+  ImGui::SliderInt("Benchmark radius", &this->bench_radius, 0, 8);
+
+  if (ImGui::Button("Bake around camera")) {
+    auto keys = this->tilesAround(noise::hash(noise),
+                                  glm::vec2(camera_position.x, camera_position.z),
+                                  this->bench_lods, this->bench_radius);
+
+    std::vector<TileKey> missing;
+    for (const auto& key : keys) {
+      if (cache->find(key) == nullptr) {
+        missing.push_back(key);
+      }
+    }
+
+    for (auto& tile : this->bakeTiles(noise, missing)) {
+      cache->insert(std::move(tile));
+    }
+  }
+
+  const auto& stats = this->last_stats;
+  ImGui::Text("Last bake: %zu tiles, %.1f M samples in %.1f ms", stats.tiles,
+              stats.samples / 1e6, stats.seconds * 1e3);
+  ImGui::Text("Throughput: %.1f M samples/s on %d threads (%s)", stats.samplesPerSecond() / 1e6,
+              stats.threads, noise::simdLevelName(noise::simdLevel()));
+}
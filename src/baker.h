@@ -0,0 +1,103 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "core.h"
+#include "noise.h"
+
+// Texels per tile side. Every tile also stores an apron of one texel on each side, duplicating the
+// edge texels of its neighbours so tiles can be filtered and differentiated on their own.
+constexpr int TILE_SIZE = 256;
+constexpr int TILE_APRON = 1;
+constexpr int TILE_STRIDE = TILE_SIZE + 2 * TILE_APRON;
+
+struct TileKey {
+  u64 noise_hash;
+  int lod;
+  int x;
+  int z;
+
+  bool operator==(const TileKey& other) const {
+    return noise_hash == other.noise_hash && lod == other.lod && x == other.x && z == other.z;
+  }
+  bool operator!=(const TileKey& other) const { return !(*this == other); }
+};
+
+struct TileKeyHash {
+  usize operator()(const TileKey& key) const {
+    u64 h = key.noise_hash;
+    h = (h ^ u64(u32(key.lod))) * 1099511628211ull;
+    h = (h ^ u64(u32(key.x))) * 1099511628211ull;
+    h = (h ^ u64(u32(key.z))) * 1099511628211ull;
+    return usize(h);
+  }
+};
+
+struct HeightTile {
+  TileKey key;
+  float min_height = 0.0f;
+  float max_height = 0.0f;
+  // TILE_STRIDE^2 heights, row major, apron included
+  std::vector<float> heights;
+
+  // `x` and `z` are in [-TILE_APRON, TILE_SIZE + TILE_APRON)
+  float at(int x, int z) const {
+    return heights[(z + TILE_APRON) * TILE_STRIDE + (x + TILE_APRON)];
+  }
+};
+
+class TileCache;
+
+struct TileBakeStats {
+  usize tiles = 0;
+  usize samples = 0;
+  int threads = 0;
+  double seconds = 0.0;
+
+  double samplesPerSecond() const { return seconds > 0.0 ? samples / seconds : 0.0; }
+};
+
+/**
+ * Evaluates the terrain noise into fixed size height tiles on the job system, one job per tile.
+ *
+ * A tile at `lod` has texels `base_texel_size * 2^lod` apart, and texel (0, 0) of tile (x, z) lies
+ * at (x, z) * TILE_SIZE * texelSize(lod) in world space.
+ */
+struct TileBaker {
+  float base_texel_size = 2.0f;
+
+  // Benchmark settings
+  int bench_lods = 4;
+  int bench_radius = 2;
+
+  TileBakeStats last_stats;
+
+  float texelSize(int lod) const { return base_texel_size * float(1 << lod); }
+  float tileWorldSize(int lod) const { return texelSize(lod) * TILE_SIZE; }
+  glm::vec2 tileOrigin(const TileKey& key) const {
+    return glm::vec2(key.x, key.z) * tileWorldSize(key.lod);
+  }
+  TileKey tileAt(u64 noise_hash, int lod, glm::vec2 position) const;
+
+  /**
+   * The (2 * radius + 1)^2 tiles around `center` for each of the `lod_count` first LODs.
+   */
+  std::vector<TileKey> tilesAround(u64 noise_hash, glm::vec2 center, int lod_count,
+                                   int radius) const;
+
+  /**
+   * Bake `tile.key` on the calling thread.
+   */
+  void bakeTile(const TerrainNoise& noise, HeightTile& tile) const;
+
+  /**
+   * Bake all `keys` in parallel and block until they are done. Updates `last_stats`.
+   */
+  std::vector<HeightTile> bakeTiles(const TerrainNoise& noise, Span<const TileKey> keys);
+
+  /**
+   * Settings and a benchmark baking the tiles around the camera that are missing from `cache`.
+   */
+  void gui(const TerrainNoise& noise, glm::vec3 camera_position, TileCache* cache);
+};
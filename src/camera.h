@@ -41,6 +41,8 @@ struct Camera {
   vec3 direction = vec3(0, 0, -1);
   float speed = 40;
   float rotation_speed = 0.12f;
+  // Minimum height above the terrain surface in fly mode
+  float ground_clearance = 2.0f;
 
   int mode = CameraMode::Fly;
 
@@ -100,6 +102,12 @@ struct Camera {
     direction = vec3(pitch * yaw * vec4(direction, 0.0f));
   }
 
+  void clampAboveGround(float ground_height) {
+    if (mode == CameraMode::Fly) {
+      position.y = max(position.y, ground_height + ground_clearance);
+    }
+  }
+
   mat4 getViewMatrix() {
     switch (mode) {
       case CameraMode::Fly: {
@@ -138,6 +146,7 @@ struct Camera {
 
     ImGui::SliderFloat("Movement Speed", &this->speed, 80.0, 350.0);
     ImGui::SliderFloat("Rotate Speed", &this->rotation_speed, 0.05, 2.0);
+    ImGui::DragFloat("Ground Clearance", &this->ground_clearance, 0.1, 0.0, 100.0);
 
     ImGui::Spacing();
 
@@ -0,0 +1,276 @@
+#include "cdlod.h"
+
+#include <imgui.h>
+
+#include <cstddef>
+
+#include "gpu.h"
+
+void Cdlod::init() { this->buildGrid(); }
+
+void Cdlod::deinit() {
+  glDeleteBuffers(1, &this->positions_bo);
+  glDeleteBuffers(1, &this->indices_bo);
+  glDeleteBuffers(1, &this->instances_bo);
+  glDeleteVertexArrays(1, &this->vao);
+  this->vao = 0;
+}
+
+void Cdlod::buildGrid() {
+  if (this->vao != 0) {
+    this->deinit();
+  }
+
+  int n = this->grid_resolution;
+  int vertices_x_count = n + 1;
+
+  std::vector<glm::vec3> positions;
+  positions.reserve(vertices_x_count * vertices_x_count);
+  for (int z = 0; z < vertices_x_count; z++) {
+    for (int x = 0; x < vertices_x_count; x++) {
+      positions.emplace_back(x / float(n), 0.0f, z / float(n));
+    }
+  }
+
+  // Quadrant by quadrant, so a quarter of the index buffer draws a single quadrant
+  std::vector<u32> indices;
+  indices.reserve(n * n * 6);
+  int half = n / 2;
+  for (int quadrant = 0; quadrant < 4; quadrant++) {
+    int x0 = (quadrant & 1) * half;
+    int z0 = (quadrant >> 1) * half;
+    for (int z = z0; z < z0 + half; z++) {
+      for (int x = x0; x < x0 + half; x++) {
+        u32 top_left = z * vertices_x_count + x;
+        u32 top_right = top_left + 1;
+        u32 bot_left = top_left + vertices_x_count;
+        u32 bot_right = bot_left + 1;
+
+        indices.push_back(top_left);
+        indices.push_back(bot_left);
+        indices.push_back(bot_right);
+
+        indices.push_back(top_right);
+        indices.push_back(top_left);
+        indices.push_back(bot_right);
+      }
+    }
+  }
+
+  glCreateVertexArrays(1, &this->vao);
+
+  glCreateBuffers(1, &this->positions_bo);
+  glNamedBufferData(this->positions_bo, positions.size() * sizeof(positions[0]), positions.data(),
+                    GL_STATIC_DRAW);
+  glVertexArrayVertexBuffer(this->vao, 0, this->positions_bo, 0, sizeof(glm::vec3));
+  glEnableVertexArrayAttrib(this->vao, 0);
+  glVertexArrayAttribFormat(this->vao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+  glVertexArrayAttribBinding(this->vao, 0, 0);
+
+  glCreateBuffers(1, &this->instances_bo);
+  glVertexArrayVertexBuffer(this->vao, 1, this->instances_bo, 0, sizeof(CdlodChunk));
+  glVertexArrayBindingDivisor(this->vao, 1, 1);
+  glEnableVertexArrayAttrib(this->vao, 1);
+  glVertexArrayAttribFormat(this->vao, 1, 4, GL_FLOAT, GL_FALSE, 0);
+  glVertexArrayAttribBinding(this->vao, 1, 1);
+  glEnableVertexArrayAttrib(this->vao, 2);
+  glVertexArrayAttribFormat(this->vao, 2, 1, GL_FLOAT, GL_FALSE,
+                            offsetof(CdlodChunk, atlas_layer));
+  glVertexArrayAttribBinding(this->vao, 2, 1);
+  glEnableVertexArrayAttrib(this->vao, 3);
+  glVertexArrayAttribFormat(this->vao, 3, 1, GL_FLOAT, GL_FALSE, offsetof(CdlodChunk, quadrant));
+  glVertexArrayAttribBinding(this->vao, 3, 1);
+
+  glCreateBuffers(1, &this->indices_bo);
+  glNamedBufferData(this->indices_bo, indices.size() * sizeof(u32), indices.data(),
+                    GL_STATIC_DRAW);
+  glVertexArrayElementBuffer(this->vao, this->indices_bo);
+
+  CHECK_GL_ERROR();
+
+  this->mesh_resolution = n;
+}
+
+float Cdlod::distanceTo(glm::vec2 origin, float size) const {
+  glm::vec2 camera_xz(this->camera_position.x, this->camera_position.z);
+  glm::vec2 nearest = glm::clamp(camera_xz, origin, origin + size);
+  float dy = glm::max(glm::max(this->camera_position.y - this->height_bounds.y,
+                               this->height_bounds.x - this->camera_position.y),
+                      0.0f);
+  glm::vec2 d = camera_xz - nearest;
+  return glm::sqrt(d.x * d.x + d.y * d.y + dy * dy);
+}
+
+bool Cdlod::selectNode(glm::vec2 origin, int lod) {
+  float size = this->chunk_size * float(1 << lod);
+  float distance = this->distanceTo(origin, size);
+  if (distance > this->lodRange(lod)) {
+    // Covered by the parent
+    return false;
+  }
+
+  CdlodChunk chunk = {origin, size, float(lod)};
+  if (lod == 0 || distance > this->lodRange(lod - 1)) {
+    this->addChunk(0, chunk);
+    return true;
+  }
+
+  float half = size / 2.0f;
+  for (int quadrant = 0; quadrant < 4; quadrant++) {
+    glm::vec2 child_origin = origin + glm::vec2(quadrant & 1, quadrant >> 1) * half;
+    if (!this->selectNode(child_origin, lod - 1)) {
+      this->addChunk(1 + quadrant, chunk);
+    }
+  }
+  return true;
+}
+
+void Cdlod::addChunk(int bucket, const CdlodChunk& chunk) {
+  glm::vec2 min = chunk.origin;
+  float size = chunk.size;
+  if (bucket > 0) {
+    int quadrant = bucket - 1;
+    size /= 2.0f;
+    min += glm::vec2(quadrant & 1, quadrant >> 1) * size;
+  }
+  glm::vec2 max = min + size;
+
+  glm::vec2 heights = this->height_bounds;
+  if (this->pyramid != nullptr) {
+    this->pyramid->heightRange(min, max, &heights);
+  }
+  // The GPU heights differ from the CPU ones by up to ~1e-3 of the amplitude
+  float margin = (this->height_bounds.y - this->height_bounds.x) * 2e-3f;
+
+  this->buckets[bucket].push_back(chunk);
+  this->buckets[bucket].back().quadrant = float(bucket - 1);
+  this->bucket_bounds[bucket].push_back({glm::vec3(min.x, heights.x - margin, min.y),
+                                         glm::vec3(max.x, heights.y + margin, max.y)});
+  this->lod_counts[int(chunk.lod)] += 1;
+}
+
+void Cdlod::select(glm::vec3 camera_position, glm::vec2 height_bounds,
+                   const HeightPyramid* pyramid) {
+  this->camera_position = camera_position;
+  this->height_bounds = height_bounds;
+  this->pyramid = pyramid;
+  this->lod_count = glm::clamp(this->lod_count, 1, MAX_LODS);
+  this->lod_distance_ratio = glm::max(this->lod_distance_ratio, minDistanceRatio());
+
+  for (int i = 0; i < BUCKET_COUNT; i++) {
+    this->buckets[i].clear();
+    this->bucket_bounds[i].clear();
+  }
+  this->lod_counts.fill(0);
+
+  // 2x2 roots around the camera, it is always at least half a root away from the far edges
+  float root_size = this->rootSize();
+  glm::vec2 camera_xz(camera_position.x, camera_position.z);
+  glm::vec2 base = glm::floor(camera_xz / root_size + 0.5f) * root_size - root_size;
+  int top_lod = this->lod_count - 1;
+  for (int z = 0; z < 2; z++) {
+    for (int x = 0; x < 2; x++) {
+      glm::vec2 origin = base + glm::vec2(x, z) * root_size;
+      if (!this->selectNode(origin, top_lod)) {
+        this->addChunk(0, {origin, root_size, float(top_lod)});
+      }
+    }
+  }
+  this->pyramid = nullptr;
+}
+
+void Cdlod::setUniforms(GLuint program) const {
+  std::array<float, MAX_LODS> ranges{};
+  for (int lod = 0; lod < this->lod_count; lod++) {
+    ranges[lod] = this->lodRange(lod);
+  }
+  glUniform1fv(glGetUniformLocation(program, "cdlod.lod_ranges"), MAX_LODS, ranges.data());
+  glUniform2f(glGetUniformLocation(program, "cdlod.height_bounds"), this->height_bounds.x,
+              this->height_bounds.y);
+  gpu::setUniformSlow(program, "cdlod.grid_resolution", float(this->mesh_resolution));
+}
+
+void Cdlod::draw(const Frustum* frustum, CullStats* stats) {
+  if (this->mesh_resolution != this->grid_resolution) {
+    this->buildGrid();
+  }
+
+  // Cull bucket by bucket so the visible chunks of a bucket stay next to each other
+  std::array<usize, BUCKET_COUNT> visible_counts{};
+  this->visible.clear();
+  for (int bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+    const auto& chunks = this->buckets[bucket];
+    for (usize i = 0; i < chunks.size(); i++) {
+      if (frustum == nullptr || frustum->intersects(this->bucket_bounds[bucket][i])) {
+        this->visible.push_back(chunks[i]);
+        visible_counts[bucket] += 1;
+      }
+    }
+  }
+  stats->visible = this->visible.size();
+  stats->culled = this->chunkCount() - this->visible.size();
+
+  // Orphans the storage of the previous pass
+  glNamedBufferData(this->instances_bo, this->visible.size() * sizeof(CdlodChunk),
+                    this->visible.data(), GL_STREAM_DRAW);
+
+  GLsizei full_count = this->mesh_resolution * this->mesh_resolution * 6;
+  GLsizei quadrant_count = full_count / 4;
+
+  glBindVertexArray(this->vao);
+  usize base_instance = 0;
+  for (int bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+    usize instances = visible_counts[bucket];
+    if (instances > 0) {
+      GLsizei count = bucket == 0 ? full_count : quadrant_count;
+      usize offset = bucket == 0 ? 0 : (bucket - 1) * quadrant_count * sizeof(u32);
+      glDrawElementsInstancedBaseInstance(GL_PATCHES, count, GL_UNSIGNED_INT, (void*)offset,
+                                          GLsizei(instances), GLuint(base_instance));
+    }
+    base_instance += instances;
+  }
+  glBindVertexArray(0);
+}
+
+usize Cdlod::chunkCount() const {
+  usize count = 0;
+  for (const auto& bucket : this->buckets) {
+    count += bucket.size();
+  }
+  return count;
+}
+
+usize Cdlod::triangleCount() const {
+  usize quads = usize(this->grid_resolution) * this->grid_resolution;
+  usize full = this->buckets[0].size() * quads * 2;
+  usize quadrants = 0;
+  for (int bucket = 1; bucket < BUCKET_COUNT; bucket++) {
+    quadrants += this->buckets[bucket].size() * quads / 2;
+  }
+  return full + quadrants;
+}
+
+bool Cdlod::gui() {
+  bool changed = false;
+  changed |= ImGui::SliderFloat("Chunk size", &this->chunk_size, 32.0f, 1024.0f);
+  changed |= ImGui::SliderInt("LODs", &this->lod_count, 1, MAX_LODS);
+  if (ImGui::SliderInt("Grid resolution", &this->grid_resolution, 2, 64)) {
+    // Morphing needs an even number of quads
+    this->grid_resolution = glm::max(this->grid_resolution / 2 * 2, 2);
+    changed = true;
+  }
+  changed |= ImGui::SliderFloat("LOD distance ratio", &this->lod_distance_ratio,
+                                minDistanceRatio(), 16.0f);
+
+  ImGui::Text("View distance: at least %.1f km", this->rootSize() / 2.0f / 1000.0f);
+  ImGui::Text("Chunks: %zu (%zu partial), triangles: %zu",
+              this->chunkCount(), this->chunkCount() - this->buckets[0].size(),
+              this->triangleCount());
+  for (int lod = 0; lod < this->lod_count; lod++) {
+    if (this->lod_counts[lod] > 0) {
+      ImGui::Text("  LOD %d: %zu chunks, range %.0f m", lod, this->lod_counts[lod],
+                  this->lodRange(lod));
+    }
+  }
+  return changed;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <array>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "core.h"
+#include "frustum.h"
+#include "heightpyramid.h"
+
+/**
+ * One selected chunk, uploaded as is as the per-instance attribute of terrain.vert.
+ */
+struct CdlodChunk {
+  glm::vec2 origin;  // minimum corner in world space (x, z)
+  float size;
+  float lod;
+  // Page in the HeightAtlas, -1 for none
+  float atlas_layer = -1.0f;
+  // Drawn quadrant 0..3 (x + 2 z) of the node, -1 for all of it
+  float quadrant = -1.0f;
+};
+static_assert(sizeof(CdlodChunk) == 6 * sizeof(float), "CdlodChunk is uploaded as vec4 + 2 floats");
+
+/**
+ * Continuous distance-dependent LOD (CDLOD) chunks.
+ *
+ * A quadtree of square chunks covers the terrain around the camera, 2x2 roots snapped to the root
+ * size. A node of LOD L is chunk_size * 2^L wide and is split while it comes closer to the camera
+ * than the range of LOD L - 1. Every chunk is an instance of one shared grid of grid_resolution^2
+ * quads. Towards the end of its range terrain.vert morphs every odd grid vertex onto its even
+ * neighbour, so at its border a chunk matches the next coarser LOD. A node with only some of its
+ * children selected draws the other quadrants itself from the matching quarter of the index
+ * buffer.
+ *
+ * Distances are measured to the slab between the global height bounds, not to the unknown surface,
+ * on the CPU and in terrain.vert alike. A chunk then reaches at most sqrt(2) * its size beyond its
+ * nearest point, and its coarser neighbour only starts to morph past that as long as
+ * lod_distance_ratio >= minDistanceRatio().
+ *
+ * Every selected chunk also gets a box from the height pyramid where it covers the chunk, and from
+ * the global height bounds elsewhere. draw() culls the chunks against the frustum of each pass and
+ * only uploads the visible ones.
+ */
+class Cdlod {
+public:
+  static constexpr int MAX_LODS = 16;
+  // Fraction of a LOD range after which its chunks start to morph, also used in terrain.vert
+  static constexpr float MORPH_START = 0.7f;
+
+  float chunk_size = 256.0f;
+  int lod_count = 8;
+  int grid_resolution = 16;
+  float lod_distance_ratio = 4.0f;
+
+  void init();
+  void deinit();
+
+  /**
+   * Select the chunks for a camera position. Only touches the CPU side. `pyramid` is optional and
+   * only used for tighter boxes.
+   */
+  void select(glm::vec3 camera_position, glm::vec2 height_bounds,
+              const HeightPyramid* pyramid = nullptr);
+
+  void setUniforms(GLuint program) const;
+  /**
+   * Draw the selected chunks that intersect `frustum`, or all of them without one.
+   */
+  void draw(const Frustum* frustum, CullStats* stats);
+
+  bool gui();
+
+  float lodRange(int lod) const { return chunk_size * float(1 << lod) * lod_distance_ratio; }
+  float rootSize() const { return chunk_size * float(1 << (lod_count - 1)); }
+  static float minDistanceRatio() { return 1.41421356f / (2.0f * MORPH_START - 1.0f); }
+
+  // Bucket 0 holds the full chunks, 1..4 the single quadrants 0..3 (x + 2 z)
+  static constexpr int BUCKET_COUNT = 5;
+
+  const std::vector<CdlodChunk>& chunks(int bucket) const { return buckets[bucket]; }
+  std::vector<CdlodChunk>& chunks(int bucket) { return buckets[bucket]; }
+  // Box of the drawn part of each chunk, the quadrant for buckets 1..4
+  const std::vector<Aabb>& chunkBounds(int bucket) const { return bucket_bounds[bucket]; }
+  usize chunkCount() const;
+  usize triangleCount() const;
+
+private:
+  glm::vec3 camera_position = glm::vec3(0.0f);
+  glm::vec2 height_bounds = glm::vec2(0.0f);
+
+  const HeightPyramid* pyramid = nullptr;
+
+  std::array<std::vector<CdlodChunk>, BUCKET_COUNT> buckets;
+  std::array<std::vector<Aabb>, BUCKET_COUNT> bucket_bounds;
+  std::array<usize, MAX_LODS> lod_counts{};
+  // Instances of the current pass
+  std::vector<CdlodChunk> visible;
+
+  GLuint vao = 0;
+  GLuint positions_bo = 0;
+  GLuint indices_bo = 0;
+  GLuint instances_bo = 0;
+  int mesh_resolution = 0;
+
+  void buildGrid();
+  bool selectNode(glm::vec2 origin, int lod);
+  void addChunk(int bucket, const CdlodChunk& chunk);
+  float distanceTo(glm::vec2 origin, float size) const;
+};
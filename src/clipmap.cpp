@@ -0,0 +1,270 @@
+#include "clipmap.h"
+
+#include <imgui.h>
+
+#include <chrono>
+
+#include "gpu.h"
+#include "jobs.h"
+
+void Clipmap::init() { this->buildGrid(); }
+
+void Clipmap::deinit() {
+  glDeleteTextures(1, &this->height_texture);
+  glDeleteBuffers(1, &this->positions_bo);
+  glDeleteBuffers(1, &this->indices_bo);
+  glDeleteBuffers(1, &this->instances_bo);
+  glDeleteVertexArrays(1, &this->vao);
+  this->height_texture = 0;
+  this->built_level_count = 0;
+}
+
+void Clipmap::buildGrid() {
+  const int n = GRID_SIZE;
+  const int vertices_x_count = n + 1;
+
+  std::vector<glm::vec3> positions;
+  positions.reserve(vertices_x_count * vertices_x_count);
+  for (int z = 0; z < vertices_x_count; z++) {
+    for (int x = 0; x < vertices_x_count; x++) {
+      positions.emplace_back(x / float(n), 0.0f, z / float(n));
+    }
+  }
+
+  std::vector<u32> indices;
+  for (int variant = 0; variant < VARIANT_COUNT; variant++) {
+    // The finer level covers half of the ring, a quarter in from each side moved by (dx, dz)
+    glm::ivec2 hole_min(n), hole_max(n);
+    if (variant > 0) {
+      glm::ivec2 offset((variant - 1) % 3 - 1, (variant - 1) / 3 - 1);
+      hole_min = glm::ivec2(n / 4) + offset;
+      hole_max = hole_min + n / 2;
+    }
+
+    this->variant_offsets[variant] = GLsizei(indices.size() * sizeof(u32));
+    for (int z = 0; z < n; z++) {
+      for (int x = 0; x < n; x++) {
+        if (x >= hole_min.x && x < hole_max.x && z >= hole_min.y && z < hole_max.y) {
+          continue;
+        }
+
+        u32 top_left = z * vertices_x_count + x;
+        u32 top_right = top_left + 1;
+        u32 bot_left = top_left + vertices_x_count;
+        u32 bot_right = bot_left + 1;
+
+        indices.push_back(top_left);
+        indices.push_back(bot_left);
+        indices.push_back(bot_right);
+
+        indices.push_back(top_right);
+        indices.push_back(top_left);
+        indices.push_back(bot_right);
+      }
+    }
+    this->variant_counts[variant]
+        = GLsizei(indices.size() - this->variant_offsets[variant] / sizeof(u32));
+  }
+
+  glCreateVertexArrays(1, &this->vao);
+
+  glCreateBuffers(1, &this->positions_bo);
+  glNamedBufferData(this->positions_bo, positions.size() * sizeof(positions[0]), positions.data(),
+                    GL_STATIC_DRAW);
+  glVertexArrayVertexBuffer(this->vao, 0, this->positions_bo, 0, sizeof(glm::vec3));
+  glEnableVertexArrayAttrib(this->vao, 0);
+  glVertexArrayAttribFormat(this->vao, 0, 3, GL_FLOAT, GL_FALSE, 0);
+  glVertexArrayAttribBinding(this->vao, 0, 0);
+
+  // One instance per level, laid out like CdlodChunk: (origin x, origin z, size, level)
+  glCreateBuffers(1, &this->instances_bo);
+  glVertexArrayVertexBuffer(this->vao, 1, this->instances_bo, 0, sizeof(glm::vec4));
+  glVertexArrayBindingDivisor(this->vao, 1, 1);
+  glEnableVertexArrayAttrib(this->vao, 1);
+  glVertexArrayAttribFormat(this->vao, 1, 4, GL_FLOAT, GL_FALSE, 0);
+  glVertexArrayAttribBinding(this->vao, 1, 1);
+
+  glCreateBuffers(1, &this->indices_bo);
+  glNamedBufferData(this->indices_bo, indices.size() * sizeof(u32), indices.data(),
+                    GL_STATIC_DRAW);
+  glVertexArrayElementBuffer(this->vao, this->indices_bo);
+
+  CHECK_GL_ERROR();
+}
+
+void Clipmap::createTexture() {
+  glDeleteTextures(1, &this->height_texture);
+  glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &this->height_texture);
+  glTextureStorage3D(this->height_texture, 1, GL_R32F, TEXTURE_SIZE, TEXTURE_SIZE,
+                     this->level_count);
+  glTextureParameteri(this->height_texture, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTextureParameteri(this->height_texture, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  CHECK_GL_ERROR();
+
+  this->built_level_count = this->level_count;
+}
+
+void Clipmap::update(const TerrainNoise& noise, glm::vec3 camera_position) {
+  auto start = std::chrono::steady_clock::now();
+
+  this->level_count = glm::clamp(this->level_count, 1, MAX_LEVELS);
+  this->texel_size = glm::max(this->texel_size, 0.01f);
+  if (this->level_count != this->built_level_count) {
+    this->createTexture();
+    this->noise_hash = 0;
+  }
+
+  u64 hash = noise::hash(noise);
+  if (hash != this->noise_hash || this->texel_size != this->built_texel_size) {
+    for (auto& level : this->levels) {
+      level.valid = false;
+    }
+    this->noise_hash = hash;
+    this->built_texel_size = this->texel_size;
+  }
+
+  this->texels_updated = 0;
+  const int half = TEXTURE_SIZE / 2;
+  glm::vec2 camera_xz(camera_position.x, camera_position.z);
+  std::array<glm::vec4, MAX_LEVELS> instances;
+  for (int i = 0; i < this->level_count; i++) {
+    auto& level = this->levels[i];
+    float spacing = this->levelSpacing(i);
+    glm::ivec2 center = 2 * glm::ivec2(glm::floor(camera_xz / (2.0f * spacing) + 0.5f));
+
+    glm::ivec2 new_min = center - half;
+    glm::ivec2 new_max = center + half;
+    glm::ivec2 moved = glm::abs(center - level.center);
+    if (!level.valid || glm::max(moved.x, moved.y) >= TEXTURE_SIZE) {
+      this->updateRegion(noise, i, new_min, new_max);
+    } else if (center != level.center) {
+      glm::ivec2 old_min = level.center - half;
+      glm::ivec2 old_max = level.center + half;
+
+      // Rows that came into view, over the full width of the new window
+      if (new_min.y < old_min.y) {
+        this->updateRegion(noise, i, new_min, glm::ivec2(new_max.x, old_min.y));
+      } else if (new_max.y > old_max.y) {
+        this->updateRegion(noise, i, glm::ivec2(new_min.x, old_max.y), new_max);
+      }
+
+      // Columns that came into view, only over the rows that were kept
+      int kept_min_z = glm::max(new_min.y, old_min.y);
+      int kept_max_z = glm::min(new_max.y, old_max.y);
+      if (new_min.x < old_min.x) {
+        this->updateRegion(noise, i, glm::ivec2(new_min.x, kept_min_z),
+                           glm::ivec2(old_min.x, kept_max_z));
+      } else if (new_max.x > old_max.x) {
+        this->updateRegion(noise, i, glm::ivec2(old_max.x, kept_min_z),
+                           glm::ivec2(new_max.x, kept_max_z));
+      }
+    }
+    level.center = center;
+    level.valid = true;
+
+    glm::vec2 origin = glm::vec2(center - GRID_SIZE / 2) * spacing;
+    instances[i] = glm::vec4(origin, GRID_SIZE * spacing, float(i));
+  }
+
+  glNamedBufferData(this->instances_bo, this->level_count * sizeof(glm::vec4), instances.data(),
+                    GL_STREAM_DRAW);
+
+  this->total_texels_updated += this->texels_updated;
+  if (this->texels_updated > 0) {
+    auto end = std::chrono::steady_clock::now();
+    this->last_update_ms = std::chrono::duration<float, std::milli>(end - start).count();
+  }
+}
+
+void Clipmap::updateRegion(const TerrainNoise& noise, int level, glm::ivec2 min,
+                           glm::ivec2 max) {
+  glm::ivec2 size = max - min;
+  if (size.x <= 0 || size.y <= 0) {
+    return;
+  }
+
+  usize count = usize(size.x) * size.y;
+  this->positions.resize(count);
+  this->heights.resize(count);
+  float spacing = this->levelSpacing(level);
+  for (int z = 0; z < size.y; z++) {
+    for (int x = 0; x < size.x; x++) {
+      this->positions[z * size.x + x] = glm::vec2(min + glm::ivec2(x, z)) * spacing;
+    }
+  }
+
+  // Whole rows per job, a full level is 64k evaluations
+  const glm::vec2* positions = this->positions.data();
+  float* heights = this->heights.data();
+  usize row_length = size.x;
+  JobSystem::instance()->parallelFor(
+      size.y, glm::max(4096 / size.x, 1), [&](usize begin, usize end) {
+        noise::terrainHeights(noise, positions + begin * row_length, heights + begin * row_length,
+                              (end - begin) * row_length);
+      });
+
+  // Split where the region wraps around the texture
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, size.x);
+  const int mask = TEXTURE_SIZE - 1;
+  for (int z = 0; z < size.y;) {
+    int texel_z = (min.y + z) & mask;
+    int rows = glm::min(size.y - z, TEXTURE_SIZE - texel_z);
+    for (int x = 0; x < size.x;) {
+      int texel_x = (min.x + x) & mask;
+      int columns = glm::min(size.x - x, TEXTURE_SIZE - texel_x);
+      glTextureSubImage3D(this->height_texture, 0, texel_x, texel_z, level, columns, rows, 1,
+                          GL_RED, GL_FLOAT, heights + z * size.x + x);
+      x += columns;
+    }
+    z += rows;
+  }
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+
+  this->texels_updated += count;
+}
+
+int Clipmap::variantFor(int level) const {
+  if (level == 0) {
+    return 0;
+  }
+  // The finer window relative to the middle of this one, in quads of this level
+  glm::ivec2 offset = this->levels[level - 1].center / 2 - this->levels[level].center;
+  offset = glm::clamp(offset, -1, 1);
+  return 1 + (offset.x + 1) + 3 * (offset.y + 1);
+}
+
+void Clipmap::setUniforms(GLuint program) const {
+  glBindTextureUnit(TEXTURE_UNIT, this->height_texture);
+  gpu::setUniformSlow(program, "clipmapLevelCount", (GLint)this->level_count);
+}
+
+void Clipmap::draw() const {
+  glBindVertexArray(this->vao);
+  for (int level = 0; level < this->level_count; level++) {
+    int variant = this->variantFor(level);
+    glDrawElementsInstancedBaseInstance(GL_PATCHES, this->variant_counts[variant],
+                                        GL_UNSIGNED_INT,
+                                        (void*)usize(this->variant_offsets[variant]), 1, level);
+  }
+  glBindVertexArray(0);
+}
+
+usize Clipmap::triangleCount() const {
+  usize triangles = 0;
+  for (int level = 0; level < this->level_count; level++) {
+    triangles += this->variant_counts[this->variantFor(level)] / 3;
+  }
+  return triangles;
+}
+
+void Clipmap::gui() {
+  ImGui::SliderInt("Levels", &this->level_count, 1, MAX_LEVELS);
+  ImGui::SliderFloat("Texel size", &this->texel_size, 0.5f, 32.0f);
+
+  float extent = GRID_SIZE / 2 * this->levelSpacing(this->level_count - 1);
+  ImGui::Text("View distance: %.1f km, triangles before tessellation: %zu", extent / 1000.0f,
+              this->triangleCount());
+  ImGui::Text("Texels updated: %zu this frame, %llu total", this->texels_updated,
+              (unsigned long long)this->total_texels_updated);
+  ImGui::Text("Last update: %.2f ms", this->last_update_ms);
+}
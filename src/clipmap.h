@@ -0,0 +1,102 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <array>
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "core.h"
+#include "noise.h"
+
+/**
+ * Geometry clipmap: nested square rings of one regular grid each, every level twice as coarse as
+ * the previous one, all centered on the camera.
+ *
+ * Level L keeps the heights of a TEXTURE_SIZE^2 window of its lattice (spacing texel_size * 2^L)
+ * in layer L of an R32F texture array. The texture is addressed toroidally, lattice point (i, j)
+ * lives in texel (i mod TEXTURE_SIZE, j mod TEXTURE_SIZE), so when the window follows the camera
+ * only the newly exposed L-shaped strip of rows and columns is evaluated and uploaded, the rest of
+ * the texture stays where it is.
+ *
+ * The window of a level is snapped to 2 of its texels, which puts the finer level on the lattice
+ * of the coarser one at an offset of -1, 0 or +1 coarse quads from the middle. Each level draws
+ * the variant of the ring whose hole matches that offset. terrain.vert blends the heights of the
+ * outer band of a level towards the coarser level, so at its border every odd vertex lies on the
+ * edge of the coarser ring.
+ */
+class Clipmap {
+public:
+  static constexpr int MAX_LEVELS = 12;
+  // Texels per side of a level, a power of two so the wrap is a mask in terrain.vert
+  static constexpr int TEXTURE_SIZE = 256;
+  // Quads per side of a ring, a multiple of 4 that leaves room for the normals at the border
+  static constexpr int GRID_SIZE = TEXTURE_SIZE - 8;
+  // Width of the band in which a level blends towards the next coarser one, in its own texels
+  static constexpr int TRANSITION_WIDTH = GRID_SIZE / 10;
+  // Texture unit of the height array, see terrain.vert
+  static constexpr int TEXTURE_UNIT = 11;
+
+  float texel_size = 4.0f;
+  int level_count = 8;
+
+  void init();
+  void deinit();
+
+  /**
+   * Move the windows to the camera and fill in the texels they newly cover. Everything is
+   * evaluated again when the noise or the layout changed. Call once per frame.
+   */
+  void update(const TerrainNoise& noise, glm::vec3 camera_position);
+
+  void setUniforms(GLuint program) const;
+  void draw() const;
+
+  void gui();
+
+  float levelSpacing(int level) const { return texel_size * float(1 << level); }
+  // Lattice point in the middle of the window of a level, always even
+  glm::ivec2 levelCenter(int level) const { return levels[level].center; }
+
+  usize texelsUpdated() const { return texels_updated; }
+  usize triangleCount() const;
+
+private:
+  // Index ranges: the full grid for the finest level, then the rings with their hole moved by
+  // (dx, dz) in {-1, 0, 1}^2 at 1 + (dx + 1) + 3 (dz + 1)
+  static constexpr int VARIANT_COUNT = 10;
+
+  struct Level {
+    glm::ivec2 center = glm::ivec2(0);
+    bool valid = false;
+  };
+
+  std::array<Level, MAX_LEVELS> levels;
+  u64 noise_hash = 0;
+  float built_texel_size = 0.0f;
+  int built_level_count = 0;
+
+  usize texels_updated = 0;
+  u64 total_texels_updated = 0;
+  float last_update_ms = 0.0f;
+
+  GLuint height_texture = 0;
+  GLuint vao = 0;
+  GLuint positions_bo = 0;
+  GLuint indices_bo = 0;
+  GLuint instances_bo = 0;
+  std::array<GLsizei, VARIANT_COUNT> variant_offsets{};
+  std::array<GLsizei, VARIANT_COUNT> variant_counts{};
+
+  // Scratch for the strips, reused between frames
+  std::vector<glm::vec2> positions;
+  std::vector<float> heights;
+
+  void buildGrid();
+  void createTexture();
+  int variantFor(int level) const;
+  /**
+   * Evaluate and upload the lattice points [min, max) of a level, at most TEXTURE_SIZE per side.
+   */
+  void updateRegion(const TerrainNoise& noise, int level, glm::ivec2 min, glm::ivec2 max);
+};
@@ -34,6 +34,27 @@ using isize = std::ptrdiff_t;
 #  define M_PI 3.14159265358979323846f
 #endif
 
+// Spans
+//-----------------------------------------------
+// Non-owning view over contiguous memory, stand-in for C++20 std::span
+template <typename T> struct Span {
+  Span() = default;
+  Span(T *data, usize count) : ptr(data), count(count) {}
+  template <typename C> Span(C &container) : ptr(container.data()), count(container.size()) {}
+
+  T *data() const { return ptr; }
+  usize size() const { return count; }
+  bool empty() const { return count == 0; }
+  T &operator[](usize i) const { return ptr[i]; }
+  T *begin() const { return ptr; }
+  T *end() const { return ptr + count; }
+  Span subspan(usize offset, usize n) const { return Span(ptr + offset, n); }
+
+private:
+  T *ptr = nullptr;
+  usize count = 0;
+};
+
 // Defer statements
 //-----------------------------------------------
 namespace {
@@ -0,0 +1,668 @@
+#include "demexport.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "jobs.h"
+
+namespace {
+  enum class Format { Png, R16, F32, Exr };
+
+  bool formatFor(const std::string& path, Format* format) {
+    auto extension = std::filesystem::path(path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return char(std::tolower(c)); });
+    if (extension == ".png") {
+      *format = Format::Png;
+    } else if (extension == ".r16") {
+      *format = Format::R16;
+    } else if (extension == ".f32" || extension == ".raw") {
+      *format = Format::F32;
+    } else if (extension == ".exr") {
+      *format = Format::Exr;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  u32 crc32(u32 crc, const u8* data, usize size) {
+    static const std::array<u32, 256> table = [] {
+      std::array<u32, 256> table;
+      for (u32 i = 0; i < 256; i++) {
+        u32 c = i;
+        for (int k = 0; k < 8; k++) {
+          c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+      }
+      return table;
+    }();
+
+    crc = ~crc;
+    for (usize i = 0; i < size; i++) {
+      crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+  constexpr u32 ADLER_BASE = 65521;
+
+  u32 adler32(const u8* data, usize size) {
+    u32 a = 1;
+    u32 b = 0;
+    while (size > 0) {
+      // The largest run before b can overflow 32 bits
+      usize run = std::min<usize>(size, 5552);
+      for (usize i = 0; i < run; i++) {
+        a += data[i];
+        b += a;
+      }
+      a %= ADLER_BASE;
+      b %= ADLER_BASE;
+      data += run;
+      size -= run;
+    }
+    return (b << 16) | a;
+  }
+
+  // Adler-32 of A followed by B from the checksums of A and B, as adler32_combine() of zlib
+  u32 adler32Combine(u32 adler_a, u32 adler_b, u64 size_b) {
+    u32 remainder = u32(size_b % ADLER_BASE);
+    u32 a = adler_a & 0xFFFF;
+    u32 b = u32((u64(remainder) * a) % ADLER_BASE);
+    a += (adler_b & 0xFFFF) + ADLER_BASE - 1;
+    b += (adler_a >> 16) + (adler_b >> 16) + ADLER_BASE - remainder;
+    a = a >= ADLER_BASE ? a - ADLER_BASE : a;
+    a = a >= ADLER_BASE ? a - ADLER_BASE : a;
+    b = b >= 2 * ADLER_BASE ? b - 2 * ADLER_BASE : b;
+    b = b >= ADLER_BASE ? b - ADLER_BASE : b;
+    return (b << 16) | a;
+  }
+
+  void putBigEndian(std::vector<u8>& out, u32 value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+      out.push_back(u8(value >> shift));
+    }
+  }
+
+  /**
+   * Deflate with the fixed Huffman codes and a hash chain match finder, which is enough for
+   * filtered heights, into a block that is not final and ends on a byte boundary (a zlib sync
+   * flush). Such blocks compressed independently concatenate into one stream.
+   */
+  class Deflater {
+  public:
+    void compress(const u8* data, usize size, std::vector<u8>& out) {
+      this->out = &out;
+      this->bits = 0;
+      this->bit_count = 0;
+      std::fill(this->head.begin(), this->head.end(), -1);
+
+      this->put(0, 1);  // not final
+      this->put(1, 2);  // fixed Huffman codes
+
+      auto insert = [&](usize position) {
+        if (position + MIN_MATCH <= size) {
+          u32 hash = this->hash(data + position);
+          this->previous[position & (WINDOW - 1)] = this->head[hash];
+          this->head[hash] = i32(position);
+        }
+      };
+
+      for (usize i = 0; i < size;) {
+        usize best_length = 0;
+        usize best_distance = 0;
+        if (i + MIN_MATCH <= size) {
+          usize max_length = std::min<usize>(MAX_MATCH, size - i);
+          i32 candidate = this->head[this->hash(data + i)];
+          for (int chain = 0; chain < MAX_CHAIN && candidate >= 0; chain++) {
+            usize distance = i - usize(candidate);
+            if (distance > WINDOW) {
+              break;
+            }
+            usize length = 0;
+            while (length < max_length && data[candidate + length] == data[i + length]) {
+              length++;
+            }
+            if (length > best_length) {
+              best_length = length;
+              best_distance = distance;
+              if (length == max_length) {
+                break;
+              }
+            }
+            candidate = this->previous[usize(candidate) & (WINDOW - 1)];
+          }
+        }
+
+        if (best_length >= MIN_MATCH) {
+          this->putMatch(best_length, best_distance);
+          for (usize k = 0; k < best_length; k++) {
+            insert(i + k);
+          }
+          i += best_length;
+        } else {
+          this->putSymbol(data[i]);
+          insert(i);
+          i++;
+        }
+      }
+
+      this->putSymbol(256);  // end of block
+      // An empty stored block aligns the stream to a byte
+      this->put(0, 3);
+      if (this->bit_count > 0) {
+        this->put(0, 8 - this->bit_count);
+      }
+      for (u8 byte : {0x00, 0x00, 0xFF, 0xFF}) {
+        out.push_back(byte);
+      }
+    }
+
+  private:
+    static constexpr usize WINDOW = 32768;
+    static constexpr int HASH_BITS = 15;
+    static constexpr int MAX_CHAIN = 16;
+    static constexpr usize MIN_MATCH = 3;
+    static constexpr usize MAX_MATCH = 258;
+
+    std::vector<i32> head = std::vector<i32>(usize(1) << HASH_BITS);
+    std::vector<i32> previous = std::vector<i32>(WINDOW);
+
+    std::vector<u8>* out = nullptr;
+    u32 bits = 0;
+    int bit_count = 0;
+
+    static u32 hash(const u8* data) {
+      u32 value = u32(data[0]) | u32(data[1]) << 8 | u32(data[2]) << 16;
+      return (value * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    void put(u32 value, int count) {
+      this->bits |= value << this->bit_count;
+      this->bit_count += count;
+      while (this->bit_count >= 8) {
+        this->out->push_back(u8(this->bits));
+        this->bits >>= 8;
+        this->bit_count -= 8;
+      }
+    }
+
+    // Huffman codes go most significant bit first
+    void putCode(u32 code, int length) {
+      u32 reversed = 0;
+      for (int i = 0; i < length; i++) {
+        reversed |= ((code >> i) & 1) << (length - 1 - i);
+      }
+      this->put(reversed, length);
+    }
+
+    void putSymbol(u32 symbol) {
+      if (symbol < 144) {
+        this->putCode(0x30 + symbol, 8);
+      } else if (symbol < 256) {
+        this->putCode(0x190 + symbol - 144, 9);
+      } else if (symbol < 280) {
+        this->putCode(symbol - 256, 7);
+      } else {
+        this->putCode(0xC0 + symbol - 280, 8);
+      }
+    }
+
+    void putMatch(usize length, usize distance) {
+      static constexpr u16 LENGTH_BASE[29] = {3,  4,  5,  6,  7,  8,  9,  10,  11,  13,
+                                              15, 17, 19, 23, 27, 31, 35, 43,  51,  59,
+                                              67, 83, 99, 115, 131, 163, 195, 227, 258};
+      static constexpr u8 LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+                                              2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+      static constexpr u16 DISTANCE_BASE[30] = {1,    2,    3,    4,    5,     7,     9,    13,
+                                                17,   25,   33,   49,   65,    97,    129,  193,
+                                                257,  385,  513,  769,  1025,  1537,  2049, 3073,
+                                                4097, 6145, 8193, 12289, 16385, 24577};
+      static constexpr u8 DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,  4,  4,  5,  5,
+                                                6, 6, 7, 7, 8, 8, 9,  9,  10, 10, 11, 11, 12, 12,
+                                                13, 13};
+
+      int code = 28;
+      while (LENGTH_BASE[code] > length) {
+        code--;
+      }
+      this->putSymbol(257 + code);
+      this->put(u32(length - LENGTH_BASE[code]), LENGTH_EXTRA[code]);
+
+      code = 29;
+      while (DISTANCE_BASE[code] > distance) {
+        code--;
+      }
+      this->putCode(code, 5);
+      this->put(u32(distance - DISTANCE_BASE[code]), DISTANCE_EXTRA[code]);
+    }
+  };
+
+  struct Band {
+    int row = 0;
+    int rows = 0;
+    std::vector<u8> bytes;  // ready to write
+    u32 adler = 1;          // of the uncompressed PNG rows
+    u64 raw_size = 0;
+    usize buffer_bytes = 0;
+  };
+
+  class Exporter {
+  public:
+    Exporter(const TerrainNoise& noise, const DemExportSettings& settings, Format format)
+        : noise(noise), settings(settings), format(format) {
+      glm::vec2 bounds = noise::heightBounds(noise);
+      bool has_range = settings.max_height > settings.min_height;
+      this->min_height = has_range ? settings.min_height : bounds.x;
+      this->max_height = has_range ? settings.max_height : bounds.y;
+    }
+
+    float min_height;
+    float max_height;
+
+    void encode(Band& band) const {
+      int width = this->settings.width;
+      // PNG filters look at the row above, which belongs to the band before
+      int first = this->format == Format::Png ? std::max(band.row - 1, 0) : band.row;
+      int rows = band.row + band.rows - first;
+
+      std::vector<float> heights(usize(width) * rows);
+      std::vector<glm::vec2> positions(width);
+      for (int r = 0; r < rows; r++) {
+        float z = this->settings.origin.y + float(first + r) * this->settings.texel_size;
+        for (int x = 0; x < width; x++) {
+          positions[x] = glm::vec2(this->settings.origin.x + float(x) * this->settings.texel_size,
+                                   z);
+        }
+        noise::terrainHeights(this->noise, positions.data(), &heights[usize(r) * width], width);
+      }
+      const float* band_heights = &heights[usize(band.row - first) * width];
+      usize samples = usize(width) * band.rows;
+
+      switch (this->format) {
+        case Format::F32:
+          band.bytes.resize(samples * sizeof(float));
+          std::memcpy(band.bytes.data(), band_heights, band.bytes.size());
+          break;
+        case Format::R16:
+          band.bytes.resize(samples * sizeof(u16));
+          for (usize i = 0; i < samples; i++) {
+            u16 value = this->quantize(band_heights[i]);
+            std::memcpy(&band.bytes[i * sizeof(u16)], &value, sizeof(u16));
+          }
+          break;
+        case Format::Exr:
+          // A chunk per scanline: y, size and the floats of the one channel
+          band.bytes.resize(band.rows * (8 + usize(width) * sizeof(float)));
+          for (int r = 0; r < band.rows; r++) {
+            u8* chunk = &band.bytes[r * (8 + usize(width) * sizeof(float))];
+            i32 y = band.row + r;
+            i32 size = i32(width * sizeof(float));
+            std::memcpy(chunk, &y, sizeof(y));
+            std::memcpy(chunk + 4, &size, sizeof(size));
+            std::memcpy(chunk + 8, band_heights + usize(r) * width, width * sizeof(float));
+          }
+          break;
+        case Format::Png:
+          this->encodePng(band, heights.data(), band.row - first);
+          break;
+      }
+      band.buffer_bytes = heights.size() * sizeof(float) + band.bytes.capacity();
+    }
+
+    /**
+     * Everything before the first band.
+     */
+    std::vector<u8> header() const {
+      std::vector<u8> out;
+      if (this->format == Format::Png) {
+        const u8 signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        out.insert(out.end(), signature, signature + 8);
+        std::vector<u8> ihdr;
+        putBigEndian(ihdr, u32(this->settings.width));
+        putBigEndian(ihdr, u32(this->settings.height));
+        for (u8 byte : {16, 0, 0, 0, 0}) {  // 16 bit grey, deflate, adaptive filters, no interlace
+          ihdr.push_back(byte);
+        }
+        putChunk(out, "IHDR", ihdr.data(), ihdr.size());
+        const u8 zlib_header[2] = {0x78, 0x01};
+        putChunk(out, "IDAT", zlib_header, sizeof(zlib_header));
+      } else if (this->format == Format::Exr) {
+        this->putExrHeader(out);
+      }
+      return out;
+    }
+
+    /**
+     * Everything after the last band, `adler` of all the PNG rows.
+     */
+    std::vector<u8> footer(u32 adler) const {
+      std::vector<u8> out;
+      if (this->format == Format::Png) {
+        // An empty final stored block and the checksum end the zlib stream
+        std::vector<u8> end = {0x01, 0x00, 0x00, 0xFF, 0xFF};
+        putBigEndian(end, adler);
+        putChunk(out, "IDAT", end.data(), end.size());
+        putChunk(out, "IEND", nullptr, 0);
+      }
+      return out;
+    }
+
+    static void putChunk(std::vector<u8>& out, const char type[4], const u8* data, usize size) {
+      putBigEndian(out, u32(size));
+      usize start = out.size();
+      out.insert(out.end(), type, type + 4);
+      if (size > 0) {
+        out.insert(out.end(), data, data + size);
+      }
+      putBigEndian(out, crc32(0, &out[start], size + 4));
+    }
+
+  private:
+    const TerrainNoise& noise;
+    const DemExportSettings& settings;
+    Format format;
+
+    u16 quantize(float height) const {
+      float t = (height - this->min_height) / (this->max_height - this->min_height);
+      return u16(std::lround(glm::clamp(t, 0.0f, 1.0f) * 65535.0f));
+    }
+
+    // `heights` starts `skip` rows above the band, 0 or 1
+    void encodePng(Band& band, const float* heights, int skip) const {
+      usize width = usize(this->settings.width);
+      usize stride = 1 + width * 2;
+      std::vector<u8> raw(stride * band.rows);
+      std::vector<u8> previous(width * 2, 0);
+      std::vector<u8> current(width * 2);
+      std::array<std::vector<u8>, 5> filtered;
+      for (auto& row : filtered) {
+        row.resize(width * 2);
+      }
+
+      auto toBytes = [&](const float* row, std::vector<u8>& out) {
+        for (usize x = 0; x < width; x++) {
+          u16 value = this->quantize(row[x]);
+          out[x * 2] = u8(value >> 8);
+          out[x * 2 + 1] = u8(value);
+        }
+      };
+      if (skip > 0) {
+        toBytes(heights, previous);
+      }
+
+      for (int r = 0; r < band.rows; r++) {
+        toBytes(heights + usize(skip + r) * width, current);
+
+        // The filter with the smallest sum of signed differences, as libpng does
+        int best_filter = 0;
+        u64 best_cost = ~0ull;
+        for (int filter = 0; filter < 5; filter++) {
+          u64 cost = 0;
+          for (usize i = 0; i < width * 2; i++) {
+            int left = i >= 2 ? current[i - 2] : 0;
+            int up = previous[i];
+            int up_left = i >= 2 ? previous[i - 2] : 0;
+            int predictor = 0;
+            if (filter == 1) {
+              predictor = left;
+            } else if (filter == 2) {
+              predictor = up;
+            } else if (filter == 3) {
+              predictor = (left + up) / 2;
+            } else if (filter == 4) {
+              int p = left + up - up_left;
+              int pa = std::abs(p - left);
+              int pb = std::abs(p - up);
+              int pc = std::abs(p - up_left);
+              predictor = pa <= pb && pa <= pc ? left : pb <= pc ? up : up_left;
+            }
+            u8 value = u8(current[i] - predictor);
+            filtered[filter][i] = value;
+            cost += value < 128 ? value : 256 - value;
+          }
+          if (cost < best_cost) {
+            best_cost = cost;
+            best_filter = filter;
+          }
+        }
+
+        u8* out = &raw[r * stride];
+        out[0] = u8(best_filter);
+        std::memcpy(out + 1, filtered[best_filter].data(), width * 2);
+        std::swap(previous, current);
+      }
+
+      band.adler = adler32(raw.data(), raw.size());
+      band.raw_size = raw.size();
+
+      std::vector<u8> compressed;
+      compressed.reserve(raw.size() / 2);
+      Deflater().compress(raw.data(), raw.size(), compressed);
+      putChunk(band.bytes, "IDAT", compressed.data(), compressed.size());
+    }
+
+    void putExrHeader(std::vector<u8>& out) const {
+      auto putBytes = [&](const void* data, usize size) {
+        const auto* bytes = static_cast<const u8*>(data);
+        out.insert(out.end(), bytes, bytes + size);
+      };
+      auto putString = [&](const char* text) { putBytes(text, std::strlen(text) + 1); };
+      auto putAttribute = [&](const char* name, const char* type, const void* value, i32 size) {
+        putString(name);
+        putString(type);
+        putBytes(&size, sizeof(size));
+        putBytes(value, size);
+      };
+
+      const u32 magic = 20000630;
+      const u32 version = 2;  // single part scanlines
+      putBytes(&magic, sizeof(magic));
+      putBytes(&version, sizeof(version));
+
+      // Channel Y: FLOAT, not linear, sampled 1 x 1, then the list terminator
+      u8 channels[19] = {'Y', 0, 2, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 0};
+      putAttribute("channels", "chlist", channels, sizeof(channels));
+      u8 compression = 0;
+      putAttribute("compression", "compression", &compression, 1);
+      i32 window[4] = {0, 0, this->settings.width - 1, this->settings.height - 1};
+      putAttribute("dataWindow", "box2i", window, sizeof(window));
+      putAttribute("displayWindow", "box2i", window, sizeof(window));
+      u8 line_order = 0;
+      putAttribute("lineOrder", "lineOrder", &line_order, 1);
+      float aspect = 1.0f;
+      putAttribute("pixelAspectRatio", "float", &aspect, sizeof(aspect));
+      float center[2] = {0.0f, 0.0f};
+      putAttribute("screenWindowCenter", "v2f", center, sizeof(center));
+      float window_width = 1.0f;
+      putAttribute("screenWindowWidth", "float", &window_width, sizeof(window_width));
+      out.push_back(0);
+
+      // Offsets of the scanline chunks, which all have the same size when uncompressed
+      u64 chunk_size = 8 + u64(this->settings.width) * sizeof(float);
+      u64 offset = out.size() + u64(this->settings.height) * sizeof(u64);
+      for (int y = 0; y < this->settings.height; y++) {
+        u64 chunk_offset = offset + u64(y) * chunk_size;
+        putBytes(&chunk_offset, sizeof(chunk_offset));
+      }
+    }
+  };
+}  // namespace
+
+bool dem::exportHeights(const TerrainNoise& noise, const DemExportSettings& settings,
+                        DemExportStats* stats) {
+  auto start = std::chrono::steady_clock::now();
+
+  Format format;
+  if (!formatFor(settings.output_path, &format)) {
+    std::cout << "Export " << settings.output_path << ": unknown format\n";
+    return false;
+  }
+  if (settings.width <= 0 || settings.height <= 0) {
+    std::cout << "Export " << settings.output_path << ": empty size\n";
+    return false;
+  }
+
+  auto* jobs = JobSystem::instance();
+  int band_rows = settings.band_rows > 0 ? settings.band_rows
+                                         : glm::clamp((1 << 20) / settings.width, 1, 256);
+  int band_count = (settings.height + band_rows - 1) / band_rows;
+  int batch = jobs->threadCount() + 1;
+
+  std::string temporary_path = settings.output_path + ".tmp";
+  std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+  if (!file) {
+    std::cout << "Export " << temporary_path << ": could not open for writing\n";
+    return false;
+  }
+
+  Exporter exporter(noise, settings, format);
+  auto header = exporter.header();
+  file.write(reinterpret_cast<const char*>(header.data()), header.size());
+  u64 bytes_written = header.size();
+  usize buffer_bytes = 0;
+  u32 adler = 1;
+
+  std::vector<Band> bands(batch);
+  for (int first = 0; first < band_count && file; first += batch) {
+    int count = std::min(batch, band_count - first);
+    jobs->parallelFor(count, 1, [&](usize begin, usize end) {
+      for (usize i = begin; i < end; i++) {
+        auto& band = bands[i];
+        band.row = (first + int(i)) * band_rows;
+        band.rows = std::min(band_rows, settings.height - band.row);
+        band.bytes.clear();
+        exporter.encode(band);
+      }
+    });
+
+    usize batch_bytes = 0;
+    for (int i = 0; i < count; i++) {
+      const auto& band = bands[i];
+      file.write(reinterpret_cast<const char*>(band.bytes.data()), band.bytes.size());
+      bytes_written += band.bytes.size();
+      adler = adler32Combine(adler, band.adler, band.raw_size);
+      batch_bytes += band.buffer_bytes;
+    }
+    buffer_bytes = std::max(buffer_bytes, batch_bytes);
+  }
+
+  auto footer = exporter.footer(adler);
+  file.write(reinterpret_cast<const char*>(footer.data()), footer.size());
+  bytes_written += footer.size();
+
+  file.close();
+  std::error_code error;
+  if (!file) {
+    std::cout << "Export " << temporary_path << ": write failed\n";
+    std::filesystem::remove(temporary_path, error);
+    return false;
+  }
+  std::filesystem::rename(temporary_path, settings.output_path, error);
+  if (error) {
+    std::filesystem::remove(settings.output_path, error);
+    std::filesystem::rename(temporary_path, settings.output_path, error);
+  }
+  if (error) {
+    std::cout << "Export " << settings.output_path << ": " << error.message() << "\n";
+    return false;
+  }
+
+  if (stats != nullptr) {
+    *stats = {};
+    stats->width = settings.width;
+    stats->height = settings.height;
+    stats->bands = usize(band_count);
+    stats->bytes_written = bytes_written;
+    stats->buffer_bytes = buffer_bytes;
+    if (format == Format::Png || format == Format::R16) {
+      stats->min_height = exporter.min_height;
+      stats->max_height = exporter.max_height;
+    }
+    stats->threads = batch;
+    stats->seconds
+        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  return true;
+}
+
+int dem::runExportCommandLine(int argc, char* argv[]) {
+  if (argc < 1) {
+    std::cout << "Usage: --export-heights <output.png|.r16|.f32|.exr> [--origin <x> <z>]\n"
+              << "         [--size <width> <height>] [--texel-size <m>] [--range <min> <max>]\n"
+              << "         [--band-rows <n>] [--style <0-3>] [--octaves <n>]\n"
+              << "         [--amplitude <m>] [--frequency <f>] [--persistence <p>]\n"
+              << "         [--lacunarity <l>] [--warp-strength <m>]\n";
+    return 1;
+  }
+
+  TerrainNoise noise;
+  DemExportSettings settings;
+  settings.output_path = argv[0];
+  for (int i = 1; i < argc; i++) {
+    std::string option = argv[i];
+    bool has_value = i + 1 < argc;
+    if (option == "--origin" && i + 2 < argc) {
+      settings.origin.x = float(std::atof(argv[++i]));
+      settings.origin.y = float(std::atof(argv[++i]));
+    } else if (option == "--size" && i + 2 < argc) {
+      settings.width = std::atoi(argv[++i]);
+      settings.height = std::atoi(argv[++i]);
+    } else if (option == "--texel-size" && has_value) {
+      settings.texel_size = float(std::atof(argv[++i]));
+    } else if (option == "--range" && i + 2 < argc) {
+      settings.min_height = float(std::atof(argv[++i]));
+      settings.max_height = float(std::atof(argv[++i]));
+    } else if (option == "--band-rows" && has_value) {
+      settings.band_rows = std::atoi(argv[++i]);
+    } else if (option == "--style" && has_value) {
+      int style = glm::clamp(std::atoi(argv[++i]), 0, int(TerrainStyle::Count) - 1);
+      noise.style = TerrainStyle(style);
+    } else if (option == "--octaves" && has_value) {
+      noise.num_octaves = std::atoi(argv[++i]);
+    } else if (option == "--amplitude" && has_value) {
+      noise.amplitude = float(std::atof(argv[++i]));
+    } else if (option == "--frequency" && has_value) {
+      noise.frequency = float(std::atof(argv[++i]));
+    } else if (option == "--persistence" && has_value) {
+      noise.persistence = float(std::atof(argv[++i]));
+    } else if (option == "--lacunarity" && has_value) {
+      noise.lacunarity = float(std::atof(argv[++i]));
+    } else if (option == "--warp-strength" && has_value) {
+      noise.warp_strength = float(std::atof(argv[++i]));
+    } else {
+      std::cout << "Unknown option " << option << "\n";
+      return 1;
+    }
+  }
+
+  JobSystem::instance()->init();
+  DemExportStats stats;
+  bool exported = dem::exportHeights(noise, settings, &stats);
+  JobSystem::instance()->deinit();
+  if (!exported) {
+    return 1;
+  }
+
+  std::printf("%d x %d samples, %zu bands, %.1f MB written\n", stats.width, stats.height,
+              stats.bands, stats.bytes_written / 1e6);
+  std::printf("%.2f s on %d threads, %.1f M samples/s, %.1f MB of band buffers\n", stats.seconds,
+              stats.threads, stats.samplesPerSecond() / 1e6, stats.buffer_bytes / 1e6);
+  if (stats.max_height > stats.min_height) {
+    std::printf("16 bit values span [%.2f, %.2f] m", stats.min_height, stats.max_height);
+    std::printf(", import with --height-scale %g --height-offset %g\n",
+                (stats.max_height - stats.min_height) / 65535.0, stats.min_height);
+  }
+  return 0;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <string>
+
+#include "core.h"
+#include "noise.h"
+
+struct DemExportSettings {
+  // The format follows the extension: .png (16 bit grey), .r16 (little endian u16), .f32 (little
+  // endian floats) or .exr (one FLOAT channel Y, uncompressed scanlines)
+  std::string output_path = "heights.png";
+
+  // World position of the first sample, rows go towards +z
+  glm::vec2 origin = glm::vec2(0.0f);
+  int width = 4096;
+  int height = 4096;
+  float texel_size = 2.0f;
+
+  // .png and .r16 map [min_height, max_height] to [0, 65535], noise::heightBounds() when equal
+  float min_height = 0.0f;
+  float max_height = 0.0f;
+
+  // Rows per band, 0 picks about a million samples
+  int band_rows = 0;
+};
+
+struct DemExportStats {
+  int width = 0;
+  int height = 0;
+  usize bands = 0;
+  u64 bytes_written = 0;
+  usize buffer_bytes = 0;  // bands held in memory at once, independent of the map height
+  float min_height = 0.0f;  // range of the 16 bit formats, both 0 for the others
+  float max_height = 0.0f;
+  int threads = 0;
+  double seconds = 0.0;
+
+  double samplesPerSecond() const {
+    return seconds > 0.0 ? double(width) * height / seconds : 0.0;
+  }
+};
+
+namespace dem {
+  /**
+   * Evaluate `noise` over a grid and stream it to disk in bands of rows, so any size fits in
+   * memory. A batch of bands as large as the job system is computed in parallel, encoded by the
+   * same jobs and then written in order.
+   *
+   * PNG bands are filtered and deflated on their own and joined with sync flushes, which makes
+   * them one zlib stream, so the file is compressed without ever holding the image.
+   */
+  bool exportHeights(const TerrainNoise& noise, const DemExportSettings& settings,
+                     DemExportStats* stats = nullptr);
+
+  /**
+   * `--export-heights <output> [options]` without opening a window, returns the exit code.
+   */
+  int runExportCommandLine(int argc, char* argv[]);
+}  // namespace dem
@@ -0,0 +1,969 @@
+#include "demimport.h"
+
+#include <stb_image.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include "baker.h"
+#include "jobs.h"
+#include "tilefile.h"
+
+namespace {
+  constexpr int WINDOW_ROWS = TILE_SIZE + 2 * TILE_APRON;
+  // Rows decoded at once
+  constexpr int STRIP_ROWS = 64;
+  constexpr int MAX_LODS = 16;
+
+  // The filter of the next LOD reaches one row back, which the window has to still hold
+  static_assert(TILE_APRON >= 1, "the row window keeps 2 * TILE_APRON rows between bands");
+
+  u64 hashBytes(u64 h, const void* data, usize size) {
+    const auto* bytes = static_cast<const u8*>(data);
+    for (usize i = 0; i < size; i++) {
+      h = (h ^ bytes[i]) * 1099511628211ull;
+    }
+    return h;
+  }
+
+  /**
+   * Decodes a DEM top row first.
+   */
+  class DemReader {
+  public:
+    int width = 0;
+    int height = 0;
+    float cell_size = 0.0f;  // 0 when the format does not say
+    u64 bytes_read = 0;
+
+    virtual ~DemReader() = default;
+    virtual bool open(const std::string& path, const DemImportSettings& settings) = 0;
+
+    /**
+     * The next `rows` rows as heights in meters.
+     */
+    virtual bool readRows(float* out, int rows) = 0;
+  };
+
+  // Fixed size samples after an optional header: .f32, .r16 and binary .pgm
+  class BinaryReader : public DemReader {
+  public:
+    bool open(const std::string& path, const DemImportSettings& settings) override {
+      this->settings = settings;
+      this->file.open(path, std::ios::binary);
+      if (!this->file) {
+        std::cout << "DEM " << path << ": could not open\n";
+        return false;
+      }
+
+      auto extension = std::filesystem::path(path).extension().string();
+      std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+      if (extension == ".pgm") {
+        return this->readPgmHeader(path);
+      }
+
+      this->width = settings.raw_width;
+      this->height = settings.raw_height;
+      this->sample_size = extension == ".r16" ? 2 : 4;
+      this->is_float = extension != ".r16";
+      if (this->width <= 0 || this->height <= 0) {
+        std::cout << "DEM " << path << ": raw input needs its size\n";
+        return false;
+      }
+      return true;
+    }
+
+    bool readRows(float* out, int rows) override {
+      usize count = usize(rows) * this->width;
+      this->buffer.resize(count * this->sample_size);
+      this->file.read(reinterpret_cast<char*>(this->buffer.data()), this->buffer.size());
+      if (!this->file) {
+        std::cout << "DEM: input ends early\n";
+        return false;
+      }
+      this->bytes_read += this->buffer.size();
+
+      const u8* bytes = this->buffer.data();
+      float scale = this->settings.height_scale;
+      float offset = this->settings.height_offset;
+      JobSystem::instance()->parallelFor(count, 65536, [&](usize begin, usize end) {
+        for (usize i = begin; i < end; i++) {
+          float value;
+          if (this->is_float) {
+            std::memcpy(&value, bytes + i * 4, 4);
+          } else if (this->sample_size == 1) {
+            value = bytes[i];
+          } else if (this->big_endian) {
+            value = float(bytes[i * 2] << 8 | bytes[i * 2 + 1]);
+          } else {
+            value = float(bytes[i * 2] | bytes[i * 2 + 1] << 8);
+          }
+          out[i] = value * scale + offset;
+        }
+      });
+      return true;
+    }
+
+  private:
+    DemImportSettings settings;
+    std::ifstream file;
+    std::vector<u8> buffer;
+    int sample_size = 4;
+    bool is_float = true;
+    bool big_endian = false;
+
+    // "P5 <width> <height> <maxval>" with # comments, then one whitespace before the samples
+    bool readPgmHeader(const std::string& path) {
+      std::string fields[4];
+      for (auto& field : fields) {
+        int c = this->file.get();
+        while (c == '#' || std::isspace(c)) {
+          if (c == '#') {
+            while (c != '\n' && c != EOF) c = this->file.get();
+          }
+          c = this->file.get();
+        }
+        while (c != EOF && !std::isspace(c)) {
+          field += char(c);
+          c = this->file.get();
+        }
+      }
+
+      int max_value = std::atoi(fields[3].c_str());
+      if (fields[0] != "P5" || max_value <= 0 || max_value > 65535) {
+        std::cout << "DEM " << path << ": not a binary PGM\n";
+        return false;
+      }
+      this->width = std::atoi(fields[1].c_str());
+      this->height = std::atoi(fields[2].c_str());
+      this->sample_size = max_value > 255 ? 2 : 1;
+      this->is_float = false;
+      this->big_endian = true;
+      this->bytes_read = u64(this->file.tellg());
+      return this->width > 0 && this->height > 0;
+    }
+  };
+
+  // ESRI ASCII grid: a header of "<key> <value>" lines, then the values separated by any
+  // whitespace, however the writer split them into lines
+  class AsciiGridReader : public DemReader {
+  public:
+    bool open(const std::string& path, const DemImportSettings& settings) override {
+      this->settings = settings;
+      this->file.open(path, std::ios::binary);
+      if (!this->file) {
+        std::cout << "DEM " << path << ": could not open\n";
+        return false;
+      }
+
+      // The header ends at the first key that is a number
+      while (true) {
+        auto position = this->file.tellg();
+        std::string key;
+        if (!(this->file >> key)) {
+          break;
+        }
+        if (std::isdigit(key[0]) || key[0] == '-' || key[0] == '.') {
+          this->file.seekg(position);
+          break;
+        }
+        std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+        double value;
+        this->file >> value;
+        if (key == "ncols") this->width = int(value);
+        if (key == "nrows") this->height = int(value);
+        if (key == "cellsize") this->cell_size = float(value);
+        if (key == "nodata_value") {
+          this->nodata = value;
+          this->has_nodata = true;
+        }
+      }
+
+      if (this->width <= 0 || this->height <= 0) {
+        std::cout << "DEM " << path << ": missing ncols or nrows\n";
+        return false;
+      }
+      return true;
+    }
+
+    bool readRows(float* out, int rows) override {
+      usize count = usize(rows) * this->width;
+      usize filled = 0;
+      while (filled < count) {
+        if (this->next_value == this->values.size()) {
+          if (!this->parseBlock()) {
+            return false;
+          }
+          continue;
+        }
+        usize n = std::min(count - filled, this->values.size() - this->next_value);
+        std::memcpy(out + filled, this->values.data() + this->next_value, n * sizeof(float));
+        this->next_value += n;
+        filled += n;
+      }
+      return true;
+    }
+
+  private:
+    // Text read at once, cut at whitespace into pieces that are parsed on the workers
+    static constexpr usize BLOCK_BYTES = 4 << 20;
+    static constexpr usize PIECE_BYTES = 64 << 10;
+
+    DemImportSettings settings;
+    std::ifstream file;
+    double nodata = 0.0;
+    bool has_nodata = false;
+
+    std::string text;
+    std::string carry;  // a value cut off at the end of the last block
+    std::vector<std::vector<float>> pieces;
+    std::vector<float> values;
+    usize next_value = 0;
+
+    /**
+     * Replace `values` with the next block of the file.
+     */
+    bool parseBlock() {
+      this->text.swap(this->carry);
+      this->carry.clear();
+      usize kept = this->text.size();
+      this->text.resize(kept + BLOCK_BYTES);
+      this->file.read(&this->text[kept], BLOCK_BYTES);
+      usize read = usize(this->file.gcount());
+      this->text.resize(kept + read);
+      this->bytes_read += read;
+
+      bool at_end = read < BLOCK_BYTES;
+      if (!at_end) {
+        usize last = this->text.find_last_of(" \t\r\n");
+        usize cut = last == std::string::npos ? 0 : last + 1;
+        this->carry.assign(this->text, cut, std::string::npos);
+        this->text.resize(cut);
+      }
+
+      // Each piece ends at whitespace, so no value straddles two pieces
+      std::vector<usize> bounds = {0};
+      while (bounds.back() < this->text.size()) {
+        usize next = std::min(bounds.back() + PIECE_BYTES, this->text.size());
+        while (next < this->text.size() && !std::isspace(u8(this->text[next]))) {
+          next++;
+        }
+        bounds.push_back(next);
+      }
+
+      usize piece_count = bounds.size() - 1;
+      this->pieces.resize(piece_count);
+      std::atomic<bool> valid{true};
+      JobSystem::instance()->parallelFor(piece_count, 1, [&](usize begin, usize end) {
+        for (usize p = begin; p < end; p++) {
+          auto& piece = this->pieces[p];
+          piece.clear();
+          const char* cursor = this->text.data() + bounds[p];
+          const char* piece_end = this->text.data() + bounds[p + 1];
+          while (true) {
+            while (cursor < piece_end && std::isspace(u8(*cursor))) {
+              cursor++;
+            }
+            if (cursor == piece_end) {
+              break;
+            }
+            char* next;
+            double value = std::strtod(cursor, &next);
+            if (next == cursor) {
+              valid = false;
+              return;
+            }
+            cursor = next;
+            piece.push_back(this->has_nodata && value == this->nodata
+                                ? this->settings.nodata_height
+                                : float(value) * this->settings.height_scale
+                                      + this->settings.height_offset);
+          }
+        }
+      });
+      if (!valid) {
+        std::cout << "DEM: a value is not a number\n";
+        return false;
+      }
+
+      this->values.clear();
+      this->next_value = 0;
+      for (const auto& piece : this->pieces) {
+        this->values.insert(this->values.end(), piece.begin(), piece.end());
+      }
+      if (this->values.empty() && at_end && this->carry.empty()) {
+        std::cout << "DEM: input ends early\n";
+        return false;
+      }
+      return true;
+    }
+  };
+
+  // Baseline TIFF and GeoTIFF with one uncompressed sample per pixel, stored in strips: 8, 16 or
+  // 32 bit integers or 32 bit floats. Compressed, tiled and BigTIFF files are rejected.
+  class TiffReader : public DemReader {
+  public:
+    bool open(const std::string& path, const DemImportSettings& settings) override {
+      this->settings = settings;
+      this->file.open(path, std::ios::binary);
+      if (!this->file) {
+        std::cout << "DEM " << path << ": could not open\n";
+        return false;
+      }
+
+      u8 header[8];
+      if (!this->readAt(0, header, sizeof(header))
+          || !(header[0] == header[1] && (header[0] == 'I' || header[0] == 'M'))) {
+        std::cout << "DEM " << path << ": not a TIFF\n";
+        return false;
+      }
+      this->big_endian = header[0] == 'M';
+      if (this->unsignedAt(header + 2, 2) != 42) {
+        std::cout << "DEM " << path << ": BigTIFF is not supported\n";
+        return false;
+      }
+
+      // Only the first image of the file
+      u64 ifd = this->unsignedAt(header + 4, 4);
+      u8 count_bytes[2];
+      if (!this->readAt(ifd, count_bytes, 2)) {
+        std::cout << "DEM " << path << ": truncated TIFF\n";
+        return false;
+      }
+      std::vector<u8> entries(this->unsignedAt(count_bytes, 2) * 12);
+      if (!this->readAt(ifd + 2, entries.data(), entries.size())) {
+        std::cout << "DEM " << path << ": truncated TIFF\n";
+        return false;
+      }
+
+      int compression = 1;
+      int samples_per_pixel = 1;
+      int sample_format = 1;
+      bool tiled = false;
+      std::vector<double> strip_offsets;
+      for (usize i = 0; i < entries.size(); i += 12) {
+        const u8* entry = entries.data() + i;
+        u64 tag = this->unsignedAt(entry, 2);
+        if (tag == 256) this->width = int(this->fieldValues(entry)[0]);
+        if (tag == 257) this->height = int(this->fieldValues(entry)[0]);
+        if (tag == 258) this->bits = int(this->fieldValues(entry)[0]);
+        if (tag == 259) compression = int(this->fieldValues(entry)[0]);
+        if (tag == 273) strip_offsets = this->fieldValues(entry);
+        if (tag == 277) samples_per_pixel = int(this->fieldValues(entry)[0]);
+        if (tag == 278) this->rows_per_strip = int(this->fieldValues(entry)[0]);
+        if (tag == 322) tiled = true;
+        if (tag == 339) sample_format = int(this->fieldValues(entry)[0]);
+        // GeoTIFF ModelPixelScaleTag, meters per pixel in x, y and z
+        if (tag == 33550) this->cell_size = float(this->fieldValues(entry)[0]);
+        // GDAL_NODATA, the value as text
+        if (tag == 42113) {
+          auto text = this->fieldText(entry);
+          this->has_nodata = !text.empty();
+          this->nodata = std::strtod(text.c_str(), nullptr);
+        }
+      }
+
+      // RowsPerStrip defaults to the whole image
+      if (this->rows_per_strip <= 0 || this->rows_per_strip > this->height) {
+        this->rows_per_strip = std::max(this->height, 1);
+      }
+      this->is_float = sample_format == 3;
+      this->is_signed = sample_format == 2;
+      bool supported_sample
+          = this->bits == 32 || (!this->is_float && (this->bits == 8 || this->bits == 16));
+      if (compression != 1 || tiled) {
+        std::cout << "DEM " << path << ": only uncompressed TIFF strips are streamed, convert it "
+                  << "with gdal_translate -co COMPRESS=NONE -co TILED=NO\n";
+        return false;
+      }
+      if (samples_per_pixel != 1 || !supported_sample) {
+        std::cout << "DEM " << path << ": expected one 8, 16 or 32 bit sample per pixel\n";
+        return false;
+      }
+      usize strips = (usize(this->height) + this->rows_per_strip - 1) / this->rows_per_strip;
+      if (this->width <= 0 || this->height <= 0 || strip_offsets.size() < strips) {
+        std::cout << "DEM " << path << ": missing image size or strips\n";
+        return false;
+      }
+      this->strip_offsets.assign(strip_offsets.begin(), strip_offsets.end());
+      return true;
+    }
+
+    bool readRows(float* out, int rows) override {
+      usize sample_size = this->bits / 8;
+      usize row_bytes = usize(this->width) * sample_size;
+      this->buffer.resize(rows * row_bytes);
+
+      // Rows of a strip are contiguous, the strips themselves may be anywhere
+      for (int done = 0; done < rows;) {
+        int strip = this->row / this->rows_per_strip;
+        int in_strip = this->row % this->rows_per_strip;
+        int n = std::min(rows - done, this->rows_per_strip - in_strip);
+        u64 offset = this->strip_offsets[strip] + u64(in_strip) * row_bytes;
+        if (!this->readAt(offset, this->buffer.data() + done * row_bytes, n * row_bytes)) {
+          std::cout << "DEM: input ends early\n";
+          return false;
+        }
+        done += n;
+        this->row += n;
+      }
+      this->bytes_read += this->buffer.size();
+
+      const u8* bytes = this->buffer.data();
+      usize count = usize(rows) * this->width;
+      JobSystem::instance()->parallelFor(count, 65536, [&](usize begin, usize end) {
+        for (usize i = begin; i < end; i++) {
+          u64 raw = this->unsignedAt(bytes + i * sample_size, sample_size);
+          double value;
+          if (this->is_float) {
+            float f;
+            u32 word = u32(raw);
+            std::memcpy(&f, &word, 4);
+            value = f;
+          } else if (this->is_signed) {
+            // Sign extend from the sample size
+            u64 sign = u64(1) << (this->bits - 1);
+            value = double(i64((raw ^ sign) - sign));
+          } else {
+            value = double(raw);
+          }
+          out[i] = this->has_nodata && value == this->nodata
+                       ? this->settings.nodata_height
+                       : float(value) * this->settings.height_scale + this->settings.height_offset;
+        }
+      });
+      return true;
+    }
+
+  private:
+    DemImportSettings settings;
+    std::ifstream file;
+    std::vector<u8> buffer;
+    std::vector<u64> strip_offsets;
+    int rows_per_strip = 0;
+    int bits = 0;
+    bool is_float = false;
+    bool is_signed = false;
+    bool big_endian = false;
+    double nodata = 0.0;
+    bool has_nodata = false;
+    int row = 0;
+
+    bool readAt(u64 offset, void* out, usize size) {
+      this->file.clear();
+      this->file.seekg(std::streamoff(offset));
+      this->file.read(static_cast<char*>(out), size);
+      return bool(this->file);
+    }
+
+    u64 unsignedAt(const u8* bytes, usize size) const {
+      u64 value = 0;
+      for (usize i = 0; i < size; i++) {
+        u64 byte = bytes[this->big_endian ? i : size - 1 - i];
+        value = value << 8 | byte;
+      }
+      return value;
+    }
+
+    // Bytes per value of the IFD field types 1 to 12
+    static usize typeSize(usize type) {
+      static const usize TYPE_SIZES[13] = {0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8};
+      return type < 13 ? TYPE_SIZES[type] : 0;
+    }
+
+    // The values of a 12 byte IFD entry, which are inline when they fit in 4 bytes
+    std::vector<u8> fieldBytes(const u8* entry) {
+      usize type = this->unsignedAt(entry + 2, 2);
+      usize count = this->unsignedAt(entry + 4, 4);
+      usize size = typeSize(type) * count;
+      std::vector<u8> bytes(size);
+      if (size <= 4) {
+        std::memcpy(bytes.data(), entry + 8, size);
+      } else if (!this->readAt(this->unsignedAt(entry + 8, 4), bytes.data(), size)) {
+        bytes.clear();
+      }
+      return bytes;
+    }
+
+    // BYTE, SHORT, LONG, FLOAT and DOUBLE values of an entry, a single 0 for other types
+    std::vector<double> fieldValues(const u8* entry) {
+      usize type = this->unsignedAt(entry + 2, 2);
+      bool is_number = type == 1 || type == 3 || type == 4 || type == 11 || type == 12;
+      usize size = is_number ? typeSize(type) : 0;
+      auto bytes = this->fieldBytes(entry);
+      std::vector<double> values;
+      for (usize i = 0; size > 0 && i + size <= bytes.size(); i += size) {
+        u64 raw = this->unsignedAt(bytes.data() + i, size);
+        if (type == 11) {
+          float f;
+          u32 word = u32(raw);
+          std::memcpy(&f, &word, 4);
+          values.push_back(f);
+        } else if (type == 12) {
+          double d;
+          std::memcpy(&d, &raw, 8);
+          values.push_back(d);
+        } else {
+          values.push_back(double(raw));
+        }
+      }
+      if (values.empty()) {
+        values.push_back(0.0);
+      }
+      return values;
+    }
+
+    std::string fieldText(const u8* entry) {
+      auto bytes = this->fieldBytes(entry);
+      return std::string(bytes.begin(), std::find(bytes.begin(), bytes.end(), u8(0)));
+    }
+  };
+
+  // Anything stb_image reads, decoded whole
+  class ImageReader : public DemReader {
+  public:
+    ~ImageReader() override { stbi_image_free(this->data); }
+
+    bool open(const std::string& path, const DemImportSettings& settings) override {
+      this->settings = settings;
+      int components;
+      this->data = stbi_load_16(path.c_str(), &this->width, &this->height, &components, 1);
+      if (this->data == nullptr) {
+        std::cout << "DEM " << path << ": " << stbi_failure_reason() << "\n";
+        return false;
+      }
+      std::cout << "DEM " << path << ": decoding the whole image, use .asc, .tif, .pgm, .f32 or "
+                << ".r16 to stream large DEMs\n";
+      this->bytes_read = u64(this->width) * this->height * sizeof(u16);
+      return true;
+    }
+
+    bool readRows(float* out, int rows) override {
+      usize count = usize(rows) * this->width;
+      const u16* samples = this->data + usize(this->row) * this->width;
+      for (usize i = 0; i < count; i++) {
+        out[i] = samples[i] * this->settings.height_scale + this->settings.height_offset;
+      }
+      this->row += rows;
+      return true;
+    }
+
+  private:
+    DemImportSettings settings;
+    u16* data = nullptr;
+    int row = 0;
+  };
+
+  struct ImportContext {
+    TileFileWriter writer;
+    std::atomic<u64> height_hash{0};
+    std::atomic<usize> tiles{0};
+    std::atomic<bool> failed{false};
+  };
+
+  /**
+   * One LOD of the pyramid: collects its rows in a window, writes the bands of tiles and filters
+   * the rows into the next LOD.
+   */
+  class Level {
+  public:
+    Level(int lod, int width, int height, int lod_count, ImportContext* context)
+        : lod(lod), width(width), height(height), context(context) {
+      // The full resolution samples are their own min and max
+      usize window_size = usize(WINDOW_ROWS) * width;
+      this->window_heights.resize(window_size);
+      if (lod > 0) {
+        this->window_lows.resize(window_size);
+        this->window_highs.resize(window_size);
+      }
+
+      if (lod + 1 < lod_count) {
+        this->next = std::make_unique<Level>(lod + 1, (width + 1) / 2, (height + 1) / 2, lod_count,
+                                             context);
+      }
+    }
+
+    static int tileCount(int samples) { return (samples + TILE_SIZE - 1) / TILE_SIZE; }
+
+    void addEntries(std::vector<TileFileEntry>& entries) const {
+      for (int z = 0; z < tileCount(this->height); z++) {
+        for (int x = 0; x < tileCount(this->width); x++) {
+          TileFileEntry entry = {};
+          entry.lod = this->lod;
+          entry.x = x;
+          entry.z = z;
+          entries.push_back(entry);
+        }
+      }
+      if (this->next) {
+        this->next->addEntries(entries);
+      }
+    }
+
+    usize bufferBytes() const {
+      usize bytes = (this->window_heights.capacity() + this->window_lows.capacity()
+                     + this->window_highs.capacity() + this->block_heights.capacity()
+                     + this->block_lows.capacity() + this->block_highs.capacity())
+                    * sizeof(float);
+      return bytes + (this->next ? this->next->bufferBytes() : 0);
+    }
+
+    /**
+     * Append the next `count` rows, `lows` and `highs` are ignored by LOD 0.
+     */
+    void push(const float* heights, const float* lows, const float* highs, int count) {
+      if (this->lod == 0) {
+        lows = heights;
+        highs = heights;
+      }
+      int first = this->rows_in;
+      this->downsample(heights, lows, highs, first, count, false);
+
+      for (int i = 0; i < count; i++) {
+        usize offset = usize(i) * this->width;
+        this->append(heights + offset, lows + offset, highs + offset);
+      }
+    }
+
+    void finish() {
+      if (this->rows_in == 0) {
+        return;
+      }
+      this->downsample(nullptr, nullptr, nullptr, this->rows_in, 0, true);
+
+      // Rows below the DEM repeat its last row
+      while (this->window_start + TILE_APRON < this->height) {
+        usize last = usize(this->window_count - 1) * this->width;
+        this->append(&this->window_heights[last], this->lows(last), this->highs(last));
+      }
+
+      if (this->next) {
+        this->next->finish();
+      }
+    }
+
+  private:
+    int lod;
+    int width;
+    int height;
+    ImportContext* context;
+    std::unique_ptr<Level> next;
+
+    int rows_in = 0;
+    int next_rows_out = 0;
+
+    // Rows [window_start, window_start + window_count), starting with the top apron of a band
+    int window_start = -TILE_APRON;
+    int window_count = 0;
+    std::vector<float> window_heights;
+    std::vector<float> window_lows;
+    std::vector<float> window_highs;
+
+    // Rows on their way to the next LOD
+    std::vector<float> block_heights;
+    std::vector<float> block_lows;
+    std::vector<float> block_highs;
+
+    const float* lows(usize offset) const {
+      return this->lod == 0 ? &this->window_heights[offset] : &this->window_lows[offset];
+    }
+    const float* highs(usize offset) const {
+      return this->lod == 0 ? &this->window_heights[offset] : &this->window_highs[offset];
+    }
+
+    void append(const float* heights, const float* lows, const float* highs) {
+      // Rows above the DEM repeat its first row
+      int copies = this->rows_in == 0 ? TILE_APRON + 1 : 1;
+      for (int i = 0; i < copies; i++) {
+        usize offset = usize(this->window_count) * this->width;
+        std::copy(heights, heights + this->width, &this->window_heights[offset]);
+        if (this->lod > 0) {
+          std::copy(lows, lows + this->width, &this->window_lows[offset]);
+          std::copy(highs, highs + this->width, &this->window_highs[offset]);
+        }
+        this->window_count += 1;
+
+        if (this->window_count == WINDOW_ROWS) {
+          this->writeBand();
+          this->slide();
+        }
+      }
+      this->rows_in += 1;
+    }
+
+    void writeBand() {
+      int tile_z = (this->window_start + TILE_APRON) / TILE_SIZE;
+      JobSystem::instance()->parallelFor(tileCount(this->width), 1, [&](usize begin, usize end) {
+        HeightTile tile;
+        tile.heights.resize(TILE_STRIDE * TILE_STRIDE);
+        for (usize tile_x = begin; tile_x < end; tile_x++) {
+          tile.key = TileKey{0, this->lod, int(tile_x), tile_z};
+          tile.min_height = INFINITY;
+          tile.max_height = -INFINITY;
+
+          for (int z = 0; z < TILE_STRIDE; z++) {
+            usize row = usize(z) * this->width;
+            for (int x = 0; x < TILE_STRIDE; x++) {
+              int column = int(tile_x) * TILE_SIZE - TILE_APRON + x;
+              usize i = row + glm::clamp(column, 0, this->width - 1);
+              tile.heights[z * TILE_STRIDE + x] = this->window_heights[i];
+              tile.min_height = std::min(tile.min_height, *this->lows(i));
+              tile.max_height = std::max(tile.max_height, *this->highs(i));
+            }
+          }
+
+          // Summed, so the hash does not depend on the order the tiles are written in
+          int coordinates[3] = {this->lod, int(tile_x), tile_z};
+          u64 h = hashBytes(14695981039346656037ull, coordinates, sizeof(coordinates));
+          h = hashBytes(h, tile.heights.data(), tile.heights.size() * sizeof(float));
+          this->context->height_hash += h;
+          this->context->tiles += 1;
+          if (!this->context->writer.writeTile(tile)) {
+            this->context->failed = true;
+          }
+        }
+      });
+    }
+
+    void slide() {
+      const int keep = 2 * TILE_APRON;
+      usize from = usize(WINDOW_ROWS - keep) * this->width;
+      usize size = usize(keep) * this->width;
+      std::copy_n(&this->window_heights[from], size, this->window_heights.begin());
+      if (this->lod > 0) {
+        std::copy_n(&this->window_lows[from], size, this->window_lows.begin());
+        std::copy_n(&this->window_highs[from], size, this->window_highs.begin());
+      }
+      this->window_start += TILE_SIZE;
+      this->window_count = keep;
+    }
+
+    /**
+     * Filter the rows of the next LOD that rows [first, first + count) complete, or all remaining
+     * ones at the end. Next LOD row k is a [1 2 1] tent over rows and columns 2k - 1 to 2k + 1,
+     * rows before `first` are still in the window.
+     */
+    void downsample(const float* heights, const float* lows, const float* highs, int first,
+                    int count, bool at_end) {
+      if (!this->next) {
+        return;
+      }
+      int next_width = this->next->width;
+      int k_begin = this->next_rows_out;
+      int k_end = at_end ? this->next->height : std::min((first + count) / 2, this->next->height);
+      if (k_end <= k_begin) {
+        return;
+      }
+
+      // The row `r` of this LOD, clamped to the DEM
+      auto row = [&](int r, const std::vector<float>& window, const float* block) {
+        r = glm::clamp(r, 0, this->height - 1);
+        if (r >= first) {
+          return block + usize(r - first) * this->width;
+        }
+        return &window[usize(r - this->window_start) * this->width];
+      };
+
+      usize size = usize(k_end - k_begin) * next_width;
+      this->block_heights.resize(size);
+      this->block_lows.resize(size);
+      this->block_highs.resize(size);
+
+      int grain = std::max(1, 16384 / next_width);
+      JobSystem::instance()->parallelFor(k_end - k_begin, grain, [&](usize begin, usize end) {
+        const auto& window_lows = this->lod == 0 ? this->window_heights : this->window_lows;
+        const auto& window_highs = this->lod == 0 ? this->window_heights : this->window_highs;
+        for (usize i = begin; i < end; i++) {
+          int k = k_begin + int(i);
+          const float* h[3];
+          const float* lo[3];
+          const float* hi[3];
+          for (int j = 0; j < 3; j++) {
+            h[j] = row(2 * k - 1 + j, this->window_heights, heights);
+            lo[j] = row(2 * k - 1 + j, window_lows, lows);
+            hi[j] = row(2 * k - 1 + j, window_highs, highs);
+          }
+
+          float* out_heights = &this->block_heights[i * next_width];
+          float* out_lows = &this->block_lows[i * next_width];
+          float* out_highs = &this->block_highs[i * next_width];
+          for (int x = 0; x < next_width; x++) {
+            int columns[3] = {std::max(2 * x - 1, 0), 2 * x, std::min(2 * x + 1, this->width - 1)};
+            const float weights[3] = {0.25f, 0.5f, 0.25f};
+            float sum = 0.0f;
+            float low = INFINITY;
+            float high = -INFINITY;
+            for (int j = 0; j < 3; j++) {
+              for (int c = 0; c < 3; c++) {
+                sum += h[j][columns[c]] * weights[j] * weights[c];
+                low = std::min(low, lo[j][columns[c]]);
+                high = std::max(high, hi[j][columns[c]]);
+              }
+            }
+            out_heights[x] = sum;
+            out_lows[x] = low;
+            out_highs[x] = high;
+          }
+        }
+      });
+
+      this->next_rows_out = k_end;
+      this->next->push(this->block_heights.data(), this->block_lows.data(),
+                       this->block_highs.data(), k_end - k_begin);
+    }
+  };
+
+  std::unique_ptr<DemReader> openReader(const DemImportSettings& settings) {
+    auto extension = std::filesystem::path(settings.input_path).extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    std::unique_ptr<DemReader> reader;
+    if (extension == ".asc") {
+      reader = std::make_unique<AsciiGridReader>();
+    } else if (extension == ".pgm" || extension == ".f32" || extension == ".r16") {
+      reader = std::make_unique<BinaryReader>();
+    } else if (extension == ".tif" || extension == ".tiff") {
+      reader = std::make_unique<TiffReader>();
+    } else {
+      reader = std::make_unique<ImageReader>();
+    }
+
+    if (!reader->open(settings.input_path, settings)) {
+      return nullptr;
+    }
+    return reader;
+  }
+}  // namespace
+
+bool dem::importTiles(const DemImportSettings& settings, DemImportStats* stats) {
+  auto start = std::chrono::steady_clock::now();
+
+  auto reader = openReader(settings);
+  if (!reader) {
+    return false;
+  }
+
+  int lod_count = 1;
+  int size = std::max(reader->width, reader->height);
+  for (; size > TILE_SIZE; size = (size + 1) / 2) {
+    lod_count += 1;
+  }
+  if (settings.lod_count > 0) {
+    lod_count = settings.lod_count;
+  }
+  lod_count = glm::clamp(lod_count, 1, MAX_LODS);
+
+  ImportContext context;
+  Level top(0, reader->width, reader->height, lod_count, &context);
+
+  std::vector<TileFileEntry> entries;
+  top.addEntries(entries);
+  if (!context.writer.open(settings.output_path,
+                           Span<const TileFileEntry>(entries.data(), entries.size()),
+                           settings.quantize)) {
+    return false;
+  }
+
+  std::vector<float> strip(usize(STRIP_ROWS) * reader->width);
+  for (int row = 0; row < reader->height && !context.failed; row += STRIP_ROWS) {
+    int rows = std::min(STRIP_ROWS, reader->height - row);
+    if (!reader->readRows(strip.data(), rows)) {
+      return false;
+    }
+    top.push(strip.data(), nullptr, nullptr, rows);
+  }
+  top.finish();
+  if (context.failed) {
+    return false;
+  }
+
+  TileFileHeader header = {};
+  header.noise_hash = context.height_hash.load();
+  header.style = TILE_FILE_STYLE_IMPORTED;
+  header.base_texel_size = settings.texel_size > 0.0f   ? settings.texel_size
+                           : reader->cell_size > 0.0f ? reader->cell_size
+                                                      : 1.0f;
+  if (!context.writer.finish(header)) {
+    return false;
+  }
+
+  if (stats != nullptr) {
+    stats->width = reader->width;
+    stats->height = reader->height;
+    stats->lods = lod_count;
+    stats->tiles = context.tiles.load();
+    stats->bytes_read = reader->bytes_read;
+    stats->bytes_written = context.writer.bytesWritten();
+    stats->buffer_bytes = top.bufferBytes() + strip.capacity() * sizeof(float);
+    stats->height_hash = header.noise_hash;
+    stats->threads = JobSystem::instance()->threadCount() + 1;
+    stats->seconds
+        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  return true;
+}
+
+int dem::runCommandLine(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cout << "Usage: --import-dem <input> <output.tiles> [--size <width> <height>]\n"
+              << "         [--texel-size <m>] [--height-scale <s>] [--height-offset <m>]\n"
+              << "         [--nodata <m>] [--lods <n>] [--float]\n";
+    return 1;
+  }
+
+  DemImportSettings settings;
+  settings.input_path = argv[0];
+  settings.output_path = argv[1];
+  for (int i = 2; i < argc; i++) {
+    std::string option = argv[i];
+    bool has_value = i + 1 < argc;
+    if (option == "--size" && i + 2 < argc) {
+      settings.raw_width = std::atoi(argv[++i]);
+      settings.raw_height = std::atoi(argv[++i]);
+    } else if (option == "--texel-size" && has_value) {
+      settings.texel_size = float(std::atof(argv[++i]));
+    } else if (option == "--height-scale" && has_value) {
+      settings.height_scale = float(std::atof(argv[++i]));
+    } else if (option == "--height-offset" && has_value) {
+      settings.height_offset = float(std::atof(argv[++i]));
+    } else if (option == "--nodata" && has_value) {
+      settings.nodata_height = float(std::atof(argv[++i]));
+    } else if (option == "--lods" && has_value) {
+      settings.lod_count = std::atoi(argv[++i]);
+    } else if (option == "--float") {
+      settings.quantize = false;
+    } else {
+      std::cout << "Unknown option " << option << "\n";
+      return 1;
+    }
+  }
+
+  JobSystem::instance()->init();
+  DemImportStats stats;
+  bool imported = dem::importTiles(settings, &stats);
+  JobSystem::instance()->deinit();
+  if (!imported) {
+    return 1;
+  }
+
+  std::cout << std::fixed << std::setprecision(1) << stats.width << " x " << stats.height
+            << " samples, " << stats.lods << " LODs, " << stats.tiles << " tiles, "
+            << stats.bytes_read / 1e6 << " MB read, " << stats.bytes_written / 1e6
+            << " MB written\n";
+  std::cout << std::setprecision(2) << stats.seconds << " s on " << stats.threads << " threads, "
+            << std::setprecision(1) << stats.samplesPerSecond() / 1e6 << " M samples/s, "
+            << stats.buffer_bytes / 1e6 << " MB of row buffers\n";
+  return 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+
+#include "core.h"
+
+struct DemImportSettings {
+  std::string input_path;
+  std::string output_path;
+
+  // Size of the headerless .f32 (little endian floats) and .r16 (little endian u16) inputs
+  int raw_width = 0;
+  int raw_height = 0;
+
+  // Meters between samples, 0 takes the cell size of an .asc header or else 1
+  float texel_size = 0.0f;
+  // Heights are value * height_scale + height_offset, missing values of an .asc become
+  // nodata_height
+  float height_scale = 1.0f;
+  float height_offset = 0.0f;
+  float nodata_height = 0.0f;
+
+  // LODs to write, 0 halves the DEM until it fits a single tile
+  int lod_count = 0;
+  bool quantize = true;
+};
+
+struct DemImportStats {
+  int width = 0;
+  int height = 0;
+  int lods = 0;
+  usize tiles = 0;
+  u64 bytes_read = 0;
+  u64 bytes_written = 0;
+  usize buffer_bytes = 0;  // rows held in memory at once, independent of the DEM height
+  u64 height_hash = 0;     // noise_hash of the written file
+  int threads = 0;
+  double seconds = 0.0;
+
+  double samplesPerSecond() const {
+    return seconds > 0.0 ? double(width) * height / seconds : 0.0;
+  }
+};
+
+namespace dem {
+  /**
+   * Convert a DEM into a tile file with a mip pyramid, without ever holding the whole DEM.
+   *
+   * Supported inputs are ESRI ASCII grids (.asc, values split into lines in any way), TIFF and
+   * GeoTIFF (.tif, .tiff), binary PGM (.pgm, 8 or 16 bit) and headerless .f32 and .r16 rasters,
+   * all decoded a strip of rows at a time. TIFFs must be uncompressed and stored in strips, with
+   * one 8, 16 or 32 bit integer or 32 bit float sample per pixel; compressed, tiled and BigTIFF
+   * files are rejected and need a `gdal_translate -co COMPRESS=NONE -co TILED=NO` first. Any other
+   * image goes through stb_image, which decodes it whole, so those are only meant for small
+   * heightmaps.
+   *
+   * Each LOD keeps a window of TILE_SIZE + 2 * TILE_APRON rows. Whenever the window is full its
+   * band of tiles is cut and written on the workers, and every row pair is filtered down into the
+   * next LOD as it arrives. Sample k of a LOD lies on sample 2k of the one above, like the baked
+   * tiles, and besides the filtered heights each LOD carries the min and max of the full
+   * resolution samples under it, so the min/max of a tile bounds the DEM and not only its own
+   * samples. Memory is a few windows of the DEM width, whatever its height.
+   *
+   * The file has TileFileHeader::style TILE_FILE_STYLE_IMPORTED, open it with
+   * TileFile::openImported(). `--height-field <file>` draws it, see HeightField::loadTileFile().
+   */
+  bool importTiles(const DemImportSettings& settings, DemImportStats* stats = nullptr);
+
+  /**
+   * `--import-dem <input> <output> [options]` without opening a window, returns the exit code.
+   */
+  int runCommandLine(int argc, char* argv[]);
+}  // namespace dem
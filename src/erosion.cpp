@@ -0,0 +1,573 @@
+#include "erosion.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "jobs.h"
+
+namespace {
+  constexpr int HALO = ErosionStage::HALO;
+  // Side of a tile's working copy, its TILE_SIZE^2 texels and the halo around them
+  constexpr int WORK_SIZE = TILE_SIZE + 2 * HALO;
+
+  struct TileCoord {
+    int x;
+    int z;
+
+    bool operator==(const TileCoord& other) const { return x == other.x && z == other.z; }
+  };
+
+  struct TileCoordHash {
+    usize operator()(const TileCoord& coord) const {
+      u64 h = 14695981039346656037ull;
+      h = (h ^ u64(u32(coord.x))) * 1099511628211ull;
+      h = (h ^ u64(u32(coord.z))) * 1099511628211ull;
+      return usize(h);
+    }
+  };
+
+  // SplitMix64, seeded per tile and pass
+  struct Random {
+    u64 state;
+
+    u64 next() {
+      u64 z = (state += 0x9e3779b97f4a7c15ull);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      return z ^ (z >> 31);
+    }
+
+    // [0, 1)
+    float uniform() { return float(next() >> 40) * (1.0f / float(1 << 24)); }
+  };
+
+  int floorDiv(int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+
+  // The 3x3 tiles a working copy overlaps, row major from (-1, -1). Set where the texels belong
+  // to a dirty tile and may change: context tiles and missing neighbours stay as they are
+  using Writable = std::array<bool, 9>;
+
+  // Which of the 3x3 tiles of a working copy texel coordinate lies in
+  int block(int texel) { return texel < HALO ? 0 : texel < HALO + TILE_SIZE ? 1 : 2; }
+
+  bool isWritable(const Writable& writable, int x, int z) {
+    return writable[block(z) * 3 + block(x)];
+  }
+
+  // All four texels of the bilinear footprint of `p` may change
+  bool footprintWritable(const Writable& writable, glm::vec2 p) {
+    int x = int(p.x);
+    int z = int(p.y);
+    return isWritable(writable, x, z) && isWritable(writable, x + 1, z)
+           && isWritable(writable, x, z + 1) && isWritable(writable, x + 1, z + 1);
+  }
+
+  /**
+   * The tiles of the region, their heights without the apron in meters and the working copies
+   * of the dirty tiles in texel units.
+   */
+  struct Region {
+    std::vector<HeightTile>* tiles;
+    std::unordered_map<TileCoord, usize, TileCoordHash> index;
+    std::vector<std::vector<float>> heights;  // TILE_SIZE^2 per tile
+    std::vector<usize> dirty;
+
+    // WORK_SIZE^2 per dirty tile, eroded in place, and the copy they started from
+    std::vector<std::vector<float>> work;
+    std::vector<std::vector<float>> snapshot;
+    std::vector<Writable> writable;
+
+    const HeightTile& tile(usize i) const { return (*tiles)[i]; }
+
+    isize find(int tile_x, int tile_z) const {
+      auto it = index.find(TileCoord{tile_x, tile_z});
+      return it != index.end() ? isize(it->second) : -1;
+    }
+
+    /**
+     * Fill the working copy of dirty tile `d` from the heights of the tile and its neighbours.
+     * Where there is no neighbour the edge of the tile is repeated.
+     */
+    void fill(usize d, float inverse_texel_size) {
+      usize self = dirty[d];
+      const auto& key = tile(self).key;
+      auto& out = work[d];
+
+      // The copy overlaps the tile and its 8 neighbours, one rectangle each
+      for (int nz = -1; nz <= 1; nz++) {
+        for (int nx = -1; nx <= 1; nx++) {
+          isize owner = find(key.x + nx, key.z + nz);
+          int x0 = nx < 0 ? 0 : nx == 0 ? HALO : HALO + TILE_SIZE;
+          int x1 = nx < 0 ? HALO : nx == 0 ? HALO + TILE_SIZE : WORK_SIZE;
+          int z0 = nz < 0 ? 0 : nz == 0 ? HALO : HALO + TILE_SIZE;
+          int z1 = nz < 0 ? HALO : nz == 0 ? HALO + TILE_SIZE : WORK_SIZE;
+          for (int z = z0; z < z1; z++) {
+            // Texel of the owner, or the nearest texel of this tile when there is no neighbour
+            int lz = owner >= 0 ? z - HALO - nz * TILE_SIZE
+                                : glm::clamp(z - HALO, 0, TILE_SIZE - 1);
+            const float* row = &heights[owner >= 0 ? owner : self][lz * TILE_SIZE];
+            for (int x = x0; x < x1; x++) {
+              int lx = owner >= 0 ? x - HALO - nx * TILE_SIZE
+                                  : glm::clamp(x - HALO, 0, TILE_SIZE - 1);
+              out[z * WORK_SIZE + x] = row[lx] * inverse_texel_size;
+            }
+          }
+        }
+      }
+    }
+  };
+
+  struct Sample {
+    float height;
+    glm::vec2 gradient;
+  };
+
+  Sample sampleBilinear(const float* h, glm::vec2 p) {
+    int x = int(p.x);
+    int z = int(p.y);
+    float fx = p.x - x;
+    float fz = p.y - z;
+    const float* row = &h[z * WORK_SIZE + x];
+    float h00 = row[0];
+    float h10 = row[1];
+    float h01 = row[WORK_SIZE];
+    float h11 = row[WORK_SIZE + 1];
+
+    Sample s;
+    s.height = (h00 * (1 - fx) + h10 * fx) * (1 - fz) + (h01 * (1 - fx) + h11 * fx) * fz;
+    s.gradient.x = (h10 - h00) * (1 - fz) + (h11 - h01) * fz;
+    s.gradient.y = (h01 - h00) * (1 - fx) + (h11 - h10) * fx;
+    return s;
+  }
+
+  // Spread `amount` over the four texels around `p` with bilinear weights
+  void addBilinear(float* h, glm::vec2 p, float amount) {
+    int x = int(p.x);
+    int z = int(p.y);
+    float fx = p.x - x;
+    float fz = p.y - z;
+    float* row = &h[z * WORK_SIZE + x];
+    row[0] += amount * (1 - fx) * (1 - fz);
+    row[1] += amount * fx * (1 - fz);
+    row[WORK_SIZE] += amount * (1 - fx) * fz;
+    row[WORK_SIZE + 1] += amount * fx * fz;
+  }
+
+  /**
+   * Run the droplets of one tile on its working copy, returns the number of steps taken. Droplets
+   * stop before they touch texels that may not change and drop what they still carry where they
+   * stop, so no material is lost.
+   */
+  u64 runDroplets(float* h, const Writable& writable, const ErosionSettings& s, Random& random) {
+    // Droplets start inside the tile and stop before their bilinear footprint leaves the copy
+    int lifetime = glm::clamp(s.max_lifetime, 1, HALO - 2);
+    float lo = 1.0f;
+    float hi = float(WORK_SIZE - 2);
+
+    u64 steps = 0;
+    for (int i = 0; i < s.droplets_per_tile; i++) {
+      glm::vec2 start(random.uniform(), random.uniform());
+      glm::vec2 pos = glm::vec2(HALO) + start * float(TILE_SIZE);
+      glm::vec2 dir(0.0f);
+      float speed = 1.0f;
+      float water = 1.0f;
+      float sediment = 0.0f;
+      if (!footprintWritable(writable, pos)) {
+        continue;
+      }
+
+      for (int step = 0; step < lifetime; step++) {
+        steps += 1;
+        Sample here = sampleBilinear(h, pos);
+
+        dir = dir * s.inertia - here.gradient * (1.0f - s.inertia);
+        float length = glm::length(dir);
+        if (length < 1e-6f) {
+          break;
+        }
+        dir /= length;
+
+        glm::vec2 next = pos + dir;
+        if (next.x < lo || next.y < lo || next.x >= hi || next.y >= hi
+            || !footprintWritable(writable, next)) {
+          break;
+        }
+
+        float delta_height = sampleBilinear(h, next).height - here.height;
+        float capacity = glm::max(-delta_height * speed * water * s.capacity, s.min_capacity);
+
+        if (sediment > capacity || delta_height > 0.0f) {
+          // Fill the pit it climbs out of, or drop what it can no longer carry
+          float amount = delta_height > 0.0f ? glm::min(delta_height, sediment)
+                                             : (sediment - capacity) * s.deposit_speed;
+          sediment -= amount;
+          addBilinear(h, pos, amount);
+        } else {
+          // Never dig deeper than the step down, that would carve spikes
+          float amount = glm::min((capacity - sediment) * s.erode_speed, -delta_height);
+          sediment += amount;
+          addBilinear(h, pos, -amount);
+        }
+
+        speed = std::sqrt(glm::max(speed * speed - delta_height * s.gravity, 0.0f));
+        water *= 1.0f - s.evaporate_speed;
+        pos = next;
+      }
+      addBilinear(h, pos, sediment);
+    }
+    return steps;
+  }
+
+  /**
+   * One Jacobi step of thermal erosion over the tile's own texels, from its working copy into
+   * `out` in meters. Nothing flows to or from texels that may not change.
+   */
+  void relaxTile(const float* h, const Writable& writable, const ErosionSettings& s,
+                 float texel_size, float* out) {
+    const int offsets[4] = {-1, 1, -WORK_SIZE, WORK_SIZE};
+    const int dx[4] = {-1, 1, 0, 0};
+    const int dz[4] = {0, 0, -1, 1};
+    // A texel loses at most half of its excess, which keeps the step stable
+    float rate = glm::clamp(s.thermal_rate, 0.0f, 1.0f) / 8.0f;
+
+    for (int z = 0; z < TILE_SIZE; z++) {
+      for (int x = 0; x < TILE_SIZE; x++) {
+        int i = (z + HALO) * WORK_SIZE + (x + HALO);
+        float change = 0.0f;
+        for (int n = 0; n < 4; n++) {
+          if (!isWritable(writable, x + HALO + dx[n], z + HALO + dz[n])) {
+            continue;
+          }
+          int offset = offsets[n];
+          float difference = h[i] - h[i + offset];
+          float excess = std::abs(difference) - s.talus;
+          if (excess > 0.0f) {
+            change -= std::copysign(rate * excess, difference);
+          }
+        }
+        out[z * TILE_SIZE + x] = (h[i] + change) * texel_size;
+      }
+    }
+  }
+}  // namespace
+
+u64 ErosionSettings::hash() const {
+  u64 h = 14695981039346656037ull;
+  auto mix = [&](u64 value) { h = (h ^ value) * 1099511628211ull; };
+  auto mix_float = [&](float value) {
+    u32 bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    mix(bits);
+  };
+
+  mix(u32(this->passes));
+  mix(u32(this->droplets_per_tile));
+  mix(u32(this->max_lifetime));
+  mix_float(this->inertia);
+  mix_float(this->capacity);
+  mix_float(this->min_capacity);
+  mix_float(this->erode_speed);
+  mix_float(this->deposit_speed);
+  mix_float(this->evaporate_speed);
+  mix_float(this->gravity);
+  mix_float(this->talus);
+  mix_float(this->thermal_rate);
+  return h;
+}
+
+ErosionStats erosion::erodeTiles(std::vector<HeightTile>& tiles, const std::vector<bool>& dirty,
+                                 float texel_size, const ErosionSettings& settings) {
+  auto start = std::chrono::steady_clock::now();
+  auto* jobs = JobSystem::instance();
+
+  Region region;
+  region.tiles = &tiles;
+  region.heights.resize(tiles.size());
+  for (usize i = 0; i < tiles.size(); i++) {
+    region.index[TileCoord{tiles[i].key.x, tiles[i].key.z}] = i;
+    region.heights[i].resize(TILE_SIZE * TILE_SIZE);
+    for (int z = 0; z < TILE_SIZE; z++) {
+      for (int x = 0; x < TILE_SIZE; x++) {
+        region.heights[i][z * TILE_SIZE + x] = tiles[i].at(x, z);
+      }
+    }
+    if (dirty[i]) {
+      region.dirty.push_back(i);
+    }
+  }
+
+  usize dirty_count = region.dirty.size();
+  region.work.assign(dirty_count, std::vector<float>(WORK_SIZE * WORK_SIZE));
+  region.snapshot.resize(dirty_count);
+  std::vector<isize> dirty_slot(tiles.size(), -1);
+  for (usize d = 0; d < dirty_count; d++) {
+    dirty_slot[region.dirty[d]] = isize(d);
+  }
+  region.writable.resize(dirty_count);
+  for (usize d = 0; d < dirty_count; d++) {
+    const auto& key = tiles[region.dirty[d]].key;
+    for (int nz = -1; nz <= 1; nz++) {
+      for (int nx = -1; nx <= 1; nx++) {
+        isize neighbour = region.find(key.x + nx, key.z + nz);
+        region.writable[d][(nz + 1) * 3 + (nx + 1)] = neighbour >= 0 && dirty_slot[neighbour] >= 0;
+      }
+    }
+  }
+
+  float inverse_texel_size = 1.0f / texel_size;
+  std::vector<u64> steps(dirty_count, 0);
+  for (int pass = 0; pass < settings.passes; pass++) {
+    // Hydraulic: every tile erodes its own copy, halo included
+    jobs->parallelFor(dirty_count, 1, [&](usize begin, usize end) {
+      for (usize d = begin; d < end; d++) {
+        region.fill(d, inverse_texel_size);
+        region.snapshot[d] = region.work[d];
+
+        const auto& key = tiles[region.dirty[d]].key;
+        Random random{u64(u32(key.x)) << 32 ^ u64(u32(key.z)) ^ u64(pass) * 0x632be59bd9b4e019ull};
+        steps[d] += runDroplets(region.work[d].data(), region.writable[d], settings, random);
+      }
+    });
+
+    // Halo exchange: each tile gathers the changes of itself and its neighbours to its texels
+    jobs->parallelFor(dirty_count, 1, [&](usize begin, usize end) {
+      for (usize d = begin; d < end; d++) {
+        const auto& key = tiles[region.dirty[d]].key;
+        auto& out = region.heights[region.dirty[d]];
+        for (int nz = -1; nz <= 1; nz++) {
+          for (int nx = -1; nx <= 1; nx++) {
+            isize neighbour = region.find(key.x + nx, key.z + nz);
+            if (neighbour < 0 || dirty_slot[neighbour] < 0) {
+              continue;
+            }
+            const auto& work = region.work[dirty_slot[neighbour]];
+            const auto& snapshot = region.snapshot[dirty_slot[neighbour]];
+
+            // Our texel (x, z) in the neighbour's copy
+            int ox = HALO - nx * TILE_SIZE;
+            int oz = HALO - nz * TILE_SIZE;
+            int x0 = glm::max(0, -ox);
+            int x1 = glm::min(TILE_SIZE, WORK_SIZE - ox);
+            int z0 = glm::max(0, -oz);
+            int z1 = glm::min(TILE_SIZE, WORK_SIZE - oz);
+            for (int z = z0; z < z1; z++) {
+              for (int x = x0; x < x1; x++) {
+                int i = (z + oz) * WORK_SIZE + (x + ox);
+                out[z * TILE_SIZE + x] += (work[i] - snapshot[i]) * texel_size;
+              }
+            }
+          }
+        }
+      }
+    });
+
+    // Thermal: all copies are filled before any tile writes its relaxed heights
+    jobs->parallelFor(dirty_count, 1, [&](usize begin, usize end) {
+      for (usize d = begin; d < end; d++) {
+        region.fill(d, inverse_texel_size);
+      }
+    });
+    jobs->parallelFor(dirty_count, 1, [&](usize begin, usize end) {
+      for (usize d = begin; d < end; d++) {
+        relaxTile(region.work[d].data(), region.writable[d], settings, texel_size,
+                  region.heights[region.dirty[d]].data());
+      }
+    });
+  }
+
+  // Write the eroded texels back, the aprons from the neighbours where there are any
+  jobs->parallelFor(dirty_count, 1, [&](usize begin, usize end) {
+    for (usize d = begin; d < end; d++) {
+      auto& tile = tiles[region.dirty[d]];
+      for (int z = -TILE_APRON; z < TILE_SIZE + TILE_APRON; z++) {
+        for (int x = -TILE_APRON; x < TILE_SIZE + TILE_APRON; x++) {
+          int gx = tile.key.x * TILE_SIZE + x;
+          int gz = tile.key.z * TILE_SIZE + z;
+          isize owner = region.find(floorDiv(gx, TILE_SIZE), floorDiv(gz, TILE_SIZE));
+          if (owner < 0) {
+            continue;
+          }
+          int lx = gx - floorDiv(gx, TILE_SIZE) * TILE_SIZE;
+          int lz = gz - floorDiv(gz, TILE_SIZE) * TILE_SIZE;
+          tile.heights[(z + TILE_APRON) * TILE_STRIDE + (x + TILE_APRON)]
+              = region.heights[owner][lz * TILE_SIZE + lx];
+        }
+      }
+
+      auto bounds = std::minmax_element(tile.heights.begin(), tile.heights.end());
+      tile.min_height = *bounds.first;
+      tile.max_height = *bounds.second;
+    }
+  });
+
+  ErosionStats stats;
+  stats.tiles = dirty_count;
+  stats.context_tiles = tiles.size() - dirty_count;
+  stats.droplets
+      = u64(dirty_count) * settings.passes * u64(glm::max(settings.droplets_per_tile, 0));
+  for (u64 count : steps) {
+    stats.droplet_steps += count;
+  }
+  stats.thermal_texels = u64(dirty_count) * settings.passes * TILE_SIZE * TILE_SIZE;
+  stats.threads = jobs->threadCount() + 1;
+  stats.seconds
+      = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return stats;
+}
+
+ErosionStage::~ErosionStage() { this->cancel(); }
+
+void ErosionStage::cancel() {
+  this->shared->generation += 1;
+  // A new state for the next run, the abandoned job keeps the old one alive
+  this->shared = std::make_shared<Shared>();
+  this->running = false;
+}
+
+void ErosionStage::update(const TileBaker& baker, TileCache& cache, const TerrainNoise& noise,
+                          glm::vec3 camera_position) {
+  u64 noise_hash = noise::hash(noise);
+  u64 hash = noise_hash ^ (this->settings.hash() * 31);
+  u32 texel_bits;
+  std::memcpy(&texel_bits, &baker.base_texel_size, sizeof(texel_bits));
+  hash = (hash ^ u64(texel_bits) ^ u64(u32(this->lod)) << 32) * 1099511628211ull;
+  if (hash != this->input_hash) {
+    this->cancel();
+    this->eroded.clear();
+    this->input_hash = hash;
+  }
+
+  if (this->running) {
+    std::vector<HeightTile> tiles;
+    {
+      std::lock_guard<std::mutex> lock(this->shared->mutex);
+      if (!this->shared->finished) {
+        return;
+      }
+      tiles = std::move(this->shared->tiles);
+      this->last_stats = this->shared->stats;
+    }
+    this->shared = std::make_shared<Shared>();
+    this->running = false;
+
+    for (auto& tile : tiles) {
+      TileKey key = tile.key;
+      this->eroded[key] = cache.insert(std::move(tile));
+    }
+    this->eroded_total += tiles.size();
+  }
+
+  if (!this->enabled) {
+    return;
+  }
+
+  // The region around the camera, dirty unless its eroded version is still in the cache
+  int lod = glm::clamp(this->lod, 0, 8);
+  TileKey middle = baker.tileAt(noise_hash, lod, glm::vec2(camera_position.x, camera_position.z));
+  std::vector<TileKey> dirty_keys;
+  for (int z = -this->radius; z <= this->radius; z++) {
+    for (int x = -this->radius; x <= this->radius; x++) {
+      TileKey key = {noise_hash, lod, middle.x + x, middle.z + z};
+      auto it = this->eroded.find(key);
+      if (it == this->eroded.end() || it->second.expired()) {
+        dirty_keys.push_back(key);
+      }
+    }
+  }
+  if (dirty_keys.empty()) {
+    return;
+  }
+
+  // Their neighbours lend their heights, eroded ones from the cache and the others freshly baked
+  std::vector<HeightTile> tiles;
+  std::vector<bool> dirty;
+  std::unordered_map<TileKey, usize, TileKeyHash> included;
+  for (const auto& key : dirty_keys) {
+    included[key] = tiles.size();
+    tiles.push_back(HeightTile{key});
+    dirty.push_back(true);
+  }
+  for (const auto& key : dirty_keys) {
+    for (int z = -1; z <= 1; z++) {
+      for (int x = -1; x <= 1; x++) {
+        TileKey neighbour = {noise_hash, lod, key.x + x, key.z + z};
+        if (included.count(neighbour) > 0) {
+          continue;
+        }
+        included[neighbour] = tiles.size();
+
+        auto it = this->eroded.find(neighbour);
+        auto cached = it != this->eroded.end() ? it->second.lock() : nullptr;
+        tiles.push_back(cached != nullptr ? cached->decode() : HeightTile{neighbour});
+        dirty.push_back(false);
+      }
+    }
+  }
+
+  this->running = true;
+  auto shared = this->shared;
+  u32 generation = shared->generation.load();
+  float texel_size = baker.texelSize(lod);
+  auto job = [shared, generation, baker, noise, tiles = std::move(tiles), dirty, texel_size,
+              settings = this->settings]() mutable {
+    JobSystem::instance()->parallelFor(tiles.size(), 1, [&](usize begin, usize end) {
+      for (usize i = begin; i < end; i++) {
+        if (tiles[i].heights.empty()) {
+          baker.bakeTile(noise, tiles[i]);
+        }
+      }
+    });
+    if (shared->generation.load() != generation) {
+      return;
+    }
+
+    auto stats = erosion::erodeTiles(tiles, dirty, texel_size, settings);
+
+    std::vector<HeightTile> eroded;
+    for (usize i = 0; i < tiles.size(); i++) {
+      if (dirty[i]) {
+        eroded.push_back(std::move(tiles[i]));
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    shared->tiles = std::move(eroded);
+    shared->stats = stats;
+    shared->finished = true;
+  };
+  JobSystem::instance()->submit(job);
+}
+
+void ErosionStage::gui() {
+  ImGui::Checkbox("Erode tiles", &this->enabled);
+  ImGui::SliderInt("Erosion LOD", &this->lod, 0, 4);
+  ImGui::SliderInt("Erosion radius", &this->radius, 0, 4);
+
+  auto& s = this->settings;
+  ImGui::SliderInt("Passes", &s.passes, 1, 64);
+  ImGui::SliderInt("Droplets per tile", &s.droplets_per_tile, 0, 65536);
+  ImGui::SliderInt("Droplet lifetime", &s.max_lifetime, 1, HALO - 2);
+  ImGui::SliderFloat("Inertia", &s.inertia, 0.0f, 1.0f);
+  ImGui::SliderFloat("Sediment capacity", &s.capacity, 0.0f, 16.0f);
+  ImGui::SliderFloat("Erode speed", &s.erode_speed, 0.0f, 1.0f);
+  ImGui::SliderFloat("Deposit speed", &s.deposit_speed, 0.0f, 1.0f);
+  ImGui::SliderFloat("Evaporate speed", &s.evaporate_speed, 0.0f, 0.5f);
+  ImGui::SliderFloat("Gravity", &s.gravity, 0.0f, 16.0f);
+  ImGui::SliderFloat("Talus slope", &s.talus, 0.0f, 4.0f);
+  ImGui::SliderFloat("Thermal rate", &s.thermal_rate, 0.0f, 1.0f);
+
+  const auto& stats = this->last_stats;
+  ImGui::Text("%s, %llu tiles eroded", this->running ? "Eroding..." : "Idle",
+              (unsigned long long)this->eroded_total);
+  ImGui::Text("Last run: %zu tiles (+%zu context) in %.1f ms on %d threads", stats.tiles,
+              stats.context_tiles, stats.seconds * 1e3, stats.threads);
+  ImGui::Text("%.2f M iterations/s, %.1f M droplet steps/s, %.1f M thermal texels/s",
+              stats.iterationsPerSecond() / 1e6,
+              stats.seconds > 0.0 ? stats.droplet_steps / stats.seconds / 1e6 : 0.0,
+              stats.seconds > 0.0 ? stats.thermal_texels / stats.seconds / 1e6 : 0.0);
+}
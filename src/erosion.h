@@ -0,0 +1,121 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "baker.h"
+#include "core.h"
+#include "noise.h"
+#include "tilecache.h"
+
+struct ErosionSettings {
+  int passes = 8;
+
+  // Hydraulic: water droplets carrying sediment downhill (Beyer 2015), heights in texel units
+  int droplets_per_tile = 8192;
+  int max_lifetime = 30;  // steps of one texel, at most ErosionStage::HALO - 2
+  float inertia = 0.05f;
+  float capacity = 4.0f;
+  float min_capacity = 0.01f;
+  float erode_speed = 0.3f;
+  float deposit_speed = 0.3f;
+  float evaporate_speed = 0.01f;
+  float gravity = 4.0f;
+
+  // Thermal: material slides down where the slope between neighbours exceeds the talus slope
+  float talus = 0.8f;
+  float thermal_rate = 0.5f;
+
+  u64 hash() const;
+};
+
+struct ErosionStats {
+  usize tiles = 0;          // tiles eroded
+  usize context_tiles = 0;  // neighbours read for their heights only
+  u64 droplets = 0;
+  u64 droplet_steps = 0;
+  u64 thermal_texels = 0;
+  int threads = 0;
+  double seconds = 0.0;
+
+  // One iteration is one droplet, as in the usual droplet counts of hydraulic erosion
+  double iterationsPerSecond() const { return seconds > 0.0 ? droplets / seconds : 0.0; }
+};
+
+namespace erosion {
+  /**
+   * Erode the tiles with `dirty[i]` set for `settings.passes` passes, the others only lend their
+   * heights to the halos. All tiles have the same LOD, texels `texel_size` apart.
+   *
+   * Every pass each dirty tile copies the heights of its neighbours into a halo of
+   * ErosionStage::HALO texels, runs its droplets on that copy in parallel with the other tiles and
+   * then gathers what the droplets of itself and its neighbours changed within its own texels.
+   * Thermal relaxation runs per tile on a fresh halo copy, its flows are antisymmetric so the
+   * material a tile loses over its border is what the neighbour gains. The other tiles are held
+   * fixed: droplets drop their sediment and stop before touching them and no material flows over
+   * their border, so nothing is eroded into heights that are not written back. The droplets are
+   * seeded from the tile keys, so the result does not depend on the thread count.
+   */
+  ErosionStats erodeTiles(std::vector<HeightTile>& tiles, const std::vector<bool>& dirty,
+                          float texel_size, const ErosionSettings& settings);
+}  // namespace erosion
+
+/**
+ * Erodes the baked tiles of one LOD around the camera in the background and replaces them in the
+ * tile cache.
+ *
+ * Only dirty tiles are eroded: tiles that entered the region or whose eroded version left the
+ * cache. Changing the noise, the settings or the texel size makes every tile dirty. Tiles that
+ * are already eroded are read back from the cache as context for their dirty neighbours, missing
+ * context is baked.
+ *
+ * The eroded tiles only reach the cache and its CPU readers, the renderer still draws the noise.
+ */
+class ErosionStage {
+public:
+  // Texels around each tile that droplets can wander into during one pass
+  static constexpr int HALO = 32;
+
+  bool enabled = false;
+  int lod = 0;
+  int radius = 1;
+  ErosionSettings settings;
+
+  ~ErosionStage();
+
+  /**
+   * Call once per frame from the main thread, after TerrainStreamer::update().
+   */
+  void update(const TileBaker& baker, TileCache& cache, const TerrainNoise& noise,
+              glm::vec3 camera_position);
+
+  /**
+   * Abandon the running erosion, its result is dropped.
+   */
+  void cancel();
+
+  void gui();
+
+private:
+  // Shared with the job, which may outlive the stage
+  struct Shared {
+    std::atomic<u32> generation{0};
+
+    std::mutex mutex;
+    bool finished = false;
+    std::vector<HeightTile> tiles;
+    ErosionStats stats;
+  };
+
+  std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+  bool running = false;
+  u64 input_hash = 0;
+  ErosionStats last_stats;
+  u64 eroded_total = 0;
+
+  // The eroded tiles handed to the cache, expired once the cache dropped them
+  std::unordered_map<TileKey, std::weak_ptr<const CachedTile>, TileKeyHash> eroded;
+};
@@ -0,0 +1,222 @@
+#pragma once
+
+/**
+ * Compile-time specialised fBm on top of the lane templates in noise_kernel.h.
+ *
+ * A recipe names the octave type of the first octave, the octave type of all the others and
+ * whether the domain is warped first. Fbm<> unrolls the octaves at compile time, so there are no
+ * branches on the octave index or type left in the inner loop, and heightFunction() picks the
+ * instantiation that matches a TerrainNoise once per batch. fbm.glsl is specialised the same way
+ * through the #defines from noise::shaderDefines().
+ *
+ * Octave i samples its shape at pos * frequency_i / 200 (i = 0), / 400 (i = 1) and
+ * / 800 + (1231, 721) (i >= 2) and divides it by 1, 1.5 and 2 respectively. TerrainStyle::Classic
+ * is the original terrain and produces the exact same values as before.
+ *
+ * Same as for noise_kernel.h: this header is included by noise_avx2.cpp, keep everything in here
+ * a template over the lane type.
+ */
+
+#include <array>
+#include <utility>
+
+#include "noise_kernel.h"
+
+namespace noise {
+  namespace fbm {
+    constexpr int MAX_OCTAVES = 10;
+
+    // The values are shared with the OCTAVE_* defines in fbm.glsl
+    enum class OctaveType { Voronoi = 0, Simplex = 1, Ridged = 2, Billow = 3 };
+
+    struct Recipe {
+      OctaveType base;
+      OctaveType detail;
+      bool warp;
+    };
+
+    constexpr Recipe recipeFor(TerrainStyle style) {
+      switch (style) {
+        case TerrainStyle::Ridged:
+          return {OctaveType::Voronoi, OctaveType::Ridged, false};
+        case TerrainStyle::Billow:
+          return {OctaveType::Billow, OctaveType::Billow, false};
+        case TerrainStyle::Warped:
+          return {OctaveType::Voronoi, OctaveType::Simplex, true};
+        default:
+          return {OctaveType::Voronoi, OctaveType::Simplex, false};
+      }
+    }
+
+    // One octave shape at p. With `Gradient` its derivatives are written to `dx` and `dy`.
+    template <OctaveType Type, bool Gradient, typename V>
+    inline V octave(V px, V py, V& dx, V& dy) {
+      using namespace kernel;
+
+      if constexpr (Type == OctaveType::Voronoi) {
+        if constexpr (Gradient) {
+          V v = voronoi2dGrad(px, py, dx, dy);
+          dx = V(2.0f) * v * dx;
+          dy = V(2.0f) * v * dy;
+          return v * v;
+        } else {
+          V v = voronoi2d(px, py);
+          return v * v;
+        }
+      } else if constexpr (Type == OctaveType::Simplex) {
+        if constexpr (Gradient) {
+          return snoiseGrad(px, py, dx, dy);
+        } else {
+          return snoise(px, py);
+        }
+      } else {
+        V s;
+        if constexpr (Gradient) {
+          s = snoiseGrad(px, py, dx, dy);
+        } else {
+          s = snoise(px, py);
+        }
+
+        if constexpr (Type == OctaveType::Ridged) {
+          // (1 - |s|)^2, sharp creases where the simplex noise crosses 0
+          V r = V(1.0f) - vabs(s);
+          if constexpr (Gradient) {
+            V chain = V(-2.0f) * r * vselect(vgreater(s, V(0.0f)), V(1.0f), V(-1.0f));
+            dx = chain * dx;
+            dy = chain * dy;
+          }
+          return r * r;
+        } else {
+          // 2 |s| - 1, rounded hills with creases in the valleys
+          if constexpr (Gradient) {
+            V chain = vselect(vgreater(s, V(0.0f)), V(2.0f), V(-2.0f));
+            dx = chain * dx;
+            dy = chain * dy;
+          }
+          return V(2.0f) * vabs(s) - V(1.0f);
+        }
+      }
+    }
+
+    template <int Octaves, OctaveType Base, OctaveType Detail, bool Warp> struct Fbm {
+      template <bool Gradient, typename V>
+      static V height(const TerrainNoise& noise, V x, V z, V* out_dx, V* out_dz) {
+        V px = x;
+        V pz = z;
+        // Jacobian of the warp
+        V j_xx = V(1.0f), j_xz = V(0.0f), j_zx = V(0.0f), j_zz = V(1.0f);
+
+        if constexpr (Warp) {
+          // Offsets of up to warp_strength meters, from simplex noise at an eighth of the
+          // frequency of the first octave
+          float k = noise.frequency / 1600.0f;
+          V strength = V(noise.warp_strength);
+          V ux = x * V(k) + V(17.0f);
+          V uz = z * V(k) + V(43.0f);
+          V vx = x * V(k) + V(-31.0f);
+          V vz = z * V(k) + V(7.0f);
+
+          V a, b;
+          if constexpr (Gradient) {
+            V a_x, a_z, b_x, b_z;
+            a = kernel::snoiseGrad(ux, uz, a_x, a_z);
+            b = kernel::snoiseGrad(vx, vz, b_x, b_z);
+            V chain = strength * V(k);
+            j_xx = V(1.0f) + chain * a_x;
+            j_xz = chain * a_z;
+            j_zx = chain * b_x;
+            j_zz = V(1.0f) + chain * b_z;
+          } else {
+            a = kernel::snoise(ux, uz);
+            b = kernel::snoise(vx, vz);
+          }
+          px = x + strength * a;
+          pz = z + strength * b;
+        }
+
+        V value = V(0.0f);
+        V gradient_x = V(0.0f);
+        V gradient_z = V(0.0f);
+        octaves<0, Gradient>(noise, px, pz, noise.frequency, noise.amplitude, value, gradient_x,
+                             gradient_z);
+
+        if constexpr (Gradient) {
+          // Chain rule through the warp, the transposed Jacobian times the gradient
+          *out_dx = gradient_x * j_xx + gradient_z * j_zx;
+          *out_dz = gradient_x * j_xz + gradient_z * j_zz;
+        }
+        return value;
+      }
+
+      template <int I, bool Gradient, typename V>
+      static inline void octaves(const TerrainNoise& noise, V x, V z, float frequency,
+                                 float amplitude, V& value, V& gradient_x, V& gradient_z) {
+        if constexpr (I < Octaves) {
+          constexpr OctaveType type = I == 0 ? Base : Detail;
+          constexpr float scale = I == 0 ? 200.0f : (I == 1 ? 400.0f : 800.0f);
+          constexpr float normalization = I == 0 ? 1.0f : (I == 1 ? 1.5f : 2.0f);
+
+          V px = x * V(frequency) / V(scale);
+          V pz = z * V(frequency) / V(scale);
+          if constexpr (I >= 2) {
+            px = px + V(1231.0f);
+            pz = pz + V(721.0f);
+          }
+
+          V dx, dz;
+          V n = octave<type, Gradient>(px, pz, dx, dz);
+          if constexpr (I != 0) {
+            n = n / V(normalization);
+          }
+
+          value = value + n * V(amplitude);
+          if constexpr (Gradient) {
+            V chain = V(frequency / scale / normalization);
+            gradient_x = gradient_x + dx * chain * V(amplitude);
+            gradient_z = gradient_z + dz * chain * V(amplitude);
+          }
+
+          octaves<I + 1, Gradient>(noise, x, z, frequency * noise.lacunarity,
+                                   amplitude * noise.persistence, value, gradient_x, gradient_z);
+        }
+      }
+    };
+
+    template <bool Gradient, typename V>
+    using HeightFunction = V (*)(const TerrainNoise& noise, V x, V z, V* out_dx, V* out_dz);
+
+    template <TerrainStyle Style, bool Gradient, typename V, int... Octaves>
+    constexpr std::array<HeightFunction<Gradient, V>, sizeof...(Octaves)> octaveTable(
+        std::integer_sequence<int, Octaves...>) {
+      constexpr Recipe recipe = recipeFor(Style);
+      return {{&Fbm<Octaves, recipe.base, recipe.detail, recipe.warp>::template height<Gradient,
+                                                                                       V>...}};
+    }
+
+    /**
+     * The instantiation for the style and octave count of `noise`.
+     */
+    template <bool Gradient, typename V>
+    HeightFunction<Gradient, V> heightFunction(const TerrainNoise& noise) {
+      using Octaves = std::make_integer_sequence<int, MAX_OCTAVES + 1>;
+      static constexpr std::array<std::array<HeightFunction<Gradient, V>, MAX_OCTAVES + 1>,
+                                  (int)TerrainStyle::Count>
+          table = {{
+              octaveTable<TerrainStyle::Classic, Gradient, V>(Octaves()),
+              octaveTable<TerrainStyle::Ridged, Gradient, V>(Octaves()),
+              octaveTable<TerrainStyle::Billow, Gradient, V>(Octaves()),
+              octaveTable<TerrainStyle::Warped, Gradient, V>(Octaves()),
+          }};
+
+      int style = (int)noise.style;
+      style = style >= 0 && style < (int)TerrainStyle::Count ? style : 0;
+      int octaves = noise.num_octaves < 0 ? 0 : noise.num_octaves;
+      octaves = octaves > MAX_OCTAVES ? MAX_OCTAVES : octaves;
+      return table[style][octaves];
+    }
+
+    template <typename V> V terrainHeight(const TerrainNoise& noise, V x, V z) {
+      return heightFunction<false, V>(noise)(noise, x, z, nullptr, nullptr);
+    }
+  }  // namespace fbm
+}  // namespace noise
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <array>
+#include <glm/glm.hpp>
+
+#include "core.h"
+
+struct Aabb {
+  glm::vec3 min;
+  glm::vec3 max;
+};
+
+/**
+ * The six clip planes of a projection * view matrix, perspective or orthographic, with the
+ * normals pointing inside. Extracted from the rows of the matrix (Gribb & Hartmann), so a point p
+ * is inside plane i when dot(planes[i], vec4(p, 1)) >= 0.
+ */
+struct Frustum {
+  std::array<glm::vec4, 6> planes;
+
+  static Frustum fromMatrix(const glm::mat4& m) {
+    auto row = [&](int i) { return glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]); };
+
+    Frustum frustum;
+    frustum.planes = {
+        row(3) + row(0),  // left
+        row(3) - row(0),  // right
+        row(3) + row(1),  // bottom
+        row(3) - row(1),  // top
+        row(3) + row(2),  // near
+        row(3) - row(2),  // far
+    };
+    for (auto& plane : frustum.planes) {
+      plane = plane / glm::length(glm::vec3(plane));
+    }
+    return frustum;
+  }
+
+  /**
+   * False when the box is entirely outside of one of the planes. Conservative: a box near a corner
+   * of the frustum may be outside and still pass.
+   */
+  bool intersects(const Aabb& box) const {
+    for (const auto& plane : this->planes) {
+      // The corner furthest along the normal
+      glm::vec3 p(plane.x >= 0.0f ? box.max.x : box.min.x, plane.y >= 0.0f ? box.max.y : box.min.y,
+                  plane.z >= 0.0f ? box.max.z : box.min.z);
+      if (glm::dot(glm::vec3(plane), p) + plane.w < 0.0f) {
+        return false;
+      }
+    }
+    return true;
+  }
+};
+
+// Chunks submitted and culled in one render pass
+struct CullStats {
+  usize visible = 0;
+  usize culled = 0;
+};
@@ -569,6 +569,9 @@ namespace gpu {
   void setUniformSlow(GLuint shaderProgram, const char* name, const glm::ivec2& value) {
     glUniform2i(glGetUniformLocation(shaderProgram, name), value.x, value.y);
   }
+  void setUniformSlow(GLuint shaderProgram, const char* name, const glm::vec2& value) {
+    glUniform2fv(glGetUniformLocation(shaderProgram, name), 1, &value.x);
+  }
 
   size_t createSubdividedPlane(float _size, unsigned int subdivisions, GLuint* out_vao,
                                GLuint* out_vbo, GLuint* out_texcoord_bo, GLuint* out_ebo) {
@@ -125,6 +125,7 @@ namespace gpu {
   void setUniformSlow(GLuint shaderProgram, const char* name, const uint32_t nof_values,
                       const glm::vec3* values);
   void setUniformSlow(GLuint shaderProgram, const char* name, const glm::ivec2& value);
+  void setUniformSlow(GLuint shaderProgram, const char* name, const glm::vec2& value);
 
   size_t createSubdividedPlane(float size, unsigned int subdivisions, GLuint* out_vao,
                                GLuint* out_position_bo, GLuint* out_texcoord_bo, GLuint* out_ebo);
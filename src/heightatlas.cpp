@@ -0,0 +1,332 @@
+#include "heightatlas.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+
+#include "gpu.h"
+#include "shader.h"
+
+void HeightAtlas::deinit() {
+  glDeleteProgram(this->program);
+  glDeleteProgram(this->surface_program);
+  std::array<GLuint*, 5> textures = {&this->heights_texture, &this->gradients_texture,
+                                     &this->normals_texture, &this->splats_texture,
+                                     &this->macro_texture};
+  for (GLuint* texture : textures) {
+    glDeleteTextures(1, texture);
+    *texture = 0;
+  }
+  this->built_capacity = 0;
+}
+
+void HeightAtlas::loadShader(bool is_reload, const std::string& defines) {
+  std::array<ShaderInput, 1> program_shaders({
+      ShaderInput{"resources/shaders/height_atlas.comp", GL_COMPUTE_SHADER},
+  });
+
+  auto program = loadShaderProgram(program_shaders, is_reload, defines);
+  if (program != 0) {
+    if (this->program != 0) {
+      glDeleteProgram(this->program);
+    }
+    this->program = program;
+  }
+
+  std::array<ShaderInput, 1> surface_shaders({
+      ShaderInput{"resources/shaders/height_atlas_surface.comp", GL_COMPUTE_SHADER},
+  });
+
+  auto surface_program = loadShaderProgram(surface_shaders, is_reload, defines);
+  if (surface_program != 0) {
+    if (this->surface_program != 0) {
+      glDeleteProgram(this->surface_program);
+    }
+    this->surface_program = surface_program;
+  }
+
+  // Baked with the previous specialisation
+  this->noise_hash = 0;
+}
+
+void HeightAtlas::createTextures() {
+  std::array<std::pair<GLuint*, GLenum>, 5> textures = {{
+      {&this->heights_texture, GL_R32F},
+      {&this->gradients_texture, GL_RG16F},
+      {&this->normals_texture, GL_RGBA8_SNORM},
+      {&this->splats_texture, GL_RGBA8},
+      {&this->macro_texture, GL_RGBA8},
+  }};
+
+  int texels = this->page_resolution + 1;
+  for (auto [texture, format] : textures) {
+    glDeleteTextures(1, texture);
+    glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, texture);
+    glTextureStorage3D(*texture, 1, format, texels, texels, this->page_capacity);
+  }
+
+  for (auto [texture_ptr, format] : textures) {
+    GLuint texture = *texture_ptr;
+    glTextureParameteri(texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  }
+  CHECK_GL_ERROR();
+
+  this->built_resolution = this->page_resolution;
+  this->built_capacity = this->page_capacity;
+  this->pages.assign(this->page_capacity, Page{});
+  this->clear();
+}
+
+void HeightAtlas::clear() {
+  this->layers.clear();
+  this->free_layers.clear();
+  for (int layer = this->built_capacity - 1; layer >= 0; layer--) {
+    this->pages[layer].used = false;
+    this->free_layers.push_back(layer);
+  }
+}
+
+int HeightAtlas::allocateLayer() {
+  if (!this->free_layers.empty()) {
+    int layer = this->free_layers.back();
+    this->free_layers.pop_back();
+    return layer;
+  }
+
+  // Evict the least recently used page that no chunk of this frame refers to
+  int oldest = -1;
+  for (int layer = 0; layer < this->built_capacity; layer++) {
+    const auto& page = this->pages[layer];
+    if (page.last_used < this->frame
+        && (oldest < 0 || page.last_used < this->pages[oldest].last_used)) {
+      oldest = layer;
+    }
+  }
+  if (oldest >= 0) {
+    this->layers.erase(this->pages[oldest].key);
+  }
+  return oldest;
+}
+
+void HeightAtlas::update(const TerrainNoise& noise, const SurfaceParameters& surface,
+                         Cdlod& cdlod) {
+  this->page_resolution = glm::clamp(this->page_resolution, 8, 512);
+  this->page_capacity = glm::clamp(this->page_capacity, 1, 2048);
+  if (this->page_resolution != this->built_resolution
+      || this->page_capacity != this->built_capacity) {
+    this->createTextures();
+  }
+
+  u64 hash = noise::hash(noise);
+  if (hash != this->noise_hash || cdlod.chunk_size != this->built_chunk_size) {
+    this->clear();
+    this->noise_hash = hash;
+    this->built_chunk_size = cdlod.chunk_size;
+  }
+
+  this->frame += 1;
+  this->chunks_without_page = 0;
+  std::vector<int> bake_layers;
+  for (int bucket = 0; bucket < Cdlod::BUCKET_COUNT; bucket++) {
+    for (auto& chunk : cdlod.chunks(bucket)) {
+      chunk.atlas_layer = -1.0f;
+      if (!this->enabled) {
+        continue;
+      }
+
+      PageKey key = {i32(glm::floor(chunk.origin.x / chunk.size + 0.5f)),
+                     i32(glm::floor(chunk.origin.y / chunk.size + 0.5f)), i32(chunk.lod)};
+      auto it = this->layers.find(key);
+      int layer = it != this->layers.end() ? it->second : -1;
+      if (layer < 0 && int(bake_layers.size()) < this->max_bakes_per_frame) {
+        layer = this->allocateLayer();
+        if (layer >= 0) {
+          this->pages[layer] = {key, chunk.origin, chunk.size, this->frame, true};
+          this->layers[key] = layer;
+          bake_layers.push_back(layer);
+        }
+      }
+
+      if (layer < 0) {
+        this->chunks_without_page += 1;
+        continue;
+      }
+      this->pages[layer].last_used = this->frame;
+      chunk.atlas_layer = float(layer);
+    }
+  }
+
+  this->bake(noise, bake_layers);
+  this->baked_this_frame = bake_layers.size();
+  this->baked_total += bake_layers.size();
+  this->pages_in_use = this->layers.size();
+
+  // The heights of the other pages are still valid, only their surface attributes need redoing
+  std::vector<int> surface_layers;
+  if (surface == this->built_surface) {
+    surface_layers = std::move(bake_layers);
+  } else {
+    for (const auto& [key, layer] : this->layers) {
+      surface_layers.push_back(layer);
+    }
+    this->built_surface = surface;
+  }
+  this->bakeSurface(surface, surface_layers);
+  this->surfaces_baked_this_frame = surface_layers.size();
+  this->surfaces_baked_total += surface_layers.size();
+}
+
+void HeightAtlas::dispatchPages(GLuint program, const std::vector<int>& bake_layers) {
+  GLuint groups = (this->built_resolution + 1 + 7) / 8;
+  GLint pages_location = glGetUniformLocation(program, "pages");
+  for (usize first = 0; first < bake_layers.size(); first += MAX_PAGES_PER_DISPATCH) {
+    usize count = std::min(bake_layers.size() - first, usize(MAX_PAGES_PER_DISPATCH));
+    std::vector<glm::vec4> jobs(count);
+    for (usize i = 0; i < count; i++) {
+      const auto& page = this->pages[bake_layers[first + i]];
+      jobs[i] = glm::vec4(page.origin, page.size, float(bake_layers[first + i]));
+    }
+    glUniform4fv(pages_location, GLsizei(count), &jobs[0].x);
+    glDispatchCompute(groups, groups, GLuint(count));
+  }
+}
+
+void HeightAtlas::bake(const TerrainNoise& noise, const std::vector<int>& bake_layers) {
+  if (bake_layers.empty() || this->program == 0) {
+    return;
+  }
+
+  glUseProgram(this->program);
+  gpu::setUniformSlow(this->program, "noise.num_octaves", (GLint)noise.num_octaves);
+  gpu::setUniformSlow(this->program, "noise.amplitude", noise.amplitude);
+  gpu::setUniformSlow(this->program, "noise.frequency", noise.frequency);
+  gpu::setUniformSlow(this->program, "noise.persistence", noise.persistence);
+  gpu::setUniformSlow(this->program, "noise.lacunarity", noise.lacunarity);
+  gpu::setUniformSlow(this->program, "noise.warp_strength", noise.warp_strength);
+  gpu::setUniformSlow(this->program, "pageResolution", (GLint)this->built_resolution);
+
+  glBindImageTexture(0, this->heights_texture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_R32F);
+  glBindImageTexture(1, this->gradients_texture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RG16F);
+  this->dispatchPages(this->program, bake_layers);
+
+  // Read by the surface pass as images, by terrain.tes as textures
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT
+                  | GL_TEXTURE_UPDATE_BARRIER_BIT);
+  glUseProgram(0);
+  CHECK_GL_ERROR();
+}
+
+void HeightAtlas::bakeSurface(const SurfaceParameters& surface,
+                              const std::vector<int>& bake_layers) {
+  if (bake_layers.empty() || this->surface_program == 0) {
+    return;
+  }
+
+  glUseProgram(this->surface_program);
+  gpu::setUniformSlow(this->surface_program, "pageResolution", (GLint)this->built_resolution);
+  glUniform1fv(glGetUniformLocation(this->surface_program, "texture_start_heights"),
+               surface.start_heights.size(), surface.start_heights.data());
+  glUniform1fv(glGetUniformLocation(this->surface_program, "texture_blends"),
+               surface.blends.size(), surface.blends.data());
+  glUniform1fv(glGetUniformLocation(this->surface_program, "texture_sizes"),
+               surface.texture_sizes.size(), surface.texture_sizes.data());
+
+  // Same units as in terrain.frag
+  glBindTextureUnit(0, surface.albedos);
+  glBindTextureUnit(3, surface.roughness);
+  glBindTextureUnit(4, surface.ambient_occlusions);
+
+  glBindImageTexture(0, this->heights_texture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_R32F);
+  glBindImageTexture(1, this->gradients_texture, 0, GL_TRUE, 0, GL_READ_ONLY, GL_RG16F);
+  glBindImageTexture(2, this->normals_texture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA8_SNORM);
+  glBindImageTexture(3, this->splats_texture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA8);
+  glBindImageTexture(4, this->macro_texture, 0, GL_TRUE, 0, GL_WRITE_ONLY, GL_RGBA8);
+  this->dispatchPages(this->surface_program, bake_layers);
+
+  glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+  glUseProgram(0);
+  CHECK_GL_ERROR();
+}
+
+void HeightAtlas::setUniforms(GLuint program) const {
+  glBindTextureUnit(HEIGHTS_TEXTURE_UNIT, this->heights_texture);
+  glBindTextureUnit(GRADIENTS_TEXTURE_UNIT, this->gradients_texture);
+  glBindTextureUnit(NORMALS_TEXTURE_UNIT, this->normals_texture);
+  glBindTextureUnit(SPLATS_TEXTURE_UNIT, this->splats_texture);
+  glBindTextureUnit(MACRO_TEXTURE_UNIT, this->macro_texture);
+  gpu::setUniformSlow(program, "atlasPageResolution", (GLint)this->built_resolution);
+}
+
+void HeightAtlas::validate(const TerrainNoise& noise) {
+  int texels = this->built_resolution + 1;
+  usize texel_count = usize(texels) * texels;
+  std::vector<float> gpu_heights(texel_count);
+  std::vector<glm::vec2> gpu_gradients(texel_count);
+  std::vector<glm::vec2> positions(texel_count);
+  std::vector<float> cpu_heights(texel_count);
+  std::vector<glm::vec2> cpu_gradients(texel_count);
+
+  this->validated_pages = 0;
+  this->max_height_error = 0.0f;
+  this->max_gradient_error = 0.0f;
+  double error_sum = 0.0;
+  for (const auto& [key, layer] : this->layers) {
+    const auto& page = this->pages[layer];
+    glGetTextureSubImage(this->heights_texture, 0, 0, 0, layer, texels, texels, 1, GL_RED,
+                         GL_FLOAT, GLsizei(texel_count * sizeof(float)), gpu_heights.data());
+    glGetTextureSubImage(this->gradients_texture, 0, 0, 0, layer, texels, texels, 1, GL_RG,
+                         GL_FLOAT, GLsizei(texel_count * sizeof(glm::vec2)),
+                         gpu_gradients.data());
+
+    for (int z = 0; z < texels; z++) {
+      for (int x = 0; x < texels; x++) {
+        positions[z * texels + x]
+            = page.origin + glm::vec2(x, z) * (page.size / this->built_resolution);
+      }
+    }
+    noise::terrainGradients(noise, positions.data(), cpu_heights.data(), cpu_gradients.data(),
+                            texel_count);
+
+    for (usize i = 0; i < texel_count; i++) {
+      float error = glm::abs(gpu_heights[i] - cpu_heights[i]);
+      glm::vec2 gradient_error = glm::abs(gpu_gradients[i] - cpu_gradients[i]);
+      this->max_height_error = glm::max(this->max_height_error, error);
+      this->max_gradient_error
+          = glm::max(this->max_gradient_error, glm::max(gradient_error.x, gradient_error.y));
+      error_sum += error;
+    }
+    this->validated_pages += 1;
+  }
+  CHECK_GL_ERROR();
+
+  usize total = this->validated_pages * texel_count;
+  this->mean_height_error = total > 0 ? float(error_sum / total) : 0.0f;
+}
+
+void HeightAtlas::gui(const TerrainNoise& noise) {
+  ImGui::Checkbox("Height atlas", &this->enabled);
+  ImGui::SliderInt("Page resolution", &this->page_resolution, 16, 256);
+  ImGui::SliderInt("Page capacity", &this->page_capacity, 64, 2048);
+  ImGui::SliderInt("Bakes per frame", &this->max_bakes_per_frame, 1, 256);
+
+  ImGui::Text("Pages: %zu / %d, chunks without a page: %zu", this->pages_in_use,
+              this->built_capacity, this->chunks_without_page);
+  ImGui::Text("Baked: %zu this frame, %llu total", this->baked_this_frame,
+              (unsigned long long)this->baked_total);
+  ImGui::Text("Surfaces baked: %zu this frame, %llu total", this->surfaces_baked_this_frame,
+              (unsigned long long)this->surfaces_baked_total);
+
+  if (ImGui::Button("Validate atlas")) {
+    this->validate(noise);
+  }
+  if (this->validated_pages > 0) {
+    ImGui::Text("%zu pages: max height error %.3f m (%.1e of the amplitude), mean %.4f m",
+                this->validated_pages, this->max_height_error,
+                this->max_height_error / glm::max(noise.amplitude, 1e-6f),
+                this->mean_height_error);
+    ImGui::Text("Max gradient error %.4f", this->max_gradient_error);
+  }
+}
@@ -0,0 +1,156 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <array>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "cdlod.h"
+#include "core.h"
+#include "noise.h"
+
+// Inputs of the splat weights and the macro colour besides height and slope, see
+// terrain_blending.glsl and height_atlas_surface.comp
+struct SurfaceParameters {
+  std::array<float, 4> start_heights;
+  std::array<float, 4> blends;
+  std::array<float, 4> texture_sizes;
+  GLuint albedos;
+  GLuint roughness;
+  GLuint ambient_occlusions;
+
+  bool operator==(const SurfaceParameters& other) const {
+    return start_heights == other.start_heights && blends == other.blends
+           && texture_sizes == other.texture_sizes && albedos == other.albedos
+           && roughness == other.roughness && ambient_occlusions == other.ambient_occlusions;
+  }
+};
+
+/**
+ * Heights and gradients of the selected CDLOD chunks baked on the GPU, so terrain.tes does one
+ * bilinear fetch of each instead of the full octave loop per tessellated vertex.
+ *
+ * Every quadtree node that has a chunk selected gets a page, (page_resolution + 1)^2 texels
+ * covering the node corner to corner, in one layer of an R32F height and an RG16F gradient
+ * texture array. height_atlas.comp evaluates terrain_height_grad() once per texel for up to
+ * max_bakes_per_frame new pages per frame. Pages are only baked again when the noise changes,
+ * pages of nodes that left the selection are reused least recently used first. Chunks without a
+ * page yet get layer -1 and terrain.tes falls back to evaluating the noise. Vertices on the border
+ * of the drawn chunk, the quadrant of a partially drawn node, evaluate the noise as well: the
+ * neighbouring chunk may have a page of another resolution or none and bilinear heights would
+ * leave cracks along the border.
+ *
+ * height_atlas_surface.comp derives the normal, splat weights and a macro albedo, roughness and
+ * AO of each page from its heights into three more arrays for terrain.frag. New
+ * pages get both passes, a change of the surface parameters only reruns the cheap second pass
+ * over the resident pages.
+ */
+class HeightAtlas {
+public:
+  // Pages baked by a single dispatch, see height_atlas.comp
+  static constexpr int MAX_PAGES_PER_DISPATCH = 64;
+  static constexpr int HEIGHTS_TEXTURE_UNIT = 12;
+  static constexpr int GRADIENTS_TEXTURE_UNIT = 13;
+  static constexpr int NORMALS_TEXTURE_UNIT = 14;
+  static constexpr int SPLATS_TEXTURE_UNIT = 15;
+  static constexpr int MACRO_TEXTURE_UNIT = 16;
+
+  bool enabled = true;
+  // Quads per page side, the pages have one more texel per side
+  int page_resolution = 128;
+  int page_capacity = 512;
+  int max_bakes_per_frame = 64;
+
+  void deinit();
+
+  // Compiled with the defines of the terrain programs, see noise::shaderDefines()
+  void loadShader(bool is_reload, const std::string& defines);
+
+  /**
+   * Look up or bake the pages of the selected chunks and store their layers in the chunks. Call
+   * once per frame after Cdlod::select().
+   */
+  void update(const TerrainNoise& noise, const SurfaceParameters& surface, Cdlod& cdlod);
+
+  void setUniforms(GLuint program) const;
+
+  /**
+   * Read the baked pages back and compare them with the CPU evaluation of the same texels.
+   */
+  void validate(const TerrainNoise& noise);
+
+  // Selected chunks that got layer -1 in the last update()
+  usize chunksWithoutPage() const { return this->chunks_without_page; }
+
+  void gui(const TerrainNoise& noise);
+
+private:
+  struct PageKey {
+    i32 x;  // origin / size
+    i32 z;
+    i32 lod;
+
+    bool operator==(const PageKey& other) const {
+      return x == other.x && z == other.z && lod == other.lod;
+    }
+  };
+
+  struct PageKeyHash {
+    usize operator()(const PageKey& key) const {
+      u64 h = 14695981039346656037ull;
+      h = (h ^ u64(u32(key.lod))) * 1099511628211ull;
+      h = (h ^ u64(u32(key.x))) * 1099511628211ull;
+      h = (h ^ u64(u32(key.z))) * 1099511628211ull;
+      return usize(h);
+    }
+  };
+
+  struct Page {
+    PageKey key;
+    glm::vec2 origin;
+    float size;
+    u64 last_used;
+    bool used = false;
+  };
+
+  GLuint program = 0;
+  GLuint surface_program = 0;
+  GLuint heights_texture = 0;
+  GLuint gradients_texture = 0;
+  GLuint normals_texture = 0;
+  GLuint splats_texture = 0;
+  GLuint macro_texture = 0;
+  int built_resolution = 0;
+  int built_capacity = 0;
+  float built_chunk_size = 0.0f;
+  u64 noise_hash = 0;
+  SurfaceParameters built_surface = {};
+
+  // Indexed by layer
+  std::vector<Page> pages;
+  std::unordered_map<PageKey, int, PageKeyHash> layers;
+  std::vector<int> free_layers;
+  u64 frame = 0;
+
+  usize pages_in_use = 0;
+  usize chunks_without_page = 0;
+  usize baked_this_frame = 0;
+  u64 baked_total = 0;
+  usize surfaces_baked_this_frame = 0;
+  u64 surfaces_baked_total = 0;
+
+  // Result of the last validate()
+  usize validated_pages = 0;
+  float max_height_error = 0.0f;
+  float mean_height_error = 0.0f;
+  float max_gradient_error = 0.0f;
+
+  void createTextures();
+  void clear();
+  int allocateLayer();
+  void dispatchPages(GLuint program, const std::vector<int>& bake_layers);
+  void bake(const TerrainNoise& noise, const std::vector<int>& bake_layers);
+  void bakeSurface(const SurfaceParameters& surface, const std::vector<int>& bake_layers);
+};
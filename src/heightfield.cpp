@@ -4,10 +4,16 @@
 #include <stb_image.h>
 #include <stdint.h>
 
+#include <cfloat>
+#include <filesystem>
 #include <glm/glm.hpp>
 #include <iostream>
+#include <unordered_map>
 #include <vector>
 
+#include "jobs.h"
+#include "tilefile.h"
+
 using namespace glm;
 using std::string;
 
@@ -18,15 +24,26 @@ HeightField::HeightField(void)
       m_uvBuffer(UINT32_MAX),
       m_indexBuffer(UINT32_MAX),
       m_numIndices(0),
+      m_indexType(GL_UNSIGNED_INT),
       m_texid_hf(UINT32_MAX),
       m_texid_diffuse(UINT32_MAX),
       m_heightFieldPath(""),
-      m_diffuseTexturePath("") {}
+      m_diffuseTexturePath(""),
+      m_heightsInMeters(false),
+      m_extent(0.0f) {}
 
 void HeightField::loadHeightField(const std::string& heigtFieldPath) {
+  if (std::filesystem::path(heigtFieldPath).extension() == ".tiles") {
+    loadTileFile(heigtFieldPath);
+    return;
+  }
+
   int width, height, components;
   stbi_set_flip_vertically_on_load(true);
+  // 8 and 16 bit images hold linear heights, not gamma encoded colors
+  stbi_ldr_to_hdr_gamma(1.0f);
   float* data = stbi_loadf(heigtFieldPath.c_str(), &width, &height, &components, 1);
+  stbi_ldr_to_hdr_gamma(2.2f);
   if (data == nullptr) {
     std::cout << "Failed to load image: " << heigtFieldPath << ".\n";
     return;
@@ -43,11 +60,76 @@ void HeightField::loadHeightField(const std::string& heigtFieldPath) {
 
   glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, width, height, 0, GL_RED, GL_FLOAT,
                data);  // just one component (float)
+  stbi_image_free(data);
 
   m_heightFieldPath = heigtFieldPath;
+  m_heightsInMeters = false;
+  m_extent = 0.0f;
   std::cout << "Successfully loaded heigh field texture: " << heigtFieldPath << ".\n";
 }
 
+void HeightField::loadTileFile(const std::string& tileFilePath, int maxSize) {
+  auto file = TileFile::openImported(tileFilePath);
+  if (file == nullptr) {
+    std::cout << "Failed to load tile file: " << tileFilePath << ".\n";
+    return;
+  }
+
+  // Tiles per side of each LOD, the coarsest one is a single tile
+  std::vector<ivec2> tiles;
+  float lowest = FLT_MAX;
+  for (const auto& entry : file->entries()) {
+    if (entry.lod >= int(tiles.size())) {
+      tiles.resize(entry.lod + 1, ivec2(0));
+    }
+    tiles[entry.lod] = max(tiles[entry.lod], ivec2(entry.x, entry.z) + 1);
+    lowest = min(lowest, entry.min_height);
+  }
+  int lod = 0;
+  while (lod + 1 < int(tiles.size()) && max(tiles[lod].x, tiles[lod].y) * TILE_SIZE > maxSize) {
+    lod++;
+  }
+
+  // A square texture, top DEM row last like a flipped image, padded with the lowest height
+  int count = max(tiles[lod].x, tiles[lod].y);
+  int size = count * TILE_SIZE;
+  std::vector<float> texels(size_t(size) * size, lowest);
+  u64 noise_hash = file->header().noise_hash;
+  JobSystem::instance()->parallelFor(
+      size_t(count) * count, 1, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+          int tile_x = int(i % count);
+          int tile_z = int(i / count);
+          auto tile = file->mapTile(TileKey{noise_hash, lod, tile_x, tile_z});
+          if (tile == nullptr) {
+            continue;
+          }
+          for (int z = 0; z < TILE_SIZE; z++) {
+            float* row = &texels[size_t(size - 1 - (tile_z * TILE_SIZE + z)) * size];
+            for (int x = 0; x < TILE_SIZE; x++) {
+              row[tile_x * TILE_SIZE + x] = tile->at(x, z);
+            }
+          }
+        }
+      });
+
+  if (m_texid_hf == UINT32_MAX) {
+    glGenTextures(1, &m_texid_hf);
+  }
+  glBindTexture(GL_TEXTURE_2D, m_texid_hf);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, size, size, 0, GL_RED, GL_FLOAT, texels.data());
+
+  m_heightFieldPath = tileFilePath;
+  m_heightsInMeters = true;
+  m_extent = size * file->header().base_texel_size * float(1 << lod);
+  std::cout << "Successfully loaded tile file: " << tileFilePath << ", LOD " << lod << ", " << size
+            << " x " << size << " texels.\n";
+}
+
 void HeightField::loadDiffuseTexture(const std::string& diffusePath) {
   int width, height, components;
   stbi_set_flip_vertically_on_load(true);
@@ -70,13 +152,131 @@ void HeightField::loadDiffuseTexture(const std::string& diffusePath) {
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE,
                data);  // plain RGB
   glGenerateMipmap(GL_TEXTURE_2D);
+  stbi_image_free(data);
 
   std::cout << "Successfully loaded diffuse texture: " << diffusePath << ".\n";
 }
 
+namespace {
+  // Quads per band. A strip row references 2 * (BAND + 1) vertices and the next row reuses the
+  // lower half of them, so a 32 entry post-transform cache misses ~0.54 times per triangle
+  // instead of ~1.06 for strips over whole rows
+  const int BAND = 14;
+
+  struct SharedIndices {
+    GLuint buffer;
+    GLenum type;
+    GLuint count;
+  };
+  std::unordered_map<int, SharedIndices> shared_indices;
+}  // namespace
+
+std::vector<uint32_t> HeightField::stripIndices(int resolution) {
+  const uint32_t restart = UINT32_MAX;
+  const uint32_t row_length = resolution + 1;
+  std::vector<uint32_t> indices;
+  int bands = (resolution + BAND - 1) / BAND;
+  indices.reserve(size_t(resolution) * (2 * (resolution + bands) + 1));
+
+  for (int band = 0; band < resolution; band += BAND) {
+    int end = min(band + BAND, resolution);
+    for (int z = 0; z < resolution; z++) {
+      // Counter clockwise seen from above
+      for (int x = band; x <= end; x++) {
+        indices.push_back(z * row_length + x);
+        indices.push_back((z + 1) * row_length + x);
+      }
+      indices.push_back(restart);
+    }
+  }
+  indices.pop_back();
+
+  return indices;
+}
+
+GLuint HeightField::sharedIndexBuffer(int resolution, GLenum* out_type, GLuint* out_count) {
+  auto it = shared_indices.find(resolution);
+  if (it == shared_indices.end()) {
+    std::vector<uint32_t> indices = stripIndices(resolution);
+
+    SharedIndices shared;
+    shared.count = GLuint(indices.size());
+    glGenBuffers(1, &shared.buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, shared.buffer);
+
+    // 0xffff is the restart index of 16 bit indices, so the last vertex has to stay below it
+    size_t vertex_count = size_t(resolution + 1) * (resolution + 1);
+    if (vertex_count < UINT16_MAX) {
+      std::vector<uint16_t> short_indices(indices.begin(), indices.end());
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER, short_indices.size() * sizeof(uint16_t),
+                   short_indices.data(), GL_STATIC_DRAW);
+      shared.type = GL_UNSIGNED_SHORT;
+    } else {
+      glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint32_t), indices.data(),
+                   GL_STATIC_DRAW);
+      shared.type = GL_UNSIGNED_INT;
+    }
+    it = shared_indices.emplace(resolution, shared).first;
+  }
+
+  *out_type = it->second.type;
+  *out_count = it->second.count;
+  return it->second.buffer;
+}
+
+void HeightField::deleteSharedIndexBuffers(void) {
+  for (auto& [resolution, shared] : shared_indices) {
+    glDeleteBuffers(1, &shared.buffer);
+  }
+  shared_indices.clear();
+}
+
 void HeightField::generateMesh(int tesselation) {
   // generate a mesh in range -1 to 1 in x and z
   // (y is 0 but will be altered in height field vertex shader)
+  if (tesselation < 1) {
+    std::cout << "Invalid height field tesselation: " << tesselation << ".\n";
+    return;
+  }
+  m_meshResolution = tesselation;
+
+  const int row_length = tesselation + 1;
+  std::vector<vec3> positions(size_t(row_length) * row_length);
+  std::vector<vec2> uvs(positions.size());
+
+  // Whole rows per job, 64k vertices each
+  JobSystem::instance()->parallelFor(
+      row_length, max(65536 / row_length, 1), [&](size_t begin, size_t end) {
+        for (size_t z = begin; z < end; z++) {
+          for (int x = 0; x < row_length; x++) {
+            vec2 uv = vec2(x, z) / float(tesselation);
+            positions[z * row_length + x] = vec3(uv.x * 2.0f - 1.0f, 0.0f, uv.y * 2.0f - 1.0f);
+            uvs[z * row_length + x] = uv;
+          }
+        }
+      });
+
+  if (m_vao == UINT32_MAX) {
+    glGenVertexArrays(1, &m_vao);
+    glGenBuffers(1, &m_positionBuffer);
+    glGenBuffers(1, &m_uvBuffer);
+  }
+  glBindVertexArray(m_vao);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_positionBuffer);
+  glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(vec3), positions.data(),
+               GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 3, GL_FLOAT, false, 0, 0);
+  glEnableVertexAttribArray(0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_uvBuffer);
+  glBufferData(GL_ARRAY_BUFFER, uvs.size() * sizeof(vec2), uvs.data(), GL_STATIC_DRAW);
+  glVertexAttribPointer(2, 2, GL_FLOAT, false, 0, 0);
+  glEnableVertexAttribArray(2);
+
+  m_indexBuffer = sharedIndexBuffer(tesselation, &m_indexType, &m_numIndices);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_indexBuffer);
+  glBindVertexArray(0);
 }
 
 void HeightField::submitTriangles(void) {
@@ -84,4 +284,29 @@ void HeightField::submitTriangles(void) {
     std::cout << "No vertex array is generated, cannot draw anything.\n";
     return;
   }
+
+  glBindVertexArray(m_vao);
+  glEnable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+  glDrawElements(GL_TRIANGLE_STRIP, m_numIndices, m_indexType, 0);
+  glDisable(GL_PRIMITIVE_RESTART_FIXED_INDEX);
+  glBindVertexArray(0);
+}
+
+void HeightField::deleteBuffers(void) {
+  if (m_vao != UINT32_MAX) {
+    glDeleteVertexArrays(1, &m_vao);
+    glDeleteBuffers(1, &m_positionBuffer);
+    glDeleteBuffers(1, &m_uvBuffer);
+    m_vao = UINT32_MAX;
+    m_positionBuffer = UINT32_MAX;
+    m_uvBuffer = UINT32_MAX;
+  }
+  if (m_texid_hf != UINT32_MAX) {
+    glDeleteTextures(1, &m_texid_hf);
+    m_texid_hf = UINT32_MAX;
+  }
+  if (m_texid_diffuse != UINT32_MAX) {
+    glDeleteTextures(1, &m_texid_diffuse);
+    m_texid_diffuse = UINT32_MAX;
+  }
 }
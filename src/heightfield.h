@@ -1,6 +1,10 @@
+#pragma once
+
 #include <glad/glad.h>
+#include <stdint.h>
 
 #include <string>
+#include <vector>
 
 class HeightField {
 public:
@@ -10,16 +14,24 @@ public:
   GLuint m_vao;
   GLuint m_positionBuffer;
   GLuint m_uvBuffer;
-  GLuint m_indexBuffer;
+  GLuint m_indexBuffer;  // shared by all height fields of the same resolution
   GLuint m_numIndices;
+  GLenum m_indexType;
   std::string m_heightFieldPath;
   std::string m_diffuseTexturePath;
+  // Images hold heights in [0, 1]. Tile files hold meters and say how many meters the texture
+  // spans per side
+  bool m_heightsInMeters;
+  float m_extent;
 
   HeightField(void);
 
-  // load height field
+  // load height field, an image or a .tiles file written by the DEM importer (see demimport.h)
   void loadHeightField(const std::string &heigtFieldPath);
 
+  // load the finest LOD of an imported tile file that fits in `maxSize` texels per side
+  void loadTileFile(const std::string &tileFilePath, int maxSize = 4096);
+
   // load diffuse map
   void loadDiffuseTexture(const std::string &diffusePath);
 
@@ -28,4 +40,15 @@ public:
 
   // render height map
   void submitTriangles(void);
+
+  // delete the textures and vertex buffers, the shared index buffer stays
+  void deleteBuffers(void);
+
+  // Triangle strips over a grid of `resolution` x `resolution` quads, one strip per row of a band
+  // of columns, strips separated by the largest index (GL_PRIMITIVE_RESTART_FIXED_INDEX)
+  static std::vector<uint32_t> stripIndices(int resolution);
+
+  // The index buffer of `resolution`, created on first use, 16 bit while the vertices fit
+  static GLuint sharedIndexBuffer(int resolution, GLenum *out_type, GLuint *out_count);
+  static void deleteSharedIndexBuffers(void);
 };
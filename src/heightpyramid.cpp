@@ -0,0 +1,360 @@
+#include "heightpyramid.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+void HeightPyramid::build(const TerrainNoise& noise, glm::vec2 center, float size,
+                          int resolution) {
+  assert(resolution > 0 && (resolution & (resolution - 1)) == 0);
+
+  this->noise = noise;
+  this->center = center;
+  this->size = size;
+  this->resolution = resolution;
+  this->cell_size = size / resolution;
+  this->origin = center - glm::vec2(size / 2.0f);
+  this->slope_bound = noise::slopeBound(noise);
+  this->height_bounds = noise::heightBounds(noise);
+
+  int samples = resolution + 1;
+  std::vector<glm::vec2> positions(samples * samples);
+  std::vector<float> heights(samples * samples);
+  for (int z = 0; z < samples; z++) {
+    for (int x = 0; x < samples; x++) {
+      positions[z * samples + x] = this->origin + glm::vec2(x, z) * this->cell_size;
+    }
+  }
+  noise::terrainHeights(noise, positions.data(), heights.data(), heights.size());
+
+  this->level_count = 1;
+  while ((1 << (this->level_count - 1)) < resolution) {
+    this->level_count += 1;
+  }
+  this->levels.assign(this->level_count, {});
+
+  // A point inside a cell is at most half a diagonal away from one of its corners
+  float margin = this->slope_bound * this->cell_size * 0.70710678f;
+
+  auto& finest = this->levels[0];
+  finest.resize(resolution * resolution);
+  for (int z = 0; z < resolution; z++) {
+    for (int x = 0; x < resolution; x++) {
+      float h00 = heights[z * samples + x];
+      float h10 = heights[z * samples + x + 1];
+      float h01 = heights[(z + 1) * samples + x];
+      float h11 = heights[(z + 1) * samples + x + 1];
+      float lo = std::min({h00, h10, h01, h11}) - margin;
+      float hi = std::max({h00, h10, h01, h11}) + margin;
+      finest[z * resolution + x] = glm::vec2(glm::max(lo, this->height_bounds.x),
+                                             glm::min(hi, this->height_bounds.y));
+    }
+  }
+
+  for (int level = 1; level < this->level_count; level++) {
+    int cells = resolution >> level;
+    const auto& below = this->levels[level - 1];
+    auto& current = this->levels[level];
+    current.resize(cells * cells);
+
+    for (int z = 0; z < cells; z++) {
+      for (int x = 0; x < cells; x++) {
+        auto b00 = below[(2 * z) * (2 * cells) + 2 * x];
+        auto b10 = below[(2 * z) * (2 * cells) + 2 * x + 1];
+        auto b01 = below[(2 * z + 1) * (2 * cells) + 2 * x];
+        auto b11 = below[(2 * z + 1) * (2 * cells) + 2 * x + 1];
+        current[z * cells + x] = glm::vec2(std::min({b00.x, b10.x, b01.x, b11.x}),
+                                           std::max({b00.y, b10.y, b01.y, b11.y}));
+      }
+    }
+  }
+}
+
+bool HeightPyramid::heightRange(glm::vec2 min, glm::vec2 max, glm::vec2* out_range) const {
+  glm::vec2 cell_min = (min - this->origin) / this->cell_size;
+  glm::vec2 cell_max = (max - this->origin) / this->cell_size;
+  if (!this->isBuilt() || cell_min.x < 0.0f || cell_min.y < 0.0f || cell_max.x > this->resolution
+      || cell_max.y > this->resolution) {
+    return false;
+  }
+
+  // At most 2x2 cells of this level overlap the rectangle
+  glm::vec2 extent = cell_max - cell_min;
+  int level = 0;
+  while (level < this->level_count - 1 && float(1 << level) < glm::max(extent.x, extent.y)) {
+    level += 1;
+  }
+
+  int cells = this->resolution >> level;
+  int x0 = glm::min(int(cell_min.x) >> level, cells - 1);
+  int z0 = glm::min(int(cell_min.y) >> level, cells - 1);
+  int x1 = glm::min(int(cell_max.x) >> level, cells - 1);
+  int z1 = glm::min(int(cell_max.y) >> level, cells - 1);
+
+  glm::vec2 range(std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest());
+  for (int z = z0; z <= z1; z++) {
+    for (int x = x0; x <= x1; x++) {
+      glm::vec2 bounds = this->levels[level][z * cells + x];
+      range = glm::vec2(glm::min(range.x, bounds.x), glm::max(range.y, bounds.y));
+    }
+  }
+  *out_range = range;
+  return true;
+}
+
+float HeightPyramid::skipEmptySpace(const RayState& ray, float t) const {
+  const auto& o = ray.origin;
+  const auto& d = ray.direction;
+
+  while (t <= ray.max_t) {
+    glm::vec3 p = o + d * t;
+
+    // Nothing reaches above the global bounds
+    if (p.y > this->height_bounds.y) {
+      if (d.y >= 0.0f) {
+        return std::numeric_limits<float>::infinity();
+      }
+      t = (this->height_bounds.y - o.y) / d.y;
+      p = o + d * t;
+    }
+
+    glm::vec2 cell = (glm::vec2(p.x, p.z) - this->origin) / this->cell_size;
+    if (!this->isBuilt() || cell.x < 0.0f || cell.y < 0.0f || cell.x >= this->resolution
+        || cell.y >= this->resolution) {
+      return t;
+    }
+
+    // Find the coarsest cell that the ray passes entirely above
+    bool skipped = false;
+    for (int level = this->level_count - 1; level >= 0; level--) {
+      int cells = this->resolution >> level;
+      float level_cell_size = this->cell_size * float(1 << level);
+      int cx = glm::min(int(cell.x) >> level, cells - 1);
+      int cz = glm::min(int(cell.y) >> level, cells - 1);
+      glm::vec2 bounds = this->levels[level][cz * cells + cx];
+
+      glm::vec2 cell_min = this->origin + glm::vec2(cx, cz) * level_cell_size;
+      float t_exit = ray.max_t;
+      if (d.x > 0.0f) {
+        t_exit = glm::min(t_exit, (cell_min.x + level_cell_size - o.x) / d.x);
+      } else if (d.x < 0.0f) {
+        t_exit = glm::min(t_exit, (cell_min.x - o.x) / d.x);
+      }
+      if (d.z > 0.0f) {
+        t_exit = glm::min(t_exit, (cell_min.y + level_cell_size - o.z) / d.z);
+      } else if (d.z < 0.0f) {
+        t_exit = glm::min(t_exit, (cell_min.y - o.z) / d.z);
+      }
+
+      float lowest = glm::min(p.y, o.y + d.y * t_exit);
+      if (lowest > bounds.y) {
+        t = glm::max(t_exit, t + 1e-3f);
+        skipped = true;
+        break;
+      }
+    }
+
+    if (!skipped) {
+      return t;
+    }
+  }
+
+  return t;
+}
+
+void HeightPyramid::beginRay(RayState& ray) const {
+  ray.direction = glm::normalize(ray.direction);
+  ray.t_prev = 0.0f;
+  ray.lo = ray.hi = 0.0f;
+  ray.steps = 0;
+  ray.phase = Phase::March;
+  ray.hit = false;
+
+  ray.t = this->skipEmptySpace(ray, 0.0f);
+  if (ray.t > ray.max_t) {
+    ray.phase = Phase::Done;
+  }
+}
+
+float HeightPyramid::sampleT(const RayState& ray) const {
+  return ray.phase == Phase::Bisect ? 0.5f * (ray.lo + ray.hi) : ray.t;
+}
+
+void HeightPyramid::consumeHeight(RayState& ray, float height) const {
+  const auto& o = ray.origin;
+  const auto& d = ray.direction;
+
+  if (ray.phase == Phase::March) {
+    float diff = o.y + d.y * ray.t - height;
+
+    if (diff < 0.0f) {
+      if (ray.steps == 0) {
+        // Started below the surface
+        ray.hit = true;
+        ray.phase = Phase::Done;
+      } else {
+        ray.lo = ray.t_prev;
+        ray.hi = ray.t;
+        ray.phase = Phase::Bisect;
+      }
+    } else if (diff < HIT_EPSILON) {
+      ray.hit = true;
+      ray.phase = Phase::Done;
+    } else {
+      // The gap to the surface can shrink at most this much per unit t
+      float rate = this->slope_bound * glm::length(glm::vec2(d.x, d.z)) - d.y;
+      if (rate <= 0.0f || ray.t >= ray.max_t) {
+        ray.phase = Phase::Done;
+      } else {
+        ray.t_prev = ray.t;
+        float min_step = MIN_STEP + ray.t * MIN_STEP_RATIO;
+        float t = this->skipEmptySpace(ray, ray.t + glm::max(diff / rate, min_step));
+        ray.t = glm::min(t, ray.max_t);
+      }
+    }
+
+    ray.steps += 1;
+    if (ray.phase == Phase::March && ray.steps >= MAX_STEPS) {
+      ray.phase = Phase::Done;
+    }
+  } else if (ray.phase == Phase::Bisect) {
+    float mid = 0.5f * (ray.lo + ray.hi);
+    if (o.y + d.y * mid - height < 0.0f) {
+      ray.hi = mid;
+    } else {
+      ray.lo = mid;
+    }
+
+    if (ray.hi - ray.lo < BISECT_EPSILON) {
+      ray.t = 0.5f * (ray.lo + ray.hi);
+      ray.hit = true;
+      ray.phase = Phase::Done;
+    }
+  }
+}
+
+void HeightPyramid::finishHits(Span<const RayState> rays, Span<TerrainHit> out_hits) const {
+  constexpr usize CHUNK_SIZE = 256;
+  glm::vec2 positions[CHUNK_SIZE];
+  glm::vec3 normals[CHUNK_SIZE];
+  usize indices[CHUNK_SIZE];
+
+  for (usize start = 0; start < rays.size(); start += CHUNK_SIZE) {
+    usize n = std::min(CHUNK_SIZE, rays.size() - start);
+    usize count = 0;
+
+    for (usize i = start; i < start + n; i++) {
+      const auto& ray = rays[i];
+      auto& hit = out_hits[i];
+      hit = TerrainHit{};
+      if (!ray.hit) {
+        continue;
+      }
+
+      hit.hit = true;
+      hit.t = ray.t;
+      hit.position = ray.origin + ray.direction * ray.t;
+      positions[count] = glm::vec2(hit.position.x, hit.position.z);
+      indices[count] = i;
+      count += 1;
+    }
+
+    noise::terrainNormals(this->noise, positions, normals, count);
+    for (usize k = 0; k < count; k++) {
+      out_hits[indices[k]].normal = normals[k];
+    }
+  }
+}
+
+TerrainHit HeightPyramid::raycast(glm::vec3 origin, glm::vec3 direction, float max_t) const {
+  RayState ray;
+  ray.origin = origin;
+  ray.direction = direction;
+  ray.max_t = max_t;
+  this->beginRay(ray);
+
+  while (ray.phase != Phase::Done) {
+    glm::vec3 p = ray.origin + ray.direction * this->sampleT(ray);
+    this->consumeHeight(ray, noise::terrainHeight(this->noise, glm::vec2(p.x, p.z)));
+  }
+
+  TerrainHit hit;
+  this->finishHits(Span<const RayState>(&ray, 1), Span<TerrainHit>(&hit, 1));
+  return hit;
+}
+
+void HeightPyramid::raycastBatch(Span<const TerrainRay> rays, Span<TerrainHit> out_hits) const {
+  assert(rays.size() == out_hits.size());
+
+  constexpr usize CHUNK_SIZE = 256;
+  RayState states[CHUNK_SIZE];
+  glm::vec2 positions[CHUNK_SIZE];
+  float heights[CHUNK_SIZE];
+  usize active[CHUNK_SIZE];
+
+  for (usize start = 0; start < rays.size(); start += CHUNK_SIZE) {
+    usize n = std::min(CHUNK_SIZE, rays.size() - start);
+
+    for (usize i = 0; i < n; i++) {
+      auto& state = states[i];
+      state.origin = rays[start + i].origin;
+      state.direction = rays[start + i].direction;
+      state.max_t = rays[start + i].max_t;
+      this->beginRay(state);
+    }
+
+    while (true) {
+      usize count = 0;
+      for (usize i = 0; i < n; i++) {
+        if (states[i].phase == Phase::Done) {
+          continue;
+        }
+        glm::vec3 p = states[i].origin + states[i].direction * this->sampleT(states[i]);
+        positions[count] = glm::vec2(p.x, p.z);
+        active[count] = i;
+        count += 1;
+      }
+
+      if (count == 0) {
+        break;
+      }
+
+      noise::terrainHeights(this->noise, positions, heights, count);
+      for (usize k = 0; k < count; k++) {
+        this->consumeHeight(states[active[k]], heights[k]);
+      }
+    }
+
+    this->finishHits(Span<const RayState>(states, n), out_hits.subspan(start, n));
+  }
+}
+
+void HeightPyramid::benchmark(int grid_size, HeightPyramidStats* stats) const {
+  glm::vec3 origin(this->center.x, noise::terrainHeight(this->noise, this->center) + 2.0f,
+                   this->center.y);
+
+  std::vector<TerrainRay> rays(grid_size * grid_size);
+  std::vector<TerrainHit> hits(rays.size());
+  for (int y = 0; y < grid_size; y++) {
+    for (int x = 0; x < grid_size; x++) {
+      float azimuth = float(x) / float(grid_size) * 6.2831853f;
+      float elevation = glm::mix(0.1f, -1.2f, float(y) / float(glm::max(grid_size - 1, 1)));
+      auto& ray = rays[y * grid_size + x];
+      ray.origin = origin;
+      ray.direction = glm::vec3(std::cos(azimuth) * std::cos(elevation), std::sin(elevation),
+                                std::sin(azimuth) * std::cos(elevation));
+      ray.max_t = this->size / 2.0f;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  this->raycastBatch(rays, hits);
+  auto end = std::chrono::steady_clock::now();
+
+  stats->rays = rays.size();
+  stats->hits = std::count_if(hits.begin(), hits.end(),
+                              [](const TerrainHit& hit) { return hit.hit; });
+  stats->us_per_ray = std::chrono::duration<double, std::micro>(end - start).count() / rays.size();
+}
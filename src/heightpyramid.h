@@ -0,0 +1,111 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+#include "core.h"
+#include "noise.h"
+
+struct TerrainRay {
+  glm::vec3 origin;
+  glm::vec3 direction;  // normalized
+  float max_t;
+};
+
+struct TerrainHit {
+  bool hit = false;
+  float t = 0.0f;
+  glm::vec3 position = glm::vec3(0.0f);
+  glm::vec3 normal = glm::vec3(0.0f, 1.0f, 0.0f);
+};
+
+struct HeightPyramidStats {
+  double build_ms = 0.0;
+  usize rays = 0;  // benchmark rays, see HeightPyramid::benchmark()
+  usize hits = 0;
+  double us_per_ray = 0.0;
+};
+
+/**
+ * Conservative min/max bounds of the terrain height over a square region, built from CPU evaluated
+ * heights. Level 0 has `resolution` x `resolution` cells and every level above halves that, up to a
+ * single cell covering the whole region.
+ *
+ * Ray casting skips every cell the ray passes entirely above, sphere traces with the noise slope
+ * bound once it is inside the bounds and bisects the final bracket around the surface.
+ */
+class HeightPyramid {
+public:
+  // Distance above the surface that counts as a hit
+  static constexpr float HIT_EPSILON = 0.05f;
+  // Smallest step while sphere tracing, MIN_STEP + t * MIN_STEP_RATIO. Rays grazing a slope would
+  // otherwise crawl along it, overshoots are resolved by bisection
+  static constexpr float MIN_STEP = 0.1f;
+  static constexpr float MIN_STEP_RATIO = 0.004f;
+  // Width of the final bisection bracket
+  static constexpr float BISECT_EPSILON = 0.01f;
+  static constexpr int MAX_STEPS = 512;
+
+  TerrainNoise noise;
+  glm::vec2 center = glm::vec2(0.0f);
+  glm::vec2 origin = glm::vec2(0.0f);  // minimum corner of the region
+  float size = 0.0f;
+  float cell_size = 0.0f;
+  int resolution = 0;
+  int level_count = 0;
+
+  float slope_bound = 0.0f;
+  glm::vec2 height_bounds = glm::vec2(0.0f);
+
+  // (min, max) per cell, row major, levels[0] is the finest
+  std::vector<std::vector<glm::vec2>> levels;
+
+  /**
+   * Evaluate the heights on a (resolution + 1)^2 grid covering `size` x `size` around `center`.
+   * `resolution` must be a power of two.
+   */
+  void build(const TerrainNoise& noise, glm::vec2 center, float size, int resolution);
+
+  bool isBuilt() const { return !levels.empty(); }
+
+  /**
+   * Conservative (min, max) height over the rectangle [min, max] from the coarsest level whose
+   * cells are at least as large as the rectangle. False when it is not entirely inside the region.
+   */
+  bool heightRange(glm::vec2 min, glm::vec2 max, glm::vec2* out_range) const;
+
+  TerrainHit raycast(glm::vec3 origin, glm::vec3 direction, float max_t) const;
+
+  /**
+   * Trace the rays in lockstep, chunk by chunk, so every step evaluates the heights of all rays
+   * still marching with one batched SIMD call.
+   */
+  void raycastBatch(Span<const TerrainRay> rays, Span<TerrainHit> out_hits) const;
+
+  /**
+   * Time a fixed fan of `grid_size`^2 batched rays from a few meters above the surface at the
+   * center, all around it and from slightly up to steeply down, as a camera on the ground sees it.
+   */
+  void benchmark(int grid_size, HeightPyramidStats* stats) const;
+
+private:
+  enum class Phase { March, Bisect, Done };
+
+  struct RayState {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float max_t;
+    float t;
+    float t_prev;
+    float lo, hi;
+    int steps;
+    Phase phase;
+    bool hit;
+  };
+
+  void beginRay(RayState& ray) const;
+  float sampleT(const RayState& ray) const;
+  void consumeHeight(RayState& ray, float height) const;
+  float skipEmptySpace(const RayState& ray, float t) const;
+  void finishHits(Span<const RayState> rays, Span<TerrainHit> out_hits) const;
+};
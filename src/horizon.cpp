@@ -0,0 +1,411 @@
+#include "horizon.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "gpu.h"
+#include "jobs.h"
+
+namespace {
+  constexpr float HALF_PI = 1.57079632679f;
+
+  u64 hashHeights(const std::array<const HeightTile*, 9>& tiles) {
+    u64 h = 14695981039346656037ull;
+    for (const auto* tile : tiles) {
+      const auto* bytes = reinterpret_cast<const u8*>(tile->heights.data());
+      for (usize i = 0; i < tile->heights.size() * sizeof(float); i++) {
+        h = (h ^ bytes[i]) * 1099511628211ull;
+      }
+    }
+    return h;
+  }
+
+  bool sameTile(const std::weak_ptr<const CachedTile>& a,
+                const std::weak_ptr<const CachedTile>& b) {
+    return !a.owner_before(b) && !b.owner_before(a);
+  }
+}  // namespace
+
+u64 horizon::traceTile(const std::array<const HeightTile*, 9>& tiles, float texel_size,
+                       int resolution, int max_distance, u8* out, u8* occlusion) {
+  // Heights in texels of the middle tile, [-TILE_SIZE, 2 * TILE_SIZE) reaches all 9 tiles
+  auto height = [&](int x, int z) {
+    int tx = x < 0 ? 0 : x < TILE_SIZE ? 1 : 2;
+    int tz = z < 0 ? 0 : z < TILE_SIZE ? 1 : 2;
+    return tiles[tz * 3 + tx]->at(x - (tx - 1) * TILE_SIZE, z - (tz - 1) * TILE_SIZE);
+  };
+  auto bilinear = [&](float x, float z) {
+    int x0 = int(std::floor(x));
+    int z0 = int(std::floor(z));
+    float fx = x - x0;
+    float fz = z - z0;
+    float top = height(x0, z0) + (height(x0 + 1, z0) - height(x0, z0)) * fx;
+    float bottom = height(x0, z0 + 1) + (height(x0 + 1, z0 + 1) - height(x0, z0 + 1)) * fx;
+    return top + (bottom - top) * fz;
+  };
+
+  // Steps growing by a quarter, fine close by where the slope matters and coarse far away
+  max_distance = glm::clamp(max_distance, 1, TILE_SIZE);
+  std::vector<float> steps;
+  for (float t = 1.0f; t <= max_distance; t = std::max(t + 1.0f, t * 1.25f)) {
+    steps.push_back(t);
+  }
+
+  float directions[HORIZON_DIRECTIONS][2];
+  for (int d = 0; d < HORIZON_DIRECTIONS; d++) {
+    float azimuth = d * 4.0f * HALF_PI / HORIZON_DIRECTIONS;
+    directions[d][0] = std::cos(azimuth);
+    directions[d][1] = std::sin(azimuth);
+  }
+
+  const float lo = -TILE_SIZE;
+  const float hi = 2 * TILE_SIZE - 1.001f;
+  usize layer_size = usize(resolution) * resolution * 4;
+  float spacing = float(TILE_SIZE) / resolution;
+  for (int j = 0; j < resolution; j++) {
+    for (int i = 0; i < resolution; i++) {
+      float x = (i + 0.5f) * spacing;
+      float z = (j + 0.5f) * spacing;
+      float origin = bilinear(x, z);
+
+      // A horizon at angle h hides sin^2(h) of the cosine weighted sky, 1 - sin^2 = 1 / (1 + tan^2)
+      float visible = 0.0f;
+      for (int d = 0; d < HORIZON_DIRECTIONS; d++) {
+        float max_slope = 0.0f;
+        for (float t : steps) {
+          float sx = x + directions[d][0] * t;
+          float sz = z + directions[d][1] * t;
+          if (sx < lo || sz < lo || sx > hi || sz > hi) {
+            break;
+          }
+          max_slope = std::max(max_slope, (bilinear(sx, sz) - origin) / (t * texel_size));
+        }
+
+        visible += 1.0f / (1.0f + max_slope * max_slope);
+        float angle = std::atan(max_slope) / HALF_PI;
+        usize texel = (usize(j) * resolution + i) * 4 + d % 4;
+        out[(d / 4) * layer_size + texel] = u8(std::lround(angle * 255.0f));
+      }
+      if (occlusion != nullptr) {
+        visible /= HORIZON_DIRECTIONS;
+        occlusion[usize(j) * resolution + i] = u8(std::lround(visible * 255.0f));
+      }
+    }
+  }
+
+  return u64(resolution) * resolution * HORIZON_DIRECTIONS;
+}
+
+HorizonStage::~HorizonStage() { this->cancel(); }
+
+void HorizonStage::deinit() {
+  this->cancel();
+  glDeleteTextures(1, &this->texture);
+  glDeleteTextures(1, &this->occlusion_texture);
+  this->texture = 0;
+  this->occlusion_texture = 0;
+  this->texture_size = 0;
+}
+
+void HorizonStage::cancel() {
+  this->shared->generation += 1;
+  // A new state for the next run, the abandoned job keeps the old one alive
+  this->shared = std::make_shared<Shared>();
+  this->running = false;
+}
+
+void HorizonStage::update(const TileBaker& baker, TileCache& cache, const TerrainNoise& noise,
+                          glm::vec3 camera_position) {
+  int lod = glm::clamp(this->lod, 0, 8);
+  int radius = glm::clamp(this->radius, 0, 8);
+  int resolution = glm::clamp(this->resolution, 8, TILE_SIZE);
+  int max_distance = glm::clamp(this->max_distance, 1, TILE_SIZE);
+
+  // Everything the traced texels depend on besides the heights
+  u64 noise_hash = noise::hash(noise);
+  u32 texel_bits;
+  std::memcpy(&texel_bits, &baker.base_texel_size, sizeof(texel_bits));
+  u64 hash = noise_hash;
+  for (u64 value : {u64(texel_bits), u64(lod), u64(resolution), u64(max_distance)}) {
+    hash = (hash ^ value) * 1099511628211ull;
+  }
+  if (hash != this->input_hash) {
+    this->cancel();
+    this->baked.clear();
+    this->input_hash = hash;
+    this->region_radius = -1;
+  }
+
+  if (this->running) {
+    std::vector<Result> results;
+    {
+      std::lock_guard<std::mutex> lock(this->shared->mutex);
+      if (this->shared->finished) {
+        results = std::move(this->shared->results);
+        this->last_stats = this->shared->stats;
+        this->running = false;
+      }
+    }
+    if (!this->running) {
+      this->shared = std::make_shared<Shared>();
+      for (auto& result : results) {
+        auto& tile = this->baked[result.key];
+        tile.sources = result.sources;
+        if (!result.texels.empty()) {
+          tile.heights_hash = result.heights_hash;
+          tile.texels = std::move(result.texels);
+          tile.occlusion = std::move(result.occlusion);
+          this->region_dirty = true;
+        }
+      }
+    }
+  }
+
+  if (!this->enabled && !this->occlusion) {
+    return;
+  }
+
+  TileKey middle = baker.tileAt(noise_hash, lod, glm::vec2(camera_position.x, camera_position.z));
+  if (middle != this->region_middle || radius != this->region_radius) {
+    this->region_middle = middle;
+    this->region_radius = radius;
+    this->region_dirty = true;
+
+    for (auto it = this->baked.begin(); it != this->baked.end();) {
+      bool inside = std::abs(it->first.x - middle.x) <= radius + 1
+                    && std::abs(it->first.z - middle.z) <= radius + 1;
+      it = inside ? std::next(it) : this->baked.erase(it);
+    }
+  }
+
+  if (!this->running) {
+    // The cache tiles under the region and one tile around it, null where not cached
+    int sources_side = 2 * radius + 3;
+    std::vector<std::shared_ptr<const CachedTile>> cached(sources_side * sources_side);
+    for (int z = 0; z < sources_side; z++) {
+      for (int x = 0; x < sources_side; x++) {
+        TileKey key = {noise_hash, lod, middle.x - radius - 1 + x, middle.z - radius - 1 + z};
+        cached[z * sources_side + x] = cache.peek(key);
+      }
+    }
+
+    // Dirty when new or when a tile of its neighbourhood was replaced in the cache
+    struct Request {
+      TileKey key;
+      std::array<usize, 9> sources;
+      bool has_previous;
+      u64 previous_hash;
+    };
+    std::vector<Request> requests;
+    std::vector<TileKey> source_keys;
+    std::vector<std::shared_ptr<const CachedTile>> source_tiles;
+    std::unordered_map<TileKey, usize, TileKeyHash> source_index;
+    std::vector<Sources> request_sources;
+
+    for (int z = -radius; z <= radius; z++) {
+      for (int x = -radius; x <= radius; x++) {
+        TileKey key = {noise_hash, lod, middle.x + x, middle.z + z};
+        Sources sources;
+        for (int n = 0; n < 9; n++) {
+          int sx = x + radius + n % 3;
+          int sz = z + radius + n / 3;
+          sources[n] = cached[sz * sources_side + sx];
+        }
+
+        auto it = this->baked.find(key);
+        bool has_previous = it != this->baked.end() && !it->second.texels.empty();
+        if (has_previous) {
+          bool same = true;
+          for (int n = 0; n < 9; n++) {
+            same = same && sameTile(sources[n], it->second.sources[n]);
+          }
+          if (same) {
+            continue;
+          }
+        }
+
+        Request request = {key, {}, has_previous, has_previous ? it->second.heights_hash : 0};
+        for (int n = 0; n < 9; n++) {
+          TileKey source = {noise_hash, lod, key.x - 1 + n % 3, key.z - 1 + n / 3};
+          auto [index, inserted] = source_index.emplace(source, source_keys.size());
+          if (inserted) {
+            source_keys.push_back(source);
+            source_tiles.push_back(sources[n].lock());
+          }
+          request.sources[n] = index->second;
+        }
+        requests.push_back(request);
+        request_sources.push_back(sources);
+      }
+    }
+
+    if (!requests.empty()) {
+      this->running = true;
+      auto shared = this->shared;
+      u32 generation = shared->generation.load();
+      float texel_size = baker.texelSize(lod);
+      auto job = [shared, generation, baker, noise, requests, request_sources, source_keys,
+                  source_tiles, texel_size, resolution, max_distance]() {
+        auto start = std::chrono::steady_clock::now();
+        auto* jobs = JobSystem::instance();
+
+        std::vector<HeightTile> tiles(source_keys.size());
+        jobs->parallelFor(tiles.size(), 1, [&](usize begin, usize end) {
+          for (usize i = begin; i < end; i++) {
+            if (source_tiles[i] != nullptr) {
+              tiles[i] = source_tiles[i]->decode();
+            } else {
+              tiles[i].key = source_keys[i];
+              baker.bakeTile(noise, tiles[i]);
+            }
+          }
+        });
+        if (shared->generation.load() != generation) {
+          return;
+        }
+
+        std::vector<Result> results(requests.size());
+        std::atomic<u64> rays{0};
+        std::atomic<usize> unchanged{0};
+        jobs->parallelFor(requests.size(), 1, [&](usize begin, usize end) {
+          for (usize i = begin; i < end; i++) {
+            const auto& request = requests[i];
+            std::array<const HeightTile*, 9> neighbourhood;
+            for (int n = 0; n < 9; n++) {
+              neighbourhood[n] = &tiles[request.sources[n]];
+            }
+
+            auto& result = results[i];
+            result.key = request.key;
+            result.sources = request_sources[i];
+            result.heights_hash = hashHeights(neighbourhood);
+            if (request.has_previous && result.heights_hash == request.previous_hash) {
+              unchanged += 1;
+              continue;
+            }
+            result.texels.resize(usize(resolution) * resolution * HORIZON_DIRECTIONS);
+            result.occlusion.resize(usize(resolution) * resolution);
+            rays += horizon::traceTile(neighbourhood, texel_size, resolution, max_distance,
+                                       result.texels.data(), result.occlusion.data());
+          }
+        });
+
+        HorizonStats stats;
+        stats.tiles = requests.size() - unchanged.load();
+        stats.unchanged = unchanged.load();
+        stats.source_tiles = tiles.size();
+        stats.rays = rays.load();
+        stats.threads = jobs->threadCount() + 1;
+        stats.seconds
+            = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->results = std::move(results);
+        shared->stats = stats;
+        shared->finished = true;
+      };
+      JobSystem::instance()->submit(job);
+    }
+  }
+
+  if (this->region_dirty) {
+    this->upload(baker);
+  }
+}
+
+void HorizonStage::upload(const TileBaker& baker) {
+  this->region_dirty = false;
+
+  int resolution = glm::clamp(this->resolution, 8, TILE_SIZE);
+  int side = 2 * this->region_radius + 1;
+  int size = side * resolution;
+  if (size != this->texture_size) {
+    glDeleteTextures(1, &this->texture);
+    glCreateTextures(GL_TEXTURE_2D_ARRAY, 1, &this->texture);
+    glTextureStorage3D(this->texture, 1, GL_RGBA8, size, size, HORIZON_DIRECTIONS / 4);
+    glTextureParameteri(this->texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(this->texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(this->texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(this->texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    glDeleteTextures(1, &this->occlusion_texture);
+    glCreateTextures(GL_TEXTURE_2D, 1, &this->occlusion_texture);
+    glTextureStorage2D(this->occlusion_texture, 1, GL_R8, size, size);
+    glTextureParameteri(this->occlusion_texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(this->occlusion_texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(this->occlusion_texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(this->occlusion_texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    this->texture_size = size;
+  }
+
+  // Tiles that are not traced yet have a flat horizon, lit like without the map
+  std::vector<u8> flat(usize(resolution) * resolution * HORIZON_DIRECTIONS, 0);
+  std::vector<u8> open(usize(resolution) * resolution, 255);
+  usize layer_size = usize(resolution) * resolution * 4;
+  // Rows of the occlusion are `resolution` bytes
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (int z = 0; z < side; z++) {
+    for (int x = 0; x < side; x++) {
+      TileKey key = this->region_middle;
+      key.x += x - this->region_radius;
+      key.z += z - this->region_radius;
+      auto it = this->baked.find(key);
+      bool traced = it != this->baked.end() && !it->second.texels.empty();
+      const u8* texels = traced ? it->second.texels.data() : flat.data();
+      for (int layer = 0; layer < HORIZON_DIRECTIONS / 4; layer++) {
+        glTextureSubImage3D(this->texture, 0, x * resolution, z * resolution, layer, resolution,
+                            resolution, 1, GL_RGBA, GL_UNSIGNED_BYTE, texels + layer * layer_size);
+      }
+      const u8* occlusion = traced ? it->second.occlusion.data() : open.data();
+      glTextureSubImage2D(this->occlusion_texture, 0, x * resolution, z * resolution, resolution,
+                          resolution, GL_RED, GL_UNSIGNED_BYTE, occlusion);
+    }
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  CHECK_GL_ERROR();
+
+  TileKey first = this->region_middle;
+  first.x -= this->region_radius;
+  first.z -= this->region_radius;
+  this->map_origin = baker.tileOrigin(first);
+  this->map_size = side * baker.tileWorldSize(first.lod);
+}
+
+void HorizonStage::setUniforms(GLuint program) const {
+  bool enabled = this->enabled && this->map_size > 0.0f;
+  float occlusion_strength = this->occlusion && this->map_size > 0.0f ? this->occlusion_strength
+                                                                       : 0.0f;
+  glBindTextureUnit(TEXTURE_UNIT, this->texture);
+  glBindTextureUnit(OCCLUSION_TEXTURE_UNIT, this->occlusion_texture);
+  gpu::setUniformSlow(program, "horizonMap.enabled", (GLint)enabled);
+  gpu::setUniformSlow(program, "horizonMap.origin", this->map_origin);
+  gpu::setUniformSlow(program, "horizonMap.size", this->map_size);
+  gpu::setUniformSlow(program, "horizonMap.softness", glm::max(this->softness, 1e-4f));
+  gpu::setUniformSlow(program, "horizonMap.occlusion_strength", occlusion_strength);
+}
+
+void HorizonStage::gui() {
+  ImGui::Checkbox("Horizon shadows", &this->enabled);
+  ImGui::SliderInt("Horizon LOD", &this->lod, 0, 6);
+  ImGui::SliderInt("Horizon radius", &this->radius, 0, 8);
+  ImGui::SliderInt("Horizon texels per tile", &this->resolution, 8, TILE_SIZE);
+  ImGui::SliderInt("Horizon ray length", &this->max_distance, 8, TILE_SIZE);
+  ImGui::SliderFloat("Horizon softness", &this->softness, 0.001f, 0.2f);
+  ImGui::Checkbox("Terrain occlusion", &this->occlusion);
+  ImGui::SliderFloat("Terrain occlusion strength", &this->occlusion_strength, 0.0f, 1.0f);
+
+  const auto& stats = this->last_stats;
+  if (this->running) {
+    ImGui::Text("Tracing...");
+  }
+  if (stats.source_tiles > 0) {
+    ImGui::Text("%zu tiles traced, %zu unchanged, from %zu height tiles", stats.tiles,
+                stats.unchanged, stats.source_tiles);
+    ImGui::Text("%.0f ms on %d threads, %.1f M rays/s", stats.seconds * 1e3, stats.threads,
+                stats.raysPerSecond() / 1e6);
+  }
+}
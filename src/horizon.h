@@ -0,0 +1,130 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "baker.h"
+#include "core.h"
+#include "noise.h"
+#include "tilecache.h"
+
+// Azimuths of a horizon map, the first along +x and then counter clockwise towards +z
+constexpr int HORIZON_DIRECTIONS = 8;
+
+struct HorizonStats {
+  usize tiles = 0;      // tiles whose horizons were traced
+  usize unchanged = 0;  // tiles whose sources changed but not their heights
+  usize source_tiles = 0;
+  u64 rays = 0;
+  int threads = 0;
+  double seconds = 0.0;
+
+  double raysPerSecond() const { return seconds > 0.0 ? rays / seconds : 0.0; }
+};
+
+namespace horizon {
+  /**
+   * Trace the horizon of the texels of the middle tile of `tiles`, a 3x3 neighbourhood row major,
+   * in HORIZON_DIRECTIONS azimuths up to `max_distance` texels (at most TILE_SIZE). Writes
+   * `resolution`^2 texels of 4 bytes for the first 4 azimuths to `out`, followed by as many for
+   * the others, each the elevation angle of the horizon from 0 (flat) to 255 (straight up).
+   *
+   * Unless null, `occlusion` gets `resolution`^2 bytes of the sky visible over the horizons,
+   * cosine weighted: 255 on flat ground and less in valleys. Returns the number of rays.
+   */
+  u64 traceTile(const std::array<const HeightTile*, 9>& tiles, float texel_size, int resolution,
+                int max_distance, u8* out, u8* occlusion = nullptr);
+}  // namespace horizon
+
+/**
+ * Bakes horizon maps for the tiles around the camera on the workers, which terrain.frag uses to
+ * shade the terrain beyond the rendered shadow cascades, and from the same horizons an ambient
+ * occlusion map for the large scale occlusion the texture AO lacks.
+ *
+ * The sun does not matter to the bake, so moving it is free. A tile is only traced again when
+ * the heights of its neighbourhood change: the heights come from the tile cache where present,
+ * e.g. eroded, and otherwise are baked, and a tile whose cache tiles were replaced compares a
+ * hash of the heights before tracing.
+ */
+class HorizonStage {
+public:
+  static constexpr int TEXTURE_UNIT = 18;
+  static constexpr int OCCLUSION_TEXTURE_UNIT = 19;
+
+  bool enabled = true;
+  bool occlusion = true;
+  float occlusion_strength = 1.0f;
+  int lod = 2;
+  int radius = 3;
+  // Texels per tile side and how far the rays go in texels of the LOD
+  int resolution = 64;
+  int max_distance = 256;
+  // Elevation in radians over which the sun fades out behind the horizon
+  float softness = 0.03f;
+
+  ~HorizonStage();
+  void deinit();
+  void cancel();
+
+  /**
+   * Call once per frame from the main thread.
+   */
+  void update(const TileBaker& baker, TileCache& cache, const TerrainNoise& noise,
+              glm::vec3 camera_position);
+
+  void setUniforms(GLuint program) const;
+  void gui();
+
+private:
+  using Sources = std::array<std::weak_ptr<const CachedTile>, 9>;
+
+  struct BakedTile {
+    u64 heights_hash = 0;
+    Sources sources;
+    std::vector<u8> texels;
+    std::vector<u8> occlusion;
+  };
+
+  struct Result {
+    TileKey key;
+    u64 heights_hash = 0;
+    Sources sources;
+    std::vector<u8> texels;  // empty when the heights did not change
+    std::vector<u8> occlusion;
+  };
+
+  // Shared with the job, which may outlive the stage
+  struct Shared {
+    std::atomic<u32> generation{0};
+
+    std::mutex mutex;
+    bool finished = false;
+    std::vector<Result> results;
+    HorizonStats stats;
+  };
+
+  std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+  bool running = false;
+  u64 input_hash = 0;
+  HorizonStats last_stats;
+
+  std::unordered_map<TileKey, BakedTile, TileKeyHash> baked;
+
+  // The region in the texture, `region_middle` +- radius tiles
+  GLuint texture = 0;
+  GLuint occlusion_texture = 0;
+  int texture_size = 0;
+  TileKey region_middle = {};
+  int region_radius = -1;
+  bool region_dirty = false;
+  glm::vec2 map_origin = glm::vec2(0.0f);
+  float map_size = 0.0f;
+
+  void upload(const TileBaker& baker);
+};
@@ -0,0 +1,796 @@
+#include "hydrology.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <queue>
+#include <unordered_map>
+
+#include "gpu.h"
+#include "jobs.h"
+
+namespace {
+  constexpr int TS = TILE_SIZE;
+  constexpr int CELLS = TS * TS;
+  constexpr int PERIMETER = 4 * TS - 4;
+
+  // D8 neighbours, counter clockwise from +x
+  constexpr int DX[8] = {1, 1, 0, -1, -1, -1, 0, 1};
+  constexpr int DZ[8] = {0, 1, 1, 1, 0, -1, -1, -1};
+  // Directions of the cells that do not flow to a neighbour
+  constexpr u8 FLOW_OUT = 8;   // over the edge of the grid
+  constexpr u8 FLOW_SINK = 9;  // nowhere, a tile edge cell without a lower cell to flow to
+
+  // Spill graph node of the grid border
+  constexpr u32 BORDER_LABEL = 0;
+  constexpr float INF = std::numeric_limits<float>::infinity();
+
+  struct Perimeter {
+    std::array<int, PERIMETER> cells;
+    std::vector<int> index;  // per cell, -1 inside
+
+    Perimeter() : index(CELLS, -1) {
+      int n = 0;
+      for (int x = 0; x < TS; x++) {
+        cells[n++] = x;
+        cells[n++] = (TS - 1) * TS + x;
+      }
+      for (int z = 1; z < TS - 1; z++) {
+        cells[n++] = z * TS;
+        cells[n++] = z * TS + TS - 1;
+      }
+      for (int i = 0; i < PERIMETER; i++) {
+        index[cells[i]] = i;
+      }
+    }
+  };
+
+  const Perimeter& perimeter() {
+    static Perimeter instance;
+    return instance;
+  }
+
+  struct Edge {
+    u32 a;
+    u32 b;
+    float height;
+  };
+
+  // What is kept of a tile between the passes
+  struct TileSummary {
+    // Pass 1: per edge cell, the label is local to the tile, 1 based
+    std::vector<float> heights;
+    std::vector<u32> labels;
+    std::vector<Edge> edges;
+    u32 label_count = 0;
+    u32 label_base = 0;
+
+    // Pass 2: per edge cell
+    std::vector<float> local_accumulation;
+    std::vector<i32> exit;    // edge cell where the flow entering here leaves the tile, -1 none
+    std::vector<i64> target;  // node (tile * PERIMETER + cell) it flows into, -1 none
+    // Resolved between the passes
+    std::vector<float> inflow;
+
+    usize bytes() const {
+      return heights.size() * sizeof(float) + labels.size() * sizeof(u32)
+             + edges.capacity() * sizeof(Edge) + local_accumulation.size() * sizeof(float)
+             + exit.size() * sizeof(i32) + target.size() * sizeof(i64)
+             + inflow.size() * sizeof(float);
+    }
+  };
+
+  struct Flood {
+    std::vector<float> filled;
+    std::vector<u32> labels;
+    u32 label_count = 0;
+  };
+
+  struct FloodEntry {
+    float height;
+    int cell;
+
+    bool operator>(const FloodEntry& other) const {
+      return height != other.height ? height > other.height : cell > other.cell;
+    }
+  };
+
+  /**
+   * Priority-flood from the tile edge. Every edge cell that is not reached from a lower one
+   * starts a new label, `edges` gets the lowest spill height between each pair of labels.
+   */
+  void floodTile(const std::vector<float>& h, Flood& flood, std::vector<Edge>* edges) {
+    const auto& rim = perimeter();
+    flood.filled.assign(CELLS, 0.0f);
+    flood.labels.assign(CELLS, 0);
+    flood.label_count = 0;
+    std::vector<u8> popped(CELLS, 0);
+    std::unordered_map<u64, float> spill;
+
+    std::priority_queue<FloodEntry, std::vector<FloodEntry>, std::greater<FloodEntry>> queue;
+    for (int cell : rim.cells) {
+      queue.push({h[cell], cell});
+    }
+
+    while (!queue.empty()) {
+      auto [height, c] = queue.top();
+      queue.pop();
+      if (popped[c]) {
+        continue;
+      }
+      popped[c] = 1;
+      if (flood.labels[c] == 0) {
+        flood.label_count += 1;
+        flood.labels[c] = flood.label_count;
+        flood.filled[c] = h[c];
+      }
+
+      int x = c % TS;
+      int z = c / TS;
+      for (int d = 0; d < 8; d++) {
+        int nx = x + DX[d];
+        int nz = z + DZ[d];
+        if (nx < 0 || nz < 0 || nx >= TS || nz >= TS) {
+          continue;
+        }
+        int n = nz * TS + nx;
+        if (flood.labels[n] != 0) {
+          if (edges != nullptr && flood.labels[n] != flood.labels[c]) {
+            u32 a = std::min(flood.labels[n], flood.labels[c]);
+            u32 b = std::max(flood.labels[n], flood.labels[c]);
+            float s = std::max(flood.filled[c], flood.filled[n]);
+            auto [it, inserted] = spill.emplace(u64(a) << 32 | b, s);
+            if (!inserted) {
+              it->second = std::min(it->second, s);
+            }
+          }
+          continue;
+        }
+        flood.labels[n] = flood.labels[c];
+        flood.filled[n] = std::max(h[n], flood.filled[c]);
+        queue.push({flood.filled[n], n});
+      }
+    }
+
+    if (edges != nullptr) {
+      for (const auto& [key, height] : spill) {
+        edges->push_back({u32(key >> 32), u32(key), height});
+      }
+    }
+  }
+
+  void loadTile(const hydrology::TileSource& source, const TileKey& key, std::vector<float>& h) {
+    HeightTile tile;
+    tile.key = key;
+    source(key, tile);
+    h.resize(CELLS);
+    for (int z = 0; z < TS; z++) {
+      for (int x = 0; x < TS; x++) {
+        h[z * TS + x] = tile.at(x, z);
+      }
+    }
+  }
+
+  /**
+   * Everything the passes share: the grid, the tile summaries and the filled levels and global
+   * order of the labels.
+   */
+  struct Solver {
+    const FlowGrid& grid;
+    std::vector<TileSummary> tiles;
+    std::vector<float> label_level;
+    std::vector<u32> label_order;
+
+    // Tile and cell of the neighbour `d` of `cell` in `tile`, false outside of the grid
+    bool neighbour(usize tile, int cell, int d, usize* out_tile, int* out_cell) const {
+      int x = cell % TS + DX[d];
+      int z = cell / TS + DZ[d];
+      int tx = int(tile % grid.tiles_x) + (x < 0 ? -1 : x >= TS ? 1 : 0);
+      int tz = int(tile / grid.tiles_x) + (z < 0 ? -1 : z >= TS ? 1 : 0);
+      if (tx < 0 || tz < 0 || tx >= grid.tiles_x || tz >= grid.tiles_z) {
+        return false;
+      }
+      *out_tile = usize(tz) * grid.tiles_x + tx;
+      *out_cell = ((z + TS) % TS) * TS + (x + TS) % TS;
+      return true;
+    }
+
+    u32 globalLabel(usize tile, u32 local_label) const {
+      return tiles[tile].label_base + local_label - 1;
+    }
+
+    // Flood order key of an edge cell as the start of a flood: filled height, then label order
+    std::pair<float, u32> edgeKey(usize tile, int rim_index) const {
+      const auto& summary = tiles[tile];
+      u32 label = this->globalLabel(tile, summary.labels[rim_index]);
+      return {std::max(summary.heights[rim_index], label_level[label]), label_order[label]};
+    }
+
+    struct RouteEntry {
+      float height;
+      u32 order;
+      u8 rank;  // entries from a neighbour, then flood starts with a direction, then without
+      int cell;
+      int from;  // -1 for a flood start
+
+      bool operator>(const RouteEntry& other) const {
+        if (height != other.height) return height > other.height;
+        if (order != other.order) return order > other.order;
+        if (rank != other.rank) return rank > other.rank;
+        return cell > other.cell;
+      }
+    };
+
+    /**
+     * Flow directions of the tile and the order in which every cell comes after all cells
+     * flowing into it. Returns the number of sinks.
+     */
+    u64 route(usize tile, const std::vector<float>& h, std::vector<u8>& dirs,
+              std::vector<int>& topological) const {
+      const auto& rim = perimeter();
+      Flood flood;
+      floodTile(h, flood, nullptr);
+
+      std::vector<float> filled(CELLS);
+      for (int c = 0; c < CELLS; c++) {
+        u32 label = this->globalLabel(tile, flood.labels[c]);
+        filled[c] = std::max(flood.filled[c], label_level[label]);
+      }
+
+      // A flood start flows off the grid or to the earliest start in another tile that comes
+      // before it. Starts that have one go first, so a flat at a label's level is flooded from
+      // them instead of ending in a sink
+      std::array<u8, PERIMETER> start_dirs;
+      start_dirs.fill(FLOW_SINK);
+      dirs.assign(CELLS, FLOW_SINK);
+      std::vector<u8> popped(CELLS, 0);
+      std::vector<u8> pushed(CELLS, 0);
+      std::priority_queue<RouteEntry, std::vector<RouteEntry>, std::greater<RouteEntry>> queue;
+      for (int i = 0; i < PERIMETER; i++) {
+        int cell = rim.cells[i];
+        auto own = this->edgeKey(tile, i);
+        auto best = own;
+        for (int d = 0; d < 8; d++) {
+          usize other_tile;
+          int other_cell;
+          if (downstream(cell, u8(d)) >= 0) {
+            continue;
+          }
+          if (!this->neighbour(tile, cell, d, &other_tile, &other_cell)) {
+            start_dirs[i] = FLOW_OUT;
+            break;
+          }
+          auto key = this->edgeKey(other_tile, rim.index[other_cell]);
+          if (key < best) {
+            best = key;
+            start_dirs[i] = u8(d);
+          }
+        }
+        u8 rank = start_dirs[i] == FLOW_SINK ? 2 : 1;
+        queue.push({own.first, own.second, rank, cell, -1});
+      }
+
+      u64 sinks = 0;
+      while (!queue.empty()) {
+        RouteEntry e = queue.top();
+        queue.pop();
+        if (popped[e.cell]) {
+          continue;
+        }
+        popped[e.cell] = 1;
+
+        int x = e.cell % TS;
+        int z = e.cell / TS;
+        if (e.from >= 0) {
+          int dx = e.from % TS - x;
+          int dz = e.from / TS - z;
+          for (int d = 0; d < 8; d++) {
+            if (DX[d] == dx && DZ[d] == dz) {
+              dirs[e.cell] = u8(d);
+            }
+          }
+        } else {
+          dirs[e.cell] = start_dirs[rim.index[e.cell]];
+          sinks += dirs[e.cell] == FLOW_SINK;
+        }
+
+        for (int d = 0; d < 8; d++) {
+          int nx = x + DX[d];
+          int nz = z + DZ[d];
+          if (nx < 0 || nz < 0 || nx >= TS || nz >= TS) {
+            continue;
+          }
+          int n = nz * TS + nx;
+          if (popped[n] || pushed[n]) {
+            continue;
+          }
+          pushed[n] = 1;
+          queue.push({std::max(filled[n], e.height), e.order, 0, n, e.cell});
+        }
+      }
+
+      // Kahn's algorithm over the flow within the tile
+      std::vector<u8> inflows(CELLS, 0);
+      for (int c = 0; c < CELLS; c++) {
+        int t = this->downstream(c, dirs[c]);
+        if (t >= 0) {
+          inflows[t] += 1;
+        }
+      }
+      topological.clear();
+      topological.reserve(CELLS);
+      for (int c = 0; c < CELLS; c++) {
+        if (inflows[c] == 0) {
+          topological.push_back(c);
+        }
+      }
+      for (usize i = 0; i < topological.size(); i++) {
+        int t = this->downstream(topological[i], dirs[topological[i]]);
+        if (t >= 0 && --inflows[t] == 0) {
+          topological.push_back(t);
+        }
+      }
+
+      return sinks;
+    }
+
+    // The cell within the tile that `cell` flows to, -1 when it leaves the tile or ends
+    static int downstream(int cell, u8 dir) {
+      if (dir >= 8) {
+        return -1;
+      }
+      int x = cell % TS + DX[dir];
+      int z = cell / TS + DZ[dir];
+      return x >= 0 && z >= 0 && x < TS && z < TS ? z * TS + x : -1;
+    }
+  };
+}  // namespace
+
+FlowStats hydrology::computeFlow(const FlowGrid& grid, const TileSource& source,
+                                 const TileSink& sink, const CancelCheck& cancelled) {
+  using Clock = std::chrono::steady_clock;
+  auto* jobs = JobSystem::instance();
+  const auto& rim = perimeter();
+
+  FlowStats stats;
+  // Polled by the workers, once it returned true the remaining tiles are skipped
+  std::atomic<bool> stopped{false};
+  auto stop = [&]() {
+    if (!stopped.load(std::memory_order_relaxed) && cancelled && cancelled()) {
+      stopped = true;
+    }
+    return stopped.load(std::memory_order_relaxed);
+  };
+  stats.tiles = grid.tileCount();
+  stats.cells = u64(stats.tiles) * CELLS;
+  stats.threads = jobs->threadCount() + 1;
+
+  Solver solver{grid};
+  solver.tiles.resize(grid.tileCount());
+
+  // Pass 1: label the tiles and their spill heights
+  auto start = Clock::now();
+  jobs->parallelFor(grid.tileCount(), 1, [&](usize begin, usize end) {
+    std::vector<float> h;
+    Flood flood;
+    for (usize t = begin; t < end && !stop(); t++) {
+      loadTile(source, grid.key(t), h);
+      auto& summary = solver.tiles[t];
+      floodTile(h, flood, &summary.edges);
+      summary.label_count = flood.label_count;
+      summary.heights.resize(PERIMETER);
+      summary.labels.resize(PERIMETER);
+      for (int i = 0; i < PERIMETER; i++) {
+        summary.heights[i] = h[rim.cells[i]];
+        summary.labels[i] = flood.labels[rim.cells[i]];
+      }
+    }
+  });
+
+  if (stop()) {
+    stats.cancelled = true;
+    return stats;
+  }
+
+  // The spill graph: labels within the tiles, the edge cells between them and the grid border
+  u32 label_count = 1;
+  for (auto& summary : solver.tiles) {
+    summary.label_base = label_count;
+    label_count += summary.label_count;
+  }
+  std::vector<Edge> edges;
+  for (usize t = 0; t < solver.tiles.size(); t++) {
+    auto& summary = solver.tiles[t];
+    for (const auto& edge : summary.edges) {
+      edges.push_back({solver.globalLabel(t, edge.a), solver.globalLabel(t, edge.b), edge.height});
+    }
+    summary.edges = {};
+
+    for (int i = 0; i < PERIMETER; i++) {
+      u32 label = solver.globalLabel(t, summary.labels[i]);
+      for (int d = 0; d < 8; d++) {
+        usize other_tile;
+        int other_cell;
+        if (!solver.neighbour(t, rim.cells[i], d, &other_tile, &other_cell)) {
+          edges.push_back({label, BORDER_LABEL, summary.heights[i]});
+        } else if (other_tile > t) {
+          int j = rim.index[other_cell];
+          if (j >= 0) {
+            const auto& other = solver.tiles[other_tile];
+            float height = std::max(summary.heights[i], other.heights[j]);
+            edges.push_back({label, solver.globalLabel(other_tile, other.labels[j]), height});
+          }
+        }
+      }
+    }
+  }
+  stats.labels = label_count - 1;
+  stats.graph_edges = edges.size();
+
+  // Minimax distance from the border: the level each label is filled to before it spills over
+  std::vector<u32> edge_offsets(label_count + 1, 0);
+  for (const auto& edge : edges) {
+    edge_offsets[edge.a + 1] += 1;
+    edge_offsets[edge.b + 1] += 1;
+  }
+  for (u32 i = 0; i < label_count; i++) {
+    edge_offsets[i + 1] += edge_offsets[i];
+  }
+  std::vector<std::pair<u32, float>> adjacency(edge_offsets.back());
+  {
+    std::vector<u32> fill = edge_offsets;
+    for (const auto& edge : edges) {
+      adjacency[fill[edge.a]++] = {edge.b, edge.height};
+      adjacency[fill[edge.b]++] = {edge.a, edge.height};
+    }
+  }
+  edges = {};
+
+  solver.label_level.assign(label_count, INF);
+  solver.label_order.assign(label_count, ~0u);
+  {
+    using Entry = std::pair<float, u32>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+    solver.label_level[BORDER_LABEL] = -INF;
+    queue.push({-INF, BORDER_LABEL});
+    u32 order = 0;
+    while (!queue.empty()) {
+      auto [level, label] = queue.top();
+      queue.pop();
+      if (solver.label_order[label] != ~0u) {
+        continue;
+      }
+      solver.label_order[label] = order++;
+      for (u32 i = edge_offsets[label]; i < edge_offsets[label + 1]; i++) {
+        auto [other, height] = adjacency[i];
+        float through = std::max(level, height);
+        if (through < solver.label_level[other]) {
+          solver.label_level[other] = through;
+          queue.push({through, other});
+        }
+      }
+    }
+  }
+  stats.fill_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  // Pass 2: directions and the accumulation within each tile
+  start = Clock::now();
+  std::atomic<u64> sinks{0};
+  jobs->parallelFor(grid.tileCount(), 1, [&](usize begin, usize end) {
+    std::vector<float> h;
+    std::vector<u8> dirs;
+    std::vector<int> topological;
+    std::vector<float> accumulation(CELLS);
+    std::vector<int> exit(CELLS);
+    for (usize t = begin; t < end && !stop(); t++) {
+      loadTile(source, grid.key(t), h);
+      sinks += solver.route(t, h, dirs, topological);
+
+      std::fill(accumulation.begin(), accumulation.end(), 1.0f);
+      for (int c : topological) {
+        int down = Solver::downstream(c, dirs[c]);
+        if (down >= 0) {
+          accumulation[down] += accumulation[c];
+        }
+      }
+      // Downstream first, so where the flow of a cell leaves the tile is known
+      for (auto it = topological.rbegin(); it != topological.rend(); ++it) {
+        int down = Solver::downstream(*it, dirs[*it]);
+        exit[*it] = down >= 0 ? exit[down] : dirs[*it] < 8 ? *it : -1;
+      }
+
+      auto& summary = solver.tiles[t];
+      summary.local_accumulation.resize(PERIMETER);
+      summary.exit.resize(PERIMETER);
+      summary.target.assign(PERIMETER, -1);
+      summary.inflow.assign(PERIMETER, 0.0f);
+      for (int i = 0; i < PERIMETER; i++) {
+        int c = rim.cells[i];
+        summary.local_accumulation[i] = accumulation[c];
+        summary.exit[i] = exit[c] >= 0 ? rim.index[exit[c]] : -1;
+
+        usize other_tile;
+        int other_cell;
+        if (dirs[c] < 8 && Solver::downstream(c, dirs[c]) < 0
+            && solver.neighbour(t, c, dirs[c], &other_tile, &other_cell)) {
+          summary.target[i] = i64(other_tile) * PERIMETER + rim.index[other_cell];
+        }
+      }
+    }
+  });
+  stats.sinks = sinks.load();
+  if (stop()) {
+    stats.cancelled = true;
+    return stats;
+  }
+
+  // Between the tiles: the total of every cell that flows into another tile, upstream first
+  {
+    usize node_count = grid.tileCount() * PERIMETER;
+    auto tile_of = [](i64 node) { return usize(node / PERIMETER); };
+    auto cell_of = [](i64 node) { return int(node % PERIMETER); };
+
+    // The next crossing downstream of a crossing cell
+    auto next_crossing = [&](i64 node) -> i64 {
+      const auto& summary = solver.tiles[tile_of(node)];
+      i64 entered = summary.target[cell_of(node)];
+      if (entered < 0) {
+        return -1;
+      }
+      int exit = solver.tiles[tile_of(entered)].exit[cell_of(entered)];
+      return exit >= 0 ? i64(tile_of(entered)) * PERIMETER + exit : -1;
+    };
+
+    std::vector<float> total(node_count, 0.0f);
+    std::vector<u32> upstream(node_count, 0);
+    for (usize node = 0; node < node_count; node++) {
+      const auto& summary = solver.tiles[tile_of(node)];
+      if (summary.target[cell_of(node)] >= 0) {
+        total[node] = summary.local_accumulation[cell_of(node)];
+        i64 next = next_crossing(node);
+        if (next >= 0) {
+          upstream[next] += 1;
+        }
+      }
+    }
+
+    std::vector<i64> ready;
+    for (usize node = 0; node < node_count; node++) {
+      if (solver.tiles[tile_of(node)].target[cell_of(node)] >= 0 && upstream[node] == 0) {
+        ready.push_back(i64(node));
+      }
+    }
+    while (!ready.empty()) {
+      i64 node = ready.back();
+      ready.pop_back();
+
+      i64 entered = solver.tiles[tile_of(node)].target[cell_of(node)];
+      solver.tiles[tile_of(entered)].inflow[cell_of(entered)] += total[node];
+
+      i64 next = next_crossing(node);
+      if (next >= 0) {
+        total[next] += total[node];
+        if (--upstream[next] == 0) {
+          ready.push_back(next);
+        }
+      }
+    }
+  }
+  for (const auto& summary : solver.tiles) {
+    stats.summary_bytes += summary.bytes();
+  }
+  stats.summary_bytes += solver.label_level.size() * (sizeof(float) + sizeof(u32));
+  stats.route_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  // Pass 3: the accumulation within each tile plus what enters over its edge
+  start = Clock::now();
+  std::mutex max_mutex;
+  jobs->parallelFor(grid.tileCount(), 1, [&](usize begin, usize end) {
+    std::vector<float> h;
+    std::vector<u8> dirs;
+    std::vector<int> topological;
+    std::vector<float> accumulation(CELLS);
+    for (usize t = begin; t < end && !stop(); t++) {
+      loadTile(source, grid.key(t), h);
+      solver.route(t, h, dirs, topological);
+
+      const auto& summary = solver.tiles[t];
+      std::fill(accumulation.begin(), accumulation.end(), 1.0f);
+      for (int i = 0; i < PERIMETER; i++) {
+        accumulation[rim.cells[i]] += summary.inflow[i];
+      }
+      for (int c : topological) {
+        int down = Solver::downstream(c, dirs[c]);
+        if (down >= 0) {
+          accumulation[down] += accumulation[c];
+        }
+      }
+
+      float tile_max = *std::max_element(accumulation.begin(), accumulation.end());
+      {
+        std::lock_guard<std::mutex> lock(max_mutex);
+        stats.max_accumulation = std::max(stats.max_accumulation, tile_max);
+      }
+      sink(t, accumulation);
+    }
+  });
+  stats.accumulate_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  stats.cancelled = stopped.load();
+
+  return stats;
+}
+
+HydrologyStage::~HydrologyStage() { this->cancel(); }
+
+void HydrologyStage::deinit() {
+  this->cancel();
+  glDeleteTextures(1, &this->texture);
+  this->texture = 0;
+  this->texture_resolution = 0;
+}
+
+void HydrologyStage::cancel() {
+  this->shared->generation += 1;
+  this->shared = std::make_shared<Shared>();
+  this->running = false;
+}
+
+void HydrologyStage::start(const TileBaker& baker, const TerrainNoise& noise,
+                           glm::vec3 camera_position) {
+  this->cancel();
+
+  FlowGrid grid;
+  grid.noise_hash = noise::hash(noise);
+  grid.lod = glm::clamp(this->lod, 0, 8);
+  int count = glm::clamp(this->tiles, 1, 64);
+  TileKey middle
+      = baker.tileAt(grid.noise_hash, grid.lod, glm::vec2(camera_position.x, camera_position.z));
+  grid.tile_x = middle.x - count / 2;
+  grid.tile_z = middle.z - count / 2;
+  grid.tiles_x = count;
+  grid.tiles_z = count;
+
+  // Each map texel keeps the largest accumulation of the cells it covers
+  int resolution = glm::clamp(this->map_resolution, 64, 4096);
+  int cells_per_texel = 1;
+  while (cells_per_texel < TILE_SIZE && count * TILE_SIZE / (cells_per_texel * 2) >= resolution) {
+    cells_per_texel *= 2;
+  }
+  resolution = count * TILE_SIZE / cells_per_texel;
+
+  this->running = true;
+  this->running_tiles = grid.tileCount();
+  this->running_origin = baker.tileOrigin(grid.key(0));
+  this->running_size = count * baker.tileWorldSize(grid.lod);
+
+  auto shared = this->shared;
+  u32 generation = shared->generation.load();
+  auto job = [shared, generation, baker, noise, grid, resolution, cells_per_texel]() {
+    std::vector<float> map(usize(resolution) * resolution, 0.0f);
+
+    auto source = [&](const TileKey& key, HeightTile& tile) { baker.bakeTile(noise, tile); };
+    // The tiles cover disjoint texels of the map
+    auto sink = [&](usize t, const std::vector<float>& accumulation) {
+      int texels = TILE_SIZE / cells_per_texel;
+      int x0 = int(t % grid.tiles_x) * texels;
+      int z0 = int(t / grid.tiles_x) * texels;
+      for (int z = 0; z < TILE_SIZE; z++) {
+        for (int x = 0; x < TILE_SIZE; x++) {
+          int row = z0 + z / cells_per_texel;
+          float& texel = map[usize(row) * resolution + x0 + x / cells_per_texel];
+          texel = std::max(texel, std::log2(accumulation[z * TILE_SIZE + x]));
+        }
+      }
+      shared->tiles_done += 1;
+    };
+
+    auto cancelled = [&]() { return shared->generation.load() != generation; };
+    if (cancelled()) {
+      return;
+    }
+    // Stops between tiles once the stage moved on, so the workers are free for the other stages
+    auto stats = hydrology::computeFlow(grid, source, sink, cancelled);
+    if (stats.cancelled) {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(shared->mutex);
+    shared->map = std::move(map);
+    shared->stats = stats;
+    shared->finished = true;
+  };
+  JobSystem::instance()->submit(job);
+}
+
+void HydrologyStage::update(const TerrainNoise& noise) {
+  u64 hash = noise::hash(noise);
+  if (hash != this->noise_hash) {
+    this->cancel();
+    this->noise_hash = hash;
+    this->map_size = 0.0f;
+  }
+
+  if (!this->running) {
+    return;
+  }
+
+  std::vector<float> map;
+  {
+    std::lock_guard<std::mutex> lock(this->shared->mutex);
+    if (!this->shared->finished) {
+      return;
+    }
+    map = std::move(this->shared->map);
+    this->last_stats = this->shared->stats;
+  }
+  this->shared = std::make_shared<Shared>();
+  this->running = false;
+
+  int resolution = int(std::lround(std::sqrt(double(map.size()))));
+  if (resolution != this->texture_resolution) {
+    glDeleteTextures(1, &this->texture);
+    glCreateTextures(GL_TEXTURE_2D, 1, &this->texture);
+    glTextureStorage2D(this->texture, 1, GL_R32F, resolution, resolution);
+    glTextureParameteri(this->texture, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTextureParameteri(this->texture, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTextureParameteri(this->texture, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTextureParameteri(this->texture, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    this->texture_resolution = resolution;
+  }
+  glTextureSubImage2D(this->texture, 0, 0, 0, resolution, resolution, GL_RED, GL_FLOAT,
+                      map.data());
+  CHECK_GL_ERROR();
+
+  this->map_origin = this->running_origin;
+  this->map_size = this->running_size;
+}
+
+void HydrologyStage::setUniforms(GLuint program) const {
+  bool enabled = this->show_rivers && this->map_size > 0.0f;
+  glBindTextureUnit(TEXTURE_UNIT, this->texture);
+  gpu::setUniformSlow(program, "flowMap.enabled", (GLint)enabled);
+  gpu::setUniformSlow(program, "flowMap.origin", this->map_origin);
+  gpu::setUniformSlow(program, "flowMap.size", this->map_size);
+  gpu::setUniformSlow(program, "flowMap.wet_threshold", this->wet_threshold);
+  gpu::setUniformSlow(program, "flowMap.river_threshold", this->river_threshold);
+}
+
+void HydrologyStage::gui(const TileBaker& baker, const TerrainNoise& noise,
+                         glm::vec3 camera_position) {
+  ImGui::SliderInt("Flow LOD", &this->lod, 0, 6);
+  ImGui::SliderInt("Flow tiles per side", &this->tiles, 1, 64);
+  ImGui::SliderInt("Flow map resolution", &this->map_resolution, 256, 4096);
+  int cells = glm::clamp(this->tiles, 1, 64) * TILE_SIZE;
+  ImGui::Text("Grid: %d x %d cells, %.1f km", cells, cells,
+              cells * baker.texelSize(glm::clamp(this->lod, 0, 8)) / 1000.0f);
+
+  if (this->running) {
+    ImGui::Text("Computing... %zu / %zu tiles", this->shared->tiles_done.load(),
+                this->running_tiles);
+    if (ImGui::Button("Cancel flow")) {
+      this->cancel();
+    }
+  } else if (ImGui::Button("Compute rivers around camera")) {
+    this->start(baker, noise, camera_position);
+  }
+
+  ImGui::Checkbox("Show rivers", &this->show_rivers);
+  ImGui::SliderFloat("Wet soil from (log2 cells)", &this->wet_threshold, 0.0f, 20.0f);
+  ImGui::SliderFloat("Rivers from (log2 cells)", &this->river_threshold, 0.0f, 24.0f);
+
+  const auto& stats = this->last_stats;
+  if (stats.tiles > 0) {
+    ImGui::Text("%zu tiles, %zu labels, %zu spill edges, %llu sinks", stats.tiles, stats.labels,
+                stats.graph_edges, (unsigned long long)stats.sinks);
+    ImGui::Text("Fill %.0f ms, route %.0f ms, accumulate %.0f ms on %d threads",
+                stats.fill_seconds * 1e3, stats.route_seconds * 1e3,
+                stats.accumulate_seconds * 1e3, stats.threads);
+    ImGui::Text("%.1f M cells/s, %.1f MB of tile summaries, largest basin %.0f cells",
+                stats.cellsPerSecond() / 1e6, stats.summary_bytes / 1e6,
+                stats.max_accumulation);
+  }
+}
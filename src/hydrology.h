@@ -0,0 +1,144 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "baker.h"
+#include "core.h"
+#include "noise.h"
+
+/**
+ * A rectangle of `tiles_x` * `tiles_z` tiles of one LOD, the cells are the tile texels.
+ */
+struct FlowGrid {
+  u64 noise_hash = 0;
+  int lod = 0;
+  int tile_x = 0;  // first tile
+  int tile_z = 0;
+  int tiles_x = 0;
+  int tiles_z = 0;
+
+  usize tileCount() const { return usize(tiles_x) * tiles_z; }
+  TileKey key(usize tile) const {
+    return TileKey{noise_hash, lod, tile_x + int(tile % tiles_x), tile_z + int(tile / tiles_x)};
+  }
+};
+
+struct FlowStats {
+  usize tiles = 0;
+  u64 cells = 0;
+  usize labels = 0;       // watersheds draining to a tile edge, the nodes of the spill graph
+  usize graph_edges = 0;  // spill graph edges within and between tiles
+  u64 sinks = 0;          // cells whose flow ends inside the grid
+  float max_accumulation = 0.0f;
+  usize summary_bytes = 0;  // kept per tile between the passes, instead of the whole grid
+  int threads = 0;
+  double fill_seconds = 0.0;
+  double route_seconds = 0.0;
+  double accumulate_seconds = 0.0;
+  bool cancelled = false;  // stopped early, the sink did not get every tile
+
+  double seconds() const { return fill_seconds + route_seconds + accumulate_seconds; }
+  double cellsPerSecond() const { return seconds() > 0.0 ? cells / seconds() : 0.0; }
+};
+
+namespace hydrology {
+  // Heights of a tile in meters, apron included, see HeightTile
+  using TileSource = std::function<void(const TileKey& key, HeightTile& tile)>;
+  // Flow accumulation of a tile in cells, TILE_SIZE^2 row major. Called from the workers.
+  using TileSink = std::function<void(usize tile, const std::vector<float>& accumulation)>;
+  // Polled between the tiles, the computation stops once it returns true
+  using CancelCheck = std::function<bool()>;
+
+  /**
+   * Depression filling, D8 flow directions and flow accumulation over `grid`, water leaves the
+   * grid over its outer edge. Only per tile summaries of the tile edges are kept in memory, so
+   * every tile is requested from `source` three times, one at a time per worker:
+   *
+   * 1. Fill: a priority-flood (Barnes 2014) from the tile edge labels each cell with the edge
+   *    cells it drains to and collects the lowest spill height between neighbouring labels. The
+   *    labels of all tiles form a graph with the spill heights between tile edge cells, whose
+   *    minimax distance from the grid border is the level every label is filled to (Barnes 2016).
+   * 2. Route: a second flood over the filled heights gives each cell a direction: towards the
+   *    cell it was flooded from, or for edge cells that start a flood, the lowest neighbour in
+   *    another tile that comes earlier in the global order. Following the directions always
+   *    reaches an earlier flood start, so there are no cycles, also on the flats of filled
+   *    depressions. The accumulation within the tile and where the flow entering each edge cell
+   *    leaves the tile is kept, the flow between tiles is then resolved on the edge cells alone
+   *    (Barnes 2017).
+   * 3. Accumulate: the route is repeated and the inflow of the edge cells added downstream.
+   *
+   * A large grid keeps every worker busy for a while, so `cancelled` is checked before each tile
+   * and between the passes.
+   */
+  FlowStats computeFlow(const FlowGrid& grid, const TileSource& source, const TileSink& sink,
+                        const CancelCheck& cancelled = nullptr);
+}  // namespace hydrology
+
+/**
+ * Runs the flow computation over the tiles around the camera in the background and keeps a
+ * downsampled log2 of the flow accumulation as a texture for the river and wet soil masks of
+ * terrain.frag.
+ */
+class HydrologyStage {
+public:
+  static constexpr int TEXTURE_UNIT = 17;
+
+  int lod = 1;
+  // Tiles per side, 64 tiles of 256 texels make a 16k x 16k grid
+  int tiles = 8;
+  int map_resolution = 1024;
+
+  bool show_rivers = true;
+  // log2 of the upstream area in cells where the soil starts to get wet and where rivers start
+  float wet_threshold = 7.0f;
+  float river_threshold = 11.0f;
+
+  ~HydrologyStage();
+  void deinit();
+
+  /**
+   * Start computing the grid around `camera_position`, replacing a computation still running.
+   */
+  void start(const TileBaker& baker, const TerrainNoise& noise, glm::vec3 camera_position);
+  void cancel();
+
+  /**
+   * Call once per frame from the main thread, uploads a finished map. Drops the map when the noise
+   * changed.
+   */
+  void update(const TerrainNoise& noise);
+
+  void setUniforms(GLuint program) const;
+  void gui(const TileBaker& baker, const TerrainNoise& noise, glm::vec3 camera_position);
+
+private:
+  // Shared with the job, which may outlive the stage
+  struct Shared {
+    std::atomic<u32> generation{0};
+    std::atomic<usize> tiles_done{0};
+
+    std::mutex mutex;
+    bool finished = false;
+    std::vector<float> map;
+    FlowStats stats;
+  };
+
+  std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+  bool running = false;
+  usize running_tiles = 0;
+
+  GLuint texture = 0;
+  int texture_resolution = 0;
+  u64 noise_hash = 0;
+  glm::vec2 map_origin = glm::vec2(0.0f);
+  float map_size = 0.0f;
+  glm::vec2 running_origin = glm::vec2(0.0f);
+  float running_size = 0.0f;
+  FlowStats last_stats;
+};
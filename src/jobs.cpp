@@ -0,0 +1,114 @@
+#include "jobs.h"
+
+#include <algorithm>
+#include <memory>
+
+void JobSystem::init(int thread_count) {
+  if (thread_count <= 0) {
+    thread_count = std::max(1, int(std::thread::hardware_concurrency()) - 1);
+  }
+
+  this->stopping = false;
+  for (int i = 0; i < thread_count; i++) {
+    this->workers.emplace_back([this]() { this->workerLoop(); });
+  }
+}
+
+void JobSystem::deinit() {
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->stopping = true;
+    this->queue = {};
+  }
+  this->wake_up.notify_all();
+
+  for (auto& worker : this->workers) {
+    worker.join();
+  }
+  this->workers.clear();
+}
+
+usize JobSystem::queuedJobs() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->queue.size();
+}
+
+void JobSystem::submit(Job job, int priority) {
+  if (this->workers.empty()) {
+    job();
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->queue.push(QueuedJob{priority, this->next_sequence++, std::move(job)});
+  }
+  this->wake_up.notify_one();
+}
+
+void JobSystem::workerLoop() {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->wake_up.wait(lock, [this]() { return this->stopping || !this->queue.empty(); });
+      if (this->stopping) {
+        return;
+      }
+
+      // priority_queue::top() is const, the job is moved out right before it is popped
+      job = std::move(const_cast<QueuedJob&>(this->queue.top()).job);
+      this->queue.pop();
+    }
+
+    job();
+  }
+}
+
+void JobSystem::parallelFor(usize count, usize grain,
+                            const std::function<void(usize, usize)>& body, int priority) {
+  grain = std::max<usize>(grain, 1);
+  usize range_count = (count + grain - 1) / grain;
+  if (range_count == 0) {
+    return;
+  }
+
+  // Helpers may only start after the loop is finished, so everything they touch is kept alive by
+  // them and they never call `body` once all ranges are claimed
+  struct Loop {
+    std::atomic<usize> next_range{0};
+    std::atomic<usize> done_ranges{0};
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+  auto loop = std::make_shared<Loop>();
+
+  using Body = std::function<void(usize, usize)>;
+  auto run_ranges = [loop, count, grain, range_count](const Body* f) {
+    while (true) {
+      usize range = loop->next_range.fetch_add(1);
+      if (range >= range_count) {
+        return;
+      }
+
+      usize begin = range * grain;
+      (*f)(begin, std::min(begin + grain, count));
+
+      if (loop->done_ranges.fetch_add(1) + 1 == range_count) {
+        std::lock_guard<std::mutex> lock(loop->mutex);
+        loop->finished.notify_all();
+      }
+    }
+  };
+
+  usize helper_count = std::min(range_count - 1, this->workers.size());
+  const Body* body_ptr = &body;
+  for (usize i = 0; i < helper_count; i++) {
+    this->submit([run_ranges, body_ptr]() { run_ranges(body_ptr); }, priority);
+  }
+
+  run_ranges(body_ptr);
+
+  std::unique_lock<std::mutex> lock(loop->mutex);
+  loop->finished.wait(lock, [&]() { return loop->done_ranges.load() == range_count; });
+}
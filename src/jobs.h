@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "core.h"
+
+/**
+ * Fixed pool of worker threads pulling jobs from a shared priority queue.
+ *
+ * Jobs with a lower priority value run first, jobs of equal priority run in submission order.
+ * Without init() (or with zero workers) every job runs inline on the submitting thread.
+ */
+class JobSystem {
+public:
+  using Job = std::function<void()>;
+
+  // Jobs call this from the workers, so it is a function local static which C++11 initializes
+  // once even when the first calls race
+  static JobSystem* instance() {
+    static JobSystem job_system;
+    return &job_system;
+  }
+
+  ~JobSystem() { this->deinit(); }
+
+  /**
+   * Start `thread_count` workers, or one less than the number of hardware threads when 0 so the
+   * main thread keeps a core to itself.
+   */
+  void init(int thread_count = 0);
+
+  /**
+   * Drop the queued jobs and join the workers once their current job is done.
+   */
+  void deinit();
+
+  int threadCount() const { return int(workers.size()); }
+  usize queuedJobs();
+
+  void submit(Job job, int priority = 0);
+
+  /**
+   * Call `body(begin, end)` on ranges of at most `grain` items covering [0, count) and return once
+   * all of them are done. The calling thread works on the ranges too, so this may be called from
+   * inside a job without deadlocking.
+   */
+  void parallelFor(usize count, usize grain, const std::function<void(usize, usize)>& body,
+                   int priority = 0);
+
+private:
+  struct QueuedJob {
+    int priority;
+    u64 sequence;
+    Job job;
+  };
+
+  struct RunsLater {
+    bool operator()(const QueuedJob& a, const QueuedJob& b) const {
+      if (a.priority != b.priority) {
+        return a.priority > b.priority;
+      }
+      return a.sequence > b.sequence;
+    }
+  };
+
+  std::mutex mutex;
+  std::condition_variable wake_up;
+  std::priority_queue<QueuedJob, std::vector<QueuedJob>, RunsLater> queue;
+  std::vector<std::thread> workers;
+  u64 next_sequence = 0;
+  bool stopping = false;
+
+  void workerLoop();
+};
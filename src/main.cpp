@@ -10,8 +10,10 @@
 #include <chrono>
 #include <cmath>
 #include <cstdlib>
+#include <iostream>
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
+#include <vector>
 
 #include "gpu.h"
 using namespace glm;
@@ -19,8 +21,12 @@ using namespace glm;
 #include "camera.h"
 #include "core.h"
 #include "debug.h"
+#include "demexport.h"
+#include "demimport.h"
 #include "fbo.h"
 #include "hdr.h"
+#include "heightfield.h"
+#include "jobs.h"
 #include "model.h"
 #include "postfx.h"
 #include "shadowmap.h"
@@ -28,6 +34,8 @@ using namespace glm;
 #include "water.h"
 
 constexpr vec3 worldUp(0.0f, 1.0f, 0.0f);
+// Exit code of --test-atlas without a GL context, SKIP_RETURN_CODE of the ctest test
+constexpr int TEST_SKIPPED = 77;
 
 struct App {
   struct Window {
@@ -61,6 +69,19 @@ struct App {
 
   Terrain terrain;
   ShadowMap shadow_map;
+
+  // A loaded DEM drawn as a displaced grid next to the procedural terrain, loaded when enabled.
+  // An image or a tile file of --import-dem, which brings its own size and heights in meters
+  struct LoadedHeightField {
+    HeightField field;
+    std::string path = "resources/models/nlsFinland/L3123F.png";
+    bool enabled = false;
+    int resolution = 1024;
+    float size = 6000.0f;          // meters per side, the NLS tiles have 2 m texels
+    float height_scale = 600.0f;  // meters at the brightest texel
+    vec3 position = vec3(0.0f, 0.0f, 0.0f);
+    vec3 color = vec3(0.55f, 0.5f, 0.4f);
+  } height_field;
   Water water;
   PostFX postfx;
 
@@ -74,11 +95,15 @@ struct App {
   GLuint simple_shader_program;  // Shader used to draw the shadow map
   GLuint background_program;
   GLuint debug_program;
+  GLuint heightfield_program;
 
   bool fighter_draggable = false;
   mat4 fighter_model_matrix = translate(vec3(0, 500, 0));
   mat4 shrek_model_matrix = translate(vec3(-50, 500, 0));
   mat4 material_test_matrix = translate(vec3(50, 500, 0));
+  float fighter_hover_height = 20.0f;
+  // Terrain noise version the models were last placed for
+  u32 models_noise_version = 0;
 
   struct DebugLight {
     mat4 model_matrix = glm::translate(vec3(50.0, 505, 0.0));
@@ -115,6 +140,10 @@ struct App {
                                     is_reload);
     if (shader != 0) debug_program = shader;
 
+    shader = gpu::loadShaderProgram("resources/shaders/heightfield.vert",
+                                    "resources/shaders/heightfield.frag", is_reload);
+    if (shader != 0) heightfield_program = shader;
+
     this->terrain.loadShader(is_reload);
     this->water.loadShader(is_reload);
     this->postfx.loadShader(is_reload);
@@ -122,8 +151,14 @@ struct App {
     DebugDrawer::instance()->loadShaders(is_reload);
   }
 
-  void init() {
+  // False when no window with a GL 4.5 context could be created
+  bool init() {
+    JobSystem::instance()->init();
+
     window.handle = gpu::init_window_SDL("OpenGL Project");
+    if (window.handle == nullptr) {
+      return false;
+    }
 
     glEnable(GL_DEPTH_TEST);  // enable Z-buffering
     glEnable(GL_CULL_FACE);   // enables backface culling
@@ -160,6 +195,7 @@ struct App {
     terrain.init();
     water.init();
     postfx.init();
+    return true;
   }
 
   void deinit() {
@@ -167,6 +203,8 @@ struct App {
     water.deinit();
     shadow_map.deinit();
     postfx.deinit();
+    height_field.field.deleteBuffers();
+    HeightField::deleteSharedIndexBuffers();
 
     gpu::freeModel(models.fighter);
     gpu::freeModel(models.landingpad);
@@ -174,6 +212,8 @@ struct App {
     gpu::freeModel(models.sphere);
 
     glDeleteTextures(1, &ibl_brdf_lut.gl_id);
+
+    JobSystem::instance()->deinit();
   }
 
   void debugDrawLight(const glm::mat4& view_matrix, const glm::mat4& proj_matrix,
@@ -188,6 +228,33 @@ struct App {
     gpu::render(models.sphere);
   }
 
+  void drawHeightField(const mat4& view_matrix, const mat4& proj_matrix) {
+    auto& hf = height_field;
+    if (!hf.enabled) {
+      return;
+    }
+    if (hf.field.m_texid_hf == UINT32_MAX) {
+      hf.field.loadHeightField(hf.path);
+    }
+    if (hf.field.m_meshResolution != hf.resolution) {
+      hf.field.generateMesh(hf.resolution);
+    }
+
+    float size = hf.field.m_heightsInMeters ? hf.field.m_extent : hf.size;
+    float height_scale = hf.field.m_heightsInMeters ? 1.0f : hf.height_scale;
+    mat4 model_matrix = translate(hf.position) * scale(vec3(size / 2.0f, 1.0f, size / 2.0f));
+    glUseProgram(heightfield_program);
+    gpu::setUniformSlow(heightfield_program, "modelViewProjectionMatrix",
+                        proj_matrix * view_matrix * model_matrix);
+    gpu::setUniformSlow(heightfield_program, "modelViewMatrix", view_matrix * model_matrix);
+    gpu::setUniformSlow(heightfield_program, "normalMatrix",
+                        inverse(transpose(view_matrix * model_matrix)));
+    gpu::setUniformSlow(heightfield_program, "heightScale", height_scale);
+    gpu::setUniformSlow(heightfield_program, "material_color", hf.color);
+    glBindTextureUnit(0, hf.field.m_texid_hf);
+    hf.field.submitTriangles();
+  }
+
   void drawBackground(const mat4& view_matrix, const mat4& proj_matrix) {
     glUseProgram(background_program);
     gpu::setUniformSlow(background_program, "environment_multiplier", environment_map.multiplier);
@@ -206,7 +273,7 @@ struct App {
 
     glUseProgram(current_program);
 
-    for (uint i = 0; i < NUM_CASCADES; i++) {
+    for (uint i = 0; i < (uint)shadow_map.rendered_cascades; i++) {
       // Bind and clear the current cascade
       shadow_map.bindWrite(i);
       glClear(GL_DEPTH_BUFFER_BIT);
@@ -215,7 +282,7 @@ struct App {
       mat4 light_proj_matrix = shadow_map.shadow_projections[i];
 
       // Terrain
-      terrain.begin(true);
+      terrain.begin(true, i);
 
       glDisable(GL_CULL_FACE);
       terrain.render(light_proj_matrix, light_view_matrix, center, cam_pos, mat4(), water.height,
@@ -308,12 +375,65 @@ struct App {
                         inverse(transpose(view_matrix * material_test_matrix)));
     gpu::render(models.material_test);
 
+    drawHeightField(view_matrix, proj_matrix);
 
     water.render(&terrain, window.width, window.height, current_time, proj_matrix, view_matrix,
                  center, camera.projection, environment_map.multiplier);
   }
 
-  void update(void) { terrain.update(delta_time, current_time); }
+  // Place the models on the terrain, or on the water where the terrain is submerged
+  void snapModelsToGround() {
+    std::array<mat4*, 3> matrices = {&fighter_model_matrix, &shrek_model_matrix,
+                                     &material_test_matrix};
+    std::array<float, 3> offsets = {fighter_hover_height, 0.0f, 0.0f};
+
+    std::array<vec2, 3> positions;
+    std::array<float, 3> heights;
+    for (size_t i = 0; i < matrices.size(); i++) {
+      positions[i] = vec2((*matrices[i])[3].x, (*matrices[i])[3].z);
+    }
+
+    terrain.queryHeights(positions, heights);
+
+    for (size_t i = 0; i < matrices.size(); i++) {
+      (*matrices[i])[3].y = max(heights[i], water.height) + offsets[i];
+    }
+  }
+
+  // Move the fighter to the point on the terrain under the mouse cursor
+  void moveFighterToCursor(int mouse_x, int mouse_y) {
+    mat4 inverse_view_projection
+        = inverse(camera.getProjMatrix(window.width, window.height) * camera.getViewMatrix());
+    vec2 ndc = vec2(2.0f * mouse_x / window.width - 1.0f, 1.0f - 2.0f * mouse_y / window.height);
+    vec4 near_point = inverse_view_projection * vec4(ndc, -1.0f, 1.0f);
+    vec4 far_point = inverse_view_projection * vec4(ndc, 1.0f, 1.0f);
+    vec3 origin = vec3(near_point) / near_point.w;
+    vec3 direction = normalize(vec3(far_point) / far_point.w - origin);
+
+    auto hit = terrain.raycast(origin, direction, camera.projection.far);
+    if (hit.hit) {
+      fighter_model_matrix[3] = vec4(hit.position.x,
+                                     max(hit.position.y, water.height) + fighter_hover_height,
+                                     hit.position.z, 1.0f);
+    }
+  }
+
+  void update(void) {
+    terrain.update(delta_time, current_time);
+    terrain.updateBounds(camera.getWorldPos());
+    terrain.updateStreaming(camera.getWorldPos());
+    terrain.updateLod(camera.getWorldPos());
+
+    if (models_noise_version != terrain.noise_version) {
+      snapModelsToGround();
+      models_noise_version = terrain.noise_version;
+    }
+
+    vec2 camera_xz = vec2(camera.position.x, camera.position.z);
+    float ground_height;
+    terrain.queryHeights(Span<const vec2>(&camera_xz, 1), Span<float>(&ground_height, 1));
+    camera.clampAboveGround(ground_height);
+  }
 
   void display(void) {
     SDL_GetWindowSize(window.handle, &window.width, &window.height);
@@ -421,6 +541,11 @@ struct App {
         input.prev_mouse_pos.y = y;
       }
 
+      if (event.type == SDL_MOUSEBUTTONDOWN && event.button.button == SDL_BUTTON_RIGHT
+          && !io.WantCaptureMouse) {
+        moveFighterToCursor(event.button.x, event.button.y);
+      }
+
       if ((SDL_GetMouseState(nullptr, nullptr) & SDL_BUTTON(SDL_BUTTON_LEFT)) == 0U) {
         input.is_mouse_dragging = false;
       }
@@ -470,6 +595,10 @@ struct App {
       }
 
       ImGui::Checkbox("Fighter Draggable", &fighter_draggable);
+      ImGui::SameLine();
+      if (ImGui::Button("Snap to ground")) {
+        snapModelsToGround();
+      }
 
       if (ImGui::CollapsingHeader("Camera")) {
         ImGui::Checkbox("Static camera [C]", &static_camera_enabled);
@@ -486,6 +615,16 @@ struct App {
       }
 
       terrain.gui(&camera);
+
+      if (ImGui::CollapsingHeader("Height field")) {
+        ImGui::Checkbox("Show height field", &height_field.enabled);
+        ImGui::SliderInt("Grid resolution", &height_field.resolution, 16, 2048);
+        ImGui::DragFloat3("Position", &height_field.position.x, 10.0f);
+        ImGui::SliderFloat("Size (m)", &height_field.size, 100.0f, 20000.0f);
+        ImGui::SliderFloat("Height scale (m)", &height_field.height_scale, 0.0f, 2000.0f);
+        ImGui::ColorEdit3("Color", &height_field.color.x);
+      }
+
       shadow_map.gui(window.handle);
       water.gui();
       postfx.gui();
@@ -495,12 +634,121 @@ struct App {
     ImGui::Render();
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
   }
+
+  // One frame of the main loop at a fixed time
+  void testFrame() {
+    update();
+    display();
+    gui();
+    SDL_GL_SwapWindow(window.handle);
+    handleEvents();
+  }
+
+  // The terrain as seen from the start camera, read back before the post processing
+  std::vector<vec4> readScreen() {
+    std::vector<vec4> pixels(usize(postfx.screen_fbo.width) * postfx.screen_fbo.height);
+    glGetTextureImage(postfx.screen_fbo.colorTextureTargets[0], 0, GL_RGBA, GL_FLOAT,
+                      GLsizei(pixels.size() * sizeof(vec4)), pixels.data());
+    return pixels;
+  }
+
+  /**
+   * Render the chunked terrain once evaluating the noise per vertex and once from the height
+   * atlas, and compare the images. Returns the exit code of --test-atlas.
+   */
+  int testAtlas() {
+    const int max_frames = 1000;
+    const float pixel_tolerance = 0.1f;
+    const float max_differing_fraction = 0.01f;
+    const float max_mean_difference = 0.01f;
+
+    terrain.mode = TerrainMode::Chunked;
+    // The macro colour is only in the atlas path
+    terrain.macro_enabled = false;
+    // The horizon and flow maps are computed in the background and would change the shading
+    // between the two captures
+    terrain.horizon.enabled = false;
+    terrain.horizon.occlusion = false;
+    terrain.hydrology.show_rivers = false;
+    terrain.atlas.max_bakes_per_frame = terrain.atlas.page_capacity;
+    delta_time = 0.0f;
+
+    // The chunk selection depends on the height pyramid, wait until it is in
+    terrain.atlas.enabled = false;
+    int frames = 0;
+    while (frames < max_frames
+           && (terrain.pyramid_job != nullptr || !terrain.height_pyramid.isBuilt())) {
+      testFrame();
+      frames += 1;
+    }
+    for (int i = 0; i < 4; i++) {
+      testFrame();
+    }
+    std::vector<vec4> procedural = readScreen();
+
+    terrain.atlas.enabled = true;
+    do {
+      testFrame();
+      frames += 1;
+    } while (frames < max_frames && terrain.atlas.chunksWithoutPage() > 0);
+    if (terrain.atlas.chunksWithoutPage() > 0) {
+      std::cout << "Atlas test: gave up after " << frames << " frames" << std::endl;
+      return 1;
+    }
+    std::vector<vec4> atlas = readScreen();
+
+    usize differing = 0;
+    double sum = 0.0;
+    float max_difference = 0.0f;
+    for (usize i = 0; i < procedural.size(); i++) {
+      vec3 a = clamp(vec3(procedural[i]), 0.0f, 1.0f);
+      vec3 b = clamp(vec3(atlas[i]), 0.0f, 1.0f);
+      vec3 d = abs(a - b);
+      float difference = max(d.x, max(d.y, d.z));
+      differing += difference > pixel_tolerance ? 1 : 0;
+      sum += difference;
+      max_difference = max(max_difference, difference);
+    }
+    float differing_fraction = float(differing) / float(procedural.size());
+    float mean_difference = float(sum / double(procedural.size()));
+    bool passed = differing_fraction <= max_differing_fraction
+                  && mean_difference <= max_mean_difference;
+
+    std::cout << "Atlas test: " << procedural.size() << " pixels, " << differing
+              << " differ by more than " << pixel_tolerance << " (" << differing_fraction * 100.0f
+              << "%), mean " << mean_difference << ", max " << max_difference << " -> "
+              << (passed ? "passed" : "FAILED") << std::endl;
+    return passed ? 0 : 1;
+  }
 };
 
 int main(int argc, char* argv[]) {
+  // Headless tools
+  if (argc >= 2 && std::string(argv[1]) == "--import-dem") {
+    return dem::runCommandLine(argc - 2, argv + 2);
+  }
+  if (argc >= 2 && std::string(argv[1]) == "--export-heights") {
+    return dem::runExportCommandLine(argc - 2, argv + 2);
+  }
+
   App* app = new App();
+  if (argc >= 2 && std::string(argv[1]) == "--test-atlas") {
+    if (!app->init()) {
+      std::cout << "Atlas test: skipped, no GL 4.5 context" << std::endl;
+      return TEST_SKIPPED;
+    }
+    int result = app->testAtlas();
+    app->deinit();
+    return result;
+  }
+  if (argc >= 3 && std::string(argv[1]) == "--height-field") {
+    app->height_field.path = argv[2];
+    app->height_field.enabled = true;
+  }
 
-  app->init();
+  if (!app->init()) {
+    return 1;
+  }
   defer(app->deinit());
 
   bool stopRendering = false;
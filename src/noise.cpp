@@ -0,0 +1,354 @@
+#include "noise.h"
+
+#include <algorithm>
+#include <atomic>
+
+#include "fbm.h"
+
+#if defined(_MSC_VER) && NOISE_X86
+#  include <immintrin.h>
+#  include <intrin.h>
+#endif
+
+namespace noise {
+  namespace kernel {
+    void terrainHeightBatchScalar(const TerrainNoise& noise, const float* xs, const float* zs,
+                                  float* out) {
+      auto height = fbm::heightFunction<false, float>(noise);
+      for (int i = 0; i < BATCH_SIZE; i++) {
+        out[i] = height(noise, xs[i], zs[i], nullptr, nullptr);
+      }
+    }
+
+    void terrainGradientBatchScalar(const TerrainNoise& noise, const float* xs, const float* zs,
+                                    float* out, float* out_dx, float* out_dz) {
+      auto height = fbm::heightFunction<true, float>(noise);
+      for (int i = 0; i < BATCH_SIZE; i++) {
+        out[i] = height(noise, xs[i], zs[i], &out_dx[i], &out_dz[i]);
+      }
+    }
+
+#if NOISE_X86
+    void terrainHeightBatchSSE2(const TerrainNoise& noise, const float* xs, const float* zs,
+                                float* out) {
+      auto height = fbm::heightFunction<false, F32x4>(noise);
+      for (int i = 0; i < BATCH_SIZE; i += 4) {
+        F32x4 x(_mm_loadu_ps(xs + i));
+        F32x4 z(_mm_loadu_ps(zs + i));
+        _mm_storeu_ps(out + i, height(noise, x, z, nullptr, nullptr).v);
+      }
+    }
+
+    void terrainGradientBatchSSE2(const TerrainNoise& noise, const float* xs, const float* zs,
+                                  float* out, float* out_dx, float* out_dz) {
+      auto height = fbm::heightFunction<true, F32x4>(noise);
+      for (int i = 0; i < BATCH_SIZE; i += 4) {
+        F32x4 x(_mm_loadu_ps(xs + i));
+        F32x4 z(_mm_loadu_ps(zs + i));
+        F32x4 dx, dz;
+        _mm_storeu_ps(out + i, height(noise, x, z, &dx, &dz).v);
+        _mm_storeu_ps(out_dx + i, dx.v);
+        _mm_storeu_ps(out_dz + i, dz.v);
+      }
+    }
+#endif
+  }  // namespace kernel
+
+  namespace {
+    SimdLevel detectSimdLevel() {
+#if NOISE_AVX2
+#  if defined(_MSC_VER)
+      int info[4];
+      __cpuid(info, 0);
+      if (info[0] >= 7) {
+        __cpuid(info, 1);
+        bool os_saves_ymm = (info[2] & (1 << 27)) != 0 && (_xgetbv(0) & 0x6) == 0x6;
+        __cpuidex(info, 7, 0);
+        if (os_saves_ymm && (info[1] & (1 << 5)) != 0) {
+          return SimdLevel::AVX2;
+        }
+      }
+#  else
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        return SimdLevel::AVX2;
+      }
+#  endif
+#endif
+#if NOISE_X86
+      return SimdLevel::SSE2;
+#else
+      return SimdLevel::Scalar;
+#endif
+    }
+
+    const SimdLevel supported_level = detectSimdLevel();
+    std::atomic<SimdLevel> current_level{supported_level};
+
+    kernel::BatchFunction batchFunction(SimdLevel level) {
+      switch (level) {
+#if NOISE_AVX2
+        case SimdLevel::AVX2:
+          return kernel::terrainHeightBatchAVX2;
+#endif
+#if NOISE_X86
+        case SimdLevel::SSE2:
+          return kernel::terrainHeightBatchSSE2;
+#endif
+        default:
+          return kernel::terrainHeightBatchScalar;
+      }
+    }
+
+    kernel::GradientBatchFunction gradientBatchFunction(SimdLevel level) {
+      switch (level) {
+#if NOISE_AVX2
+        case SimdLevel::AVX2:
+          return kernel::terrainGradientBatchAVX2;
+#endif
+#if NOISE_X86
+        case SimdLevel::SSE2:
+          return kernel::terrainGradientBatchSSE2;
+#endif
+        default:
+          return kernel::terrainGradientBatchScalar;
+      }
+    }
+  }  // namespace
+
+  SimdLevel simdLevel() { return current_level.load(std::memory_order_relaxed); }
+
+  void setSimdLevel(SimdLevel level) {
+    current_level.store(std::min(level, supported_level), std::memory_order_relaxed);
+  }
+
+  const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+      case SimdLevel::Scalar:
+        return "Scalar";
+      case SimdLevel::SSE2:
+        return "SSE2";
+      case SimdLevel::AVX2:
+        return "AVX2";
+    }
+    return "Unknown";
+  }
+
+  float terrainHeight(const TerrainNoise& noise, glm::vec2 pos) {
+    return fbm::terrainHeight<float>(noise, pos.x, pos.y);
+  }
+
+  void terrainHeightBatch(const TerrainNoise& noise, const float* xs, const float* zs, float* out) {
+    batchFunction(simdLevel())(noise, xs, zs, out);
+  }
+
+  void terrainHeights(const TerrainNoise& noise, const glm::vec2* positions, float* out,
+                      usize count) {
+    auto batch = batchFunction(simdLevel());
+
+    float xs[BATCH_SIZE];
+    float zs[BATCH_SIZE];
+    float heights[BATCH_SIZE];
+
+    for (usize start = 0; start < count; start += BATCH_SIZE) {
+      usize n = std::min<usize>(BATCH_SIZE, count - start);
+
+      // Pad the last batch by repeating its final position
+      for (usize i = 0; i < BATCH_SIZE; i++) {
+        const auto& p = positions[start + std::min(i, n - 1)];
+        xs[i] = p.x;
+        zs[i] = p.y;
+      }
+
+      batch(noise, xs, zs, heights);
+      std::copy(heights, heights + n, out + start);
+    }
+  }
+
+  void terrainGradients(const TerrainNoise& noise, const glm::vec2* positions, float* out_heights,
+                        glm::vec2* out_gradients, usize count) {
+    auto batch = gradientBatchFunction(simdLevel());
+
+    float xs[BATCH_SIZE];
+    float zs[BATCH_SIZE];
+    float heights[BATCH_SIZE];
+    float dxs[BATCH_SIZE];
+    float dzs[BATCH_SIZE];
+
+    for (usize start = 0; start < count; start += BATCH_SIZE) {
+      usize n = std::min<usize>(BATCH_SIZE, count - start);
+
+      // Pad the last batch by repeating its final position
+      for (usize i = 0; i < BATCH_SIZE; i++) {
+        const auto& p = positions[start + std::min(i, n - 1)];
+        xs[i] = p.x;
+        zs[i] = p.y;
+      }
+
+      batch(noise, xs, zs, heights, dxs, dzs);
+      for (usize i = 0; i < n; i++) {
+        if (out_heights != nullptr) {
+          out_heights[start + i] = heights[i];
+        }
+        out_gradients[start + i] = glm::vec2(dxs[i], dzs[i]);
+      }
+    }
+  }
+
+  void terrainNormals(const TerrainNoise& noise, const glm::vec2* positions, glm::vec3* out,
+                      usize count) {
+    constexpr usize CHUNK_SIZE = 256;
+    glm::vec2 gradients[CHUNK_SIZE];
+
+    for (usize start = 0; start < count; start += CHUNK_SIZE) {
+      usize n = std::min(CHUNK_SIZE, count - start);
+      terrainGradients(noise, positions + start, nullptr, gradients, n);
+      for (usize i = 0; i < n; i++) {
+        out[start + i] = glm::normalize(glm::vec3(-gradients[i].x, 1.0f, -gradients[i].y));
+      }
+    }
+  }
+
+  void terrainNormalsFiniteDifference(const TerrainNoise& noise, const glm::vec2* positions,
+                                      glm::vec3* out, usize count) {
+    // The four offset positions of a chunk are packed into one array so they are evaluated in a
+    // single batched call
+    constexpr usize CHUNK_SIZE = 256;
+    const float eps = 0.1f;
+    glm::vec2 samples[CHUNK_SIZE * 4];
+    float heights[CHUNK_SIZE * 4];
+
+    for (usize start = 0; start < count; start += CHUNK_SIZE) {
+      usize n = std::min(CHUNK_SIZE, count - start);
+      for (usize i = 0; i < n; i++) {
+        auto p = positions[start + i];
+        samples[i + 0 * n] = p - glm::vec2(eps, 0);
+        samples[i + 1 * n] = p + glm::vec2(eps, 0);
+        samples[i + 2 * n] = p - glm::vec2(0, eps);
+        samples[i + 3 * n] = p + glm::vec2(0, eps);
+      }
+
+      terrainHeights(noise, samples, heights, n * 4);
+
+      for (usize i = 0; i < n; i++) {
+        float dx = heights[i + 0 * n] - heights[i + 1 * n];
+        float dz = heights[i + 2 * n] - heights[i + 3 * n];
+        out[start + i] = glm::normalize(glm::vec3(dx, 2 * eps, dz));
+      }
+    }
+  }
+
+  namespace {
+    // voronoi2d() is a smooth minimum of the distances to the feature points of the 3x3 cells
+    // around p, never more than the nearest one. The point of p's own cell is within sqrt(2).
+    constexpr float VORONOI_SQ_MAX = 2.0f;
+    // The smooth minimum weighs the distance gradients, unit vectors, with weights that sum to 1
+    // and so has a gradient of at most 1. Squaring it gives 2 * sqrt(VORONOI_SQ_MAX).
+    constexpr float VORONOI_SQ_MAX_GRADIENT = 2.8284272f;
+    constexpr float SNOISE_MAX = 1.0f;
+    // Every simplex corner adds 130 t^4 (G . x) n with t = 0.5 - |x|^2 and n the approximated
+    // 1 / |G|, so |G| n <= 0.966 over the gradient diamond. The corner's gradient is 130 n times
+    // t^4 G - 8 t^3 (G . x) x, at most 130 |G| n t^3 max(t, |t - 8 |x|^2|). Summing that bound
+    // over the three corners of the simplex p lies in peaks at 0.0965, times 130 * 0.966 is 12.11.
+    constexpr float SNOISE_MAX_GRADIENT = 12.2f;
+
+    struct OctaveRange {
+      float min;
+      float max;
+      float max_gradient;
+    };
+
+    OctaveRange octaveRange(fbm::OctaveType type) {
+      switch (type) {
+        case fbm::OctaveType::Voronoi:
+          return {0.0f, VORONOI_SQ_MAX, VORONOI_SQ_MAX_GRADIENT};
+        case fbm::OctaveType::Simplex:
+          return {-SNOISE_MAX, SNOISE_MAX, SNOISE_MAX_GRADIENT};
+        case fbm::OctaveType::Ridged:
+          return {0.0f, 1.0f, 2.0f * SNOISE_MAX_GRADIENT};
+        case fbm::OctaveType::Billow:
+          return {-1.0f, 1.0f, 2.0f * SNOISE_MAX_GRADIENT};
+      }
+      return {-SNOISE_MAX, SNOISE_MAX, SNOISE_MAX_GRADIENT};
+    }
+  }  // namespace
+
+  glm::vec2 heightBounds(const TerrainNoise& noise) {
+    auto recipe = fbm::recipeFor(noise.style);
+    glm::vec2 bounds(0.0f);
+    float amplitude = noise.amplitude;
+
+    for (int i = 0; i < noise.num_octaves; i++) {
+      auto range = octaveRange(i == 0 ? recipe.base : recipe.detail);
+      float normalization = i == 0 ? 1.0f : (i == 1 ? 1.5f : 2.0f);
+      // A negative amplitude flips the range
+      float a = range.min * amplitude / normalization;
+      float b = range.max * amplitude / normalization;
+      bounds += glm::vec2(glm::min(a, b), glm::max(a, b));
+      amplitude *= noise.persistence;
+    }
+
+    return bounds;
+  }
+
+  float slopeBound(const TerrainNoise& noise) {
+    auto recipe = fbm::recipeFor(noise.style);
+    float bound = 0.0f;
+    float frequency = noise.frequency;
+    float amplitude = noise.amplitude;
+
+    for (int i = 0; i < noise.num_octaves; i++) {
+      auto range = octaveRange(i == 0 ? recipe.base : recipe.detail);
+      float a = glm::abs(amplitude);
+      if (i == 0) {
+        bound += a * frequency / 200.0f * range.max_gradient;
+      } else if (i == 1) {
+        bound += a * frequency / 400.0f * range.max_gradient / 1.5f;
+      } else {
+        bound += a * frequency / 800.0f * range.max_gradient / 2.0f;
+      }
+      amplitude *= noise.persistence;
+      frequency *= noise.lacunarity;
+    }
+
+    if (recipe.warp) {
+      // The gradient is multiplied by the transposed Jacobian of the warp, bounded by its
+      // Frobenius norm
+      float k = noise.frequency / 1600.0f;
+      bound *= 1.0f + glm::abs(noise.warp_strength) * k * SNOISE_MAX_GRADIENT * 1.4142136f;
+    }
+
+    return bound;
+  }
+
+  u64 hash(const TerrainNoise& noise) {
+    u64 h = 14695981039346656037ull;
+    auto mix = [&h](const void* data, usize size) {
+      const auto* bytes = static_cast<const u8*>(data);
+      for (usize i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 1099511628211ull;
+      }
+    };
+
+    mix(&noise.num_octaves, sizeof(noise.num_octaves));
+    mix(&noise.amplitude, sizeof(noise.amplitude));
+    mix(&noise.frequency, sizeof(noise.frequency));
+    mix(&noise.persistence, sizeof(noise.persistence));
+    mix(&noise.lacunarity, sizeof(noise.lacunarity));
+    mix(&noise.style, sizeof(noise.style));
+    mix(&noise.warp_strength, sizeof(noise.warp_strength));
+    return h;
+  }
+
+  std::string shaderDefines(const TerrainNoise& noise) {
+    auto recipe = fbm::recipeFor(noise.style);
+    int octaves = glm::clamp(noise.num_octaves, 0, fbm::MAX_OCTAVES);
+
+    std::string defines;
+    defines += "#define FBM_OCTAVES " + std::to_string(octaves) + "\n";
+    defines += "#define FBM_BASE " + std::to_string((int)recipe.base) + "\n";
+    defines += "#define FBM_DETAIL " + std::to_string((int)recipe.detail) + "\n";
+    defines += "#define FBM_WARP " + std::to_string(recipe.warp ? 1 : 0) + "\n";
+    return defines;
+  }
+}  // namespace noise
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <imgui.h>
+
+#include <glm/glm.hpp>
+#include <string>
+
+#include "core.h"
+
+/**
+ * Octave recipes of the terrain, see fbm.h.
+ */
+enum class TerrainStyle : int {
+  Classic = 0,  // voronoi^2 mountains, simplex detail
+  Ridged = 1,   // voronoi^2 mountains, ridged simplex detail
+  Billow = 2,   // billowy simplex everywhere
+  Warped = 3,   // Classic on a domain warped by low frequency simplex noise
+  Count = 4,
+};
+
+struct TerrainNoise {
+  int num_octaves = 7;
+  float amplitude = 1055.0;
+  float frequency = 0.110;
+  float persistence = 0.063;
+  float lacunarity = 8.150;
+  TerrainStyle style = TerrainStyle::Classic;
+  // Meters, only used by TerrainStyle::Warped
+  float warp_strength = 600.0f;
+
+  bool gui() {
+    const char* style_names[] = {"Classic", "Ridged", "Billow", "Warped"};
+    auto did_change = false;
+    int style = (int)this->style;
+    if (ImGui::Combo("Style", &style, style_names, (int)TerrainStyle::Count)) {
+      this->style = (TerrainStyle)style;
+      did_change = true;
+    }
+    did_change |= ImGui::SliderInt("Octaves", &this->num_octaves, 1, 10);
+    did_change |= ImGui::DragFloat("Amplitude", &this->amplitude, 1.0f, 0.0f, 10000.f);
+    did_change |= ImGui::DragFloat("Frequency", &this->frequency, 0.001f, 0.0f, 10000.f);
+    did_change |= ImGui::DragFloat("Persistence", &this->persistence, 0.001f, 0.0f, 10000.f);
+    did_change |= ImGui::DragFloat("Lacunarity", &this->lacunarity, 0.05f, 0.0f, 20.f);
+    if (this->style == TerrainStyle::Warped) {
+      did_change |= ImGui::DragFloat("Warp strength", &this->warp_strength, 1.0f, 0.0f, 5000.f);
+    }
+    return did_change;
+  }
+};
+
+/**
+ * CPU port of `terrain_height()` from terrain_height.glsl, for each TerrainStyle (see fbm.h).
+ *
+ * The scalar, SSE2 and AVX2 paths run the exact same sequence of IEEE operations and therefore
+ * return bit-identical results. Compared to the shader the results agree to within
+ * 1e-3 * amplitude for the default noise over the 8 km terrain window; the difference comes from
+ * GPU `pow()` being evaluated through exp2/log2 and from drivers fusing multiply-adds.
+ */
+namespace noise {
+  // Number of positions evaluated per call to terrainHeightBatch()
+  constexpr int BATCH_SIZE = 16;
+
+  enum class SimdLevel { Scalar = 0, SSE2 = 1, AVX2 = 2 };
+
+  /**
+   * The code path used by the batched functions. Picked at startup from what the CPU supports.
+   */
+  SimdLevel simdLevel();
+
+  /**
+   * Force a code path, e.g. for benchmarking. Clamped to what the CPU supports.
+   */
+  void setSimdLevel(SimdLevel level);
+
+  const char* simdLevelName(SimdLevel level);
+
+  /**
+   * Scalar reference evaluation of a single position.
+   */
+  float terrainHeight(const TerrainNoise& noise, glm::vec2 pos);
+
+  /**
+   * Evaluate exactly BATCH_SIZE positions given as separate x and z arrays.
+   */
+  void terrainHeightBatch(const TerrainNoise& noise, const float* xs, const float* zs, float* out);
+
+  /**
+   * Evaluate any number of positions, BATCH_SIZE at a time.
+   */
+  void terrainHeights(const TerrainNoise& noise, const glm::vec2* positions, float* out,
+                      usize count);
+
+  /**
+   * Heights and their analytic gradient (d/dx, d/dz) from a single evaluation, like
+   * terrain_height_grad() in terrain_height.glsl. The heights are identical to terrainHeights(),
+   * `out_heights` may be null.
+   */
+  void terrainGradients(const TerrainNoise& noise, const glm::vec2* positions, float* out_heights,
+                        glm::vec2* out_gradients, usize count);
+
+  /**
+   * Surface normals from the analytic gradient.
+   */
+  void terrainNormals(const TerrainNoise& noise, const glm::vec2* positions, glm::vec3* out,
+                      usize count);
+
+  /**
+   * Reference surface normals from central differences, same as computeNormal() in terrain.tes.
+   */
+  void terrainNormalsFiniteDifference(const TerrainNoise& noise, const glm::vec2* positions,
+                                      glm::vec3* out, usize count);
+
+  /**
+   * Conservative (min, max) of the terrain height, from voronoi^2 in [0, 2] and |snoise| <= 1.
+   */
+  glm::vec2 heightBounds(const TerrainNoise& noise);
+
+  /**
+   * Upper bound of |grad terrain_height|. The per-octave gradient bounds (12.2 for snoise, 2.83
+   * for voronoi^2) are derived from the kernels in noise.cpp, the largest gradients measured over
+   * 16M samples are 7.37 and 1.94.
+   */
+  float slopeBound(const TerrainNoise& noise);
+
+  /**
+   * FNV-1a hash of the noise parameters, identifies everything baked from them.
+   */
+  u64 hash(const TerrainNoise& noise);
+
+  /**
+   * The #defines that specialise fbm.glsl for the style and octave count of `noise`. Programs
+   * including it have to be recompiled when these change.
+   */
+  std::string shaderDefines(const TerrainNoise& noise);
+}  // namespace noise
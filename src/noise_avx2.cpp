@@ -0,0 +1,58 @@
+// This translation unit is compiled with AVX2 enabled (see CMakeLists.txt) and is only called
+// after noise::simdLevel() has verified that the CPU supports it.
+#include "fbm.h"
+
+#if NOISE_AVX2
+#  include <immintrin.h>
+
+namespace noise {
+  namespace kernel {
+    struct F32x8 {
+      __m256 v;
+      F32x8() = default;
+      F32x8(float s) : v(_mm256_set1_ps(s)) {}
+      explicit F32x8(__m256 v) : v(v) {}
+    };
+
+    static inline F32x8 operator+(F32x8 a, F32x8 b) { return F32x8(_mm256_add_ps(a.v, b.v)); }
+    static inline F32x8 operator-(F32x8 a, F32x8 b) { return F32x8(_mm256_sub_ps(a.v, b.v)); }
+    static inline F32x8 operator*(F32x8 a, F32x8 b) { return F32x8(_mm256_mul_ps(a.v, b.v)); }
+    static inline F32x8 operator/(F32x8 a, F32x8 b) { return F32x8(_mm256_div_ps(a.v, b.v)); }
+    static inline F32x8 vfloor(F32x8 x) { return F32x8(_mm256_floor_ps(x.v)); }
+    static inline F32x8 vabs(F32x8 x) {
+      return F32x8(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), x.v));
+    }
+    static inline F32x8 vmax(F32x8 a, F32x8 b) { return F32x8(_mm256_max_ps(a.v, b.v)); }
+    static inline F32x8 vsqrt(F32x8 x) { return F32x8(_mm256_sqrt_ps(x.v)); }
+    static inline F32x8 vgreater(F32x8 a, F32x8 b) {
+      return F32x8(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ));
+    }
+    static inline F32x8 vselect(F32x8 mask, F32x8 a, F32x8 b) {
+      return F32x8(_mm256_blendv_ps(b.v, a.v, mask.v));
+    }
+
+    void terrainHeightBatchAVX2(const TerrainNoise& noise, const float* xs, const float* zs,
+                                float* out) {
+      auto height = fbm::heightFunction<false, F32x8>(noise);
+      for (int i = 0; i < BATCH_SIZE; i += 8) {
+        F32x8 x(_mm256_loadu_ps(xs + i));
+        F32x8 z(_mm256_loadu_ps(zs + i));
+        _mm256_storeu_ps(out + i, height(noise, x, z, nullptr, nullptr).v);
+      }
+    }
+
+    void terrainGradientBatchAVX2(const TerrainNoise& noise, const float* xs, const float* zs,
+                                  float* out, float* out_dx, float* out_dz) {
+      auto height = fbm::heightFunction<true, F32x8>(noise);
+      for (int i = 0; i < BATCH_SIZE; i += 8) {
+        F32x8 x(_mm256_loadu_ps(xs + i));
+        F32x8 z(_mm256_loadu_ps(zs + i));
+        F32x8 dx, dz;
+        _mm256_storeu_ps(out + i, height(noise, x, z, &dx, &dz).v);
+        _mm256_storeu_ps(out_dx + i, dx.v);
+        _mm256_storeu_ps(out_dz + i, dz.v);
+      }
+    }
+  }  // namespace kernel
+}  // namespace noise
+#endif
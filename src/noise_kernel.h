@@ -0,0 +1,309 @@
+#pragma once
+
+/**
+ * Lane-generic implementation of the noise functions in resources/shaders/noise.glsl.
+ *
+ * Every function is a template over a "lane" type V which is either a plain float or one of the
+ * SIMD wrappers below. V must provide construction from float, + - * / and the free functions
+ * vfloor, vabs, vmax, vsqrt, vgreater and vselect. Keep the order of operations identical to the
+ * GLSL source, the scalar and SIMD paths are expected to produce bit-identical results.
+ *
+ * NOTE: This header is included by noise_avx2.cpp which is compiled with AVX2 enabled. Anything
+ * inline that is instantiated there must not also be used by the rest of the program, otherwise
+ * the linker may pick the AVX2 copy for everyone. Stick to intrinsics and the lane templates.
+ */
+
+#include "noise.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#  define NOISE_X86 1
+#  include <emmintrin.h>
+#endif
+
+#include <cmath>
+
+namespace noise {
+  namespace kernel {
+    // Scalar lanes
+    //-----------------------------------------------
+    inline float vfloor(float x) { return std::floor(x); }
+    inline float vabs(float x) { return std::fabs(x); }
+    inline float vmax(float a, float b) { return a > b ? a : b; }
+    inline float vsqrt(float x) { return std::sqrt(x); }
+    inline bool vgreater(float a, float b) { return a > b; }
+    inline float vselect(bool mask, float a, float b) { return mask ? a : b; }
+
+#if NOISE_X86
+    // SSE2 lanes, part of the x86-64 baseline so usable from any translation unit
+    //-----------------------------------------------
+    struct F32x4 {
+      __m128 v;
+      F32x4() = default;
+      F32x4(float s) : v(_mm_set1_ps(s)) {}
+      explicit F32x4(__m128 v) : v(v) {}
+    };
+
+    inline F32x4 operator+(F32x4 a, F32x4 b) { return F32x4(_mm_add_ps(a.v, b.v)); }
+    inline F32x4 operator-(F32x4 a, F32x4 b) { return F32x4(_mm_sub_ps(a.v, b.v)); }
+    inline F32x4 operator*(F32x4 a, F32x4 b) { return F32x4(_mm_mul_ps(a.v, b.v)); }
+    inline F32x4 operator/(F32x4 a, F32x4 b) { return F32x4(_mm_div_ps(a.v, b.v)); }
+    inline F32x4 vabs(F32x4 x) { return F32x4(_mm_andnot_ps(_mm_set1_ps(-0.0f), x.v)); }
+    inline F32x4 vmax(F32x4 a, F32x4 b) { return F32x4(_mm_max_ps(a.v, b.v)); }
+    inline F32x4 vsqrt(F32x4 x) { return F32x4(_mm_sqrt_ps(x.v)); }
+    inline F32x4 vgreater(F32x4 a, F32x4 b) { return F32x4(_mm_cmpgt_ps(a.v, b.v)); }
+    inline F32x4 vselect(F32x4 mask, F32x4 a, F32x4 b) {
+      return F32x4(_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v)));
+    }
+    inline F32x4 vfloor(F32x4 x) {
+      // SSE2 has no floor, truncate and step down for negative non-integers. Values >= 2^23 are
+      // already integral (and may not fit in an int32), pass those through untouched.
+      __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(x.v));
+      __m128 floored
+          = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, x.v), _mm_set1_ps(1.0f)));
+      __m128 is_integral = _mm_cmpge_ps(vabs(x).v, _mm_set1_ps(8388608.0f));
+      return vselect(F32x4(is_integral), x, F32x4(floored));
+    }
+#endif
+
+    // noise.glsl
+    //-----------------------------------------------
+    template <typename V> inline V fract(V x) { return x - vfloor(x); }
+
+    template <typename V> inline V mod289(V x) {
+      return x - vfloor(x * V(1.0f / 289.0f)) * V(289.0f);
+    }
+
+    template <typename V> inline V permute(V x) { return mod289(((x * V(34.0f)) + V(1.0f)) * x); }
+
+    // permute() of the integers [0, PERMUTE_TABLE_SIZE), evaluated at compile time with the same
+    // float operations. snoise() only ever permutes mod289() results plus at most 290, so the
+    // scalar lanes can look those up. The SIMD lanes keep the arithmetic, SSE2 has no gather.
+    constexpr int PERMUTE_TABLE_SIZE = 2 * 289 + 2;
+
+    constexpr float floorConstexpr(float x) {
+      float truncated = float(i64(x));
+      return truncated > x ? truncated - 1.0f : truncated;
+    }
+
+    struct PermuteTable {
+      float values[PERMUTE_TABLE_SIZE];
+    };
+
+    constexpr PermuteTable makePermuteTable() {
+      PermuteTable table = {};
+      for (int i = 0; i < PERMUTE_TABLE_SIZE; i++) {
+        float x = ((float(i) * 34.0f) + 1.0f) * float(i);
+        table.values[i] = x - floorConstexpr(x * (1.0f / 289.0f)) * 289.0f;
+      }
+      return table;
+    }
+
+    constexpr PermuteTable PERMUTE_TABLE = makePermuteTable();
+    static_assert(PERMUTE_TABLE.values[1] == 35.0f && PERMUTE_TABLE.values[2] == 138.0f,
+                  "permute(x) = (34 x^2 + x) mod 289");
+
+    inline float permute(float x) {
+      if (x >= 0.0f && x < float(PERMUTE_TABLE_SIZE)) {
+        int i = int(x);
+        if (float(i) == x) {
+          return PERMUTE_TABLE.values[i];
+        }
+      }
+      return mod289(((x * 34.0f) + 1.0f) * x);
+    }
+
+    // With `Gradient` the analytic gradient is written to `out_dx` and `out_dy`. The value is
+    // computed the same way in both variants.
+    template <bool Gradient, typename V> V snoiseImpl(V vx, V vy, V* out_dx, V* out_dy) {
+      const float Cx = 0.211324865405187f;   // (3.0-sqrt(3.0))/6.0
+      const float Cy = 0.366025403784439f;   // 0.5*(sqrt(3.0)-1.0)
+      const float Cz = -0.577350269189626f;  // -1.0 + 2.0 * C.x
+      const float Cw = 0.024390243902439f;   // 1.0 / 41.0
+
+      // First corner
+      V skew = vx * V(Cy) + vy * V(Cy);
+      V ix = vfloor(vx + skew);
+      V iy = vfloor(vy + skew);
+      V unskew = ix * V(Cx) + iy * V(Cx);
+      V x0x = vx - ix + unskew;
+      V x0y = vy - iy + unskew;
+
+      // Other corners
+      auto x_major = vgreater(x0x, x0y);
+      V i1x = vselect(x_major, V(1.0f), V(0.0f));
+      V i1y = vselect(x_major, V(0.0f), V(1.0f));
+
+      V x12x = x0x + V(Cx) - i1x;
+      V x12y = x0y + V(Cx) - i1y;
+      V x12z = x0x + V(Cz);
+      V x12w = x0y + V(Cz);
+
+      // Permutations
+      ix = mod289(ix);
+      iy = mod289(iy);
+      V p0 = permute(permute(iy) + ix);
+      V p1 = permute(permute(iy + i1y) + ix + i1x);
+      V p2 = permute(permute(iy + V(1.0f)) + ix + V(1.0f));
+
+      V t0 = vmax(V(0.5f) - (x0x * x0x + x0y * x0y), V(0.0f));
+      V t1 = vmax(V(0.5f) - (x12x * x12x + x12y * x12y), V(0.0f));
+      V t2 = vmax(V(0.5f) - (x12z * x12z + x12w * x12w), V(0.0f));
+      V t0_2 = t0 * t0;
+      V t1_2 = t1 * t1;
+      V t2_2 = t2 * t2;
+      V m0 = t0_2 * t0_2;
+      V m1 = t1_2 * t1_2;
+      V m2 = t2_2 * t2_2;
+
+      // Gradients: 41 points uniformly over a line, mapped onto a diamond.
+      V gx0 = V(2.0f) * fract(p0 * V(Cw)) - V(1.0f);
+      V gx1 = V(2.0f) * fract(p1 * V(Cw)) - V(1.0f);
+      V gx2 = V(2.0f) * fract(p2 * V(Cw)) - V(1.0f);
+      V h0 = vabs(gx0) - V(0.5f);
+      V h1 = vabs(gx1) - V(0.5f);
+      V h2 = vabs(gx2) - V(0.5f);
+      V a0 = gx0 - vfloor(gx0 + V(0.5f));
+      V a1 = gx1 - vfloor(gx1 + V(0.5f));
+      V a2 = gx2 - vfloor(gx2 + V(0.5f));
+
+      // Normalise gradients implicitly by scaling m
+      V norm0 = V(1.79284291400159f) - V(0.85373472095314f) * (a0 * a0 + h0 * h0);
+      V norm1 = V(1.79284291400159f) - V(0.85373472095314f) * (a1 * a1 + h1 * h1);
+      V norm2 = V(1.79284291400159f) - V(0.85373472095314f) * (a2 * a2 + h2 * h2);
+      m0 = m0 * norm0;
+      m1 = m1 * norm1;
+      m2 = m2 * norm2;
+
+      // Compute final noise value at P
+      V g0 = a0 * x0x + h0 * x0y;
+      V g1 = a1 * x12x + h1 * x12y;
+      V g2 = a2 * x12z + h2 * x12w;
+
+      if constexpr (Gradient) {
+        // d/dP of t^4 (G . x) is t^4 G - 8 t^3 (G . x) x, where t = 0.5 - x . x
+        V w0 = V(-8.0f) * t0_2 * t0 * g0 * norm0;
+        V w1 = V(-8.0f) * t1_2 * t1 * g1 * norm1;
+        V w2 = V(-8.0f) * t2_2 * t2 * g2 * norm2;
+        *out_dx = V(130.0f) * (w0 * x0x + w1 * x12x + w2 * x12z + m0 * a0 + m1 * a1 + m2 * a2);
+        *out_dy = V(130.0f) * (w0 * x0y + w1 * x12y + w2 * x12w + m0 * h0 + m1 * h1 + m2 * h2);
+      }
+
+      return V(130.0f) * (m0 * g0 + m1 * g1 + m2 * g2);
+    }
+
+    template <typename V> V snoise(V vx, V vy) {
+      return snoiseImpl<false, V>(vx, vy, nullptr, nullptr);
+    }
+
+    template <typename V> V snoiseGrad(V vx, V vy, V& out_dx, V& out_dy) {
+      return snoiseImpl<true, V>(vx, vy, &out_dx, &out_dy);
+    }
+
+    template <typename V> inline void rhash(V ux, V uy, V& out_x, V& out_y) {
+      // uv *= mat2(.12121212, .13131313, -.13131313, .12121212) (column major)
+      V tx = ux * V(.12121212f) + uy * V(.13131313f);
+      V ty = ux * V(-.13131313f) + uy * V(.12121212f);
+      // uv *= vec2(1e4, 1e6)
+      tx = tx * V(1e4f);
+      ty = ty * V(1e6f);
+      out_x = fract(fract(tx / V(1e4f)) * tx);
+      out_y = fract(fract(ty / V(1e6f)) * ty);
+    }
+
+    template <bool Gradient, typename V> V voronoi2dImpl(V px, V py, V* out_dx, V* out_dy) {
+      V cell_x = vfloor(px);
+      V cell_y = vfloor(py);
+      V fx = px - cell_x;
+      V fy = py - cell_y;
+
+      V res = V(0.0f);
+      V ws[9], dists[9], rxs[9], rys[9];
+      for (int j = -1; j <= 1; j++) {
+        for (int i = -1; i <= 1; i++) {
+          V bx = V((float)i);
+          V by = V((float)j);
+          V hx, hy;
+          rhash(cell_x + bx, cell_y + by, hx, hy);
+          V rx = bx - fx + hx;
+          V ry = by - fy + hy;
+          // pow(dot(r, r), 8.)
+          V dist = rx * rx + ry * ry;
+          V d = dist * dist;
+          d = d * d;
+          d = d * d;
+          V w = V(1.0f) / d;
+          res = res + w;
+
+          if constexpr (Gradient) {
+            int k = (j + 1) * 3 + (i + 1);
+            ws[k] = w;
+            dists[k] = dist;
+            rxs[k] = rx;
+            rys[k] = ry;
+          }
+        }
+      }
+      // pow(1. / res, 0.0625)
+      V value = vsqrt(vsqrt(vsqrt(vsqrt(V(1.0f) / res))));
+
+      if constexpr (Gradient) {
+        // value = res^(-1/16) and d(res)/dP = sum 16 w / dist * r. Normalizing w by res first
+        // keeps the terms finite, except within a few meters of a feature point where res itself
+        // overflows and the value and the gradient are 0.
+        V inverse_res = V(1.0f) / res;
+        V dx = V(0.0f);
+        V dy = V(0.0f);
+        for (int k = 0; k < 9; k++) {
+          V c = ws[k] * inverse_res / dists[k];
+          dx = dx + c * rxs[k];
+          dy = dy + c * rys[k];
+        }
+
+        auto is_finite = vgreater(value, V(0.0f));
+        *out_dx = vselect(is_finite, V(0.0f) - value * dx, V(0.0f));
+        *out_dy = vselect(is_finite, V(0.0f) - value * dy, V(0.0f));
+      }
+
+      return value;
+    }
+
+    template <typename V> V voronoi2d(V px, V py) {
+      return voronoi2dImpl<false, V>(px, py, nullptr, nullptr);
+    }
+
+    template <typename V> V voronoi2dGrad(V px, V py, V& out_dx, V& out_dy) {
+      return voronoi2dImpl<true, V>(px, py, &out_dx, &out_dy);
+    }
+
+    // Batch entry points, one per instruction set
+    //-----------------------------------------------
+    using BatchFunction = void (*)(const TerrainNoise& noise, const float* xs, const float* zs,
+                                   float* out);
+
+    void terrainHeightBatchScalar(const TerrainNoise& noise, const float* xs, const float* zs,
+                                  float* out);
+#if NOISE_X86
+    void terrainHeightBatchSSE2(const TerrainNoise& noise, const float* xs, const float* zs,
+                                float* out);
+#endif
+#if NOISE_AVX2
+    void terrainHeightBatchAVX2(const TerrainNoise& noise, const float* xs, const float* zs,
+                                float* out);
+#endif
+
+    using GradientBatchFunction = void (*)(const TerrainNoise& noise, const float* xs,
+                                           const float* zs, float* out, float* out_dx,
+                                           float* out_dz);
+
+    void terrainGradientBatchScalar(const TerrainNoise& noise, const float* xs, const float* zs,
+                                    float* out, float* out_dx, float* out_dz);
+#if NOISE_X86
+    void terrainGradientBatchSSE2(const TerrainNoise& noise, const float* xs, const float* zs,
+                                  float* out, float* out_dx, float* out_dz);
+#endif
+#if NOISE_AVX2
+    void terrainGradientBatchAVX2(const TerrainNoise& noise, const float* xs, const float* zs,
+                                  float* out, float* out_dx, float* out_dz);
+#endif
+  }  // namespace kernel
+}  // namespace noise
@@ -0,0 +1,399 @@
+#include "rtin.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <unordered_map>
+
+#include "jobs.h"
+
+namespace {
+  constexpr usize GRID_SAMPLES = usize(RTIN_GRID) * RTIN_GRID;
+
+  /**
+   * Corners a and b of the hypotenuse of every triangle of the full hierarchy, as ax, ay, bx, by,
+   * parents before their children. Triangle i has the children 2i + 2 and 2i + 3.
+   */
+  const std::vector<u16>& triangleCoordinates() {
+    static const std::vector<u16> coordinates = [] {
+      usize count = usize(TILE_SIZE) * TILE_SIZE * 2 - 2;
+      std::vector<u16> coordinates(count * 4);
+      for (usize i = 0; i < count; i++) {
+        usize id = i + 2;
+        int ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+        if (id & 1) {
+          bx = by = cx = TILE_SIZE;
+        } else {
+          ax = ay = cy = TILE_SIZE;
+        }
+        while ((id >>= 1) > 1) {
+          int mx = (ax + bx) >> 1;
+          int my = (ay + by) >> 1;
+          if (id & 1) {
+            bx = ax;
+            by = ay;
+            ax = cx;
+            ay = cy;
+          } else {
+            ax = bx;
+            ay = by;
+            bx = cx;
+            by = cy;
+          }
+          cx = mx;
+          cy = my;
+        }
+        coordinates[i * 4 + 0] = u16(ax);
+        coordinates[i * 4 + 1] = u16(ay);
+        coordinates[i * 4 + 2] = u16(bx);
+        coordinates[i * 4 + 3] = u16(by);
+      }
+      return coordinates;
+    }();
+    return coordinates;
+  }
+
+  bool endsWith(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size()
+           && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+  }
+
+  bool writeObj(const std::string& path, const std::vector<RtinMesh>& meshes, float texel_size,
+                u64* bytes_written) {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      std::cout << "Mesh " << path << ": could not open for writing\n";
+      return false;
+    }
+
+    char line[128];
+    u64 first_vertex = 1;
+    for (const auto& mesh : meshes) {
+      file << "o tile_" << mesh.key.x << "_" << mesh.key.z << "\n";
+      for (usize i = 0; i < mesh.vertices.size(); i++) {
+        // From the global sample, so a seam vertex gets the same position in both tiles
+        double x = (double(mesh.key.x) * TILE_SIZE + mesh.vertices[i].x) * texel_size;
+        double z = (double(mesh.key.z) * TILE_SIZE + mesh.vertices[i].y) * texel_size;
+        std::snprintf(line, sizeof(line), "v %.3f %.3f %.3f\n", x, mesh.heights[i], z);
+        file << line;
+      }
+      for (usize i = 0; i < mesh.indices.size(); i += 3) {
+        file << "f " << first_vertex + mesh.indices[i] << " " << first_vertex + mesh.indices[i + 1]
+             << " " << first_vertex + mesh.indices[i + 2] << "\n";
+      }
+      first_vertex += mesh.vertices.size();
+    }
+
+    *bytes_written = u64(file.tellp());
+    file.close();
+    if (!file) {
+      std::cout << "Mesh " << path << ": write failed\n";
+      return false;
+    }
+    return true;
+  }
+
+  bool writeMeshFile(const std::string& path, const std::vector<RtinMesh>& meshes,
+                     const RtinSettings& settings, float texel_size, u64* bytes_written) {
+    float min_height = std::numeric_limits<float>::max();
+    float max_height = std::numeric_limits<float>::lowest();
+    for (const auto& mesh : meshes) {
+      for (float height : mesh.heights) {
+        min_height = std::min(min_height, height);
+        max_height = std::max(max_height, height);
+      }
+    }
+    if (min_height > max_height) {
+      min_height = max_height = 0.0f;
+    }
+    float range = max_height - min_height;
+
+    TerrainMeshHeader header = {};
+    std::memcpy(header.magic, TERRAIN_MESH_MAGIC, sizeof(header.magic));
+    header.version = TERRAIN_MESH_VERSION;
+    header.header_size = sizeof(TerrainMeshHeader);
+    header.lod = settings.lod;
+    header.texel_size = texel_size;
+    header.max_error = settings.max_error;
+    header.min_height = min_height;
+    header.max_height = max_height;
+    header.tile_size = TILE_SIZE;
+    header.tile_count = u32(meshes.size());
+    header.index_offset = sizeof(TerrainMeshHeader);
+
+    std::vector<TerrainMeshEntry> index(meshes.size());
+    u64 offset = header.index_offset + index.size() * sizeof(TerrainMeshEntry);
+    for (usize i = 0; i < meshes.size(); i++) {
+      bool wide = meshes[i].vertices.size() > 65536;
+      auto& entry = index[i];
+      entry.x = meshes[i].key.x;
+      entry.z = meshes[i].key.z;
+      entry.vertex_count = u32(meshes[i].vertices.size());
+      entry.index_count = u32(meshes[i].indices.size());
+      entry.offset = offset;
+      entry.size = u64(entry.vertex_count) * 3 * sizeof(u16)
+                   + u64(entry.index_count) * (wide ? sizeof(u32) : sizeof(u16));
+      offset = (offset + entry.size + 3) / 4 * 4;
+    }
+    header.file_size = offset;
+
+    std::string temporary_path = path + ".tmp";
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      std::cout << "Mesh " << temporary_path << ": could not open for writing\n";
+      return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(index[0]));
+
+    std::vector<u8> payload;
+    for (usize i = 0; i < meshes.size(); i++) {
+      const auto& mesh = meshes[i];
+      payload.assign(index[i].size, 0);
+
+      u16* vertices = reinterpret_cast<u16*>(payload.data());
+      for (usize v = 0; v < mesh.vertices.size(); v++) {
+        float height = range > 0.0f ? (mesh.heights[v] - min_height) / range : 0.0f;
+        vertices[v * 3 + 0] = u16(mesh.vertices[v].x);
+        vertices[v * 3 + 1] = u16(mesh.vertices[v].y);
+        vertices[v * 3 + 2] = u16(std::lround(glm::clamp(height, 0.0f, 1.0f) * 65535.0f));
+      }
+
+      u8* indices = payload.data() + mesh.vertices.size() * 3 * sizeof(u16);
+      if (mesh.vertices.size() > 65536) {
+        std::memcpy(indices, mesh.indices.data(), mesh.indices.size() * sizeof(u32));
+      } else {
+        for (usize n = 0; n < mesh.indices.size(); n++) {
+          u16 value = u16(mesh.indices[n]);
+          std::memcpy(indices + n * sizeof(u16), &value, sizeof(u16));
+        }
+      }
+
+      file.seekp(std::streamoff(index[i].offset));
+      file.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+    }
+    if (header.file_size > 0) {
+      file.seekp(std::streamoff(header.file_size - 1));
+      file.put('\0');
+    }
+
+    file.close();
+    std::error_code error;
+    if (!file) {
+      std::cout << "Mesh " << temporary_path << ": write failed\n";
+      std::filesystem::remove(temporary_path, error);
+      return false;
+    }
+    std::filesystem::rename(temporary_path, path, error);
+    if (error) {
+      std::filesystem::remove(path, error);
+      std::filesystem::rename(temporary_path, path, error);
+    }
+    if (error) {
+      std::cout << "Mesh " << path << ": " << error.message() << "\n";
+      return false;
+    }
+
+    *bytes_written = header.file_size;
+    return true;
+  }
+}  // namespace
+
+void rtin::computeErrors(const float* heights, float* errors) {
+  const auto& coordinates = triangleCoordinates();
+  usize count = coordinates.size() / 4;
+  usize parents = count - usize(TILE_SIZE) * TILE_SIZE;
+
+  // Children first, so each error already covers the hierarchy below it
+  for (usize i = count; i-- > 0;) {
+    int ax = coordinates[i * 4 + 0];
+    int ay = coordinates[i * 4 + 1];
+    int bx = coordinates[i * 4 + 2];
+    int by = coordinates[i * 4 + 3];
+    int mx = (ax + bx) >> 1;
+    int my = (ay + by) >> 1;
+    int cx = mx + my - ay;
+    int cy = my + ax - mx;
+
+    usize middle = usize(my) * RTIN_GRID + mx;
+    float interpolated = (heights[ay * RTIN_GRID + ax] + heights[by * RTIN_GRID + bx]) * 0.5f;
+    float error = std::max(errors[middle], std::abs(interpolated - heights[middle]));
+    if (i < parents) {
+      usize left = usize((ay + cy) >> 1) * RTIN_GRID + ((ax + cx) >> 1);
+      usize right = usize((by + cy) >> 1) * RTIN_GRID + ((bx + cx) >> 1);
+      error = std::max(error, std::max(errors[left], errors[right]));
+    }
+    errors[middle] = error;
+  }
+}
+
+RtinMesh rtin::extractMesh(const float* heights, const float* errors, float max_error) {
+  RtinMesh mesh;
+  std::vector<u32> vertex_index(GRID_SAMPLES, ~0u);
+  auto vertex = [&](int x, int z) {
+    u32& index = vertex_index[usize(z) * RTIN_GRID + x];
+    if (index == ~0u) {
+      index = u32(mesh.vertices.size());
+      mesh.vertices.push_back(glm::ivec2(x, z));
+      mesh.heights.push_back(heights[usize(z) * RTIN_GRID + x]);
+    }
+    return index;
+  };
+
+  // Split depth first from the two halves of the tile while the hypotenuse midpoint is needed,
+  // so neighbouring triangles share their vertices while they are recent
+  struct Triangle {
+    int ax, ay, bx, by, cx, cy;
+  };
+  std::vector<Triangle> stack = {{TILE_SIZE, TILE_SIZE, 0, 0, 0, TILE_SIZE},
+                                 {0, 0, TILE_SIZE, TILE_SIZE, TILE_SIZE, 0}};
+  while (!stack.empty()) {
+    Triangle t = stack.back();
+    stack.pop_back();
+
+    int mx = (t.ax + t.bx) >> 1;
+    int my = (t.ay + t.by) >> 1;
+    bool splittable = std::abs(t.ax - t.cx) + std::abs(t.ay - t.cy) > 1;
+    if (splittable && errors[usize(my) * RTIN_GRID + mx] > max_error) {
+      stack.push_back({t.bx, t.by, t.cx, t.cy, mx, my});
+      stack.push_back({t.cx, t.cy, t.ax, t.ay, mx, my});
+    } else {
+      mesh.indices.push_back(vertex(t.ax, t.ay));
+      mesh.indices.push_back(vertex(t.bx, t.by));
+      mesh.indices.push_back(vertex(t.cx, t.cy));
+    }
+  }
+
+  return mesh;
+}
+
+std::vector<RtinMesh> rtin::triangulate(Span<const HeightTile> tiles, float max_error) {
+  std::unordered_map<TileKey, usize, TileKeyHash> tile_index;
+  for (usize i = 0; i < tiles.size(); i++) {
+    tile_index[tiles[i].key] = i;
+  }
+
+  // Offsets to the tiles holding sample `v` of a row or column: the one where it is texel 0 first,
+  // then the one whose apron it is, the same order from either side of the seam
+  auto offsets = [](int v, int* out) {
+    int count = 0;
+    if (v == TILE_SIZE) {
+      out[count++] = 1;
+    }
+    out[count++] = 0;
+    if (v == 0) {
+      out[count++] = -1;
+    }
+    return count;
+  };
+  // Calls `body` with each tile holding sample `x`, `z` of tile `i` until it returns true
+  auto forEachHolder = [&](usize i, int x, int z, auto&& body) {
+    const TileKey& key = tiles[i].key;
+    int columns[2], rows[2];
+    int column_count = offsets(x, columns);
+    int row_count = offsets(z, rows);
+    for (int r = 0; r < row_count; r++) {
+      for (int c = 0; c < column_count; c++) {
+        int dx = columns[c];
+        int dz = rows[r];
+        TileKey holder = {key.noise_hash, key.lod, key.x + dx, key.z + dz};
+        auto it = tile_index.find(holder);
+        if (it != tile_index.end() && body(it->second, x - dx * TILE_SIZE, z - dz * TILE_SIZE)) {
+          return;
+        }
+      }
+    }
+  };
+  auto onBorder = [](int x, int z) {
+    return x == 0 || z == 0 || x == TILE_SIZE || z == TILE_SIZE;
+  };
+
+  auto* jobs = JobSystem::instance();
+  std::vector<float> heights(tiles.size() * GRID_SAMPLES);
+  std::vector<float> own_errors(tiles.size() * GRID_SAMPLES, 0.0f);
+  jobs->parallelFor(tiles.size(), 1, [&](usize begin, usize end) {
+    for (usize i = begin; i < end; i++) {
+      float* out = &heights[i * GRID_SAMPLES];
+      for (int z = 0; z < RTIN_GRID; z++) {
+        for (int x = 0; x < RTIN_GRID; x++) {
+          float& height = out[z * RTIN_GRID + x];
+          if (!onBorder(x, z)) {
+            height = tiles[i].at(x, z);
+            continue;
+          }
+          // A seam sample comes from the same tile on both sides
+          forEachHolder(i, x, z, [&](usize holder, int hx, int hz) {
+            height = tiles[holder].at(hx, hz);
+            return true;
+          });
+        }
+      }
+      rtin::computeErrors(out, &own_errors[i * GRID_SAMPLES]);
+    }
+  });
+
+  std::vector<RtinMesh> meshes(tiles.size());
+  jobs->parallelFor(tiles.size(), 1, [&](usize begin, usize end) {
+    std::vector<float> errors(GRID_SAMPLES);
+    for (usize i = begin; i < end; i++) {
+      std::copy_n(&own_errors[i * GRID_SAMPLES], GRID_SAMPLES, errors.data());
+
+      // The larger error of both sides of a seam. Raising them again keeps every parent above
+      // its children, and a seam vertex only has seam vertices below it on the seam, which both
+      // sides raised alike, so the seams stay equal
+      for (int z = 0; z < RTIN_GRID; z++) {
+        for (int x = 0; x < RTIN_GRID; x++) {
+          if (!onBorder(x, z)) {
+            continue;
+          }
+          float& error = errors[z * RTIN_GRID + x];
+          forEachHolder(i, x, z, [&](usize holder, int hx, int hz) {
+            error = std::max(error, own_errors[holder * GRID_SAMPLES + hz * RTIN_GRID + hx]);
+            return false;
+          });
+        }
+      }
+      rtin::computeErrors(&heights[i * GRID_SAMPLES], errors.data());
+
+      meshes[i] = rtin::extractMesh(&heights[i * GRID_SAMPLES], errors.data(), max_error);
+      meshes[i].key = tiles[i].key;
+    }
+  });
+
+  return meshes;
+}
+
+bool rtin::exportMeshes(const RtinSettings& settings, Span<const HeightTile> tiles,
+                        float texel_size, RtinStats* stats) {
+  auto start = std::chrono::steady_clock::now();
+
+  auto meshes = rtin::triangulate(tiles, std::max(settings.max_error, 0.0f));
+  std::sort(meshes.begin(), meshes.end(), [](const RtinMesh& a, const RtinMesh& b) {
+    return a.key.z != b.key.z ? a.key.z < b.key.z : a.key.x < b.key.x;
+  });
+
+  u64 bytes_written = 0;
+  bool written = endsWith(settings.path, ".obj")
+                     ? writeObj(settings.path, meshes, texel_size, &bytes_written)
+                     : writeMeshFile(settings.path, meshes, settings, texel_size, &bytes_written);
+
+  if (stats != nullptr) {
+    *stats = {};
+    stats->tiles = meshes.size();
+    for (const auto& mesh : meshes) {
+      stats->vertices += mesh.vertices.size();
+      stats->triangles += mesh.indices.size() / 3;
+    }
+    stats->bytes_written = bytes_written;
+    stats->threads = JobSystem::instance()->threadCount() + 1;
+    stats->seconds
+        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  return written;
+}
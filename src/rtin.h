@@ -0,0 +1,115 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+
+#include "baker.h"
+#include "core.h"
+
+// Samples per side of a tile's RTIN, its texels and the first row and column of its neighbours
+constexpr int RTIN_GRID = TILE_SIZE + 1;
+
+/**
+ * Adaptive triangle meshes of baked tiles for clients without tessellation.
+ *
+ * Layout of a mesh file, all little endian:
+ *   TerrainMeshHeader
+ *   TerrainMeshEntry[tile_count], sorted by (z, x)
+ *   per tile, 4 byte aligned: u16 vertices[vertex_count][3] of grid x, grid z and height, then
+ *   indices[index_count], u16 when vertex_count <= 65536 and u32 otherwise
+ *
+ * A vertex lies at ((tile x, tile z) * tile_size + (grid x, grid z)) * texel_size, and its height
+ * is min_height + height * (max_height - min_height) / 65535. The range is shared by all tiles, so
+ * the vertices on a seam dequantize to the same position in both tiles. Triangles are counter
+ * clockwise seen from above.
+ */
+constexpr char TERRAIN_MESH_MAGIC[8] = {'T', 'E', 'R', 'R', 'M', 'E', 'S', 'H'};
+constexpr u32 TERRAIN_MESH_VERSION = 1;
+
+struct TerrainMeshHeader {
+  char magic[8];
+  u32 version;
+  u32 header_size;
+  u64 file_size;
+
+  i32 lod;
+  f32 texel_size;
+  f32 max_error;
+  f32 min_height;
+  f32 max_height;
+  i32 tile_size;
+  u32 tile_count;
+  u32 reserved;
+  u64 index_offset;
+};
+static_assert(sizeof(TerrainMeshHeader) == 64, "TerrainMeshHeader is stored as is");
+
+struct TerrainMeshEntry {
+  i32 x;
+  i32 z;
+  u32 vertex_count;
+  u32 index_count;
+  u64 offset;
+  u64 size;
+};
+static_assert(sizeof(TerrainMeshEntry) == 32, "TerrainMeshEntry is stored as is");
+
+struct RtinMesh {
+  TileKey key;
+  std::vector<glm::ivec2> vertices;  // grid coordinates, 0 to TILE_SIZE
+  std::vector<float> heights;
+  std::vector<u32> indices;
+};
+
+struct RtinSettings {
+  // Written as a mesh file, or as a Wavefront OBJ in world space when the path ends with .obj
+  std::string path = "terrain.tmesh";
+  int lod = 2;
+  int radius = 2;
+  // Largest vertical distance in meters of a left out vertex to the edge it would have split,
+  // which other samples under a triangle can slightly exceed
+  float max_error = 1.0f;
+};
+
+struct RtinStats {
+  usize tiles = 0;
+  usize vertices = 0;
+  usize triangles = 0;
+  u64 bytes_written = 0;
+  int threads = 0;
+  double seconds = 0.0;
+
+  // How many times fewer triangles than the full resolution grid
+  double reduction() const {
+    return triangles > 0 ? double(tiles) * TILE_SIZE * TILE_SIZE * 2 / triangles : 0.0;
+  }
+};
+
+namespace rtin {
+  /**
+   * Raise `errors` (RTIN_GRID^2, row major) to the error of each vertex of the right triangulated
+   * irregular network of `heights` (as many samples), which includes every vertex whose error is
+   * at most max_error. The error of a vertex is its distance to the edge it splits, raised to that
+   * of the vertices below it in the hierarchy, so a parent is never left out while a child is in.
+   */
+  void computeErrors(const float* heights, float* errors);
+
+  /**
+   * The triangles of `heights` whose vertices have an error above `max_error`.
+   */
+  RtinMesh extractMesh(const float* heights, const float* errors, float max_error);
+
+  /**
+   * Triangulate `tiles`, which share a LOD, in parallel. A seam between two tiles of `tiles` gets
+   * the same vertices in both: the heights of the seam are taken from one of them and the errors
+   * on it are the larger of both before meshing.
+   */
+  std::vector<RtinMesh> triangulate(Span<const HeightTile> tiles, float max_error);
+
+  /**
+   * Triangulate `tiles` and write them to `path` as described by `settings`.
+   */
+  bool exportMeshes(const RtinSettings& settings, Span<const HeightTile> tiles, float texel_size,
+                    RtinStats* stats = nullptr);
+}  // namespace rtin
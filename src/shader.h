@@ -7,6 +7,7 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <string>
 
 #include "gpu.h"
 
@@ -64,8 +65,12 @@ static bool readShaderSource(const std::filesystem::path& filepath, std::ifstrea
   return true;
 }
 
+/**
+ * `defines` is inserted into every stage right after the #version line, e.g. "#define X 1\n".
+ */
 template <auto N>
-GLuint loadShaderProgram(const std::array<ShaderInput, N>& shaders, bool allow_errors) {
+GLuint loadShaderProgram(const std::array<ShaderInput, N>& shaders, bool allow_errors,
+                         const std::string& defines = "") {
   GLuint gl_program = glCreateProgram();
 
   for (auto& s : shaders) {
@@ -83,6 +88,12 @@ GLuint loadShaderProgram(const std::array<ShaderInput, N>& shaders, bool allow_e
 
     std::string full_source{std::istreambuf_iterator<char>(shader_source),
                             std::istreambuf_iterator<char>()};
+    if (!defines.empty()) {
+      auto version_end = full_source.find('\n', full_source.find("#version"));
+      if (version_end != std::string::npos) {
+        full_source.insert(version_end + 1, defines + "#line 2 0\n");
+      }
+    }
     const char* c_str = full_source.c_str();
     glShaderSource(gl_shader, 1, &c_str, nullptr);
 
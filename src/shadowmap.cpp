@@ -78,6 +78,7 @@ void ShadowMap::begin(uint tex_index, Projection projection, mat4 proj_matrix,
   }
 
   gpu::setUniformSlow(shader_program, "shadow_map.blend_distance", blend_distance);
+  gpu::setUniformSlow(shader_program, "shadow_map.rendered_cascades", rendered_cascades);
   gpu::setUniformSlow(shader_program, "shadow_map.debug_show_splits", debug_show_splits);
   gpu::setUniformSlow(shader_program, "shadow_map.debug_show_blend", debug_show_blend);
 
@@ -154,6 +155,7 @@ void ShadowMap::gui(SDL_Window* window) {
   if (ImGui::CollapsingHeader("Cascading Shadow Map")) {
     ImGui::DragFloat("Bias", &this->bias);
     ImGui::DragFloat("Blend distance", &this->blend_distance);
+    ImGui::SliderInt("Rendered cascades", &this->rendered_cascades, 1, NUM_CASCADES);
 
     ImGui::Text("Debug");
     ImGui::Checkbox("Show cascade splits", &debug_show_splits);
@@ -29,6 +29,8 @@ public:
   int resolution = 1024 * 4;
   float bias = 4098;
   float blend_distance = 150.0;
+  // Cascades past this many are not rendered, the terrain shades them with its horizon maps
+  int rendered_cascades = NUM_CASCADES;
 
   GLuint fbo;
   GLuint shadow_tex;
@@ -0,0 +1,273 @@
+#include "streamer.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "jobs.h"
+
+namespace {
+  // Seconds over which the camera velocity is smoothed
+  constexpr float VELOCITY_SMOOTHING = 0.25f;
+  // Faster than this between two frames is a teleport, not motion
+  constexpr float MAX_SPEED = 5000.0f;
+  constexpr usize RESIDENT_SAMPLES = 256;
+}  // namespace
+
+TerrainStreamer::~TerrainStreamer() { this->cancel(); }
+
+void TerrainStreamer::cancel() {
+  this->shared->generation += 1;
+  {
+    std::lock_guard<std::mutex> lock(this->shared->mutex);
+    this->shared->finished.clear();
+  }
+  this->in_flight.clear();
+}
+
+void TerrainStreamer::openTileFile(const TerrainNoise& noise, float base_texel_size) {
+  auto path = TileFile::pathFor(this->tile_directory, noise::hash(noise));
+  this->tile_file = TileFile::open(path, noise, base_texel_size);
+}
+
+bool TerrainStreamer::inRange(const TileBaker& baker, const TileKey& key) const {
+  int range = this->radius + std::max(this->eviction_margin, 0);
+  for (glm::vec2 center : {this->camera_center, this->prefetch_center}) {
+    TileKey middle = baker.tileAt(key.noise_hash, key.lod, center);
+    if (std::abs(key.x - middle.x) <= range && std::abs(key.z - middle.z) <= range) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void TerrainStreamer::makeResident(const TileKey& key, std::shared_ptr<const CachedTile> tile,
+                                   Clock::time_point now) {
+  this->resident[key] = tile;
+
+  auto it = this->requested.find(key);
+  if (it == this->requested.end()) {
+    return;
+  }
+  float ms = std::chrono::duration<float, std::milli>(now - it->second).count();
+  this->requested.erase(it);
+  if (this->resident_ms.size() < RESIDENT_SAMPLES) {
+    this->resident_ms.push_back(ms);
+  } else {
+    this->resident_ms[this->resident_ms_next] = ms;
+    this->resident_ms_next = (this->resident_ms_next + 1) % RESIDENT_SAMPLES;
+  }
+}
+
+void TerrainStreamer::update(const TileBaker& baker, TileCache& cache, const TerrainNoise& noise,
+                             glm::vec3 camera_position) {
+  auto now = Clock::now();
+  u64 hash = noise::hash(noise);
+  if (hash != this->noise_hash || baker.base_texel_size != this->texel_size) {
+    this->cancel();
+    this->noise_hash = hash;
+    this->texel_size = baker.base_texel_size;
+    this->openTileFile(noise, baker.base_texel_size);
+    this->is_rebaking = true;
+    this->rebake_start = now;
+    // The tiles of the old noise are left to the LRU order, switching back may still find them
+    this->resident.clear();
+    this->requested.clear();
+  }
+
+  // Camera velocity, reset by a teleport or a long stall
+  glm::vec2 center = glm::vec2(camera_position.x, camera_position.z);
+  if (this->has_camera) {
+    float dt = std::chrono::duration<float>(now - this->last_update).count();
+    glm::vec2 frame_velocity = (center - this->camera_center) / std::max(dt, 1e-4f);
+    if (dt > 0.0f && dt < 0.5f && glm::length(frame_velocity) < MAX_SPEED) {
+      float blend = 1.0f - std::exp(-dt / VELOCITY_SMOOTHING);
+      this->velocity += (frame_velocity - this->velocity) * blend;
+    } else {
+      this->velocity = glm::vec2(0.0f);
+    }
+  }
+  this->has_camera = true;
+  this->last_update = now;
+  this->camera_center = center;
+  this->prefetch_center = center + this->velocity * std::max(this->prefetch_seconds, 0.0f);
+
+  // Hand a few finished tiles to the cache so the frame time stays flat
+  std::vector<HeightTile> finished;
+  {
+    std::lock_guard<std::mutex> lock(this->shared->mutex);
+    auto& queue = this->shared->finished;
+    usize count = std::min(queue.size(), usize(std::max(this->max_inserts_per_frame, 1)));
+    std::move(queue.begin(), queue.begin() + count, std::back_inserter(finished));
+    queue.erase(queue.begin(), queue.begin() + count);
+  }
+  for (auto& tile : finished) {
+    TileKey key = tile.key;
+    this->in_flight.erase(key);
+    // Out of range by now, e.g. after a turn, it would only be evicted again
+    if (this->enabled && !this->inRange(baker, key)) {
+      this->dropped_tiles += 1;
+      this->requested.erase(key);
+      continue;
+    }
+    this->makeResident(key, cache.insert(std::move(tile)), now);
+  }
+
+  if (!this->enabled) {
+    return;
+  }
+
+  auto keys = baker.tilesAround(hash, center, this->lod_count, this->radius);
+  if (glm::length(this->prefetch_center - center) > 0.0f) {
+    auto ahead = baker.tilesAround(hash, this->prefetch_center, this->lod_count, this->radius);
+    std::unordered_set<TileKey, TileKeyHash> unique(keys.begin(), keys.end());
+    for (const auto& key : ahead) {
+      if (unique.insert(key).second) {
+        keys.push_back(key);
+      }
+    }
+  }
+
+  // By the distance to the closest point of each tile, from the camera and the prefetch position
+  float heading_weight = glm::clamp(this->heading_weight, 0.0f, 1.0f);
+  std::vector<std::pair<float, TileKey>> wanted;
+  wanted.reserve(keys.size());
+  for (const auto& key : keys) {
+    glm::vec2 tile_min = baker.tileOrigin(key);
+    glm::vec2 tile_max = tile_min + glm::vec2(baker.tileWorldSize(key.lod));
+    auto distanceFrom = [&](glm::vec2 p) {
+      return glm::length(glm::clamp(p, tile_min, tile_max) - p);
+    };
+    float priority = glm::mix(distanceFrom(center), distanceFrom(this->prefetch_center),
+                              heading_weight);
+    wanted.emplace_back(priority, key);
+  }
+  std::stable_sort(wanted.begin(), wanted.end(),
+                   [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  this->missing_tiles = 0;
+  this->queue_depth = 0;
+  int free_slots = std::max(this->max_in_flight, 1) - int(this->in_flight.size());
+  for (const auto& [priority, key] : wanted) {
+    if (cache.contains(key)) {
+      // Possibly from another stage, which decides when it leaves
+      continue;
+    }
+
+    this->requested.emplace(key, now);
+    if (this->tile_file != nullptr) {
+      if (auto tile = this->tile_file->mapTile(key)) {
+        this->mapped_tiles += 1;
+        this->makeResident(key, cache.insert(std::move(tile)), now);
+        continue;
+      }
+    }
+
+    this->missing_tiles += 1;
+    if (this->in_flight.count(key) != 0) {
+      continue;
+    }
+    if (free_slots <= 0) {
+      this->queue_depth += 1;
+      continue;
+    }
+    free_slots -= 1;
+    this->in_flight.insert(key);
+
+    auto shared = this->shared;
+    u32 generation = shared->generation.load();
+    auto job = [shared, generation, baker, noise, key]() {
+      if (shared->generation.load() != generation) {
+        shared->cancelled += 1;
+        return;
+      }
+
+      HeightTile tile;
+      tile.key = key;
+      baker.bakeTile(noise, tile);
+
+      if (shared->generation.load() != generation) {
+        shared->cancelled += 1;
+        return;
+      }
+
+      shared->baked += 1;
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      shared->finished.push_back(std::move(tile));
+    };
+    JobSystem::instance()->submit(job, int(priority));
+  }
+
+  // Requests of tiles that are no longer wanted do not count towards the time to resident
+  for (auto it = this->requested.begin(); it != this->requested.end();) {
+    bool wanted_now = this->in_flight.count(it->first) != 0 || this->inRange(baker, it->first);
+    it = wanted_now ? std::next(it) : this->requested.erase(it);
+  }
+
+  for (auto it = this->resident.begin(); it != this->resident.end();) {
+    if (this->inRange(baker, it->first)) {
+      ++it;
+      continue;
+    }
+    // Unless it was evicted or replaced since
+    if (auto tile = it->second.lock()) {
+      this->evicted_tiles += cache.erase(it->first, tile.get()) ? 1 : 0;
+    }
+    it = this->resident.erase(it);
+  }
+
+  if (this->is_rebaking && this->missing_tiles == 0) {
+    this->is_rebaking = false;
+    this->last_rebake_ms
+        = std::chrono::duration<float, std::milli>(Clock::now() - this->rebake_start).count();
+  }
+
+  this->last_update_ms = std::chrono::duration<float, std::milli>(Clock::now() - now).count();
+}
+
+void TerrainStreamer::gui() {
+  ImGui::Checkbox("Stream tiles", &this->enabled);
+  ImGui::SliderInt("Streamed LODs", &this->lod_count, 1, 8);
+  ImGui::SliderInt("Streamed radius", &this->radius, 0, 8);
+  ImGui::SliderInt("Inserts per frame", &this->max_inserts_per_frame, 1, 32);
+  ImGui::SliderInt("Bakes in flight", &this->max_in_flight, 1, 64);
+  ImGui::SliderInt("Eviction margin", &this->eviction_margin, 0, 4);
+  ImGui::SliderFloat("Prefetch seconds", &this->prefetch_seconds, 0.0f, 10.0f);
+  ImGui::SliderFloat("Heading weight", &this->heading_weight, 0.0f, 1.0f);
+
+  ImGui::Text("Generation: %u, missing: %zu, in flight: %zu, queued jobs: %zu",
+              this->shared->generation.load(), this->missing_tiles, this->in_flight.size(),
+              JobSystem::instance()->queuedJobs());
+  ImGui::Text("Queue depth: %zu, resident: %zu, evicted: %llu, dropped: %llu", this->queue_depth,
+              this->resident.size(), (unsigned long long)this->evicted_tiles,
+              (unsigned long long)this->dropped_tiles);
+
+  if (!this->resident_ms.empty()) {
+    std::vector<float> sorted = this->resident_ms;
+    std::sort(sorted.begin(), sorted.end());
+    float mean = 0.0f;
+    for (float ms : sorted) {
+      mean += ms / sorted.size();
+    }
+    ImGui::Text("Time to resident: %.1f ms mean, %.1f ms p95, %.1f ms max", mean,
+                sorted[sorted.size() * 95 / 100], sorted.back());
+  }
+  ImGui::Text("Speed: %.0f m/s, update: %.2f ms", glm::length(this->velocity),
+              this->last_update_ms);
+  ImGui::Text("Baked: %llu, cancelled: %llu, mapped from file: %llu",
+              (unsigned long long)this->shared->baked.load(),
+              (unsigned long long)this->shared->cancelled.load(),
+              (unsigned long long)this->mapped_tiles);
+  if (this->tile_file != nullptr) {
+    ImGui::Text("Tile file: %s (%u tiles)", this->tile_file->path().c_str(),
+                this->tile_file->header().tile_count);
+  } else {
+    ImGui::Text("Tile file: none");
+  }
+  if (this->is_rebaking) {
+    ImGui::Text("Rebaking...");
+  } else {
+    ImGui::Text("Last rebake: %.1f ms", this->last_rebake_ms);
+  }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "baker.h"
+#include "core.h"
+#include "noise.h"
+#include "tilecache.h"
+#include "tilefile.h"
+
+/**
+ * Keeps the tiles around the camera baked for the current noise parameters.
+ *
+ * Tiles found in the tile file of the current noise parameters are mapped straight into the cache.
+ * Other missing tiles are baked on the job system. They wait in a queue on the main thread that is
+ * sorted again every frame, by the distance to the camera and to where its velocity takes it, and
+ * only max_in_flight of them are handed to the workers at a time so a turn reorders the backlog.
+ * The tiles around that prefetch position are wanted too.
+ *
+ * The tiles serve the CPU consumers of the cache (erosion, horizon maps, mesh export). The GPU
+ * still evaluates the noise itself, so the CDLOD bounds and the rendered surface do not read them.
+ *
+ * Changing the noise starts a new generation: queued jobs of older generations return without
+ * baking and results that finish late are dropped. Finished tiles are handed to the cache on the
+ * main thread, a few per frame, and the tiles put in the cache are evicted again once they are out
+ * of range, so nothing on the main thread waits for a bake.
+ */
+class TerrainStreamer {
+public:
+  bool enabled = true;
+  int lod_count = 4;
+  int radius = 2;
+  // Tiles moved from the workers into the cache per frame, quantizing one takes ~0.3 ms
+  int max_inserts_per_frame = 4;
+  int max_in_flight = 16;
+  // Tiles further than radius + eviction_margin tiles from the camera and the prefetch position
+  // leave the cache
+  int eviction_margin = 1;
+  // The prefetch position is this far ahead at the current velocity
+  float prefetch_seconds = 2.0f;
+  // 0 orders the bakes by the distance to the camera, 1 by the distance to the prefetch position
+  float heading_weight = 0.35f;
+  std::string tile_directory = "tiles";
+
+  ~TerrainStreamer();
+
+  /**
+   * Call once per frame from the main thread.
+   */
+  void update(const TileBaker& baker, TileCache& cache, const TerrainNoise& noise,
+              glm::vec3 camera_position);
+
+  /**
+   * Abandon all queued and running bakes.
+   */
+  void cancel();
+
+  /**
+   * (Re)open the tile file of `noise`, e.g. after it was written.
+   */
+  void openTileFile(const TerrainNoise& noise, float base_texel_size);
+
+  u64 noiseHash() const { return noise_hash; }
+  usize inFlight() const { return in_flight.size(); }
+  usize queueDepth() const { return queue_depth; }
+
+  void gui();
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  // Shared with the jobs, which may outlive the streamer
+  struct Shared {
+    std::atomic<u32> generation{0};
+    std::atomic<u64> baked{0};
+    std::atomic<u64> cancelled{0};
+
+    std::mutex mutex;
+    std::vector<HeightTile> finished;
+  };
+
+  std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+  u64 noise_hash = 0;
+  float texel_size = 0.0f;
+  std::unordered_set<TileKey, TileKeyHash> in_flight;
+  std::shared_ptr<TileFile> tile_file;
+  u64 mapped_tiles = 0;
+
+  // Camera motion, smoothed over a few frames
+  bool has_camera = false;
+  glm::vec2 camera_center = glm::vec2(0.0f);
+  glm::vec2 prefetch_center = glm::vec2(0.0f);
+  glm::vec2 velocity = glm::vec2(0.0f);
+  Clock::time_point last_update;
+
+  // Tiles this streamer put in the cache, the only ones it evicts, and since when a wanted tile is
+  // missing. Tiles other stages inserted or replaced, e.g. eroded ones, are theirs to keep
+  std::unordered_map<TileKey, std::weak_ptr<const CachedTile>, TileKeyHash> resident;
+  std::unordered_map<TileKey, Clock::time_point, TileKeyHash> requested;
+  usize queue_depth = 0;
+  u64 evicted_tiles = 0;
+  u64 dropped_tiles = 0;
+  float last_update_ms = 0.0f;
+
+  // The latest times from a tile being wanted to being in the cache
+  std::vector<float> resident_ms;
+  usize resident_ms_next = 0;
+
+  // Time from the last noise change until every wanted tile was in the cache
+  bool is_rebaking = false;
+  Clock::time_point rebake_start;
+  float last_rebake_ms = 0.0f;
+  usize missing_tiles = 0;
+
+  bool inRange(const TileBaker& baker, const TileKey& key) const;
+  void makeResident(const TileKey& key, std::shared_ptr<const CachedTile> tile,
+                    Clock::time_point now);
+};
@@ -1,7 +1,17 @@
 #include "terrain.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "jobs.h"
+
 void Terrain::init() {
+  this->onNoiseChanged();
   this->buildMesh(false);
+  this->cdlod.init();
+  this->clipmap.init();
+  this->volume.init();
 
   // OpenGL Setup
   glPatchParameteri(GL_PATCH_VERTICES, 3);
@@ -55,6 +65,12 @@ void Terrain::deinit() {
   glDeleteBuffers(1, &this->positions_bo);
   glDeleteBuffers(1, &this->indices_bo);
   glDeleteVertexArrays(1, &this->vao);
+  this->cdlod.deinit();
+  this->atlas.deinit();
+  this->clipmap.deinit();
+  this->volume.deinit();
+  this->hydrology.deinit();
+  this->horizon.deinit();
 }
 
 void Terrain::loadShader(bool is_reload) {
@@ -65,7 +81,10 @@ void Terrain::loadShader(bool is_reload) {
       ShaderInput{"resources/shaders/terrain.tes", GL_TESS_EVALUATION_SHADER},
   });
 
-  auto program = loadShaderProgram(program_shaders, is_reload);
+  // The noise functions are specialised for the style and octave count
+  this->shader_defines = noise::shaderDefines(this->noise);
+
+  auto program = loadShaderProgram(program_shaders, is_reload, this->shader_defines);
   if (program != 0) {
     if (is_reload) {
       glDeleteProgram(this->shader_program);
@@ -80,13 +99,17 @@ void Terrain::loadShader(bool is_reload) {
       ShaderInput{"resources/shaders/terrain.tes", GL_TESS_EVALUATION_SHADER},
   });
 
-  auto program_simple = loadShaderProgram(program_shaders_simple, is_reload);
+  auto program_simple
+      = loadShaderProgram(program_shaders_simple, is_reload, this->shader_defines);
   if (program_simple != 0) {
     if (is_reload) {
       glDeleteProgram(this->shader_program_simple);
     }
     this->shader_program_simple = program_simple;
   }
+
+  this->atlas.loadShader(is_reload, this->shader_defines);
+  this->volume.loadShader(is_reload, this->shader_defines);
 }
 
 void Terrain::buildMesh(bool is_reload) {
@@ -106,9 +129,307 @@ void Terrain::update(float delta_time, float current_time) {
   sun.direction = vec3(sun_matrix[2][0], sun_matrix[2][1], sun_matrix[2][2]);
 }
 
-void Terrain::begin(bool simple) {
-  glUseProgram(simple ? this->shader_program_simple : this->shader_program);
+TerrainNoise Terrain::queryNoise() {
+  std::lock_guard<std::mutex> lock(this->query_mutex);
+  return this->query_noise;
+}
+
+void Terrain::onNoiseChanged() {
+  std::lock_guard<std::mutex> lock(this->query_mutex);
+  this->query_noise = this->noise;
+  this->noise_version += 1;
+}
+
+void Terrain::queryHeights(Span<const glm::vec2> positions, Span<float> out_heights) {
+  assert(positions.size() == out_heights.size());
+  auto noise = this->queryNoise();
+  noise::terrainHeights(noise, positions.data(), out_heights.data(), positions.size());
+}
+
+void Terrain::queryNormals(Span<const glm::vec2> positions, Span<glm::vec3> out_normals) {
+  assert(positions.size() == out_normals.size());
+  auto noise = this->queryNoise();
+  noise::terrainNormals(noise, positions.data(), out_normals.data(), positions.size());
+}
+
+void Terrain::updateBounds(glm::vec3 center) {
+  if (auto job = this->pyramid_job) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (!job->finished) {
+      return;
+    }
+    {
+      std::unique_lock<std::shared_mutex> pyramid_lock(this->pyramid_mutex);
+      std::swap(this->height_pyramid, job->pyramid);
+      this->pyramid_noise_version = job->noise_version;
+    }
+    this->pyramid_stats = job->stats;
+    this->pyramid_job = nullptr;
+  }
+
+  TerrainNoise noise;
+  u32 version;
+  {
+    std::lock_guard<std::mutex> lock(this->query_mutex);
+    noise = this->query_noise;
+    version = this->noise_version;
+  }
+
+  // Snap to whole cells so the bounds don't change while moving inside the region
+  float cell_size = this->terrain_size / this->pyramid_resolution;
+  glm::vec2 center_xz = glm::floor(glm::vec2(center.x, center.z) / cell_size) * cell_size;
+
+  // Only this thread swaps the pyramid, reading it needs no lock
+  const auto& pyramid = this->height_pyramid;
+  glm::vec2 moved = glm::abs(center_xz - pyramid.center);
+  bool is_stale = !pyramid.isBuilt() || this->pyramid_noise_version != version
+                  || pyramid.size != this->terrain_size
+                  || pyramid.resolution != this->pyramid_resolution
+                  || glm::max(moved.x, moved.y) > pyramid.size / 4.0f;
+  if (!is_stale) {
+    return;
+  }
+
+  auto job = std::make_shared<PyramidJob>();
+  this->pyramid_job = job;
+  float size = this->terrain_size;
+  int resolution = this->pyramid_resolution;
+  int benchmark_grid = this->pyramid_benchmark_grid;
+  JobSystem::instance()->submit([=]() {
+    HeightPyramid rebuilt;
+    HeightPyramidStats stats;
+    auto start = std::chrono::steady_clock::now();
+    rebuilt.build(noise, center_xz, size, resolution);
+    auto end = std::chrono::steady_clock::now();
+    stats.build_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    rebuilt.benchmark(benchmark_grid, &stats);
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->noise_version = version;
+    job->pyramid = std::move(rebuilt);
+    job->stats = stats;
+    job->finished = true;
+  });
+}
+
+TerrainHit Terrain::raycast(glm::vec3 origin, glm::vec3 direction, float max_t) {
+  std::shared_lock<std::shared_mutex> lock(this->pyramid_mutex);
+  if (!this->height_pyramid.isBuilt()) {
+    return TerrainHit{};
+  }
+  return this->height_pyramid.raycast(origin, direction, max_t);
+}
+
+void Terrain::raycastBatch(Span<const TerrainRay> rays, Span<TerrainHit> out_hits) {
+  std::shared_lock<std::shared_mutex> lock(this->pyramid_mutex);
+  if (!this->height_pyramid.isBuilt()) {
+    std::fill(out_hits.begin(), out_hits.end(), TerrainHit{});
+    return;
+  }
+  this->height_pyramid.raycastBatch(rays, out_hits);
+}
+
+void Terrain::benchmarkRaycasts(Camera* camera) {
+  // A 128x128 grid of rays over a 90 degree cone around the view direction
+  const int grid_size = 128;
+  vec3 origin = camera->getWorldPos();
+  vec3 forward = normalize(camera->direction);
+  vec3 right = normalize(cross(forward, vec3(0, 1, 0)));
+  vec3 up = cross(right, forward);
+
+  std::vector<TerrainRay> rays(grid_size * grid_size);
+  std::vector<TerrainHit> hits(rays.size());
+  for (int y = 0; y < grid_size; y++) {
+    for (int x = 0; x < grid_size; x++) {
+      vec2 uv = vec2(x, y) / float(grid_size - 1) * 2.0f - 1.0f;
+      auto& ray = rays[y * grid_size + x];
+      ray.origin = origin;
+      ray.direction = normalize(forward + right * uv.x + up * uv.y);
+      ray.max_t = camera->projection.far;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  this->raycastBatch(rays, hits);
+  auto end = std::chrono::steady_clock::now();
+
+  auto elapsed = std::chrono::duration<float, std::micro>(end - start).count();
+  this->raycast_benchmark_us = elapsed / rays.size();
+}
+
+void Terrain::updateStreaming(glm::vec3 camera_position) {
+  if (auto job = this->tile_file_job) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->finished) {
+      this->tile_file_stats = job->stats;
+      this->tile_file_job = nullptr;
+      if (this->tile_file_stats.succeeded) {
+        this->streamer.openTileFile(this->noise, this->baker.base_texel_size);
+      }
+    }
+  }
+  if (auto job = this->mesh_export_job) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->finished) {
+      this->mesh_export_stats = job->stats;
+      this->mesh_export_job = nullptr;
+    }
+  }
+  if (auto job = this->height_export_job) {
+    std::lock_guard<std::mutex> lock(job->mutex);
+    if (job->finished) {
+      this->height_export_stats = job->stats;
+      this->height_export_job = nullptr;
+    }
+  }
+
+  this->streamer.update(this->baker, this->tile_cache, this->noise, camera_position);
+  this->erosion.update(this->baker, this->tile_cache, this->noise, camera_position);
+  this->hydrology.update(this->noise);
+  this->horizon.update(this->baker, this->tile_cache, this->noise, camera_position);
+}
+
+void Terrain::updateLod(glm::vec3 camera_position) {
+  if (this->mode == TerrainMode::Chunked) {
+    std::shared_lock<std::shared_mutex> lock(this->pyramid_mutex);
+    this->cdlod.select(camera_position, noise::heightBounds(this->noise), &this->height_pyramid);
+    SurfaceParameters surface = {
+        this->texture_start_heights, this->texture_blends,   this->texture_sizes,
+        this->albedos.gl_id,         this->roughness.gl_id, this->ambient_occlusions.gl_id,
+    };
+    this->atlas.update(this->noise, surface, this->cdlod);
+  } else if (this->mode == TerrainMode::Clipmap) {
+    this->clipmap.update(this->noise, camera_position);
+  } else if (this->mode == TerrainMode::Volume) {
+    this->volume.update(this->noise, camera_position);
+  }
+}
+
+void Terrain::writeTileFile(glm::vec3 camera_position) {
+  if (this->tile_file_job != nullptr) {
+    return;
+  }
+
+  // The LOD 0 tiles the streamer wants, rounded out to whole tiles of the coarsest LOD so every
+  // level covers the same region
+  u64 noise_hash = noise::hash(this->noise);
+  int lod_count = glm::clamp(this->streamer.lod_count, 1, 8);
+  int alignment = 1 << (lod_count - 1);
+  int radius = std::max(this->streamer.radius, 0);
+  TileKey middle
+      = this->baker.tileAt(noise_hash, 0, glm::vec2(camera_position.x, camera_position.z));
+  auto roundDown = [&](int tile) {
+    return int(std::floor(float(tile) / float(alignment))) * alignment;
+  };
+  int first_x = roundDown(middle.x - radius);
+  int first_z = roundDown(middle.z - radius);
+  int tiles = std::max(roundDown(middle.x + radius) - first_x,
+                       roundDown(middle.z + radius) - first_z)
+              + alignment;
+
+  auto job = std::make_shared<TileFileJob>();
+  this->tile_file_job = job;
+  auto path = TileFile::pathFor(this->streamer.tile_directory, noise_hash);
+  TerrainNoise noise = this->noise;
+  float base_texel_size = this->baker.base_texel_size;
+  bool quantize = this->tile_cache.quantize();
+  JobSystem::instance()->submit([=]() {
+    TileFileStats stats;
+    TileFile::writePyramid(path, noise, base_texel_size, first_x, first_z, tiles, lod_count,
+                           quantize, &stats);
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->stats = stats;
+    job->finished = true;
+  });
+}
+
+void Terrain::exportMesh(glm::vec3 camera_position) {
+  if (this->mesh_export_job != nullptr) {
+    return;
+  }
+
+  int lod = glm::clamp(this->mesh_export.lod, 0, 8);
+  u64 noise_hash = noise::hash(this->noise);
+  auto keys = this->baker.tilesAround(noise_hash, glm::vec2(camera_position.x, camera_position.z),
+                                      lod + 1, glm::clamp(this->mesh_export.radius, 0, 8));
+  keys.erase(std::remove_if(keys.begin(), keys.end(),
+                            [&](const TileKey& key) { return key.lod != lod; }),
+             keys.end());
+
+  // The cache is only touched here, the job decodes the cached tiles and bakes the others
+  std::vector<std::shared_ptr<const CachedTile>> cached(keys.size());
+  for (usize i = 0; i < keys.size(); i++) {
+    cached[i] = this->tile_cache.peek(keys[i]);
+  }
+
+  this->mesh_export.lod = lod;
+  auto job = std::make_shared<MeshExportJob>();
+  this->mesh_export_job = job;
+  TerrainNoise noise = this->noise;
+  RtinSettings settings = this->mesh_export;
+  // A copy, bakeTiles() writes its stats
+  TileBaker baker = this->baker;
+  JobSystem::instance()->submit([=]() mutable {
+    std::vector<HeightTile> tiles(keys.size());
+    std::vector<TileKey> missing;
+    std::vector<usize> missing_index;
+    for (usize i = 0; i < keys.size(); i++) {
+      if (cached[i] != nullptr) {
+        tiles[i] = cached[i]->decode();
+      } else {
+        missing.push_back(keys[i]);
+        missing_index.push_back(i);
+      }
+    }
+    auto baked = baker.bakeTiles(noise, missing);
+    for (usize i = 0; i < baked.size(); i++) {
+      tiles[missing_index[i]] = std::move(baked[i]);
+    }
+
+    RtinStats stats;
+    rtin::exportMeshes(settings, tiles, baker.texelSize(lod), &stats);
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->stats = stats;
+    job->finished = true;
+  });
+}
+
+void Terrain::exportHeights(glm::vec3 camera_position) {
+  if (this->height_export_job != nullptr) {
+    return;
+  }
+
+  glm::vec2 extent = glm::vec2(this->height_export.width, this->height_export.height)
+                     * this->height_export.texel_size;
+  this->height_export.origin = glm::vec2(camera_position.x, camera_position.z) - extent * 0.5f;
+
+  auto job = std::make_shared<HeightExportJob>();
+  this->height_export_job = job;
+  TerrainNoise noise = this->noise;
+  DemExportSettings settings = this->height_export;
+  JobSystem::instance()->submit([=]() {
+    DemExportStats stats;
+    dem::exportHeights(noise, settings, &stats);
+
+    std::lock_guard<std::mutex> lock(job->mutex);
+    job->stats = stats;
+    job->finished = true;
+  });
+}
+
+GLuint Terrain::program() const {
+  if (this->mode == TerrainMode::Volume) {
+    return this->volume.program(this->simple);
+  }
+  return this->simple ? this->shader_program_simple : this->shader_program;
+}
+
+void Terrain::begin(bool simple, int cascade) {
   this->simple = simple;
+  glUseProgram(this->program());
+  this->cull_pass = cascade >= 0 ? cascade : NUM_CASCADES;
 }
 
 void Terrain::render(glm::mat4 projection_matrix, glm::mat4 view_matrix, glm::vec3 center,
@@ -116,7 +437,7 @@ void Terrain::render(glm::mat4 projection_matrix, glm::mat4 view_matrix, glm::ve
                      float environment_multiplier) {
   GLint prev_polygon_mode;
 
-  GLuint shader_program = this->simple ? this->shader_program_simple : this->shader_program;
+  GLuint shader_program = this->program();
 
   {
     glBindTextureUnit(0, albedos.gl_id);
@@ -149,6 +470,9 @@ void Terrain::render(glm::mat4 projection_matrix, glm::mat4 view_matrix, glm::ve
     gpu::setUniformSlow(shader_program, "noise.frequency", noise.frequency);
     gpu::setUniformSlow(shader_program, "noise.persistence", noise.persistence);
     gpu::setUniformSlow(shader_program, "noise.lacunarity", noise.lacunarity);
+    gpu::setUniformSlow(shader_program, "noise.warp_strength", noise.warp_strength);
+    gpu::setUniformSlow(shader_program, "finiteDifferenceNormals",
+                        (GLint)this->finite_difference_normals);
 
     sun.upload(shader_program, "sun", view_matrix);
     gpu::setUniformSlow(shader_program, "environment_multiplier", environment_multiplier);
@@ -164,13 +488,42 @@ void Terrain::render(glm::mat4 projection_matrix, glm::mat4 view_matrix, glm::ve
                  texture_sizes.data());
     glUniform1fv(glGetUniformLocation(shader_program, "texture_displacement_weights"),
                  texture_displacement_weights.size(), texture_displacement_weights.data());
-
-    glUniform1fv(glGetUniformLocation(shader_program, "tessMultiplier"), 1, &this->tess_multiplier);
+    gpu::setUniformSlow(shader_program, "macroEnabled", (GLint)this->macro_enabled);
+    gpu::setUniformSlow(shader_program, "macroDistance", this->macro_distance);
+    gpu::setUniformSlow(shader_program, "macroFadeBand", glm::max(this->macro_fade_band, 1.0f));
+    this->hydrology.setUniforms(shader_program);
+    this->horizon.setUniforms(shader_program);
+
+    // The clipmap grid already has the resolution of its heights, tessellating it adds nothing. The
+    // CDLOD grid and its morph do the LOD, tessellating the chunks would multiply the far triangles
+    // and split the edges between chunks of different LODs independently, leaving cracks
+    bool clipmapped = this->mode == TerrainMode::Clipmap;
+    bool tessellated = !clipmapped && this->mode != TerrainMode::Chunked;
+    float tess_multiplier = tessellated ? this->tess_multiplier : 0.0f;
+    glUniform1fv(glGetUniformLocation(shader_program, "tessMultiplier"), 1, &tess_multiplier);
 
     // Draw the terrain
-    glBindVertexArray(this->vao);
-    glDrawElements(GL_PATCHES, this->indices_count, GL_UNSIGNED_SHORT, 0);
-    glBindVertexArray(0);
+    gpu::setUniformSlow(shader_program, "terrainMode", (GLint)this->mode);
+    gpu::setUniformSlow(shader_program, "clipmapped", (GLint)clipmapped);
+    if (this->mode == TerrainMode::Chunked) {
+      // The projection is the ortho box of the cascade in the shadow passes
+      Frustum frustum = Frustum::fromMatrix(projection_matrix * view_matrix);
+      this->cdlod.setUniforms(shader_program);
+      this->atlas.setUniforms(shader_program);
+      this->cdlod.draw(this->frustum_culling ? &frustum : nullptr,
+                       &this->cull_stats[this->cull_pass]);
+    } else if (clipmapped) {
+      this->clipmap.setUniforms(shader_program);
+      this->clipmap.draw();
+    } else if (this->mode == TerrainMode::Volume) {
+      Frustum frustum = Frustum::fromMatrix(projection_matrix * view_matrix);
+      this->volume.draw(this->frustum_culling ? &frustum : nullptr,
+                        &this->cull_stats[this->cull_pass]);
+    } else {
+      glBindVertexArray(this->vao);
+      glDrawElements(GL_PATCHES, this->indices_count, GL_UNSIGNED_SHORT, 0);
+      glBindVertexArray(0);
+    }
   }
 
   if (this->wireframe) {
@@ -181,15 +534,51 @@ void Terrain::render(glm::mat4 projection_matrix, glm::mat4 view_matrix, glm::ve
 void Terrain::gui(Camera* camera) {
   if (ImGui::CollapsingHeader("Terrain")) {
     ImGui::Text("Debug");
-    { ImGui::Checkbox("Wireframe", &this->wireframe); }
+    {
+      ImGui::Checkbox("Wireframe", &this->wireframe);
+      ImGui::Checkbox("Finite difference normals", &this->finite_difference_normals);
+    }
 
     ImGui::Text("Mesh");
     {
-      ImGui::Text("Triangles: %d", this->indices_count / 3);
+      const char* mode_names[] = {"Plane", "Chunked", "Clipmap", "Volume"};
+      int mode = (int)this->mode;
+      if (ImGui::Combo("Mode", &mode, mode_names, 4)) {
+        this->mode = (TerrainMode)mode;
+      }
 
       bool mesh_changed = false;
-      mesh_changed |= ImGui::SliderFloat("Size", &this->terrain_size, 512, 8192);
-      mesh_changed |= ImGui::SliderInt("Subdivisions", &this->terrain_subdivision, 0, 256);
+      if (this->mode == TerrainMode::Plane) {
+        ImGui::Text("Triangles: %d", this->indices_count / 3);
+        mesh_changed |= ImGui::SliderFloat("Size", &this->terrain_size, 512, 8192);
+        mesh_changed |= ImGui::SliderInt("Subdivisions", &this->terrain_subdivision, 0, 256);
+      } else if (this->mode == TerrainMode::Chunked) {
+        this->cdlod.gui();
+      } else if (this->mode == TerrainMode::Volume) {
+        this->volume.gui(this->noise);
+      }
+
+      if (this->mode == TerrainMode::Chunked || this->mode == TerrainMode::Volume) {
+        ImGui::Checkbox("Frustum culling", &this->frustum_culling);
+        for (int pass = 0; pass <= NUM_CASCADES; pass++) {
+          const auto& stats = this->cull_stats[pass];
+          if (pass < NUM_CASCADES) {
+            ImGui::Text("  Cascade %d: %zu visible, %zu culled", pass, stats.visible,
+                        stats.culled);
+          } else {
+            ImGui::Text("  Camera: %zu visible, %zu culled", stats.visible, stats.culled);
+          }
+        }
+      }
+
+      if (this->mode == TerrainMode::Chunked) {
+        this->atlas.gui(this->noise);
+        ImGui::Checkbox("Macro texture", &this->macro_enabled);
+        ImGui::SliderFloat("Macro distance", &this->macro_distance, 250.0f, 8000.0f);
+        ImGui::SliderFloat("Macro fade band", &this->macro_fade_band, 1.0f, 2000.0f);
+      } else if (this->mode == TerrainMode::Clipmap) {
+        this->clipmap.gui();
+      }
       ImGui::DragFloat("Tesselation Multiplier", &this->tess_multiplier, 1.0, 0.0);
       this->tess_multiplier = glm::max(this->tess_multiplier, 0.f);
 
@@ -201,12 +590,103 @@ void Terrain::gui(Camera* camera) {
     ImGui::Text("Shader");
     {
       ImGui::Text("Noise");
-      this->noise.gui();
+      if (this->noise.gui()) {
+        this->onNoiseChanged();
+        if (noise::shaderDefines(this->noise) != this->shader_defines) {
+          this->loadShader(true);
+        }
+      }
 
       ImGui::Text("Sun");
       this->sun.gui(camera);
     }
 
+    ImGui::Text("Ray casting");
+    {
+      const auto& pyramid = this->height_pyramid;
+      ImGui::Text("Height pyramid: %d levels, %.1f m cells", pyramid.level_count,
+                  pyramid.cell_size);
+      ImGui::Text("Slope bound: %.3f", pyramid.slope_bound);
+      ImGui::Text("Rebuilt in %.1f ms, %zu rays at %.2f us/ray, %zu hits",
+                  this->pyramid_stats.build_ms, this->pyramid_stats.rays,
+                  this->pyramid_stats.us_per_ray, this->pyramid_stats.hits);
+      if (ImGui::Button("Benchmark ray casts")) {
+        this->benchmarkRaycasts(camera);
+      }
+      ImGui::SameLine();
+      ImGui::Text("%.2f us/ray", this->raycast_benchmark_us);
+    }
+
+    ImGui::Text("Baking");
+    { this->baker.gui(this->noise, camera->getWorldPos(), &this->tile_cache); }
+
+    ImGui::Text("Tile cache");
+    { this->tile_cache.gui(); }
+
+    ImGui::Text("Streaming");
+    {
+      this->streamer.gui();
+      if (this->tile_file_job != nullptr) {
+        ImGui::Text("Writing tile file...");
+      } else if (ImGui::Button("Write tile file")) {
+        this->writeTileFile(camera->getWorldPos());
+      }
+      const auto& stats = this->tile_file_stats;
+      if (stats.tiles > 0) {
+        ImGui::Text("%zu tiles in %d LODs, %.1f MB%s", stats.tiles, stats.lods,
+                    stats.bytes_written / 1e6, stats.succeeded ? "" : ", failed");
+        ImGui::Text("%.0f ms on %d threads, %.1f MB of grids", stats.seconds * 1e3,
+                    stats.threads, stats.grid_bytes / 1e6);
+      }
+    }
+
+    ImGui::Text("Mesh export");
+    {
+      ImGui::SliderInt("Mesh LOD", &this->mesh_export.lod, 0, 8);
+      ImGui::SliderInt("Mesh radius", &this->mesh_export.radius, 0, 8);
+      ImGui::SliderFloat("Mesh max error", &this->mesh_export.max_error, 0.05f, 20.0f);
+      if (this->mesh_export_job != nullptr) {
+        ImGui::Text("Exporting mesh...");
+      } else if (ImGui::Button("Export mesh")) {
+        this->exportMesh(camera->getWorldPos());
+      }
+      const auto& stats = this->mesh_export_stats;
+      if (stats.tiles > 0) {
+        ImGui::Text("%zu tiles, %zu triangles, %.1fx fewer than the grid", stats.tiles,
+                    stats.triangles, stats.reduction());
+        ImGui::Text("%.0f ms on %d threads, %.1f MB", stats.seconds * 1e3, stats.threads,
+                    stats.bytes_written / 1e6);
+      }
+    }
+
+    ImGui::Text("Height export");
+    {
+      ImGui::SliderInt("Export width", &this->height_export.width, 256, 32768);
+      ImGui::SliderInt("Export height", &this->height_export.height, 256, 32768);
+      ImGui::DragFloat("Export texel size", &this->height_export.texel_size, 0.05f, 0.05f, 64.0f);
+      if (this->height_export_job != nullptr) {
+        ImGui::Text("Exporting heights...");
+      } else if (ImGui::Button("Export heights")) {
+        this->exportHeights(camera->getWorldPos());
+      }
+      const auto& stats = this->height_export_stats;
+      if (stats.bands > 0) {
+        ImGui::Text("%d x %d to %s, %.1f MB", stats.width, stats.height,
+                    this->height_export.output_path.c_str(), stats.bytes_written / 1e6);
+        ImGui::Text("%.0f ms on %d threads, %.1f M samples/s", stats.seconds * 1e3, stats.threads,
+                    stats.samplesPerSecond() / 1e6);
+      }
+    }
+
+    ImGui::Text("Erosion");
+    { this->erosion.gui(); }
+
+    ImGui::Text("Hydrology");
+    { this->hydrology.gui(this->baker, this->noise, camera->getWorldPos()); }
+
+    ImGui::Text("Horizon shadows");
+    { this->horizon.gui(); }
+
     ImGui::Text("Texture Start Heights");
     for (int i = 0; i < texture_start_heights.size(); i++) {
       auto& h = texture_start_heights[i];
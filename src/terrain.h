@@ -15,32 +15,33 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/mat4x4.hpp>
+#include <mutex>
+#include <shared_mutex>
 #include <sstream>
 #include <vector>
 
+#include "baker.h"
 #include "camera.h"
+#include "cdlod.h"
+#include "clipmap.h"
+#include "core.h"
 #include "debug.h"
+#include "demexport.h"
+#include "erosion.h"
 #include "gpu.h"
+#include "heightatlas.h"
+#include "hydrology.h"
+#include "heightpyramid.h"
+#include "horizon.h"
 #include "model.h"
+#include "noise.h"
+#include "rtin.h"
 #include "shader.h"
-
-struct TerrainNoise {
-  int num_octaves = 7;
-  float amplitude = 1055.0;
-  float frequency = 0.110;
-  float persistence = 0.063;
-  float lacunarity = 8.150;
-
-  bool gui() {
-    auto did_change = false;
-    did_change |= ImGui::SliderInt("Octaves", &this->num_octaves, 1, 10);
-    did_change |= ImGui::DragFloat("Amplitude", &this->amplitude, 1.0f, 0.0f, 10000.f);
-    did_change |= ImGui::DragFloat("Frequency", &this->frequency, 0.001f, 0.0f, 10000.f);
-    did_change |= ImGui::DragFloat("Persistence", &this->persistence, 0.001f, 0.0f, 10000.f);
-    did_change |= ImGui::DragFloat("Lacunarity", &this->lacunarity, 0.05f, 0.0f, 20.f);
-    return did_change;
-  }
-};
+#include "shadowmap.h"
+#include "streamer.h"
+#include "tilecache.h"
+#include "tilefile.h"
+#include "volume.h"
 
 struct Sun {
   glm::vec3 direction = glm::vec3(0.13, -0.228, 0.965);
@@ -98,21 +99,106 @@ struct Sun {
   }
 };
 
+enum class TerrainMode : int {
+  Plane = 0,    // one subdivided plane that follows the camera
+  Chunked = 1,  // CDLOD quadtree chunks, see cdlod.h
+  Clipmap = 2,  // nested rings with toroidally updated height textures, see clipmap.h
+  Volume = 3,   // meshed chunks of a density field with overhangs and caves, see volume.h
+};
+
 struct Terrain {
+  TerrainMode mode = TerrainMode::Chunked;
+  Cdlod cdlod;
+  HeightAtlas atlas;
+  Clipmap clipmap;
+  VolumeTerrain volume;
+
+  bool frustum_culling = true;
+  // Chunks culled per render pass: the shadow cascades, then the camera
+  std::array<CullStats, NUM_CASCADES + 1> cull_stats;
+  int cull_pass = NUM_CASCADES;
+
   float terrain_size = 4096.0 * 2.0;
   int terrain_subdivision = 24;
   int indices_count;
 
   bool wireframe = false;
   bool simple = false;
+  // Reference path: central differences of the height instead of the analytic derivatives
+  bool finite_difference_normals = false;
 
   TerrainNoise noise;
   Sun sun;
 
+  // Copy of `noise` read by the CPU queries, which may run on any thread
+  std::mutex query_mutex;
+  TerrainNoise query_noise;
+  // Bumped every time the noise parameters change
+  u32 noise_version = 0;
+
+  // Min/max height bounds around the camera, accelerates the ray casts. Rebuilt on the job
+  // system, the ray casts keep using the previous pyramid until the new one is swapped in
+  std::shared_mutex pyramid_mutex;
+  HeightPyramid height_pyramid;
+  u32 pyramid_noise_version = 0;
+  int pyramid_resolution = 256;
+  // Rays traced by HeightPyramid::benchmark() after every rebuild
+  int pyramid_benchmark_grid = 64;
+  HeightPyramidStats pyramid_stats;
+  float raycast_benchmark_us = 0.0f;
+
+  // The height pyramid being built on the job system, shared with the job
+  struct PyramidJob {
+    std::mutex mutex;
+    bool finished = false;
+    u32 noise_version = 0;
+    HeightPyramid pyramid;
+    HeightPyramidStats stats;
+  };
+  std::shared_ptr<PyramidJob> pyramid_job;
+
+  TileBaker baker;
+  TileCache tile_cache;
+  TerrainStreamer streamer;
+  ErosionStage erosion;
+  HydrologyStage hydrology;
+  HorizonStage horizon;
+  RtinSettings mesh_export;
+  RtinStats mesh_export_stats;
+  DemExportSettings height_export;
+  DemExportStats height_export_stats;
+
+  // The tile file being written on the job system, shared with the job
+  struct TileFileJob {
+    std::mutex mutex;
+    bool finished = false;
+    TileFileStats stats;
+  };
+  std::shared_ptr<TileFileJob> tile_file_job;
+  TileFileStats tile_file_stats;
+
+  // The mesh export running on the job system, shared with the job
+  struct MeshExportJob {
+    std::mutex mutex;
+    bool finished = false;
+    RtinStats stats;
+  };
+  std::shared_ptr<MeshExportJob> mesh_export_job;
+
+  // The height export running on the job system, shared with the job
+  struct HeightExportJob {
+    std::mutex mutex;
+    bool finished = false;
+    DemExportStats stats;
+  };
+  std::shared_ptr<HeightExportJob> height_export_job;
+
   float tess_multiplier = 8.0;
 
   GLuint shader_program;
   GLuint shader_program_simple;
+  // What the programs were specialised for, see noise::shaderDefines()
+  std::string shader_defines;
 
   glm::mat4 model_matrix = glm::mat4(1.0);
 
@@ -127,6 +213,12 @@ struct Terrain {
   std::array<float, 4> texture_sizes{70.40F, 16.229F, 6.629F, 11.657F};
   std::array<float, 4> texture_displacement_weights{0.5, 0.671, 0.676, 0.869};
 
+  // Beyond macro_distance the chunks with an atlas page use its averaged macro material instead of
+  // the detail layers, cross-faded over macro_fade_band
+  bool macro_enabled = true;
+  float macro_distance = 2500.0f;
+  float macro_fade_band = 500.0f;
+
   // Buffers on GPU
   uint32_t positions_bo;
   uint32_t indices_bo;
@@ -139,10 +231,41 @@ struct Terrain {
 
   void update(float delta_time, float current_time);
 
+  // CPU queries of the procedural surface, safe to call from any thread
+  TerrainNoise queryNoise();
+  void queryHeights(Span<const glm::vec2> positions, Span<float> out_heights);
+  void queryNormals(Span<const glm::vec2> positions, Span<glm::vec3> out_normals);
+  void onNoiseChanged();
+
+  // Rebuild the height pyramid in the background when the noise changed or `center` moved away
+  // from it, call once per frame
+  void updateBounds(glm::vec3 center);
+  TerrainHit raycast(glm::vec3 origin, glm::vec3 direction, float max_t);
+  void raycastBatch(Span<const TerrainRay> rays, Span<TerrainHit> out_hits);
+  void benchmarkRaycasts(Camera* camera);
+
+  // Bake and erode the tiles around the camera in the background, call once per frame
+  void updateStreaming(glm::vec3 camera_position);
+  // Write the streamed LOD 0 tiles around the camera and their mip levels into the tile file of
+  // the current noise, in the background. The streamer reopens the file once it is written
+  void writeTileFile(glm::vec3 camera_position);
+  // Triangulate the tiles around the camera, eroded where cached, to `mesh_export.path` in the
+  // background
+  void exportMesh(glm::vec3 camera_position);
+  // Write the noise heights of `height_export` centered on the camera, without erosion, in the
+  // background
+  void exportHeights(glm::vec3 camera_position);
+
+  // Select the chunks or move the clipmap around the camera, call once per frame
+  void updateLod(glm::vec3 camera_position);
+
   void loadShader(bool is_reload);
   void buildMesh(bool is_reload);
 
-  void begin(bool simple);
+  // The program of the current mode, simple for the shadow passes
+  GLuint program() const;
+  // `cascade` is the shadow cascade rendered next, or -1 for the camera
+  void begin(bool simple, int cascade = -1);
   void render(glm::mat4 projection_matrix, glm::mat4 view_matrix, glm::vec3 center,
               glm::vec3 camera_position, glm::mat4 light_matrix, float water_height,
               float environment_multiplier);
@@ -0,0 +1,217 @@
+#include "tilecache.h"
+
+#include <imgui.h>
+
+#include <cmath>
+
+std::shared_ptr<CachedTile> CachedTile::encode(HeightTile&& tile, bool quantize) {
+  auto cached = std::make_shared<CachedTile>();
+  cached->key = tile.key;
+  cached->min_height = tile.min_height;
+  cached->max_height = tile.max_height;
+  cached->is_quantized = quantize;
+
+  if (!quantize) {
+    cached->heights = std::move(tile.heights);
+    cached->height_data = cached->heights.data();
+    return cached;
+  }
+
+  cached->quantized_heights.resize(tile.heights.size());
+  cached->scale = CachedTile::quantize(tile, cached->quantized_heights.data());
+  cached->quantized_data = cached->quantized_heights.data();
+
+  return cached;
+}
+
+float CachedTile::quantize(const HeightTile& tile, u16* out) {
+  float range = tile.max_height - tile.min_height;
+  float inverse_scale = range > 0.0f ? 65535.0f / range : 0.0f;
+
+  for (usize i = 0; i < tile.heights.size(); i++) {
+    float q = std::round((tile.heights[i] - tile.min_height) * inverse_scale);
+    out[i] = u16(glm::clamp(q, 0.0f, 65535.0f));
+  }
+
+  return range / 65535.0f;
+}
+
+HeightTile CachedTile::decode() const {
+  HeightTile tile;
+  tile.key = this->key;
+  tile.min_height = this->min_height;
+  tile.max_height = this->max_height;
+
+  usize count = TILE_STRIDE * TILE_STRIDE;
+  if (!this->is_quantized) {
+    tile.heights.assign(this->height_data, this->height_data + count);
+    return tile;
+  }
+
+  tile.heights.resize(count);
+  for (usize i = 0; i < count; i++) {
+    tile.heights[i] = this->min_height + this->quantized_data[i] * this->scale;
+  }
+  return tile;
+}
+
+usize CachedTile::bytes() const {
+  // Mapped tiles live in the OS page cache, which pages them out on its own
+  return sizeof(CachedTile) + this->heights.capacity() * sizeof(float)
+         + this->quantized_heights.capacity() * sizeof(u16);
+}
+
+std::shared_ptr<const CachedTile> TileCache::find(const TileKey& key) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  auto it = this->entries.find(key);
+  if (it == this->entries.end()) {
+    this->counters.misses += 1;
+    return nullptr;
+  }
+
+  this->counters.hits += 1;
+  this->lru.splice(this->lru.begin(), this->lru, it->second);
+  return *it->second;
+}
+
+bool TileCache::contains(const TileKey& key) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->entries.count(key) != 0;
+}
+
+std::shared_ptr<const CachedTile> TileCache::peek(const TileKey& key) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  auto it = this->entries.find(key);
+  return it != this->entries.end() ? *it->second : nullptr;
+}
+
+std::shared_ptr<const CachedTile> TileCache::insert(HeightTile&& tile) {
+  // Encoding is the expensive part, keep it outside the lock
+  bool quantize = this->quantize();
+  return this->insert(CachedTile::encode(std::move(tile), quantize));
+}
+
+std::shared_ptr<const CachedTile> TileCache::insert(std::shared_ptr<const CachedTile> entry) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+
+  auto it = this->entries.find(entry->key);
+  if (it != this->entries.end()) {
+    this->counters.bytes -= (*it->second)->bytes();
+    this->lru.erase(it->second);
+    this->entries.erase(it);
+  }
+
+  this->lru.push_front(entry);
+  this->entries[entry->key] = this->lru.begin();
+  this->counters.bytes += entry->bytes();
+
+  this->evictToBudget();
+  return entry;
+}
+
+bool TileCache::erase(const TileKey& key) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  auto it = this->entries.find(key);
+  if (it == this->entries.end()) {
+    return false;
+  }
+
+  this->counters.bytes -= (*it->second)->bytes();
+  this->lru.erase(it->second);
+  this->entries.erase(it);
+  return true;
+}
+
+bool TileCache::erase(const TileKey& key, const CachedTile* tile) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  auto it = this->entries.find(key);
+  if (it == this->entries.end() || it->second->get() != tile) {
+    return false;
+  }
+
+  this->counters.bytes -= (*it->second)->bytes();
+  this->lru.erase(it->second);
+  this->entries.erase(it);
+  return true;
+}
+
+void TileCache::evictToBudget() {
+  // The newest tile is never evicted, even when it alone is over budget
+  while (this->counters.bytes > this->budget_bytes && this->lru.size() > 1) {
+    const auto& oldest = this->lru.back();
+    this->counters.bytes -= oldest->bytes();
+    this->counters.evictions += 1;
+    this->entries.erase(oldest->key);
+    this->lru.pop_back();
+  }
+}
+
+void TileCache::clear() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->lru.clear();
+  this->entries.clear();
+  this->counters.bytes = 0;
+}
+
+usize TileCache::budget() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->budget_bytes;
+}
+
+void TileCache::setBudget(usize bytes) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->budget_bytes = bytes;
+  this->evictToBudget();
+}
+
+bool TileCache::quantize() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  return this->quantize_tiles;
+}
+
+void TileCache::setQuantize(bool quantize) {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->quantize_tiles = quantize;
+}
+
+TileCacheStats TileCache::stats() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  auto stats = this->counters;
+  stats.tiles = this->entries.size();
+  return stats;
+}
+
+void TileCache::resetStats() {
+  std::lock_guard<std::mutex> lock(this->mutex);
+  this->counters.hits = 0;
+  this->counters.misses = 0;
+  this->counters.evictions = 0;
+}
+
+void TileCache::gui() {
+  int budget_mb = int(this->budget() >> 20);
+  if (ImGui::SliderInt("Cache budget (MB)", &budget_mb, 16, 4096)) {
+    this->setBudget(usize(budget_mb) << 20);
+  }
+
+  bool quantize = this->quantize();
+  if (ImGui::Checkbox("16 bit tiles", &quantize)) {
+    this->setQuantize(quantize);
+  }
+
+  auto stats = this->stats();
+  u64 lookups = stats.hits + stats.misses;
+  ImGui::Text("Cached: %zu tiles, %.1f MB", stats.tiles, stats.bytes / double(1 << 20));
+  ImGui::Text("Hits: %llu, misses: %llu (%.1f%% hits), evictions: %llu",
+              (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+              lookups > 0 ? 100.0 * stats.hits / lookups : 0.0,
+              (unsigned long long)stats.evictions);
+  if (ImGui::Button("Reset counters")) {
+    this->resetStats();
+  }
+  ImGui::SameLine();
+  if (ImGui::Button("Clear cache")) {
+    this->clear();
+  }
+}
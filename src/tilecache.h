@@ -0,0 +1,119 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "baker.h"
+#include "core.h"
+
+/**
+ * A height tile as stored in the cache, either as floats or as 16 bit values normalized to the
+ * tile's own [min_height, max_height]. The quantization error is at most half of `scale`, e.g.
+ * 1 cm for a tile spanning 1300 m.
+ */
+struct CachedTile {
+  TileKey key;
+  float min_height = 0.0f;
+  float max_height = 0.0f;
+
+  bool is_quantized = false;
+  float scale = 0.0f;  // meters per quantization step
+  std::vector<float> heights;
+  std::vector<u16> quantized_heights;
+
+  // TILE_STRIDE^2 values, either pointing into the vectors above or into a memory mapped tile
+  // file that `mapping` keeps alive
+  const float* height_data = nullptr;
+  const u16* quantized_data = nullptr;
+  std::shared_ptr<const void> mapping;
+
+  CachedTile() = default;
+  CachedTile(const CachedTile&) = delete;
+  CachedTile& operator=(const CachedTile&) = delete;
+
+  static std::shared_ptr<CachedTile> encode(HeightTile&& tile, bool quantize);
+
+  /**
+   * Write the 16 bit values of `tile` to `out` and return the scale.
+   */
+  static float quantize(const HeightTile& tile, u16* out);
+
+  // `x` and `z` are in [-TILE_APRON, TILE_SIZE + TILE_APRON)
+  float at(int x, int z) const {
+    usize i = (z + TILE_APRON) * TILE_STRIDE + (x + TILE_APRON);
+    return is_quantized ? min_height + quantized_data[i] * scale : height_data[i];
+  }
+
+  HeightTile decode() const;
+  usize bytes() const;
+};
+
+struct TileCacheStats {
+  u64 hits = 0;
+  u64 misses = 0;
+  u64 evictions = 0;
+  usize tiles = 0;
+  usize bytes = 0;
+};
+
+/**
+ * Thread-safe LRU cache of height tiles with a byte budget.
+ *
+ * Tiles are handed out as shared pointers, so a tile that gets evicted while someone is still
+ * reading it stays alive until they are done.
+ */
+class TileCache {
+public:
+  /**
+   * Look up a tile and mark it as most recently used. Counts as a hit or a miss.
+   */
+  std::shared_ptr<const CachedTile> find(const TileKey& key);
+
+  /**
+   * Like find() but neither counts nor touches the LRU order.
+   */
+  bool contains(const TileKey& key);
+  std::shared_ptr<const CachedTile> peek(const TileKey& key);
+
+  /**
+   * Insert or replace a tile, then evict the least recently used tiles until within budget.
+   */
+  std::shared_ptr<const CachedTile> insert(HeightTile&& tile);
+  std::shared_ptr<const CachedTile> insert(std::shared_ptr<const CachedTile> tile);
+
+  /**
+   * Drop a tile before the LRU order would, returns whether it was cached.
+   */
+  bool erase(const TileKey& key);
+  // Only while the cached tile is still `tile`, and not a replacement inserted since
+  bool erase(const TileKey& key, const CachedTile* tile);
+
+  void clear();
+
+  usize budget();
+  void setBudget(usize bytes);
+  bool quantize();
+  void setQuantize(bool quantize);
+
+  TileCacheStats stats();
+  void resetStats();
+
+  void gui();
+
+private:
+  using Entry = std::shared_ptr<const CachedTile>;
+
+  std::mutex mutex;
+  // Most recently used first
+  std::list<Entry> lru;
+  std::unordered_map<TileKey, std::list<Entry>::iterator, TileKeyHash> entries;
+
+  usize budget_bytes = usize(256) << 20;
+  bool quantize_tiles = true;
+  TileCacheStats counters;
+
+  void evictToBudget();
+};
@@ -0,0 +1,537 @@
+#include "tilefile.h"
+
+#if defined(_WIN32)
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "jobs.h"
+
+namespace {
+  u64 alignUp(u64 value, u64 alignment) { return (value + alignment - 1) / alignment * alignment; }
+
+  u64 checksum(const void* data, usize size) {
+    u64 h = 14695981039346656037ull;
+    const auto* bytes = static_cast<const u8*>(data);
+    for (usize i = 0; i < size; i++) {
+      h = (h ^ bytes[i]) * 1099511628211ull;
+    }
+    return h;
+  }
+
+  bool entryBefore(const TileFileEntry& a, const TileFileEntry& b) {
+    if (a.lod != b.lod) return a.lod < b.lod;
+    if (a.z != b.z) return a.z < b.z;
+    return a.x < b.x;
+  }
+
+  constexpr usize TILE_TEXELS = TILE_STRIDE * TILE_STRIDE;
+
+  u64 payloadSize(TileFormat format) {
+    return TILE_TEXELS * (format == TileFormat::U16 ? sizeof(u16) : sizeof(f32));
+  }
+}  // namespace
+
+TileFile::~TileFile() { this->unmap(); }
+
+std::string TileFile::pathFor(const std::string& directory, u64 noise_hash) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%016llx.tiles", (unsigned long long)noise_hash);
+  return (std::filesystem::path(directory) / name).u8string();
+}
+
+bool TileFile::writePyramid(const std::string& path, const TerrainNoise& noise,
+                            float base_texel_size, int first_x, int first_z, int tiles,
+                            int lod_count, bool quantize, TileFileStats* stats) {
+  auto start = std::chrono::steady_clock::now();
+  auto* jobs = JobSystem::instance();
+  u64 noise_hash = noise::hash(noise);
+
+  int alignment = lod_count >= 1 && lod_count <= 16 ? 1 << (lod_count - 1) : 0;
+  if (alignment == 0 || tiles <= 0 || tiles % alignment != 0 || first_x % alignment != 0
+      || first_z % alignment != 0) {
+    std::cout << "Tile file " << path << ": region not aligned to the coarsest LOD\n";
+    return false;
+  }
+
+  std::vector<TileFileEntry> entries;
+  for (int lod = 0; lod < lod_count; lod++) {
+    int count = tiles >> lod;
+    for (int z = 0; z < count; z++) {
+      for (int x = 0; x < count; x++) {
+        TileFileEntry entry = {};
+        entry.lod = lod;
+        entry.x = first_x / (1 << lod) + x;
+        entry.z = first_z / (1 << lod) + z;
+        entries.push_back(entry);
+      }
+    }
+  }
+
+  TileFileWriter writer;
+  if (!writer.open(path, Span<const TileFileEntry>(entries.data(), entries.size()), quantize)) {
+    return false;
+  }
+
+  // A level as one grid, `margin` texels wider than its tiles on every side: the aprons of the
+  // coarsest level need one, and each finer level one more than twice that for the tent filter
+  struct Level {
+    int margin;
+    int side;
+    std::vector<float> heights;
+  };
+
+  Level level;
+  level.margin = (1 << lod_count) - 1;
+  level.side = tiles * TILE_SIZE + 2 * level.margin;
+  level.heights.resize(usize(level.side) * level.side);
+  glm::vec2 origin
+      = (glm::vec2(first_x, first_z) * float(TILE_SIZE) - float(level.margin)) * base_texel_size;
+  jobs->parallelFor(level.side, 16, [&](usize begin, usize end) {
+    std::vector<glm::vec2> positions(level.side);
+    for (usize z = begin; z < end; z++) {
+      for (int x = 0; x < level.side; x++) {
+        positions[x] = origin + glm::vec2(x, z) * base_texel_size;
+      }
+      noise::terrainHeights(noise, positions.data(), &level.heights[z * level.side], level.side);
+    }
+  });
+  usize grid_bytes = level.heights.size() * sizeof(float);
+
+  std::atomic<bool> ok{true};
+  for (int lod = 0; lod < lod_count && ok; lod++) {
+    int count = tiles >> lod;
+    jobs->parallelFor(usize(count) * count, 1, [&](usize begin, usize end) {
+      HeightTile tile;
+      tile.heights.resize(TILE_TEXELS);
+      for (usize i = begin; i < end; i++) {
+        int tx = int(i % count);
+        int tz = int(i / count);
+        tile.key = TileKey{noise_hash, lod, first_x / (1 << lod) + tx, first_z / (1 << lod) + tz};
+
+        int x0 = level.margin + tx * TILE_SIZE - TILE_APRON;
+        int z0 = level.margin + tz * TILE_SIZE - TILE_APRON;
+        for (int z = 0; z < TILE_STRIDE; z++) {
+          const float* row = &level.heights[usize(z0 + z) * level.side + x0];
+          std::copy(row, row + TILE_STRIDE, &tile.heights[z * TILE_STRIDE]);
+        }
+        auto bounds = std::minmax_element(tile.heights.begin(), tile.heights.end());
+        tile.min_height = *bounds.first;
+        tile.max_height = *bounds.second;
+
+        if (!writer.writeTile(tile)) {
+          ok = false;
+        }
+      }
+    });
+
+    if (lod + 1 == lod_count) {
+      break;
+    }
+
+    // Coarse texel c lies on fine texel 2c + 1 of the grids, the tent covers 2c to 2c + 2
+    Level coarser;
+    coarser.margin = (level.margin - 1) / 2;
+    coarser.side = (tiles >> (lod + 1)) * TILE_SIZE + 2 * coarser.margin;
+    coarser.heights.resize(usize(coarser.side) * coarser.side);
+    jobs->parallelFor(coarser.side, 16, [&](usize begin, usize end) {
+      const float weights[3] = {0.25f, 0.5f, 0.25f};
+      for (usize z = begin; z < end; z++) {
+        for (int x = 0; x < coarser.side; x++) {
+          float sum = 0.0f;
+          for (int dz = 0; dz < 3; dz++) {
+            const float* row = &level.heights[(2 * z + dz) * level.side + 2 * x];
+            sum += weights[dz] * (weights[0] * row[0] + weights[1] * row[1] + weights[2] * row[2]);
+          }
+          coarser.heights[z * coarser.side + x] = sum;
+        }
+      }
+    });
+    if (lod == 0) {
+      grid_bytes += coarser.heights.size() * sizeof(float);
+    }
+    level = std::move(coarser);
+  }
+
+  TileFileHeader header = {};
+  header.noise_hash = noise_hash;
+  header.num_octaves = noise.num_octaves;
+  header.amplitude = noise.amplitude;
+  header.frequency = noise.frequency;
+  header.persistence = noise.persistence;
+  header.lacunarity = noise.lacunarity;
+  header.base_texel_size = base_texel_size;
+  header.style = (i32)noise.style;
+  header.warp_strength = noise.warp_strength;
+  bool succeeded = ok && writer.finish(header);
+
+  if (stats != nullptr) {
+    stats->tiles = entries.size();
+    stats->lods = lod_count;
+    stats->bytes_written = succeeded ? writer.bytesWritten() : 0;
+    stats->grid_bytes = grid_bytes;
+    stats->threads = jobs->threadCount() + 1;
+    stats->seconds
+        = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    stats->succeeded = succeeded;
+  }
+  return succeeded;
+}
+
+TileFileWriter::~TileFileWriter() {
+  // Abandoned before finish()
+  if (this->file.is_open()) {
+    this->file.close();
+    std::error_code error;
+    std::filesystem::remove(this->temporary_path, error);
+  }
+}
+
+bool TileFileWriter::open(const std::string& path, Span<const TileFileEntry> entries,
+                          bool quantize) {
+  this->path = path;
+  this->temporary_path = path + ".tmp";
+  this->quantize = quantize;
+
+  TileFormat format = quantize ? TileFormat::U16 : TileFormat::F32;
+  this->index.assign(entries.begin(), entries.end());
+  std::sort(this->index.begin(), this->index.end(), entryBefore);
+  this->written.assign(this->index.size(), false);
+
+  u64 offset = alignUp(sizeof(TileFileHeader) + this->index.size() * sizeof(TileFileEntry),
+                       TILE_FILE_PAGE_SIZE);
+  for (usize i = 0; i < this->index.size(); i++) {
+    auto& entry = this->index[i];
+    if (i > 0 && !entryBefore(this->index[i - 1], entry)) {
+      std::cout << "Tile file " << path << ": tile " << entry.lod << "/" << entry.x << "/"
+                << entry.z << " appears twice\n";
+      return false;
+    }
+    entry.format = format;
+    entry.size = payloadSize(format);
+    entry.offset = offset;
+    offset = alignUp(offset + entry.size, TILE_FILE_PAGE_SIZE);
+  }
+  this->file_size = offset;
+
+  std::error_code error;
+  std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+  this->file.open(this->temporary_path, std::ios::binary | std::ios::trunc);
+  if (!this->file) {
+    std::cout << "Tile file " << this->temporary_path << ": could not open for writing\n";
+    return false;
+  }
+  return true;
+}
+
+bool TileFileWriter::writeTile(const HeightTile& tile) {
+  TileFileEntry wanted = {};
+  wanted.lod = tile.key.lod;
+  wanted.x = tile.key.x;
+  wanted.z = tile.key.z;
+  auto it = std::lower_bound(this->index.begin(), this->index.end(), wanted, entryBefore);
+  if (it == this->index.end() || entryBefore(wanted, *it) || tile.heights.size() != TILE_TEXELS) {
+    std::cout << "Tile file " << this->path << ": unexpected tile " << wanted.lod << "/"
+              << wanted.x << "/" << wanted.z << "\n";
+    return false;
+  }
+
+  // Encoded outside of the lock, only the write itself is serialised
+  std::vector<u16> quantized;
+  const char* payload = reinterpret_cast<const char*>(tile.heights.data());
+  float scale = 0.0f;
+  if (this->quantize) {
+    quantized.resize(TILE_TEXELS);
+    scale = CachedTile::quantize(tile, quantized.data());
+    payload = reinterpret_cast<const char*>(quantized.data());
+  }
+
+  std::lock_guard<std::mutex> lock(this->mutex);
+  auto& entry = *it;
+  entry.min_height = tile.min_height;
+  entry.max_height = tile.max_height;
+  entry.scale = scale;
+  this->written[it - this->index.begin()] = true;
+
+  this->file.seekp(std::streamoff(entry.offset));
+  this->file.write(payload, entry.size);
+  if (!this->file) {
+    this->failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool TileFileWriter::finish(TileFileHeader header) {
+  std::memcpy(header.magic, TILE_FILE_MAGIC, sizeof(header.magic));
+  header.version = TILE_FILE_VERSION;
+  header.header_size = sizeof(TileFileHeader);
+  header.file_size = this->file_size;
+  header.tile_size = TILE_SIZE;
+  header.tile_apron = TILE_APRON;
+  header.page_size = TILE_FILE_PAGE_SIZE;
+  header.tile_count = u32(this->index.size());
+  header.index_offset = sizeof(TileFileHeader);
+  header.index_checksum
+      = checksum(this->index.data(), this->index.size() * sizeof(TileFileEntry));
+
+  if (std::find(this->written.begin(), this->written.end(), false) != this->written.end()) {
+    std::cout << "Tile file " << this->path << ": not every tile was written\n";
+    this->failed = true;
+  }
+
+  if (!this->failed) {
+    this->file.seekp(0);
+    this->file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    this->file.write(reinterpret_cast<const char*>(this->index.data()),
+                     this->index.size() * sizeof(TileFileEntry));
+
+    // Pad the last payload to a whole page so the file size matches the header
+    if (header.file_size > 0) {
+      this->file.seekp(std::streamoff(header.file_size - 1));
+      this->file.put('\0');
+    }
+
+    this->file.close();
+    if (!this->file) {
+      std::cout << "Tile file " << this->temporary_path << ": write failed\n";
+      this->failed = true;
+    }
+  }
+
+  std::error_code error;
+  if (this->failed) {
+    this->file.close();
+    std::filesystem::remove(this->temporary_path, error);
+    return false;
+  }
+
+  std::filesystem::rename(this->temporary_path, this->path, error);
+  if (error) {
+    std::filesystem::remove(this->path, error);
+    std::filesystem::rename(this->temporary_path, this->path, error);
+  }
+  if (error) {
+    std::cout << "Tile file " << this->path << ": " << error.message() << "\n";
+    return false;
+  }
+
+  return true;
+}
+
+std::shared_ptr<TileFile> TileFile::open(const std::string& path, const TerrainNoise& noise,
+                                         float base_texel_size) {
+  auto file = std::make_shared<TileFile>();
+  if (!file->map(path)) {
+    return nullptr;
+  }
+  if (!file->validate(noise, base_texel_size)) {
+    std::cout << "Tile file " << path << ": invalid or baked with other settings, ignoring it\n";
+    return nullptr;
+  }
+  return file;
+}
+
+std::shared_ptr<TileFile> TileFile::openImported(const std::string& path) {
+  auto file = std::make_shared<TileFile>();
+  if (!file->map(path)) {
+    std::cout << "Tile file " << path << ": could not open\n";
+    return nullptr;
+  }
+  if (!file->validateLayout() || file->header().style != TILE_FILE_STYLE_IMPORTED) {
+    std::cout << "Tile file " << path << ": invalid or not an imported DEM, ignoring it\n";
+    return nullptr;
+  }
+  return file;
+}
+
+bool TileFile::map(const std::string& path) {
+  this->file_path = path;
+
+#if defined(_WIN32)
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  this->file_handle = file;
+
+  LARGE_INTEGER file_size;
+  if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+    return false;
+  }
+  this->size = usize(file_size.QuadPart);
+
+  HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (mapping == nullptr) {
+    return false;
+  }
+  this->mapping_handle = mapping;
+
+  this->data = static_cast<const u8*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  return this->data != nullptr;
+#else
+  this->file_descriptor = ::open(path.c_str(), O_RDONLY);
+  if (this->file_descriptor < 0) {
+    return false;
+  }
+
+  struct stat info;
+  if (fstat(this->file_descriptor, &info) != 0 || info.st_size == 0) {
+    return false;
+  }
+  this->size = usize(info.st_size);
+
+  void* mapped = mmap(nullptr, this->size, PROT_READ, MAP_SHARED, this->file_descriptor, 0);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  this->data = static_cast<const u8*>(mapped);
+
+  // Tiles are looked up all over the file
+  madvise(mapped, this->size, MADV_RANDOM);
+  return true;
+#endif
+}
+
+void TileFile::unmap() {
+#if defined(_WIN32)
+  if (this->data != nullptr) UnmapViewOfFile(this->data);
+  if (this->mapping_handle != nullptr) CloseHandle(this->mapping_handle);
+  if (this->file_handle != nullptr) CloseHandle(this->file_handle);
+  this->mapping_handle = nullptr;
+  this->file_handle = nullptr;
+#else
+  if (this->data != nullptr) munmap(const_cast<u8*>(this->data), this->size);
+  if (this->file_descriptor >= 0) close(this->file_descriptor);
+  this->file_descriptor = -1;
+#endif
+  this->data = nullptr;
+  this->size = 0;
+}
+
+bool TileFile::validate(const TerrainNoise& noise, float base_texel_size) const {
+  if (!this->validateLayout()) {
+    return false;
+  }
+
+  // The hash alone could collide, so the parameters have to match too
+  const auto& header = this->header();
+  if (header.noise_hash != noise::hash(noise) || header.num_octaves != noise.num_octaves
+      || header.amplitude != noise.amplitude || header.frequency != noise.frequency
+      || header.persistence != noise.persistence || header.lacunarity != noise.lacunarity
+      || header.base_texel_size != base_texel_size || header.style != (i32)noise.style
+      || header.warp_strength != noise.warp_strength) {
+    return false;
+  }
+
+  return true;
+}
+
+bool TileFile::validateLayout() const {
+  if (this->size < sizeof(TileFileHeader)) {
+    return false;
+  }
+
+  const auto& header = this->header();
+  if (std::memcmp(header.magic, TILE_FILE_MAGIC, sizeof(header.magic)) != 0
+      || header.version != TILE_FILE_VERSION || header.header_size != sizeof(TileFileHeader)
+      || header.file_size != this->size) {
+    return false;
+  }
+
+  if (header.tile_size != TILE_SIZE || header.tile_apron != TILE_APRON
+      || header.page_size != TILE_FILE_PAGE_SIZE) {
+    return false;
+  }
+
+  u64 index_size = u64(header.tile_count) * sizeof(TileFileEntry);
+  if (header.index_offset % alignof(TileFileEntry) != 0 || header.index_offset > this->size
+      || index_size > this->size - header.index_offset) {
+    return false;
+  }
+  if (checksum(this->data + header.index_offset, index_size) != header.index_checksum) {
+    return false;
+  }
+
+  auto entries = this->entries();
+  for (usize i = 0; i < entries.size(); i++) {
+    const auto& entry = entries[i];
+    bool known_format = entry.format == TileFormat::F32 || entry.format == TileFormat::U16;
+    if (!known_format || entry.size != payloadSize(entry.format)
+        || entry.offset % TILE_FILE_PAGE_SIZE != 0 || entry.offset > this->size
+        || entry.size > this->size - entry.offset) {
+      return false;
+    }
+    if (i > 0 && !entryBefore(entries[i - 1], entry)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+Span<const TileFileEntry> TileFile::entries() const {
+  const auto& header = this->header();
+  return Span<const TileFileEntry>(
+      reinterpret_cast<const TileFileEntry*>(this->data + header.index_offset), header.tile_count);
+}
+
+const TileFileEntry* TileFile::find(int lod, int x, int z) const {
+  auto entries = this->entries();
+  TileFileEntry wanted = {};
+  wanted.lod = lod;
+  wanted.x = x;
+  wanted.z = z;
+
+  auto it = std::lower_bound(entries.begin(), entries.end(), wanted, entryBefore);
+  if (it == entries.end() || it->lod != lod || it->x != x || it->z != z) {
+    return nullptr;
+  }
+  return it;
+}
+
+std::shared_ptr<CachedTile> TileFile::mapTile(const TileKey& key) const {
+  if (key.noise_hash != this->header().noise_hash) {
+    return nullptr;
+  }
+
+  const auto* entry = this->find(key.lod, key.x, key.z);
+  if (entry == nullptr) {
+    return nullptr;
+  }
+
+  auto tile = std::make_shared<CachedTile>();
+  tile->key = key;
+  tile->min_height = entry->min_height;
+  tile->max_height = entry->max_height;
+  tile->mapping = this->shared_from_this();
+
+  const u8* payload = this->data + entry->offset;
+  if (entry->format == TileFormat::U16) {
+    tile->is_quantized = true;
+    tile->scale = entry->scale;
+    tile->quantized_data = reinterpret_cast<const u16*>(payload);
+  } else {
+    tile->height_data = reinterpret_cast<const float*>(payload);
+  }
+
+  return tile;
+}
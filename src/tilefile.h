@@ -0,0 +1,191 @@
+#pragma once
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "baker.h"
+#include "core.h"
+#include "noise.h"
+#include "tilecache.h"
+
+/**
+ * On-disk container of baked height tiles, designed to be memory mapped and used in place.
+ *
+ * Layout, all little endian:
+ *   TileFileHeader
+ *   TileFileEntry[tile_count], sorted by (lod, z, x)
+ *   tile payloads, each starting on a page boundary so it is faulted in on its own
+ *
+ * Each LOD present in the file is a mip level of the same region: LOD 0 is baked from the noise and
+ * every coarser LOD filtered down from the one below, see writePyramid(). DEM imports are
+ * filtered down as well, see demimport.h.
+ *
+ * Opening validates the header, the noise parameters, the index checksum and every entry's bounds.
+ * The payloads are not checksummed, that would fault in every page on open.
+ */
+constexpr char TILE_FILE_MAGIC[8] = {'T', 'E', 'R', 'R', 'T', 'I', 'L', 'E'};
+constexpr u32 TILE_FILE_VERSION = 2;
+constexpr u32 TILE_FILE_PAGE_SIZE = 4096;
+
+enum class TileFormat : u32 { F32 = 0, U16 = 1 };
+
+// TileFileHeader::style of files imported from a DEM instead of baked from the noise, their
+// noise_hash is a hash of the imported heights and the other noise parameters are zero
+constexpr i32 TILE_FILE_STYLE_IMPORTED = -1;
+
+struct TileFileHeader {
+  char magic[8];
+  u32 version;
+  u32 header_size;
+  u64 file_size;
+
+  u64 noise_hash;
+  i32 num_octaves;
+  f32 amplitude;
+  f32 frequency;
+  f32 persistence;
+  f32 lacunarity;
+  f32 base_texel_size;
+  i32 style;
+  f32 warp_strength;
+
+  i32 tile_size;
+  i32 tile_apron;
+  u32 page_size;
+  u32 tile_count;
+  u64 index_offset;
+  u64 index_checksum;
+};
+static_assert(sizeof(TileFileHeader) == 96, "TileFileHeader is stored as is");
+
+struct TileFileEntry {
+  i32 lod;
+  i32 x;
+  i32 z;
+  TileFormat format;
+  f32 min_height;
+  f32 max_height;
+  f32 scale;  // meters per step for TileFormat::U16
+  u32 reserved;
+  u64 offset;
+  u64 size;
+};
+static_assert(sizeof(TileFileEntry) == 48, "TileFileEntry is stored as is");
+
+struct TileFileStats {
+  usize tiles = 0;
+  int lods = 0;
+  u64 bytes_written = 0;
+  usize grid_bytes = 0;  // the two finest levels held in memory at once
+  int threads = 0;
+  double seconds = 0.0;
+  bool succeeded = false;
+};
+
+class TileFile : public std::enable_shared_from_this<TileFile> {
+public:
+  TileFile() = default;
+  TileFile(const TileFile&) = delete;
+  TileFile& operator=(const TileFile&) = delete;
+  ~TileFile();
+
+  /**
+   * Where the tiles of a noise parameter set are stored, e.g. "tiles/0123456789abcdef.tiles".
+   */
+  static std::string pathFor(const std::string& directory, u64 noise_hash);
+
+  /**
+   * Bake the `tiles` x `tiles` LOD 0 tiles starting at tile (`first_x`, `first_z`) and write them
+   * with `lod_count` mip levels of the same region through a temporary file that is renamed into
+   * place. Each level is the level below filtered with a [1 2 1] / 4 tent and decimated, the
+   * texels of both lie on the same grid points. `first_x`, `first_z` and `tiles` are multiples of
+   * 2^(lod_count - 1). Uses the job system and blocks, so call it from a job.
+   */
+  static bool writePyramid(const std::string& path, const TerrainNoise& noise,
+                           float base_texel_size, int first_x, int first_z, int tiles,
+                           int lod_count, bool quantize, TileFileStats* stats = nullptr);
+
+  /**
+   * Map and validate a file. Returns nullptr when it is missing, corrupt or baked with other
+   * settings.
+   */
+  static std::shared_ptr<TileFile> open(const std::string& path, const TerrainNoise& noise,
+                                        float base_texel_size);
+
+  /**
+   * Map and validate a file written by the DEM importer, see demimport.h.
+   */
+  static std::shared_ptr<TileFile> openImported(const std::string& path);
+
+  const std::string& path() const { return file_path; }
+  const TileFileHeader& header() const { return *reinterpret_cast<const TileFileHeader*>(data); }
+  Span<const TileFileEntry> entries() const;
+
+  const TileFileEntry* find(int lod, int x, int z) const;
+
+  /**
+   * A cache tile pointing straight into the mapping, which it keeps alive. No copies are made and
+   * the pages are only read once the tile is sampled.
+   */
+  std::shared_ptr<CachedTile> mapTile(const TileKey& key) const;
+
+private:
+  std::string file_path;
+  const u8* data = nullptr;
+  usize size = 0;
+
+#if defined(_WIN32)
+  void* file_handle = nullptr;
+  void* mapping_handle = nullptr;
+#else
+  int file_descriptor = -1;
+#endif
+
+  bool map(const std::string& path);
+  void unmap();
+  bool validate(const TerrainNoise& noise, float base_texel_size) const;
+  bool validateLayout() const;
+};
+
+/**
+ * Writes a tile file whose tiles are known up front but produced one at a time, from any thread,
+ * so they never have to be in memory together. Each payload goes straight to its final offset,
+ * the header and index follow in finish().
+ */
+class TileFileWriter {
+public:
+  ~TileFileWriter();
+
+  /**
+   * Start writing the tiles of `entries` (lod, x and z, in any order) to a temporary file.
+   */
+  bool open(const std::string& path, Span<const TileFileEntry> entries, bool quantize);
+
+  /**
+   * Write `tile.key` with the range of `tile.min_height` and `tile.max_height`. Thread safe.
+   */
+  bool writeTile(const HeightTile& tile);
+
+  /**
+   * Write the index and `header`, whose layout fields are filled in, and rename the file into
+   * place. Fails when a tile is missing.
+   */
+  bool finish(TileFileHeader header);
+
+  u64 bytesWritten() const { return file_size; }
+
+private:
+  std::string path;
+  std::string temporary_path;
+  bool quantize = false;
+
+  std::mutex mutex;
+  std::ofstream file;
+  std::vector<TileFileEntry> index;
+  std::vector<bool> written;
+  u64 file_size = 0;
+  bool failed = false;
+};
@@ -0,0 +1,826 @@
+#include "volume.h"
+
+#include <imgui.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include "gpu.h"
+#include "jobs.h"
+#include "shader.h"
+
+namespace {
+  constexpr int N = VOLUME_CHUNK_SIZE;
+  // Samples per side of the density grid, one more to each side for the gradients
+  constexpr int GRID = N + 3;
+  // Samples per side of the meshed grid
+  constexpr int POINTS = N + 1;
+  // Edges of the tetrahedra leave a sample towards the corners 1..7 of its cube, x + 2 y + 4 z
+  constexpr int EDGE_DIRECTIONS = 7;
+  constexpr u32 NO_VERTEX = 0xffffffffu;
+  // Largest |simplex3()| found over 100M random positions is 0.979
+  constexpr float SIMPLEX3_MAX = 1.0f;
+
+  // The 6 tetrahedra of a cube around its (0, 0, 0) - (1, 1, 1) diagonal, as corners
+  // x + 2 y + 4 z. Each one walks from corner 0 to 7 along one axis after the other, so every
+  // corner holds the bits of the corners before it
+  constexpr std::array<std::array<int, 4>, 6> TETRAHEDRA = {{
+      {0, 1, 3, 7},
+      {0, 1, 5, 7},
+      {0, 2, 3, 7},
+      {0, 2, 6, 7},
+      {0, 4, 5, 7},
+      {0, 4, 6, 7},
+  }};
+
+  glm::ivec3 cornerOffset(int corner) {
+    return glm::ivec3(corner & 1, (corner >> 1) & 1, (corner >> 2) & 1);
+  }
+
+  u32 hashLattice(int x, int y, int z) {
+    u32 h = u32(x) * 0x8da6b343u ^ u32(y) * 0xd8163841u ^ u32(z) * 0xcb1ab31fu;
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return h;
+  }
+
+  float gradientDot(u32 hash, float x, float y, float z) {
+    // The 12 edges of a cube
+    switch (hash % 12) {
+      case 0: return x + y;
+      case 1: return -x + y;
+      case 2: return x - y;
+      case 3: return -x - y;
+      case 4: return x + z;
+      case 5: return -x + z;
+      case 6: return x - z;
+      case 7: return -x - z;
+      case 8: return y + z;
+      case 9: return -y + z;
+      case 10: return y - z;
+      default: return -y - z;
+    }
+  }
+
+  /**
+   * 3D simplex noise in about [-1, 1], after Gustavson's "Simplex noise demystified" with the
+   * permutation table replaced by a hash.
+   */
+  float simplex3(glm::vec3 p) {
+    constexpr float F3 = 1.0f / 3.0f;
+    constexpr float G3 = 1.0f / 6.0f;
+
+    float s = (p.x + p.y + p.z) * F3;
+    int i = int(std::floor(p.x + s));
+    int j = int(std::floor(p.y + s));
+    int k = int(std::floor(p.z + s));
+    float t = float(i + j + k) * G3;
+    glm::vec3 d0 = p - (glm::vec3(i, j, k) - t);
+
+    // The simplex of the point, by the order of its coordinates
+    glm::ivec3 o1, o2;
+    if (d0.x >= d0.y) {
+      if (d0.y >= d0.z) {
+        o1 = {1, 0, 0}, o2 = {1, 1, 0};
+      } else if (d0.x >= d0.z) {
+        o1 = {1, 0, 0}, o2 = {1, 0, 1};
+      } else {
+        o1 = {0, 0, 1}, o2 = {1, 0, 1};
+      }
+    } else {
+      if (d0.y < d0.z) {
+        o1 = {0, 0, 1}, o2 = {0, 1, 1};
+      } else if (d0.x < d0.z) {
+        o1 = {0, 1, 0}, o2 = {0, 1, 1};
+      } else {
+        o1 = {0, 1, 0}, o2 = {1, 1, 0};
+      }
+    }
+
+    std::array<glm::vec3, 4> d = {
+        d0,
+        d0 - glm::vec3(o1) + G3,
+        d0 - glm::vec3(o2) + 2.0f * G3,
+        d0 - 1.0f + 3.0f * G3,
+    };
+    std::array<glm::ivec3, 4> corners = {glm::ivec3(0), o1, o2, glm::ivec3(1)};
+
+    float sum = 0.0f;
+    for (int c = 0; c < 4; c++) {
+      float falloff = 0.6f - glm::dot(d[c], d[c]);
+      if (falloff > 0.0f) {
+        falloff *= falloff;
+        u32 hash = hashLattice(i + corners[c].x, j + corners[c].y, k + corners[c].z);
+        sum += falloff * falloff * gradientDot(hash, d[c].x, d[c].y, d[c].z);
+      }
+    }
+    return 32.0f * sum;
+  }
+
+  // Normalised by the sum of the amplitudes, so it stays within SIMPLEX3_MAX
+  float fbm3(const VolumeNoise& volume, glm::vec3 pos) {
+    float sum = 0.0f;
+    float total = 0.0f;
+    float amplitude = 1.0f;
+    float frequency = volume.frequency;
+    for (int octave = 0; octave < volume.num_octaves; octave++) {
+      sum += amplitude * simplex3(pos * frequency);
+      total += amplitude;
+      amplitude *= volume.persistence;
+      frequency *= volume.lacunarity;
+    }
+    return total > 0.0f ? sum / total : 0.0f;
+  }
+
+  // Farthest the noise moves the surface away from the heightfield
+  float noiseReach(const VolumeNoise& volume) {
+    return volume.num_octaves > 0 ? std::abs(volume.strength) * SIMPLEX3_MAX : 0.0f;
+  }
+
+  // Grows to the largest chunk meshed on its thread and is reused for every chunk after that
+  struct Scratch {
+    std::vector<glm::vec2> columns;
+    std::vector<float> heights;
+    std::vector<float> density;  // GRID^3
+    std::vector<float> surface;  // POINTS^3, with the borders to the next LOD replaced
+    std::vector<u32> edge_vertices;  // POINTS^3 * EDGE_DIRECTIONS
+  };
+  thread_local Scratch scratch;
+
+  int densityIndex(int x, int y, int z) { return ((z + 1) * GRID + (y + 1)) * GRID + (x + 1); }
+  int pointIndex(int x, int y, int z) { return (z * POINTS + y) * POINTS + x; }
+  int pointIndex(glm::ivec3 p) { return pointIndex(p.x, p.y, p.z); }
+}  // namespace
+
+bool VolumeNoise::gui() {
+  auto did_change = false;
+  did_change |= ImGui::DragFloat("Strength", &this->strength, 1.0f, 0.0f, 1000.0f);
+  did_change |= ImGui::DragFloat("3D frequency", &this->frequency, 0.0001f, 0.0f, 1.0f, "%.4f");
+  did_change |= ImGui::SliderInt("3D octaves", &this->num_octaves, 0, 8);
+  did_change |= ImGui::DragFloat("3D persistence", &this->persistence, 0.01f, 0.0f, 1.0f);
+  did_change |= ImGui::DragFloat("3D lacunarity", &this->lacunarity, 0.05f, 1.0f, 8.0f);
+  return did_change;
+}
+
+namespace volume {
+  float density(const TerrainNoise& noise, const VolumeNoise& volume, glm::vec3 pos) {
+    float height = noise::terrainHeight(noise, glm::vec2(pos.x, pos.z));
+    return height - pos.y + volume.strength * fbm3(volume, pos);
+  }
+
+  u64 hash(const TerrainNoise& noise, const VolumeNoise& volume, float voxel_size) {
+    u64 h = noise::hash(noise);
+    auto mix = [&h](const void* data, usize size) {
+      const auto* bytes = static_cast<const u8*>(data);
+      for (usize i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 1099511628211ull;
+      }
+    };
+
+    mix(&volume.strength, sizeof(volume.strength));
+    mix(&volume.frequency, sizeof(volume.frequency));
+    mix(&volume.num_octaves, sizeof(volume.num_octaves));
+    mix(&volume.persistence, sizeof(volume.persistence));
+    mix(&volume.lacunarity, sizeof(volume.lacunarity));
+    mix(&voxel_size, sizeof(voxel_size));
+    return h;
+  }
+
+  u8 borderFaces(glm::ivec3 coord, const VolumeRegion& region) {
+    u8 border = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      border |= coord[axis] == region.min[axis] ? 1 << (2 * axis) : 0;
+      border |= coord[axis] == region.max[axis] - 1 ? 2 << (2 * axis) : 0;
+    }
+    return border;
+  }
+
+  VolumeMesh meshChunk(const TerrainNoise& noise, const VolumeNoise& volume, float voxel_size,
+                       VolumeChunkKey key) {
+    VolumeMesh mesh;
+    mesh.key = key;
+
+    // Positions are integers times a power of two times the voxel size, so a sample shared by
+    // two chunks, of the same LOD or not, is evaluated at exactly the same position
+    float spacing = voxel_size * float(1 << key.lod);
+    glm::ivec3 base = key.coord * N;
+    auto worldPosition = [&](int x, int y, int z) {
+      return glm::vec3(base + glm::ivec3(x, y, z)) * spacing;
+    };
+
+    auto& s = scratch;
+    s.columns.resize(GRID * GRID);
+    s.heights.resize(GRID * GRID);
+    for (int z = -1; z <= N + 1; z++) {
+      for (int x = -1; x <= N + 1; x++) {
+        glm::vec3 pos = worldPosition(x, 0, z);
+        s.columns[(z + 1) * GRID + (x + 1)] = glm::vec2(pos.x, pos.z);
+      }
+    }
+    noise::terrainHeights(noise, s.columns.data(), s.heights.data(), s.columns.size());
+
+    // Nothing but air or rock, whatever the noise does
+    float reach = noiseReach(volume);
+    auto [lowest, highest] = std::minmax_element(s.heights.begin(), s.heights.end());
+    if (worldPosition(0, 0, 0).y > *highest + reach || worldPosition(0, N, 0).y < *lowest - reach) {
+      return mesh;
+    }
+
+    // The noise is only needed where an edge of a sample can cross the surface: up to one sample
+    // away, in the height range of the neighbouring columns widened by the reach. Further away
+    // the sign of height - y is already right. The samples on the faces of the chunk always get
+    // it, they have to be identical in every chunk that has them
+    s.density.resize(GRID * GRID * GRID);
+    for (int z = -1; z <= N + 1; z++) {
+      for (int x = -1; x <= N + 1; x++) {
+        float height = s.heights[(z + 1) * GRID + (x + 1)];
+        float band_min = height;
+        float band_max = height;
+        for (int nz = std::max(z - 1, -1); nz <= std::min(z + 1, N + 1); nz++) {
+          for (int nx = std::max(x - 1, -1); nx <= std::min(x + 1, N + 1); nx++) {
+            float neighbour = s.heights[(nz + 1) * GRID + (nx + 1)];
+            band_min = std::min(band_min, neighbour);
+            band_max = std::max(band_max, neighbour);
+          }
+        }
+        band_min -= reach + spacing;
+        band_max += reach + spacing;
+
+        bool column_inside = x >= 0 && x <= N && z >= 0 && z <= N;
+        bool column_face = column_inside && (x == 0 || x == N || z == 0 || z == N);
+        for (int y = -1; y <= N + 1; y++) {
+          glm::vec3 pos = worldPosition(x, y, z);
+          float value = height - pos.y;
+          bool face = column_face && y >= 0 && y <= N;
+          face |= column_inside && (y == 0 || y == N);
+          if (face || (pos.y >= band_min && pos.y <= band_max)) {
+            value += volume.strength * fbm3(volume, pos);
+          }
+          s.density[densityIndex(x, y, z)] = value;
+        }
+      }
+    }
+
+    s.surface.resize(POINTS * POINTS * POINTS);
+    for (int z = 0; z <= N; z++) {
+      for (int y = 0; y <= N; y++) {
+        for (int x = 0; x <= N; x++) {
+          s.surface[pointIndex(x, y, z)] = s.density[densityIndex(x, y, z)];
+        }
+      }
+    }
+
+    // On the border to the next coarser LOD the odd samples take the value of the coarser
+    // tetrahedra, linear between the even samples around them
+    if (key.border != 0) {
+      auto coarse = [&](glm::ivec3 p) {
+        glm::ivec3 corner;
+        glm::vec3 f;
+        for (int axis = 0; axis < 3; axis++) {
+          corner[axis] = std::min(p[axis] & ~1, N - 2);
+          f[axis] = float(p[axis] - corner[axis]) * 0.5f;
+        }
+        // Walk the axes from the largest fraction to the smallest, as the tetrahedra do
+        std::array<int, 3> order = {0, 1, 2};
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return f[a] > f[b]; });
+
+        auto at = [&](glm::ivec3 q) { return s.density[densityIndex(q.x, q.y, q.z)]; };
+        float value = (1.0f - f[order[0]]) * at(corner);
+        corner[order[0]] += 2;
+        value += (f[order[0]] - f[order[1]]) * at(corner);
+        corner[order[1]] += 2;
+        value += (f[order[1]] - f[order[2]]) * at(corner);
+        corner[order[2]] += 2;
+        value += f[order[2]] * at(corner);
+        return value;
+      };
+
+      for (int z = 0; z <= N; z++) {
+        for (int y = 0; y <= N; y++) {
+          for (int x = 0; x <= N; x++) {
+            glm::ivec3 p(x, y, z);
+            if ((x & 1) == 0 && (y & 1) == 0 && (z & 1) == 0) {
+              continue;
+            }
+            bool on_border = false;
+            for (int axis = 0; axis < 3; axis++) {
+              on_border |= (key.border & (1 << (2 * axis))) != 0 && p[axis] == 0;
+              on_border |= (key.border & (2 << (2 * axis))) != 0 && p[axis] == N;
+            }
+            if (on_border) {
+              s.surface[pointIndex(p)] = coarse(p);
+            }
+          }
+        }
+      }
+    }
+
+    auto gradient = [&](glm::ivec3 p) {
+      auto at = [&](int x, int y, int z) { return s.density[densityIndex(x, y, z)]; };
+      return glm::vec3(at(p.x + 1, p.y, p.z) - at(p.x - 1, p.y, p.z),
+                       at(p.x, p.y + 1, p.z) - at(p.x, p.y - 1, p.z),
+                       at(p.x, p.y, p.z + 1) - at(p.x, p.y, p.z - 1));
+    };
+
+    // One vertex per crossed edge, shared by all tetrahedra around it
+    s.edge_vertices.assign(POINTS * POINTS * POINTS * EDGE_DIRECTIONS, NO_VERTEX);
+    auto edgeVertex = [&](glm::ivec3 cell, int from, int to) {
+      glm::ivec3 a = cell + cornerOffset(from);
+      glm::ivec3 step = cornerOffset(from ^ to);
+      u32& index = s.edge_vertices[pointIndex(a) * EDGE_DIRECTIONS + ((from ^ to) - 1)];
+      if (index != NO_VERTEX) {
+        return index;
+      }
+
+      float da = s.surface[pointIndex(a)];
+      float db = s.surface[pointIndex(a + step)];
+      float t = da / (da - db);
+      glm::vec3 position = (glm::vec3(base + a) + t * glm::vec3(step)) * spacing;
+      glm::vec3 slope = glm::mix(gradient(a), gradient(a + step), t);
+      float length = glm::length(slope);
+      glm::vec3 normal = length > 0.0f ? -slope / length : glm::vec3(0.0f, 1.0f, 0.0f);
+
+      if (mesh.vertices.empty()) {
+        mesh.bounds = {position, position};
+      }
+      mesh.bounds.min = glm::min(mesh.bounds.min, position);
+      mesh.bounds.max = glm::max(mesh.bounds.max, position);
+      index = u32(mesh.vertices.size());
+      mesh.vertices.push_back({position, normal});
+      return index;
+    };
+
+    auto addTriangle = [&](u32 a, u32 b, u32 c) {
+      if (a != b && b != c && c != a) {
+        mesh.indices.insert(mesh.indices.end(), {a, b, c});
+      }
+    };
+
+    std::array<float, 8> values;
+    for (int z = 0; z < N; z++) {
+      for (int y = 0; y < N; y++) {
+        for (int x = 0; x < N; x++) {
+          glm::ivec3 cell(x, y, z);
+          int solid_corners = 0;
+          for (int corner = 0; corner < 8; corner++) {
+            values[corner] = s.surface[pointIndex(cell + cornerOffset(corner))];
+            solid_corners += values[corner] > 0.0f ? 1 : 0;
+          }
+          if (solid_corners == 0 || solid_corners == 8) {
+            continue;
+          }
+
+          for (const auto& tetrahedron : TETRAHEDRA) {
+            std::array<int, 4> solid, air;
+            int solid_count = 0;
+            int air_count = 0;
+            for (int corner : tetrahedron) {
+              if (values[corner] > 0.0f) {
+                solid[solid_count++] = corner;
+              } else {
+                air[air_count++] = corner;
+              }
+            }
+            if (solid_count == 0 || air_count == 0) {
+              continue;
+            }
+
+            // Corners only ever hold the bits of the corners before them, so the edge from the
+            // smaller corner to the larger one is the one from the lattice point upwards
+            auto vertex = [&](int p, int q) {
+              return p < q ? edgeVertex(cell, p, q) : edgeVertex(cell, q, p);
+            };
+            // Towards the air, the triangles face it
+            auto centroid = [](const std::array<int, 4>& corners, int count) {
+              glm::vec3 sum(0.0f);
+              for (int i = 0; i < count; i++) {
+                sum += glm::vec3(cornerOffset(corners[i]));
+              }
+              return sum / float(count);
+            };
+            glm::vec3 outwards = centroid(air, air_count) - centroid(solid, solid_count);
+            auto position = [&](u32 index) { return mesh.vertices[index].position; };
+
+            if (solid_count == 2) {
+              std::array<u32, 4> quad = {vertex(solid[0], air[0]), vertex(solid[0], air[1]),
+                                         vertex(solid[1], air[1]), vertex(solid[1], air[0])};
+              glm::vec3 normal = glm::cross(position(quad[2]) - position(quad[0]),
+                                            position(quad[3]) - position(quad[1]));
+              if (glm::dot(normal, outwards) < 0.0f) {
+                std::swap(quad[1], quad[3]);
+              }
+              addTriangle(quad[0], quad[1], quad[2]);
+              addTriangle(quad[0], quad[2], quad[3]);
+            } else {
+              // One corner on its own
+              bool lone_solid = solid_count == 1;
+              int lone = lone_solid ? solid[0] : air[0];
+              const auto& others = lone_solid ? air : solid;
+              u32 a = vertex(lone, others[0]);
+              u32 b = vertex(lone, others[1]);
+              u32 c = vertex(lone, others[2]);
+              glm::vec3 normal = glm::cross(position(b) - position(a), position(c) - position(a));
+              if (glm::dot(normal, outwards) < 0.0f) {
+                std::swap(b, c);
+              }
+              addTriangle(a, b, c);
+            }
+          }
+        }
+      }
+    }
+
+    return mesh;
+  }
+}  // namespace volume
+
+VolumeTerrain::~VolumeTerrain() { this->cancel(); }
+
+void VolumeTerrain::init() {
+  glCreateVertexArrays(1, &this->vao);
+  glEnableVertexArrayAttrib(this->vao, 0);
+  glVertexArrayAttribFormat(this->vao, 0, 3, GL_FLOAT, GL_FALSE, offsetof(VolumeVertex, position));
+  glVertexArrayAttribBinding(this->vao, 0, 0);
+  glEnableVertexArrayAttrib(this->vao, 1);
+  glVertexArrayAttribFormat(this->vao, 1, 3, GL_FLOAT, GL_FALSE, offsetof(VolumeVertex, normal));
+  glVertexArrayAttribBinding(this->vao, 1, 0);
+}
+
+void VolumeTerrain::deinit() {
+  this->cancel();
+  this->clearChunks();
+  glDeleteVertexArrays(1, &this->vao);
+  this->vao = 0;
+}
+
+void VolumeTerrain::loadShader(bool is_reload, const std::string& defines) {
+  std::array<ShaderInput, 2> program_shaders({
+      ShaderInput{"resources/shaders/terrain_volume.vert", GL_VERTEX_SHADER},
+      ShaderInput{"resources/shaders/terrain.frag", GL_FRAGMENT_SHADER},
+  });
+  auto program = loadShaderProgram(program_shaders, is_reload, defines);
+  if (program != 0) {
+    if (is_reload) {
+      glDeleteProgram(this->shader_program);
+    }
+    this->shader_program = program;
+  }
+
+  std::array<ShaderInput, 2> program_shaders_simple({
+      ShaderInput{"resources/shaders/terrain_volume.vert", GL_VERTEX_SHADER},
+      ShaderInput{"resources/shaders/simple.frag", GL_FRAGMENT_SHADER},
+  });
+  auto program_simple = loadShaderProgram(program_shaders_simple, is_reload, defines);
+  if (program_simple != 0) {
+    if (is_reload) {
+      glDeleteProgram(this->shader_program_simple);
+    }
+    this->shader_program_simple = program_simple;
+  }
+}
+
+void VolumeTerrain::cancel() {
+  this->shared->generation += 1;
+  {
+    std::lock_guard<std::mutex> lock(this->shared->mutex);
+    this->shared->finished.clear();
+  }
+  this->in_flight.clear();
+}
+
+void VolumeTerrain::release(CachedChunk& chunk) {
+  if (chunk.vertex_bo != 0) {
+    glDeleteBuffers(1, &chunk.vertex_bo);
+    glDeleteBuffers(1, &chunk.index_bo);
+  }
+  this->cache_bytes -= chunk.bytes;
+  chunk = {};
+}
+
+void VolumeTerrain::clearChunks() {
+  for (auto& [key, chunk] : this->chunks) {
+    this->release(chunk);
+  }
+  this->chunks.clear();
+  this->cache_bytes = 0;
+  this->drawn.clear();
+  this->drawn_triangles = 0;
+}
+
+void VolumeTerrain::upload(VolumeMesh&& mesh) {
+  CachedChunk chunk;
+  chunk.bounds = mesh.bounds;
+  chunk.index_count = u32(mesh.indices.size());
+  chunk.last_used = this->frame;
+  // Empty chunks are cached too, so they are not meshed again
+  chunk.bytes = sizeof(VolumeChunkKey) + sizeof(CachedChunk);
+
+  if (!mesh.indices.empty()) {
+    usize vertex_bytes = mesh.vertices.size() * sizeof(VolumeVertex);
+    usize index_bytes = mesh.indices.size() * sizeof(u32);
+    glCreateBuffers(1, &chunk.vertex_bo);
+    glNamedBufferData(chunk.vertex_bo, vertex_bytes, mesh.vertices.data(), GL_STATIC_DRAW);
+    glCreateBuffers(1, &chunk.index_bo);
+    glNamedBufferData(chunk.index_bo, index_bytes, mesh.indices.data(), GL_STATIC_DRAW);
+    chunk.bytes += vertex_bytes + index_bytes;
+  }
+
+  auto it = this->chunks.find(mesh.key);
+  if (it != this->chunks.end()) {
+    this->release(it->second);
+  }
+  this->cache_bytes += chunk.bytes;
+  this->chunks[mesh.key] = chunk;
+}
+
+void VolumeTerrain::evict() {
+  usize budget = usize(std::max(this->cache_megabytes, 1)) << 20;
+  if (this->cache_bytes <= budget) {
+    return;
+  }
+
+  // Least recently used first, the chunks used this frame stay
+  std::vector<std::pair<u64, VolumeChunkKey>> unused;
+  for (const auto& [key, chunk] : this->chunks) {
+    if (chunk.last_used != this->frame) {
+      unused.emplace_back(chunk.last_used, key);
+    }
+  }
+  std::sort(unused.begin(), unused.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+  for (const auto& [last_used, key] : unused) {
+    if (this->cache_bytes <= budget) {
+      break;
+    }
+    auto it = this->chunks.find(key);
+    this->release(it->second);
+    this->chunks.erase(it);
+  }
+}
+
+void VolumeTerrain::select(glm::vec3 camera_position, glm::vec2 height_bounds) {
+  int lods = glm::clamp(this->lod_count, 1, MAX_LODS);
+  int radius = std::max(this->radius / 2 * 2, 4);
+
+  // Snapped to even chunks, so the border of a LOD lies on chunks of the next
+  std::vector<glm::ivec3> centers(lods);
+  for (int lod = 0; lod < lods; lod++) {
+    float size = 2.0f * volume::chunkWorldSize(this->voxel_size, lod);
+    centers[lod] = 2 * glm::ivec3(glm::floor(camera_position / size + 0.5f));
+  }
+  if (centers == this->selection_centers && radius == this->selection_radius
+      && lods == this->selection_lods) {
+    return;
+  }
+  this->selection_centers = centers;
+  this->selection_radius = radius;
+  this->selection_lods = lods;
+
+  float reach = noiseReach(this->noise);
+  this->selection.clear();
+  this->regions.resize(lods);
+  for (int lod = 0; lod < lods; lod++) {
+    VolumeRegion region = {centers[lod] - radius, centers[lod] + radius};
+    this->regions[lod] = region;
+    float size = volume::chunkWorldSize(this->voxel_size, lod);
+
+    for (int z = region.min.z; z < region.max.z; z++) {
+      for (int y = region.min.y; y < region.max.y; y++) {
+        for (int x = region.min.x; x < region.max.x; x++) {
+          glm::ivec3 coord(x, y, z);
+          if (lod > 0) {
+            // Covered by the LOD below, whose region has even bounds
+            const auto& inner = this->regions[lod - 1];
+            glm::ivec3 finer = coord * 2;
+            if (glm::all(glm::greaterThanEqual(finer, inner.min))
+                && glm::all(glm::lessThan(finer, inner.max))) {
+              continue;
+            }
+          }
+
+          // Entirely above or below anything the noise can reach
+          float bottom = float(y) * size;
+          if (bottom > height_bounds.y + reach || bottom + size < height_bounds.x - reach) {
+            continue;
+          }
+          // The coarsest LOD borders nothing
+          u8 border = lod + 1 < lods ? volume::borderFaces(coord, region) : 0;
+          this->selection.push_back({lod, coord, border});
+        }
+      }
+    }
+  }
+}
+
+void VolumeTerrain::update(const TerrainNoise& noise, glm::vec3 camera_position) {
+  auto now = Clock::now();
+  this->frame += 1;
+
+  u64 hash = volume::hash(noise, this->noise, this->voxel_size);
+  if (hash != this->density_hash) {
+    this->cancel();
+    this->clearChunks();
+    this->density_hash = hash;
+    this->selection_centers.clear();
+  }
+
+  std::vector<VolumeMesh> finished;
+  {
+    std::lock_guard<std::mutex> lock(this->shared->mutex);
+    auto& queue = this->shared->finished;
+    usize count = std::min(queue.size(), usize(std::max(this->max_uploads_per_frame, 1)));
+    std::move(queue.begin(), queue.begin() + count, std::back_inserter(finished));
+    queue.erase(queue.begin(), queue.begin() + count);
+  }
+  for (auto& mesh : finished) {
+    this->in_flight.erase(mesh.key);
+    this->upload(std::move(mesh));
+  }
+
+  this->select(camera_position, noise::heightBounds(noise));
+
+  // Nearest first, which also puts the finer LODs first
+  std::vector<std::pair<float, VolumeChunkKey>> missing;
+  for (const auto& key : this->selection) {
+    auto it = this->chunks.find(key);
+    if (it != this->chunks.end()) {
+      it->second.last_used = this->frame;
+      continue;
+    }
+    float size = volume::chunkWorldSize(this->voxel_size, key.lod);
+    glm::vec3 min = glm::vec3(key.coord) * size;
+    float distance = glm::length(glm::clamp(camera_position, min, min + size) - camera_position);
+    missing.emplace_back(distance, key);
+  }
+  std::sort(missing.begin(), missing.end(),
+            [](const auto& a, const auto& b) { return a.first < b.first; });
+  this->missing_chunks = missing.size();
+
+  int free_slots = std::max(this->max_in_flight, 1) - int(this->in_flight.size());
+  for (const auto& [distance, key] : missing) {
+    if (free_slots <= 0) {
+      break;
+    }
+    if (this->in_flight.count(key) != 0) {
+      continue;
+    }
+    free_slots -= 1;
+    this->in_flight.insert(key);
+
+    auto shared = this->shared;
+    u32 generation = shared->generation.load();
+    VolumeNoise volume_noise = this->noise;
+    float voxel_size = this->voxel_size;
+    auto job = [shared, generation, noise, volume_noise, voxel_size, key]() {
+      if (shared->generation.load() != generation) {
+        return;
+      }
+
+      auto start = Clock::now();
+      auto mesh = volume::meshChunk(noise, volume_noise, voxel_size, key);
+      shared->busy_microseconds += u64(
+          std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count());
+
+      // Checked under the lock, cancel() clears the results after bumping the generation
+      std::lock_guard<std::mutex> lock(shared->mutex);
+      if (shared->generation.load() != generation) {
+        return;
+      }
+      shared->meshed += 1;
+      shared->empty += mesh.indices.empty() ? 1 : 0;
+      shared->finished.push_back(std::move(mesh));
+    };
+    JobSystem::instance()->submit(job, int(distance));
+  }
+
+  // Only whole selections are drawn, a partial one would leave holes and cracks
+  if (missing.empty() && this->drawn != this->selection) {
+    this->drawn = this->selection;
+    this->drawn_triangles = 0;
+    for (const auto& key : this->drawn) {
+      this->drawn_triangles += this->chunks[key].index_count / 3;
+    }
+  }
+  for (const auto& key : this->drawn) {
+    this->chunks[key].last_used = this->frame;
+  }
+  this->evict();
+
+  // Meshing throughput from the first missing chunk until none is left
+  bool has_work = !missing.empty() || !this->in_flight.empty();
+  u64 meshed = this->shared->meshed.load();
+  if (has_work && !this->busy) {
+    this->busy = true;
+    this->busy_start = now;
+    this->busy_meshed = meshed;
+  } else if (!has_work && this->busy) {
+    this->busy = false;
+    this->last_busy_seconds = std::chrono::duration<double>(now - this->busy_start).count();
+    this->last_busy_chunks = meshed - this->busy_meshed;
+  }
+}
+
+void VolumeTerrain::draw(const Frustum* frustum, CullStats* stats) {
+  if (stats != nullptr) {
+    *stats = {};
+  }
+  if (this->vao == 0 || this->drawn.empty()) {
+    return;
+  }
+
+  glBindVertexArray(this->vao);
+  for (const auto& key : this->drawn) {
+    const auto& chunk = this->chunks[key];
+    if (chunk.index_count == 0) {
+      continue;
+    }
+    if (frustum != nullptr && !frustum->intersects(chunk.bounds)) {
+      if (stats != nullptr) {
+        stats->culled += 1;
+      }
+      continue;
+    }
+    if (stats != nullptr) {
+      stats->visible += 1;
+    }
+
+    glVertexArrayVertexBuffer(this->vao, 0, chunk.vertex_bo, 0, sizeof(VolumeVertex));
+    glVertexArrayElementBuffer(this->vao, chunk.index_bo);
+    glDrawElements(GL_TRIANGLES, chunk.index_count, GL_UNSIGNED_INT, nullptr);
+  }
+  glBindVertexArray(0);
+}
+
+void VolumeTerrain::benchmark(const TerrainNoise& noise) {
+  if (this->selection.empty()) {
+    return;
+  }
+
+  std::atomic<usize> empty{0};
+  std::atomic<usize> triangles{0};
+  auto start = Clock::now();
+  JobSystem::instance()->parallelFor(this->selection.size(), 1, [&](usize begin, usize end) {
+    for (usize i = begin; i < end; i++) {
+      auto mesh = volume::meshChunk(noise, this->noise, this->voxel_size, this->selection[i]);
+      empty += mesh.indices.empty() ? 1 : 0;
+      triangles += mesh.indices.size() / 3;
+    }
+  });
+
+  auto& stats = this->benchmark_stats;
+  stats.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  stats.chunks = this->selection.size();
+  stats.empty = empty.load();
+  stats.triangles = triangles.load();
+  stats.threads = JobSystem::instance()->threadCount() + 1;
+}
+
+void VolumeTerrain::gui(const TerrainNoise& noise) {
+  ImGui::Text("Density");
+  this->noise.gui();
+  ImGui::SliderFloat("Voxel size", &this->voxel_size, 0.25f, 16.0f);
+  ImGui::SliderInt("Volume LODs", &this->lod_count, 1, MAX_LODS);
+  if (ImGui::SliderInt("Volume radius", &this->radius, 4, 8)) {
+    this->radius = this->radius / 2 * 2;
+  }
+  ImGui::SliderInt("Meshes in flight", &this->max_in_flight, 1, 128);
+  ImGui::SliderInt("Uploads per frame", &this->max_uploads_per_frame, 1, 64);
+  ImGui::SliderInt("Mesh cache (MB)", &this->cache_megabytes, 16, 2048);
+
+  int lods = glm::clamp(this->lod_count, 1, MAX_LODS);
+  ImGui::Text("View distance: at least %.1f km",
+              volume::chunkWorldSize(this->voxel_size, lods - 1) * (this->radius - 1) / 1000.0f);
+  ImGui::Text("Selected: %zu chunks, missing: %zu, in flight: %zu", this->selection.size(),
+              this->missing_chunks, this->in_flight.size());
+  ImGui::Text("Drawn: %zu chunks, %zu triangles", this->drawn.size(), this->drawn_triangles);
+  ImGui::Text("Cached: %zu chunks, %.1f MB", this->chunks.size(), this->cache_bytes / 1e6);
+
+  u64 meshed = this->shared->meshed.load();
+  ImGui::Text("Meshed: %llu chunks, %llu empty", (unsigned long long)meshed,
+              (unsigned long long)this->shared->empty.load());
+  if (meshed > 0) {
+    ImGui::Text("%.2f ms per chunk on a worker",
+                this->shared->busy_microseconds.load() / 1e3 / double(meshed));
+  }
+  if (this->busy) {
+    double seconds = std::chrono::duration<double>(Clock::now() - this->busy_start).count();
+    ImGui::Text("Meshing: %.0f chunks/s", (meshed - this->busy_meshed) / std::max(seconds, 1e-3));
+  } else if (this->last_busy_seconds > 0.0) {
+    ImGui::Text("Last burst: %llu chunks in %.0f ms, %.0f chunks/s",
+                (unsigned long long)this->last_busy_chunks, this->last_busy_seconds * 1e3,
+                this->last_busy_chunks / this->last_busy_seconds);
+  }
+
+  if (ImGui::Button("Benchmark meshing")) {
+    this->benchmark(noise);
+  }
+  const auto& stats = this->benchmark_stats;
+  if (stats.chunks > 0) {
+    ImGui::SameLine();
+    ImGui::Text("%.0f chunks/s on %d threads", stats.chunksPerSecond(), stats.threads);
+    ImGui::Text("%zu chunks (%zu empty), %zu triangles in %.0f ms", stats.chunks, stats.empty,
+                stats.triangles, stats.seconds * 1e3);
+  }
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <glad/glad.h>
+
+#include <atomic>
+#include <chrono>
+#include <glm/glm.hpp>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "core.h"
+#include "frustum.h"
+#include "noise.h"
+
+// Voxels per chunk side, a chunk has VOLUME_CHUNK_SIZE + 1 samples per side. Even, so the samples
+// of the next coarser LOD are every other sample
+constexpr int VOLUME_CHUNK_SIZE = 32;
+
+/**
+ * The 3D fBm added to the heightfield, in meters. The density of a point is
+ * height(x, z) - y + strength * fbm(position), solid where positive, so it bends the surface into
+ * overhangs, arches and caves up to `strength` meters away from the heightfield.
+ */
+struct VolumeNoise {
+  float strength = 80.0f;
+  float frequency = 0.006f;
+  int num_octaves = 4;
+  float persistence = 0.5f;
+  float lacunarity = 2.0f;
+
+  bool gui();
+};
+
+struct VolumeChunkKey {
+  int lod;
+  glm::ivec3 coord;  // in chunks of the LOD
+  // Faces on the border to the next coarser LOD, bit 2 * axis for the min side and 2 * axis + 1
+  // for the max side. Part of the key, the samples on these faces are meshed differently
+  u8 border = 0;
+
+  bool operator==(const VolumeChunkKey& other) const {
+    return lod == other.lod && coord.x == other.coord.x && coord.y == other.coord.y
+           && coord.z == other.coord.z && border == other.border;
+  }
+  bool operator!=(const VolumeChunkKey& other) const { return !(*this == other); }
+};
+
+struct VolumeChunkKeyHash {
+  usize operator()(const VolumeChunkKey& key) const {
+    u64 h = 14695981039346656037ull;
+    h = (h ^ u64(u32(key.lod))) * 1099511628211ull;
+    h = (h ^ u64(u32(key.coord.x))) * 1099511628211ull;
+    h = (h ^ u64(u32(key.coord.y))) * 1099511628211ull;
+    h = (h ^ u64(u32(key.coord.z))) * 1099511628211ull;
+    h = (h ^ u64(key.border)) * 1099511628211ull;
+    return usize(h);
+  }
+};
+
+/**
+ * Chunks [min, max) of one LOD. The next coarser LOD surrounds it.
+ */
+struct VolumeRegion {
+  glm::ivec3 min;
+  glm::ivec3 max;
+};
+
+struct VolumeVertex {
+  glm::vec3 position;  // world space
+  glm::vec3 normal;
+};
+
+struct VolumeMesh {
+  VolumeChunkKey key;
+  std::vector<VolumeVertex> vertices;
+  std::vector<u32> indices;  // counter clockwise seen from the air
+  Aabb bounds = {glm::vec3(0.0f), glm::vec3(0.0f)};
+};
+
+struct VolumeStats {
+  usize chunks = 0;
+  usize empty = 0;  // chunks without any surface
+  usize triangles = 0;
+  int threads = 0;
+  double seconds = 0.0;
+
+  double chunksPerSecond() const { return seconds > 0.0 ? chunks / seconds : 0.0; }
+};
+
+namespace volume {
+  /**
+   * Scalar reference of the density at a world position, see VolumeNoise.
+   */
+  float density(const TerrainNoise& noise, const VolumeNoise& volume, glm::vec3 pos);
+
+  /**
+   * FNV-1a hash of everything the meshes depend on.
+   */
+  u64 hash(const TerrainNoise& noise, const VolumeNoise& volume, float voxel_size);
+
+  /**
+   * The meters a LOD 0 chunk is wide, twice that for every LOD above.
+   */
+  inline float chunkWorldSize(float voxel_size, int lod) {
+    return VOLUME_CHUNK_SIZE * voxel_size * float(1 << lod);
+  }
+
+  /**
+   * The VolumeChunkKey::border faces of the chunk at `coord` of `region`.
+   */
+  u8 borderFaces(glm::ivec3 coord, const VolumeRegion& region);
+
+  /**
+   * Mesh one chunk with marching tetrahedra. `voxel_size` is the LOD 0 voxel size.
+   *
+   * Every cube of samples is split into the 6 tetrahedra around its (0, 0, 0) - (1, 1, 1)
+   * diagonal (Kuhn/Freudenthal). Splitting a cube of the next coarser LOD that way is a coarser
+   * version of the same tetrahedra, so on the `key.border` faces the samples are replaced by the
+   * linear interpolation of the coarser samples over the coarser tetrahedra: on the border both
+   * LODs then have the same surface, and the meshes meet without cracks, only with T-junctions.
+   *
+   * The heights are evaluated once per column, and the 3D noise only where it can move the surface
+   * across an edge of the chunk, so chunks far from the surface are cheap. Scratch memory is
+   * owned by each thread and reused for every chunk it meshes.
+   */
+  VolumeMesh meshChunk(const TerrainNoise& noise, const VolumeNoise& volume, float voxel_size,
+                       VolumeChunkKey key);
+}  // namespace volume
+
+/**
+ * Density field terrain for TerrainMode::Volume: the heightfield bent by 3D noise into overhangs
+ * and caves, which the tessellated heightfield cannot show.
+ *
+ * Nested cubes of chunks surround the camera, radius chunks to each side per LOD and snapped to
+ * even chunks so a LOD is made of whole chunks of the next, and every LOD leaves out the cube of
+ * the one below. The chunks are meshed on the job system, nearest first, and their buffers stay
+ * cached until the density parameters change, within a memory budget otherwise. The meshes of a
+ * selection are only drawn once all of its chunks are there, until then the last complete one is,
+ * so moving never opens holes or cracks.
+ */
+class VolumeTerrain {
+public:
+  static constexpr int MAX_LODS = 8;
+
+  VolumeNoise noise;
+  // Meters between the samples of LOD 0
+  float voxel_size = 2.0f;
+  int lod_count = 6;
+  // Chunks to each side of the camera per LOD, even and at least 4 so that only neighbouring LODs
+  // touch
+  int radius = 4;
+  int max_in_flight = 32;
+  // Uploading a chunk takes two buffers, a few per frame keep the frame time flat
+  int max_uploads_per_frame = 8;
+  int cache_megabytes = 256;
+
+  ~VolumeTerrain();
+
+  void init();
+  void loadShader(bool is_reload, const std::string& defines);
+  void deinit();
+
+  /**
+   * Abandon the queued and running meshing jobs.
+   */
+  void cancel();
+
+  /**
+   * Call once per frame from the main thread.
+   */
+  void update(const TerrainNoise& noise, glm::vec3 camera_position);
+
+  GLuint program(bool simple) const {
+    return simple ? this->shader_program_simple : this->shader_program;
+  }
+
+  /**
+   * Draw the chunks of the last complete selection that intersect `frustum`, or all of them
+   * without one.
+   */
+  void draw(const Frustum* frustum, CullStats* stats);
+
+  /**
+   * Mesh the current selection again on all threads, without uploading it.
+   */
+  void benchmark(const TerrainNoise& noise);
+
+  void gui(const TerrainNoise& noise);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct CachedChunk {
+    GLuint vertex_bo = 0;
+    GLuint index_bo = 0;
+    u32 index_count = 0;
+    usize bytes = 0;
+    Aabb bounds;
+    u64 last_used = 0;
+  };
+
+  // Shared with the jobs, which may outlive the terrain
+  struct Shared {
+    std::atomic<u32> generation{0};
+    std::atomic<u64> meshed{0};
+    std::atomic<u64> empty{0};
+    std::atomic<u64> busy_microseconds{0};
+
+    std::mutex mutex;
+    std::vector<VolumeMesh> finished;
+  };
+
+  GLuint shader_program = 0;
+  GLuint shader_program_simple = 0;
+  GLuint vao = 0;
+
+  std::shared_ptr<Shared> shared = std::make_shared<Shared>();
+  u64 density_hash = 0;
+  std::unordered_set<VolumeChunkKey, VolumeChunkKeyHash> in_flight;
+  std::unordered_map<VolumeChunkKey, CachedChunk, VolumeChunkKeyHash> chunks;
+  usize cache_bytes = 0;
+  u64 frame = 0;
+
+  // The wanted chunks and the region of each LOD, rebuilt when the camera moves to other chunks
+  std::vector<VolumeChunkKey> selection;
+  std::vector<VolumeRegion> regions;
+  std::vector<glm::ivec3> selection_centers;
+  int selection_radius = 0;
+  int selection_lods = 0;
+  // Drawn, all of them are cached
+  std::vector<VolumeChunkKey> drawn;
+  usize missing_chunks = 0;
+  usize drawn_triangles = 0;
+
+  // Throughput while there is anything to mesh: chunks finished over wall time
+  bool busy = false;
+  Clock::time_point busy_start;
+  u64 busy_meshed = 0;
+  double last_busy_seconds = 0.0;
+  u64 last_busy_chunks = 0;
+
+  VolumeStats benchmark_stats;
+
+  void select(glm::vec3 camera_position, glm::vec2 height_bounds);
+  void upload(VolumeMesh&& mesh);
+  void release(CachedChunk& chunk);
+  void clearChunks();
+  void evict();
+};